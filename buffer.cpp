@@ -0,0 +1,1011 @@
+#include "buffer.h"
+#include <atomic>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <unordered_set>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+// A block of line text. Bytes below `used` never change once written.
+// Small chunks are on the heap; big ones are pages of the scratch file,
+// and a mapped file is one read-only chunk.
+struct TextBuffer::Chunk {
+    enum Kind { HEAP, SCRATCH, MAPPED };
+    char* data;
+    size_t cap, used;
+    Kind kind;
+    uint64_t offset; // SCRATCH: where it is in the scratch file
+    int fd;          // MAPPED: the file, open while it is mapped
+    explicit Chunk(size_t cap) : data(new char[cap]), cap(cap), used(0), kind(HEAP), offset(0), fd(-1) {}
+    Chunk(char* data, size_t cap, Kind kind) : data(data), cap(cap), used(0), kind(kind), offset(0), fd(-1) {}
+    ~Chunk();
+    bool holds(const char* p) const { return p >= data && p < data + cap; }
+};
+
+namespace {
+// lines per leaf chunk
+const size_t LEAF_MAX = 64;
+// Builder chunks start small and double up to this size
+const size_t CHUNK_MIN = 4096;
+const size_t CHUNK_MAX = 1 << 20;
+// chunk size of the pool edited lines are written to
+const size_t POOL_CHUNK = 64 * 1024;
+// lines at least this long get a chunk of their own
+const size_t BIG_LINE = 16 * 1024;
+// a leaf whose chunk list grows past this starts dropping chunks it no longer uses
+const size_t LEAF_CHUNKS_MAX = 8;
+
+// chunks this big go to the scratch file
+const size_t SCRATCH_MIN = 64 * 1024;
+// bytes of a mapped file covered by one span leaf
+const size_t SPAN_BYTES = 64 * 1024;
+
+atomic<uint64_t> version_counter(0);
+
+// The scratch file: unlinked, so it goes away with the process. Freed
+// chunks punch a hole (giving the disk space back) and their range is
+// reused by the next chunk of the same size.
+mutex scratch_m;
+int scratch_fd = -1;
+bool scratch_tried = false;
+uint64_t scratch_end = 0;
+multimap<size_t, uint64_t> scratch_free;
+
+// chunks page_out() looks at
+mutex paged_m;
+vector<weak_ptr<TextBuffer::Chunk>> paged;
+size_t paged_prune = 64;
+
+// the shared pool for edited lines
+mutex pool_m;
+TextBuffer::ChunkPtr pool;
+
+void track(const TextBuffer::ChunkPtr& c) {
+    lock_guard<mutex> lk(paged_m);
+    paged.push_back(c);
+    if (paged.size() < paged_prune) return;
+    paged.erase(remove_if(paged.begin(), paged.end(), [](const weak_ptr<TextBuffer::Chunk>& w) { return w.expired(); }),
+                paged.end());
+    paged_prune = max((size_t)64, paged.size() * 2);
+}
+
+int open_scratch() {
+    const char* dir = getenv("TMPDIR");
+    string path = string(dir && *dir ? dir : "/var/tmp") + "/mini-vi-scratch-XXXXXX";
+    int fd = mkostemp(&path[0], O_CLOEXEC);
+    if (fd >= 0) unlink(path.c_str());
+    return fd;
+}
+
+// A chunk in the scratch file, or nullptr when there is none (or it is full)
+TextBuffer::ChunkPtr scratch_chunk(size_t cap) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    cap = (cap + page - 1) / page * page;
+    int fd;
+    uint64_t off;
+    {
+        lock_guard<mutex> lk(scratch_m);
+        if (scratch_fd < 0 && !scratch_tried) {
+            scratch_tried = true;
+            scratch_fd = open_scratch();
+        }
+        if (scratch_fd < 0) return nullptr;
+        fd = scratch_fd;
+        auto it = scratch_free.find(cap);
+        if (it != scratch_free.end()) {
+            off = it->second;
+            scratch_free.erase(it);
+        } else {
+            off = scratch_end;
+            scratch_end += cap;
+        }
+    }
+    // Reserve the blocks up front: a full disk would otherwise be a SIGBUS on first write
+    void* p = MAP_FAILED;
+    if (posix_fallocate(fd, off, cap) == 0) p = mmap(nullptr, cap, PROT_READ | PROT_WRITE, MAP_SHARED, fd, off);
+    if (p == MAP_FAILED) {
+        lock_guard<mutex> lk(scratch_m);
+        scratch_free.emplace(cap, off);
+        return nullptr;
+    }
+    auto c = make_shared<TextBuffer::Chunk>((char*)p, cap, TextBuffer::Chunk::SCRATCH);
+    c->offset = off;
+    track(c);
+    return c;
+}
+
+TextBuffer::ChunkPtr new_chunk(size_t cap) {
+    if (cap >= SCRATCH_MIN) {
+        if (TextBuffer::ChunkPtr c = scratch_chunk(cap)) return c;
+    }
+    return make_shared<TextBuffer::Chunk>(cap);
+}
+
+// Keeps each chunk once, and only if one of the lines points into it
+template <class L>
+void prune_chunks(vector<TextBuffer::ChunkPtr>& chunks, const vector<L>& lines) {
+    vector<TextBuffer::ChunkPtr> used;
+    for (TextBuffer::ChunkPtr& c : chunks) {
+        if (!c || find(used.begin(), used.end(), c) != used.end()) continue;
+        for (const L& l : lines) {
+            if (l.len && c->holds(l.data)) {
+                used.push_back(move(c));
+                break;
+            }
+        }
+    }
+    chunks.swap(used);
+}
+
+template <class L>
+uint64_t anchor_bits(const vector<L>& lines) {
+    uint64_t bits = 0;
+    for (const L& l : lines) {
+        if (l.anchor) bits |= 1ull << (l.anchor - 1);
+    }
+    return bits;
+}
+
+// Adds c to a leaf's chunk list. Dead entries are dropped whenever the
+// list reaches the next power of two past LEAF_CHUNKS_MAX, which keeps
+// pruning amortised when every line of a leaf really uses its own chunk.
+template <class L>
+void add_chunk(vector<TextBuffer::ChunkPtr>& chunks, const TextBuffer::ChunkPtr& c, const vector<L>& lines) {
+    if (!c || find(chunks.begin(), chunks.end(), c) != chunks.end()) return;
+    chunks.push_back(c);
+    size_t n = chunks.size();
+    if (n > LEAF_CHUNKS_MAX && (n & (n - 1)) == 0) prune_chunks(chunks, lines);
+}
+
+// Whether the node behind p is ours alone, so it may be changed in place.
+// The last other copy may have been dropped on a pool thread (a save or
+// search snapshot); the fence orders what that thread read of the node
+// before our writes, as the release in its shared_ptr decrement pairs
+// with it.
+template <class P>
+bool sole(const P& p) {
+    if (p.use_count() != 1) return false;
+    atomic_thread_fence(memory_order_acquire);
+    return true;
+}
+}
+
+TextBuffer::Chunk::~Chunk() {
+    if (kind == HEAP) {
+        delete[] data;
+        return;
+    }
+    munmap(data, cap);
+    if (kind == MAPPED) {
+        close(fd);
+        return;
+    }
+    lock_guard<mutex> lk(scratch_m);
+    fallocate(scratch_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, cap);
+    scratch_free.emplace(cap, offset);
+}
+
+TextBuffer::TextBuffer() : ver(++version_counter) {}
+
+TextBuffer::TextBuffer(NodePtr root) : root(move(root)), ver(++version_counter) {}
+
+TextBuffer::TextBuffer(NodePtr root, uint64_t ver) : root(move(root)), ver(ver) {}
+
+TextBuffer::TextBuffer(vector<string> lines) : ver(0) {
+    Builder b;
+    for (const string& s : lines) b.add(s);
+    *this = b.finish();
+}
+
+void TextBuffer::touch() {
+    ver = ++version_counter;
+}
+
+// Copies s into the edit pool (or a chunk of its own when it is big)
+TextBuffer::Line TextBuffer::store(string_view s, ChunkPtr& chunk) {
+    Line l = { nullptr, (uint32_t)s.size(), 0 };
+    chunk.reset();
+    if (s.empty()) return l;
+    char* dst;
+    if (s.size() >= BIG_LINE) {
+        chunk = new_chunk(s.size());
+        chunk->used = s.size();
+        dst = chunk->data;
+    } else {
+        lock_guard<mutex> lk(pool_m);
+        if (!pool || pool->cap - pool->used < s.size()) pool = new_chunk(POOL_CHUNK);
+        chunk = pool;
+        dst = pool->data + pool->used;
+        pool->used += s.size();
+    }
+    memcpy(dst, s.data(), s.size());
+    l.data = dst;
+    return l;
+}
+
+// Start of line i of a span leaf
+const char* TextBuffer::span_seek(const Node* n, size_t i) {
+    const char* p = n->span;
+    const char* end = p + n->span_len;
+    while (i--) p = (const char*)memchr(p, '\n', end - p) + 1;
+    return p;
+}
+
+TextBuffer::NodePtr TextBuffer::make_span(const ChunkPtr& file, const char* p, uint64_t len, size_t count, uint64_t bytes) {
+    if (count == 0) return nullptr;
+    auto n = make_shared<Node>();
+    n->span = p;
+    n->span_len = len;
+    n->count = count;
+    n->bytes = bytes;
+    n->height = 1;
+    n->chunks.push_back(file);
+    return n;
+}
+
+// The lines of a span leaf as ordinary leaves, before one of them changes.
+// The text stays in the mapped file.
+TextBuffer::NodePtr TextBuffer::explode(const NodePtr& n) {
+    Builder b;
+    const ChunkPtr& file = n->chunks[0];
+    auto add = [&](size_t, string_view s) {
+        b.add_ref(Line{ s.empty() ? nullptr : s.data(), (uint32_t)s.size(), 0 }, file);
+        return true;
+    };
+    visit(n.get(), 0, 0, n->count, add);
+    return b.finish().root;
+}
+
+void TextBuffer::collect_leaves(const NodePtr& n, vector<NodePtr>& out) {
+    if (!n) return;
+    if (n->leaf()) {
+        out.push_back(n);
+        return;
+    }
+    collect_leaves(n->left, out);
+    collect_leaves(n->right, out);
+}
+
+// Tree construction
+TextBuffer::NodePtr TextBuffer::make_leaf(vector<Line> lines, vector<ChunkPtr> chunks) {
+    if (lines.empty()) return nullptr;
+    auto n = make_shared<Node>();
+    n->count = lines.size();
+    n->bytes = 0;
+    for (const Line& l : lines) n->bytes += l.len;
+    n->height = 1;
+    n->anchors = anchor_bits(lines);
+    prune_chunks(chunks, lines);
+    n->lines = move(lines);
+    n->chunks = move(chunks);
+    return n;
+}
+
+TextBuffer::NodePtr TextBuffer::make_node(NodePtr l, NodePtr r) {
+    auto n = make_shared<Node>();
+    n->count = l->count + r->count;
+    n->bytes = l->bytes + r->bytes;
+    n->height = 1 + max(l->height, r->height);
+    n->anchors = l->anchors | r->anchors;
+    n->left = move(l);
+    n->right = move(r);
+    return n;
+}
+
+// Joins two subtrees whose heights differ by at most 2 (single or double rotation).
+TextBuffer::NodePtr TextBuffer::balance(NodePtr l, NodePtr r) {
+    int hl = height(l), hr = height(r);
+    if (hl > hr + 1) {
+        if (height(l->left) >= height(l->right)) return make_node(l->left, make_node(l->right, move(r)));
+        const NodePtr& lr = l->right;
+        return make_node(make_node(l->left, lr->left), make_node(lr->right, move(r)));
+    }
+    if (hr > hl + 1) {
+        if (height(r->right) >= height(r->left)) return make_node(make_node(move(l), r->left), r->right);
+        const NodePtr& rl = r->left;
+        return make_node(make_node(move(l), rl->left), make_node(rl->right, r->right));
+    }
+    return make_node(move(l), move(r));
+}
+
+// Concatenates two trees of any heights; small neighbouring leaves are merged.
+TextBuffer::NodePtr TextBuffer::join(NodePtr l, NodePtr r) {
+    if (!l) return r;
+    if (!r) return l;
+    if (l->leaf() && r->leaf() && !l->span && !r->span && l->count + r->count <= LEAF_MAX) {
+        vector<Line> lines;
+        lines.reserve(l->count + r->count);
+        lines.insert(lines.end(), l->lines.begin(), l->lines.end());
+        lines.insert(lines.end(), r->lines.begin(), r->lines.end());
+        vector<ChunkPtr> chunks = l->chunks;
+        chunks.insert(chunks.end(), r->chunks.begin(), r->chunks.end());
+        return make_leaf(move(lines), move(chunks));
+    }
+    int hl = l->height, hr = r->height;
+    if (hl > hr + 1) return balance(l->left, join(l->right, move(r)));
+    if (hr > hl + 1) return balance(join(move(l), r->left), r->right);
+    return make_node(move(l), move(r));
+}
+
+pair<TextBuffer::NodePtr, TextBuffer::NodePtr> TextBuffer::split(const NodePtr& n, size_t i) {
+    if (!n) return make_pair(NodePtr(), NodePtr());
+    if (i == 0) return make_pair(NodePtr(), n);
+    if (i >= n->count) return make_pair(n, NodePtr());
+    if (n->span) {
+        const char* cut = span_seek(n.get(), i);
+        uint64_t len = cut - n->span, bytes = len - i;
+        return make_pair(make_span(n->chunks[0], n->span, len, i, bytes),
+                         make_span(n->chunks[0], cut, n->span_len - len, n->count - i, n->bytes - bytes));
+    }
+    if (n->leaf()) {
+        vector<Line> a(n->lines.begin(), n->lines.begin() + i);
+        vector<Line> b(n->lines.begin() + i, n->lines.end());
+        return make_pair(make_leaf(move(a), n->chunks), make_leaf(move(b), n->chunks));
+    }
+    size_t lc = n->left->count;
+    if (i == lc) return make_pair(n->left, n->right);
+    if (i < lc) {
+        auto p = split(n->left, i);
+        return make_pair(p.first, join(p.second, n->right));
+    }
+    auto p = split(n->right, i - lc);
+    return make_pair(join(n->left, p.first), p.second);
+}
+
+TextBuffer::NodePtr TextBuffer::build(vector<NodePtr>& leaves, size_t lo, size_t hi) {
+    if (lo >= hi) return nullptr;
+    if (hi - lo == 1) return leaves[lo];
+    size_t mid = lo + (hi - lo) / 2;
+    return make_node(build(leaves, lo, mid), build(leaves, mid, hi));
+}
+
+// Path updates. `owned` stays true while every node on the path is referenced
+// only by its parent, in which case the node is updated in place. A span
+// leaf on the path is exploded first, which can make the subtree taller.
+TextBuffer::NodePtr TextBuffer::set_at(const NodePtr& n, size_t i, Line s, const ChunkPtr& c, bool owned) {
+    if (n->span) return set_at(explode(n), i, s, c, true);
+    owned = owned && sole(n);
+    Node* m = const_cast<Node*>(n.get());
+    if (n->leaf()) {
+        // the line keeps its anchor through the change
+        s.anchor = n->lines[i].anchor;
+        if (owned) {
+            m->bytes = m->bytes - m->lines[i].len + s.len;
+            m->lines[i] = s;
+            add_chunk(m->chunks, c, m->lines);
+            return n;
+        }
+        vector<Line> lines = n->lines;
+        lines[i] = s;
+        vector<ChunkPtr> chunks = n->chunks;
+        chunks.push_back(c);
+        return make_leaf(move(lines), move(chunks));
+    }
+    size_t lc = n->left->count;
+    if (i < lc) {
+        NodePtr nl = set_at(n->left, i, s, c, owned);
+        if (nl->height != n->left->height) return join(move(nl), n->right);
+        if (owned) {
+            m->left = move(nl);
+            m->bytes = m->left->bytes + m->right->bytes;
+            return n;
+        }
+        return make_node(move(nl), n->right);
+    }
+    NodePtr nr = set_at(n->right, i - lc, s, c, owned);
+    if (nr->height != n->right->height) return join(n->left, move(nr));
+    if (owned) {
+        m->right = move(nr);
+        m->bytes = m->left->bytes + m->right->bytes;
+        return n;
+    }
+    return make_node(n->left, move(nr));
+}
+
+TextBuffer::NodePtr TextBuffer::insert_at(const NodePtr& n, size_t i, Line s, const ChunkPtr& c, bool owned) {
+    if (n->span) return insert_at(explode(n), i, s, c, true);
+    owned = owned && sole(n);
+    Node* m = const_cast<Node*>(n.get());
+    if (n->leaf()) {
+        if (owned && n->count < LEAF_MAX) {
+            m->lines.insert(m->lines.begin() + i, s);
+            m->count++;
+            m->bytes += s.len;
+            add_chunk(m->chunks, c, m->lines);
+            return n;
+        }
+        vector<Line> lines = n->lines;
+        lines.insert(lines.begin() + i, s);
+        vector<ChunkPtr> chunks = n->chunks;
+        chunks.push_back(c);
+        if (lines.size() <= LEAF_MAX) return make_leaf(move(lines), move(chunks));
+        vector<Line> tail(lines.begin() + lines.size() / 2, lines.end());
+        lines.resize(lines.size() / 2);
+        return make_node(make_leaf(move(lines), chunks), make_leaf(move(tail), chunks));
+    }
+    size_t lc = n->left->count;
+    if (i <= lc) {
+        NodePtr nl = insert_at(n->left, i, s, c, owned);
+        if (owned && nl == n->left) {
+            m->count++;
+            m->bytes += s.len;
+            return n;
+        }
+        return join(move(nl), n->right);
+    }
+    NodePtr nr = insert_at(n->right, i - lc, s, c, owned);
+    if (owned && nr == n->right) {
+        m->count++;
+        m->bytes += s.len;
+        return n;
+    }
+    return join(n->left, move(nr));
+}
+
+TextBuffer::NodePtr TextBuffer::erase_at(const NodePtr& n, size_t i, bool owned) {
+    if (n->span) return erase_at(explode(n), i, true);
+    owned = owned && sole(n);
+    Node* m = const_cast<Node*>(n.get());
+    if (n->leaf()) {
+        if (n->count == 1) return nullptr;
+        if (owned) {
+            m->bytes -= m->lines[i].len;
+            m->lines.erase(m->lines.begin() + i);
+            m->count--;
+            m->anchors = anchor_bits(m->lines);
+            return n;
+        }
+        vector<Line> lines = n->lines;
+        lines.erase(lines.begin() + i);
+        return make_leaf(move(lines), n->chunks);
+    }
+    size_t lc = n->left->count;
+    if (i < lc) {
+        uint64_t before = n->left->bytes;
+        NodePtr nl = erase_at(n->left, i, owned);
+        if (owned && nl == n->left) {
+            m->count--;
+            m->bytes -= before - nl->bytes;
+            m->anchors = nl->anchors | n->right->anchors;
+            return n;
+        }
+        return join(move(nl), n->right);
+    }
+    uint64_t before = n->right->bytes;
+    NodePtr nr = erase_at(n->right, i - lc, owned);
+    if (owned && nr == n->right) {
+        m->count--;
+        m->bytes -= before - nr->bytes;
+        m->anchors = n->left->anchors | nr->anchors;
+        return n;
+    }
+    return join(n->left, move(nr));
+}
+
+// Like set_at, but only the anchor of line i changes
+TextBuffer::NodePtr TextBuffer::anchor_at(const NodePtr& n, size_t i, uint32_t id, bool owned) {
+    if (n->span) return anchor_at(explode(n), i, id, true);
+    owned = owned && sole(n);
+    Node* m = const_cast<Node*>(n.get());
+    if (n->leaf()) {
+        if (owned) {
+            m->lines[i].anchor = id;
+            m->anchors = anchor_bits(m->lines);
+            return n;
+        }
+        vector<Line> lines = n->lines;
+        lines[i].anchor = id;
+        return make_leaf(move(lines), n->chunks);
+    }
+    size_t lc = n->left->count;
+    if (i < lc) {
+        NodePtr nl = anchor_at(n->left, i, id, owned);
+        if (nl->height != n->left->height) return join(move(nl), n->right);
+        if (owned) {
+            m->left = move(nl);
+            m->anchors = m->left->anchors | m->right->anchors;
+            return n;
+        }
+        return make_node(move(nl), n->right);
+    }
+    NodePtr nr = anchor_at(n->right, i - lc, id, owned);
+    if (nr->height != n->right->height) return join(n->left, move(nr));
+    if (owned) {
+        m->right = move(nr);
+        m->anchors = m->left->anchors | m->right->anchors;
+        return n;
+    }
+    return make_node(n->left, move(nr));
+}
+
+// The same lines with no anchors; only nodes that had some are copied
+TextBuffer::NodePtr TextBuffer::unanchored(const NodePtr& n) {
+    if (!n || !n->anchors) return n;
+    if (n->leaf()) {
+        vector<Line> lines = n->lines;
+        for (Line& l : lines) l.anchor = 0;
+        return make_leaf(move(lines), n->chunks);
+    }
+    return make_node(unanchored(n->left), unanchored(n->right));
+}
+
+// Public interface
+string_view TextBuffer::operator[](size_t i) const {
+    const Node* n = root.get();
+    while (!n->leaf()) {
+        size_t lc = n->left->count;
+        if (i < lc) {
+            n = n->left.get();
+        } else {
+            i -= lc;
+            n = n->right.get();
+        }
+    }
+    if (n->span) {
+        const char* p = span_seek(n, i);
+        const char* end = n->span + n->span_len;
+        const char* nl = (const char*)memchr(p, '\n', end - p);
+        return string_view(p, (nl ? nl : end) - p);
+    }
+    return n->lines[i].view();
+}
+
+void TextBuffer::set_line(size_t i, string_view s) {
+    ChunkPtr c;
+    Line l = store(s, c);
+    if (!set_owned(i, l, c)) root = set_at(root, i, l, c, true);
+    touch();
+}
+
+// set_at for when no snapshot shares the path down to the line (the usual
+// case between snapshots): the line is replaced where it is, without
+// handing node pointers back up the tree. False if anything is shared.
+bool TextBuffer::set_owned(size_t i, Line s, const ChunkPtr& c) {
+    Node* path[128];
+    int depth = 0;
+    const NodePtr* p = &root;
+    for (;;) {
+        if (!sole(*p) || (*p)->span || depth == 128) return false;
+        Node* m = const_cast<Node*>(p->get());
+        path[depth++] = m;
+        if (m->leaf()) break;
+        size_t lc = m->left->count;
+        if (i < lc) {
+            p = &m->left;
+        } else {
+            i -= lc;
+            p = &m->right;
+        }
+    }
+    Node* leaf = path[depth - 1];
+    s.anchor = leaf->lines[i].anchor;
+    uint64_t old = leaf->lines[i].len;
+    leaf->lines[i] = s;
+    add_chunk(leaf->chunks, c, leaf->lines);
+    for (int k = 0; k < depth; ++k) path[k]->bytes = path[k]->bytes - old + s.len;
+    return true;
+}
+
+void TextBuffer::insert(size_t i, string_view s) {
+    ChunkPtr c;
+    Line l = store(s, c);
+    if (!root) {
+        root = make_leaf(vector<Line>(1, l), vector<ChunkPtr>(1, c));
+    } else {
+        root = insert_at(root, i, l, c, true);
+    }
+    touch();
+}
+
+void TextBuffer::insert(size_t i, const TextBuffer& lines) {
+    if (lines.empty()) return;
+    auto p = split(root, i);
+    root = join(join(p.first, unanchored(lines.root)), p.second);
+    touch();
+}
+
+void TextBuffer::push_back(string_view s) {
+    insert(size(), s);
+}
+
+void TextBuffer::erase(size_t i, size_t n) {
+    if (n == 0 || i >= size()) return;
+    if (n == 1) {
+        root = erase_at(root, i, true);
+    } else {
+        auto p = split(root, i);
+        auto q = split(p.second, n);
+        root = join(p.first, q.second);
+    }
+    touch();
+}
+
+void TextBuffer::clear() {
+    root.reset();
+    touch();
+}
+
+TextBuffer TextBuffer::slice(size_t i, size_t n) const {
+    return TextBuffer(split(split(root, i).second, n).first);
+}
+
+TextBuffer TextBuffer::share_lines(const vector<string_view>& lines) const {
+    // Every chunk our text is in, by address
+    vector<NodePtr> leaves;
+    collect_leaves(root, leaves);
+    vector<ChunkPtr> chunks;
+    for (const NodePtr& n : leaves) chunks.insert(chunks.end(), n->chunks.begin(), n->chunks.end());
+    auto by_addr = [](const ChunkPtr& a, const ChunkPtr& b) { return a->data < b->data; };
+    sort(chunks.begin(), chunks.end(), by_addr);
+    chunks.erase(unique(chunks.begin(), chunks.end()), chunks.end());
+    Builder b;
+    const ChunkPtr none;
+    for (string_view s : lines) {
+        if (s.empty()) {
+            b.add_ref(Line{ nullptr, 0, 0 }, none);
+            continue;
+        }
+        auto it = upper_bound(chunks.begin(), chunks.end(), s.data(),
+                              [](const char* p, const ChunkPtr& c) { return p < c->data; });
+        if (it != chunks.begin() && (*--it)->holds(s.data())) b.add_ref(Line{ s.data(), (uint32_t)s.size(), 0 }, *it);
+        else b.add(s); // not ours after all
+    }
+    return b.finish();
+}
+
+uint32_t TextBuffer::anchor_of(size_t i) const {
+    const Node* n = root.get();
+    while (!n->leaf()) {
+        size_t lc = n->left->count;
+        if (i < lc) {
+            n = n->left.get();
+        } else {
+            i -= lc;
+            n = n->right.get();
+        }
+    }
+    return n->span ? 0 : n->lines[i].anchor;
+}
+
+void TextBuffer::set_anchor(size_t i, uint32_t id) {
+    if (i >= size() || anchor_of(i) == id) return;
+    root = anchor_at(root, i, id, true);
+}
+
+size_t TextBuffer::find_anchor(uint32_t id) const {
+    if (id == 0 || id > ANCHOR_MAX || !root) return SIZE_MAX;
+    uint64_t bit = 1ull << (id - 1);
+    if (!(root->anchors & bit)) return SIZE_MAX;
+    const Node* n = root.get();
+    size_t base = 0;
+    while (!n->leaf()) {
+        if (n->left->anchors & bit) {
+            n = n->left.get();
+        } else {
+            base += n->left->count;
+            n = n->right.get();
+        }
+    }
+    for (size_t i = 0; i < n->lines.size(); ++i) {
+        if (n->lines[i].anchor == id) return base + i;
+    }
+    return SIZE_MAX;
+}
+
+void TextBuffer::common_ends(const TextBuffer& other, size_t& head, size_t& tail) const {
+    // One side of the walk: the leaf holding the current line and its first line
+    struct Side {
+        vector<NodePtr> leaves;
+        size_t leaf = 0, start = 0;
+        vector<string_view> views; // lines of span leaf `viewed`, read once
+        size_t viewed = SIZE_MAX;
+        void seek(size_t i) {
+            while (i < start) start -= leaves[--leaf]->count;
+            while (i >= start + leaves[leaf]->count) start += leaves[leaf++]->count;
+        }
+        string_view line(size_t i) {
+            seek(i);
+            const Node* n = leaves[leaf].get();
+            if (!n->span) return n->lines[i - start].view();
+            if (viewed != leaf) {
+                views.clear();
+                auto add = [&](size_t, string_view s) {
+                    views.push_back(s);
+                    return true;
+                };
+                visit(n, 0, 0, n->count, add);
+                viewed = leaf;
+            }
+            return views[i - start];
+        }
+    };
+    auto same = [](string_view x, string_view y) { return x.data() == y.data() && x.size() == y.size(); };
+    size_t n = size(), m = other.size(), limit = min(n, m);
+    head = tail = 0;
+    if (limit == 0) return;
+    Side a, b;
+    collect_leaves(root, a.leaves);
+    collect_leaves(other.root, b.leaves);
+    while (head < limit) {
+        a.seek(head);
+        b.seek(head);
+        const Node* x = a.leaves[a.leaf].get();
+        if (x == b.leaves[b.leaf].get() && a.start == head && b.start == head) {
+            head += x->count;
+        } else if (same(a.line(head), b.line(head))) {
+            head++;
+        } else {
+            break;
+        }
+    }
+    a.leaf = a.leaves.size() - 1;
+    a.start = n - a.leaves.back()->count;
+    b.leaf = b.leaves.size() - 1;
+    b.start = m - b.leaves.back()->count;
+    while (head + tail < limit) {
+        size_t i = n - 1 - tail, j = m - 1 - tail;
+        a.seek(i);
+        b.seek(j);
+        const Node* x = a.leaves[a.leaf].get();
+        // the same leaf, ending the same distance from the end
+        if (x == b.leaves[b.leaf].get() && a.start + x->count == i + 1 && b.start + x->count == j + 1 &&
+            head + tail + x->count <= limit) {
+            tail += x->count;
+        } else if (same(a.line(i), b.line(j))) {
+            tail++;
+        } else {
+            break;
+        }
+    }
+}
+
+TextBuffer::MemoryStats TextBuffer::memory() const {
+    MemoryStats st = { size(), bytes(), bytes(), 0, 0, 0 };
+    unordered_set<const Chunk*> seen;
+    vector<const Node*> todo;
+    if (root) todo.push_back(root.get());
+    while (!todo.empty()) {
+        const Node* n = todo.back();
+        todo.pop_back();
+        // node, its shared_ptr control block and the leaf vectors
+        st.nodes += sizeof(Node) + 16 + n->lines.capacity() * sizeof(Line) + n->chunks.capacity() * sizeof(ChunkPtr);
+        if (!n->leaf()) {
+            todo.push_back(n->left.get());
+            todo.push_back(n->right.get());
+            continue;
+        }
+        bool has_mapped = false;
+        for (const ChunkPtr& c : n->chunks) {
+            if (c->kind == Chunk::MAPPED) has_mapped = true;
+            if (!seen.insert(c.get()).second) continue;
+            if (c->kind == Chunk::MAPPED) st.mapped += c->cap;
+            else st.chunks += sizeof(Chunk) + 16 + c->cap;
+        }
+        if (n->span) {
+            st.copied -= n->bytes;
+        } else if (has_mapped) {
+            for (const Line& l : n->lines) {
+                for (const ChunkPtr& c : n->chunks) {
+                    if (c->kind == Chunk::MAPPED && l.len && c->holds(l.data)) st.copied -= l.len;
+                }
+            }
+        }
+    }
+    return st;
+}
+
+TextBuffer TextBuffer::compacted() const {
+    vector<NodePtr> leaves;
+    collect_leaves(root, leaves);
+    Builder b;
+    for (const NodePtr& n : leaves) {
+        if (n->span) {
+            b.add_leaf(n);
+            continue;
+        }
+        bool has_mapped = false;
+        for (const ChunkPtr& c : n->chunks) has_mapped = has_mapped || c->kind == Chunk::MAPPED;
+        for (const Line& l : n->lines) {
+            const ChunkPtr* file = nullptr;
+            if (has_mapped && l.len) {
+                for (const ChunkPtr& c : n->chunks) {
+                    if (c->kind == Chunk::MAPPED && c->holds(l.data)) file = &c;
+                }
+            }
+            if (file) b.add_ref(l, *file);
+            else b.add(l.view(), l.anchor);
+        }
+    }
+    return TextBuffer(b.finish().root, ver);
+}
+
+TextBuffer::ChunkPtr TextBuffer::map_file(const string& path, string& err) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        err = strerror(errno);
+        return nullptr;
+    }
+    struct stat st;
+    void* p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+        err = st.st_size > 0 ? strerror(errno) : "empty file";
+        close(fd);
+        return nullptr;
+    }
+    auto c = make_shared<Chunk>((char*)p, st.st_size, Chunk::MAPPED);
+    c->used = st.st_size;
+    c->fd = fd;
+    track(c);
+    return c;
+}
+
+uint64_t TextBuffer::mapped_size(const ChunkPtr& file) {
+    return file->used;
+}
+
+uint64_t TextBuffer::line_start(const ChunkPtr& file, uint64_t off) {
+    if (off == 0 || off >= file->used) return min(off, (uint64_t)file->used);
+    const char* nl = (const char*)memchr(file->data + off - 1, '\n', file->used - off + 1);
+    return nl ? nl - file->data + 1 : file->used;
+}
+
+TextBuffer TextBuffer::from_file(const ChunkPtr& file, uint64_t from, uint64_t to) {
+    Builder b;
+    const char* data = file->data;
+    uint64_t pos = from;
+    while (pos < to) {
+        uint64_t end = min(line_start(file, pos + SPAN_BYTES), to);
+        size_t newlines = count(data + pos, data + end, '\n');
+        // only the last line of the file can lack its newline
+        size_t lines = newlines + (data[end - 1] != '\n');
+        b.add_leaf(make_span(file, data + pos, end - pos, lines, end - pos - newlines));
+        pos = end;
+    }
+    return b.finish();
+}
+
+TextBuffer::ChunkPtr TextBuffer::find_mapping(const string& path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) return nullptr;
+    lock_guard<mutex> lk(paged_m);
+    for (const weak_ptr<Chunk>& w : paged) {
+        ChunkPtr c = w.lock();
+        struct stat mst;
+        if (c && c->kind == Chunk::MAPPED && c->used == (uint64_t)st.st_size && fstat(c->fd, &mst) == 0 &&
+            mst.st_dev == st.st_dev && mst.st_ino == st.st_ino) {
+            return c;
+        }
+    }
+    return nullptr;
+}
+
+const char* TextBuffer::mapped_data(const ChunkPtr& file) {
+    return file->data;
+}
+
+void TextBuffer::hot_ranges(size_t from, size_t to, vector<pair<const char*, const char*>>& hot) const {
+    for_each(from, min(to, size()), [&](size_t, string_view s) {
+        if (s.empty()) return true;
+        const char* a = s.data();
+        const char* b = a + s.size();
+        if (!hot.empty() && a >= hot.back().first && a <= hot.back().second + 1) {
+            hot.back().second = max(hot.back().second, b);
+        } else {
+            hot.push_back(make_pair(a, b));
+        }
+        return true;
+    });
+}
+
+uint64_t TextBuffer::page_out(vector<pair<const char*, const char*>> hot) {
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    sort(hot.begin(), hot.end());
+    vector<ChunkPtr> chunks;
+    {
+        lock_guard<mutex> lk(paged_m);
+        for (const weak_ptr<Chunk>& w : paged) {
+            if (ChunkPtr c = w.lock()) chunks.push_back(move(c));
+        }
+    }
+    ChunkPtr current;
+    {
+        lock_guard<mutex> lk(pool_m);
+        current = pool;
+    }
+    int fd;
+    {
+        lock_guard<mutex> lk(scratch_m);
+        fd = scratch_fd;
+    }
+    uint64_t dropped = 0;
+    for (const ChunkPtr& c : chunks) {
+        // the pool chunk is still being written to
+        if (c == current) continue;
+        uintptr_t lo = (uintptr_t)c->data, hi = lo + (c->cap + page - 1) / page * page;
+        auto cold = [&](uintptr_t a, uintptr_t b) {
+            if (a >= b) return;
+            madvise((void*)a, b - a, MADV_DONTNEED);
+            // scratch pages are dirty file pages: write them back so the cache can let them go too
+            if (c->kind == Chunk::SCRATCH) {
+                off_t off = c->offset + (a - lo);
+                sync_file_range(fd, off, b - a, SYNC_FILE_RANGE_WRITE);
+                posix_fadvise(fd, off, b - a, POSIX_FADV_DONTNEED);
+            }
+            dropped += b - a;
+        };
+        uintptr_t pos = lo;
+        auto it = lower_bound(hot.begin(), hot.end(), make_pair((const char*)lo, (const char*)lo));
+        if (it != hot.begin()) --it;
+        for (; it != hot.end() && (uintptr_t)it->first < hi; ++it) {
+            uintptr_t a = (uintptr_t)it->first / page * page;
+            uintptr_t b = ((uintptr_t)it->second + page - 1) / page * page;
+            if (b <= pos) continue;
+            cold(pos, min(max(a, pos), hi));
+            pos = min(b, hi);
+        }
+        cold(pos, hi);
+    }
+    return dropped;
+}
+
+void TextBuffer::Builder::add(string_view s, uint32_t anchor) {
+    Line l = { nullptr, (uint32_t)s.size(), anchor };
+    if (!s.empty()) {
+        char* dst;
+        if (s.size() >= BIG_LINE) {
+            ChunkPtr big = new_chunk(s.size());
+            big->used = s.size();
+            dst = big->data;
+            pending_chunks.push_back(big);
+        } else {
+            if (!chunk || chunk->cap - chunk->used < s.size()) {
+                // Grow chunk sizes so small buffers stay small
+                chunk = new_chunk(max(chunk ? min(chunk->cap * 2, CHUNK_MAX) : CHUNK_MIN, s.size()));
+            }
+            if (pending_chunks.empty() || pending_chunks.back() != chunk) pending_chunks.push_back(chunk);
+            dst = chunk->data + chunk->used;
+            chunk->used += s.size();
+        }
+        memcpy(dst, s.data(), s.size());
+        l.data = dst;
+    }
+    pending.push_back(l);
+    if (pending.size() == LEAF_MAX) flush();
+}
+
+void TextBuffer::Builder::add_ref(Line l, const ChunkPtr& c) {
+    // Rearranged lines (share_lines) can come from a different chunk each
+    if (l.len && find(pending_chunks.begin(), pending_chunks.end(), c) == pending_chunks.end()) {
+        pending_chunks.push_back(c);
+    }
+    pending.push_back(l);
+    if (pending.size() == LEAF_MAX) flush();
+}
+
+void TextBuffer::Builder::add_leaf(NodePtr leaf) {
+    if (!pending.empty()) flush();
+    if (leaf) leaves.push_back(move(leaf));
+}
+
+void TextBuffer::Builder::flush() {
+    leaves.push_back(make_leaf(move(pending), move(pending_chunks)));
+    pending.clear();
+    pending_chunks.clear();
+}
+
+TextBuffer TextBuffer::Builder::finish() {
+    if (!pending.empty()) flush();
+    NodePtr root = build(leaves, 0, leaves.size());
+    leaves.clear();
+    chunk.reset();
+    return TextBuffer(root);
+}
@@ -0,0 +1,250 @@
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <utility>
+
+// Line storage for the editor: a persistent balanced tree of line chunks.
+// Nodes are never changed once they can be seen by another copy, so
+// copying a TextBuffer is O(1) and gives an immutable snapshot that a
+// background thread may read while the original keeps being edited.
+// Edits copy only the O(log n) nodes on the path to the change (nodes
+// nobody else shares are updated in place).
+//
+// Line text is not stored per line: it is packed into large shared chunks
+// (one run of chunks per Builder, and a common pool for edited lines), and
+// a leaf only holds (pointer, length) pairs plus references to the chunks
+// they point into. Chunks are freed when no leaf uses them any more;
+// compacted() copies the live text into fresh chunks when edits have left
+// too much dead text behind.
+//
+// Big files are not read at all: map_file() maps them and from_file()
+// covers them with span leaves that only know where their lines are, so
+// lines come straight from the page cache. A span is split into ordinary
+// leaves the first time one of its lines is edited. Large chunks live in
+// an unlinked scratch file instead of the heap, and page_out() hands cold
+// pages of both back to the kernel, which keeps the resident set bounded
+// for files far bigger than memory.
+//
+// A line can carry an anchor (an id from 1 to ANCHOR_MAX) that stays with
+// it through edits anywhere else and goes away when the line is deleted.
+// Every node knows which anchors are below it, so finding an anchor's
+// current line number is a single walk down the tree.
+class TextBuffer {
+    struct Node;
+    typedef std::shared_ptr<const Node> NodePtr;
+
+    // One line: a slice of a chunk (nullptr, 0 for an empty line). The
+    // anchor sits in what would otherwise be padding.
+    struct Line {
+        const char* data;
+        uint32_t len;
+        uint32_t anchor;
+        std::string_view view() const { return std::string_view(data, len); }
+    };
+
+public:
+    static const uint32_t ANCHOR_MAX = 64;
+
+    struct Chunk;
+    typedef std::shared_ptr<Chunk> ChunkPtr;
+
+    struct MemoryStats {
+        size_t lines;
+        uint64_t text;   // bytes of line text
+        uint64_t copied; // the part of text that was copied into chunks
+        uint64_t chunks; // bytes of those chunks, dead text included
+        uint64_t mapped; // bytes of mapped files the rest comes from
+        uint64_t nodes;  // tree nodes and line descriptors
+    };
+
+    TextBuffer();
+    explicit TextBuffer(std::vector<std::string> lines);
+
+    size_t size() const { return root ? root->count : 0; }
+    bool empty() const { return !root; }
+    // characters in all lines, newlines not included
+    uint64_t bytes() const { return root ? root->bytes : 0; }
+    // changes on every edit; copies share the version of their source
+    uint64_t version() const { return ver; }
+
+    std::string_view operator[](size_t i) const;
+
+    void set_line(size_t i, std::string_view s);
+    void insert(size_t i, std::string_view s);
+    void insert(size_t i, const TextBuffer& lines);
+    void push_back(std::string_view s);
+    void erase(size_t i, size_t n = 1);
+    void clear();
+    TextBuffer slice(size_t i, size_t n) const;
+    // A buffer of `lines`, each a view of one of this buffer's lines (as
+    // operator[] and for_each hand them out), in any order and any number
+    // of times. The text is shared with this buffer, not copied.
+    TextBuffer share_lines(const std::vector<std::string_view>& lines) const;
+
+    // Anchors are not part of the text: setting one leaves version() alone,
+    // and lines inserted from another buffer come without theirs. A line
+    // holds one anchor at most (0 means none).
+    uint32_t anchor_of(size_t i) const;
+    void set_anchor(size_t i, uint32_t id);
+    // Line the anchor is on, or SIZE_MAX when it is on none.
+    size_t find_anchor(uint32_t id) const;
+
+    // How many lines at the start (head) and at the end (tail) this and
+    // other have in common, with head + tail at most the smaller size.
+    // Common means the very same text (a line neither side edited), not
+    // text that happens to be equal. Leaves the two share are skipped
+    // whole, so after a few edits this is a walk over the leaves plus the
+    // lines of the leaves that changed.
+    void common_ends(const TextBuffer& other, size_t& head, size_t& tail) const;
+
+    // Walks the whole tree; meant for idle time.
+    MemoryStats memory() const;
+    // Same lines (and version) with the text copied into fresh, full chunks.
+    // Lines that come from a mapped file are left where they are.
+    TextBuffer compacted() const;
+
+    // Memory-maps a file read-only (nullptr and err set on failure).
+    static ChunkPtr map_file(const std::string& path, std::string& err);
+    static uint64_t mapped_size(const ChunkPtr& file);
+    // Offset of the first line that starts at or after off.
+    static uint64_t line_start(const ChunkPtr& file, uint64_t off);
+    // Lines in [from, to) of a mapped file, both line starts (or to at the end).
+    static TextBuffer from_file(const ChunkPtr& file, uint64_t from, uint64_t to);
+    // A mapping map_file() made of the file now at path (same device,
+    // inode and size) that is still in use, or nullptr.
+    static ChunkPtr find_mapping(const std::string& path);
+    static const char* mapped_data(const ChunkPtr& file);
+
+    // Adds the memory behind lines [from, to) to `hot`, for page_out().
+    void hot_ranges(size_t from, size_t to, std::vector<std::pair<const char*, const char*>>& hot) const;
+    // Drops every page of the mapped files and scratch chunks that is not
+    // in `hot` from memory (the kernel reloads them when they are read
+    // again). Returns the bytes given back.
+    static uint64_t page_out(std::vector<std::pair<const char*, const char*>> hot);
+
+    // Calls fn(line_no, text) for lines [from, to) in order; stops early when fn returns false.
+    template <class F>
+    bool for_each(size_t from, size_t to, F&& fn) const {
+        if (!root || from >= to) return true;
+        return visit(root.get(), 0, from, to, fn);
+    }
+
+    // All lines in order like for_each, except that the lines of a span
+    // leaf, still as they are in the mapped file, come as one
+    // on_span(text, len, count) without being looked at: count lines in
+    // [text, text + len), each '\n'-terminated unless it ends the file.
+    template <class F, class S>
+    bool for_each_span(F&& on_line, S&& on_span) const {
+        if (!root) return true;
+        return visit_spans(root.get(), 0, on_line, on_span);
+    }
+
+    // Appends lines into full chunks without going through insert.
+    class Builder {
+    public:
+        void add(std::string_view s, uint32_t anchor = 0);
+        TextBuffer finish();
+    private:
+        std::vector<Line> pending;
+        std::vector<ChunkPtr> pending_chunks;
+        ChunkPtr chunk;
+        std::vector<NodePtr> leaves;
+        void flush();
+        // a line kept where it is (compaction of mapped text)
+        void add_ref(Line l, const ChunkPtr& c);
+        void add_leaf(NodePtr leaf);
+        friend class TextBuffer;
+    };
+
+private:
+    struct Node {
+        std::shared_ptr<const Node> left, right;
+        std::vector<Line> lines;       // only used by leaves
+        std::vector<ChunkPtr> chunks;  // what the lines point into
+        // span leaves: count lines of a mapped file, '\n'-terminated except at its end
+        const char* span = nullptr;
+        uint64_t span_len = 0;
+        size_t count;
+        uint64_t bytes;
+        uint64_t anchors = 0; // bit id - 1 for every anchor below
+        int height;
+        bool leaf() const { return !left; }
+    };
+
+    NodePtr root;
+    uint64_t ver;
+
+    explicit TextBuffer(NodePtr root);
+    TextBuffer(NodePtr root, uint64_t ver);
+    void touch();
+
+    template <class F>
+    static bool visit(const Node* n, size_t base, size_t from, size_t to, F& fn) {
+        if (n->span) {
+            size_t lo = from > base ? from - base : 0;
+            size_t hi = to - base < n->count ? to - base : n->count;
+            const char* end = n->span + n->span_len;
+            const char* p = span_seek(n, lo);
+            for (size_t i = lo; i < hi; ++i) {
+                const char* nl = (const char*)memchr(p, '\n', end - p);
+                const char* stop = nl ? nl : end;
+                if (!fn(base + i, std::string_view(p, stop - p))) return false;
+                p = stop + 1;
+            }
+            return true;
+        }
+        if (n->leaf()) {
+            size_t lo = from > base ? from - base : 0;
+            size_t hi = to - base < n->count ? to - base : n->count;
+            for (size_t i = lo; i < hi; ++i) {
+                if (!fn(base + i, n->lines[i].view())) return false;
+            }
+            return true;
+        }
+        size_t lc = n->left->count;
+        if (from < base + lc && !visit(n->left.get(), base, from, to, fn)) return false;
+        if (to > base + lc) return visit(n->right.get(), base + lc, from, to, fn);
+        return true;
+    }
+
+    template <class F, class S>
+    static bool visit_spans(const Node* n, size_t base, F& on_line, S& on_span) {
+        if (n->span) return on_span(n->span, n->span_len, n->count);
+        if (n->leaf()) {
+            for (size_t i = 0; i < n->count; ++i) {
+                if (!on_line(base + i, n->lines[i].view())) return false;
+            }
+            return true;
+        }
+        return visit_spans(n->left.get(), base, on_line, on_span) &&
+               visit_spans(n->right.get(), base + n->left->count, on_line, on_span);
+    }
+
+    static int height(const NodePtr& n) { return n ? n->height : 0; }
+    static Line store(std::string_view s, ChunkPtr& chunk);
+    static const char* span_seek(const Node* n, size_t i);
+    static NodePtr make_span(const ChunkPtr& file, const char* p, uint64_t len, size_t count, uint64_t bytes);
+    static NodePtr explode(const NodePtr& n);
+    static void collect_leaves(const NodePtr& n, std::vector<NodePtr>& out);
+    static NodePtr make_leaf(std::vector<Line> lines, std::vector<ChunkPtr> chunks);
+    static NodePtr make_node(NodePtr l, NodePtr r);
+    static NodePtr balance(NodePtr l, NodePtr r);
+    static NodePtr join(NodePtr l, NodePtr r);
+    static std::pair<NodePtr, NodePtr> split(const NodePtr& n, size_t i);
+    static NodePtr build(std::vector<NodePtr>& leaves, size_t lo, size_t hi);
+    static NodePtr set_at(const NodePtr& n, size_t i, Line s, const ChunkPtr& c, bool owned);
+    bool set_owned(size_t i, Line s, const ChunkPtr& c);
+    static NodePtr insert_at(const NodePtr& n, size_t i, Line s, const ChunkPtr& c, bool owned);
+    static NodePtr erase_at(const NodePtr& n, size_t i, bool owned);
+    static NodePtr anchor_at(const NodePtr& n, size_t i, uint32_t id, bool owned);
+    static NodePtr unanchored(const NodePtr& n);
+};
+
+#endif // BUFFER_H
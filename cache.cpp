@@ -0,0 +1,44 @@
+#include "cache.h"
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/stat.h>
+
+using namespace std;
+
+size_t align8(size_t n) {
+    return (n + 7) & ~(size_t)7;
+}
+
+bool section_ok(const Section& s, size_t elem, size_t file_size) {
+    return s.off <= file_size && s.count <= (file_size - s.off) / elem;
+}
+
+uint64_t fnv1a(const char* p, size_t n, uint64_t h) {
+    for (size_t i = 0; i < n; ++i) {
+        h ^= (unsigned char)p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+string cache_dir(const string& sub) {
+    const char* xdg = getenv("XDG_CACHE_HOME");
+    const char* home = getenv("HOME");
+    string dir = (xdg && *xdg) ? string(xdg) : string(home ? home : "/tmp") + "/.cache";
+    return dir + "/mini-vi/" + sub;
+}
+
+string cache_file(const string& sub, const string& key, const char* ext) {
+    char resolved[PATH_MAX];
+    string real = realpath(key.c_str(), resolved) ? string(resolved) : key;
+    char name[40];
+    snprintf(name, sizeof(name), "%016llx%s", (unsigned long long)fnv1a(real.data(), real.size()), ext);
+    return cache_dir(sub) + "/" + name;
+}
+
+void make_dirs(const string& path) {
+    for (size_t pos = 1; pos <= path.size(); ++pos) {
+        if (pos == path.size() || path[pos] == '/') mkdir(path.substr(0, pos).c_str(), 0700);
+    }
+}
@@ -0,0 +1,31 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+// Files kept under $XDG_CACHE_HOME/mini-vi/ (sessions, tag indexes) and
+// the pieces of their on-disk layout they share: a header of sections,
+// each 8-byte aligned, that is checked against the file size before use.
+
+struct Section {
+    uint64_t off;
+    uint64_t count;
+};
+
+size_t align8(size_t n);
+// Whether count elements of elem bytes at off fit in a file of file_size
+bool section_ok(const Section& s, size_t elem, size_t file_size);
+
+uint64_t fnv1a(const char* p, size_t n, uint64_t h = 1469598103934665603ULL);
+
+// $XDG_CACHE_HOME/mini-vi/sub (~/.cache when unset)
+std::string cache_dir(const std::string& sub);
+// The file in cache_dir(sub) for key (a path, resolved first), named by
+// its hash plus ext
+std::string cache_file(const std::string& sub, const std::string& key, const char* ext);
+// mkdir -p, private to the user
+void make_dirs(const std::string& path);
+
+#endif // CACHE_H
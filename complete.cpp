@@ -0,0 +1,113 @@
+#include "complete.h"
+#include <algorithm>
+#include <unordered_map>
+
+using namespace std;
+
+namespace {
+
+// The text of every line, in order
+vector<string_view> line_views(const TextBuffer& lines) {
+    vector<string_view> out;
+    out.reserve(lines.size());
+    lines.for_each(0, lines.size(), [&](size_t, string_view s) {
+        out.push_back(s);
+        return true;
+    });
+    return out;
+}
+
+// Untouched lines share their text, so this is mostly a pointer compare;
+// after compaction moved them it falls back to the bytes
+bool same(string_view x, string_view y) {
+    return (x.data() == y.data() && x.size() == y.size()) || x == y;
+}
+
+} // namespace
+
+vector<string_view> WordIndex::top(string_view prefix, size_t limit) const {
+    if (limit == 0) return {};
+    auto lo = lower_bound(entries.begin(), entries.end(), prefix,
+                          [&](const Entry& e, string_view p) { return word(e) < p; });
+    auto hi = partition_point(lo, entries.end(),
+                              [&](const Entry& e) { return word(e).compare(0, prefix.size(), prefix) == 0; });
+    // The best `limit` so far in a heap with the worst of them on top
+    auto better = [](const Entry* a, const Entry* b) { return a->count != b->count ? a->count > b->count : a < b; };
+    vector<const Entry*> best;
+    for (auto it = lo; it != hi; ++it) {
+        if (it->len == prefix.size()) continue;
+        if (best.size() < limit) {
+            best.push_back(&*it);
+            push_heap(best.begin(), best.end(), better);
+        } else if (better(&*it, best.front())) {
+            pop_heap(best.begin(), best.end(), better);
+            best.back() = &*it;
+            push_heap(best.begin(), best.end(), better);
+        }
+    }
+    // Ties keep the alphabetical order of the table
+    sort_heap(best.begin(), best.end(), better);
+    vector<string_view> out;
+    for (const Entry* e : best) out.push_back(word(*e));
+    return out;
+}
+
+WordIndexPtr WordIndex::updated(const TextBuffer& before, const TextBuffer& after, const CancelToken& tok) const {
+    vector<string_view> a = line_views(before), b = line_views(after);
+    size_t head = 0, tail = 0;
+    while (head < a.size() && head < b.size() && same(a[head], b[head])) head++;
+    while (tail < a.size() - head && tail < b.size() - head && same(a[a.size() - 1 - tail], b[b.size() - 1 - tail])) tail++;
+    size_t a_end = a.size() - tail, b_end = b.size() - tail;
+    // Views into the two snapshots, which outlive this call
+    unordered_map<string_view, int64_t> delta;
+    auto count = [&](string_view line, int64_t sign) { for_each_word(line, [&](string_view w) { delta[w] += sign; }); };
+    if (a_end - head == b_end - head) {
+        // Same number of lines (set_line edits): only the lines that differ
+        for (size_t i = head; i < a_end; ++i) {
+            if ((i & 4095) == 0 && tok.cancelled()) return nullptr;
+            if (same(a[i], b[i])) continue;
+            count(a[i], -1);
+            count(b[i], 1);
+        }
+    } else {
+        for (size_t i = head; i < a_end; ++i) {
+            if ((i & 4095) == 0 && tok.cancelled()) return nullptr;
+            count(a[i], -1);
+        }
+        for (size_t i = head; i < b_end; ++i) {
+            if ((i & 4095) == 0 && tok.cancelled()) return nullptr;
+            count(b[i], 1);
+        }
+    }
+    vector<pair<string_view, int64_t>> changes;
+    for (const auto& d : delta) {
+        if (d.second != 0) changes.push_back(d);
+    }
+    sort(changes.begin(), changes.end());
+    if (tok.cancelled()) return nullptr;
+
+    // Merge the sorted table with the sorted changes into a new index
+    auto next = make_shared<WordIndex>();
+    next->text.reserve(text.size());
+    next->entries.reserve(entries.size() + changes.size());
+    auto add = [&](string_view w, int64_t n) {
+        if (n <= 0) return;
+        next->entries.push_back(Entry{ (uint32_t)next->text.size(), (uint32_t)w.size(), (uint32_t)min<int64_t>(n, UINT32_MAX) });
+        next->text.append(w.data(), w.size());
+    };
+    size_t i = 0, j = 0;
+    while (i < entries.size() || j < changes.size()) {
+        if (j == changes.size() || (i < entries.size() && word(entries[i]) < changes[j].first)) {
+            add(word(entries[i]), entries[i].count);
+            i++;
+        } else if (i == entries.size() || changes[j].first < word(entries[i])) {
+            add(changes[j].first, changes[j].second);
+            j++;
+        } else {
+            add(changes[j].first, (int64_t)entries[i].count + changes[j].second);
+            i++;
+            j++;
+        }
+    }
+    return next;
+}
@@ -0,0 +1,64 @@
+#ifndef COMPLETE_H
+#define COMPLETE_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+#include "buffer.h"
+#include "scheduler.h"
+
+// Word index behind insert-mode completion (Ctrl-N / Ctrl-P). Words are
+// runs of letters, digits, '_' and non-ASCII bytes, 2 to 64 bytes long.
+// The index is immutable: all words sit back to back in one string with
+// a sorted table of (word, count) over it, so a prefix is a binary search
+// and a new version is a linear merge with a sorted delta. It counts the
+// words of every loaded buffer; the editor brings it up to date in the
+// background after edits.
+
+class WordIndex;
+typedef std::shared_ptr<const WordIndex> WordIndexPtr;
+
+class WordIndex {
+public:
+    size_t size() const { return entries.size(); }
+    // Up to limit words that start with prefix (prefix itself excluded),
+    // most frequent first
+    std::vector<std::string_view> top(std::string_view prefix, size_t limit) const;
+
+    // Brings the counts for one buffer from `before` to `after` (either may
+    // be empty). Only lines that differ are split into words, so after an
+    // edit this is the edited lines plus a pass comparing line pointers.
+    // Null once tok is cancelled.
+    WordIndexPtr updated(const TextBuffer& before, const TextBuffer& after, const CancelToken& tok) const;
+
+private:
+    struct Entry {
+        uint32_t off, len;
+        uint32_t count;
+    };
+    std::string text;
+    std::vector<Entry> entries; // sorted by word
+
+    std::string_view word(const Entry& e) const { return std::string_view(text.data() + e.off, e.len); }
+};
+
+inline bool is_word(unsigned char c) {
+    return c == '_' || c >= 0x80 || (c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z');
+}
+
+// Calls fn(word) for every word of s, in order.
+template <class F>
+void for_each_word(std::string_view s, F&& fn) {
+    size_t i = 0;
+    while (i < s.size()) {
+        while (i < s.size() && !is_word(s[i])) i++;
+        size_t start = i;
+        while (i < s.size() && is_word(s[i])) i++;
+        if (i - start >= 2 && i - start <= 64) fn(s.substr(start, i - start));
+    }
+}
+
+#endif // COMPLETE_H
@@ -0,0 +1,535 @@
+#include "compress.h"
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+using namespace std;
+
+namespace {
+
+const size_t IO_CHUNK = 1 << 20;
+
+// umask can only be read by setting it, so do it once before any threads exist
+mode_t read_umask() {
+    mode_t mask = umask(0);
+    umask(mask);
+    return mask;
+}
+const mode_t start_umask = read_umask();
+// How many decoded chunks the read-ahead thread may run in front of the reader.
+const size_t READ_AHEAD_CHUNKS = 4;
+
+class PlainReader : public StreamReader {
+public:
+    explicit PlainReader(FILE* f) : f(f), bytes(0), error(false) {}
+    ~PlainReader() override { fclose(f); }
+
+    size_t read(char* out, size_t cap) override {
+        size_t n = fread(out, 1, cap, f);
+        if (n < cap && ferror(f)) error = true;
+        bytes += n;
+        return n;
+    }
+    bool failed() const override { return error; }
+    uint64_t raw_bytes() const override { return bytes; }
+
+private:
+    FILE* f;
+    uint64_t bytes;
+    bool error;
+};
+
+class GzipReader : public StreamReader {
+public:
+    explicit GzipReader(FILE* f)
+        : f(f), in(IO_CHUNK), bytes(0), error(false), done(false), member_end(false) {
+        memset(&zs, 0, sizeof(zs));
+        // 15 + 32: accept both gzip and zlib headers
+        if (inflateInit2(&zs, 15 + 32) != Z_OK) error = done = true;
+    }
+    ~GzipReader() override {
+        inflateEnd(&zs);
+        fclose(f);
+    }
+
+    size_t read(char* out, size_t cap) override {
+        zs.next_out = (Bytef*)out;
+        zs.avail_out = (uInt)cap;
+        while (zs.avail_out > 0 && !done) {
+            if (zs.avail_in == 0) {
+                size_t n = fread(in.data(), 1, in.size(), f);
+                bytes += n;
+                if (n == 0) {
+                    // Running out of input in the middle of a member means truncation.
+                    if (ferror(f) || !member_end) error = true;
+                    done = true;
+                    break;
+                }
+                zs.next_in = (Bytef*)in.data();
+                zs.avail_in = (uInt)n;
+            }
+            int rc = inflate(&zs, Z_NO_FLUSH);
+            if (rc == Z_STREAM_END) {
+                // Concatenated gzip members decode as one stream.
+                inflateReset(&zs);
+                member_end = true;
+            } else if (rc == Z_OK) {
+                member_end = false;
+            } else if (rc != Z_BUF_ERROR) {
+                error = done = true;
+            }
+        }
+        return cap - zs.avail_out;
+    }
+    bool failed() const override { return error; }
+    uint64_t raw_bytes() const override { return bytes; }
+
+private:
+    FILE* f;
+    z_stream zs;
+    vector<char> in;
+    uint64_t bytes;
+    bool error;
+    bool done;
+    bool member_end;
+};
+
+#ifdef HAVE_ZSTD
+class ZstdReader : public StreamReader {
+public:
+    explicit ZstdReader(FILE* f)
+        : f(f), ds(ZSTD_createDStream()), in(IO_CHUNK), bytes(0), error(false), done(false), last_ret(1) {
+        ib.src = in.data();
+        ib.size = ib.pos = 0;
+        if (!ds) error = done = true;
+        else ZSTD_initDStream(ds);
+    }
+    ~ZstdReader() override {
+        ZSTD_freeDStream(ds);
+        fclose(f);
+    }
+
+    size_t read(char* out, size_t cap) override {
+        ZSTD_outBuffer ob = { out, cap, 0 };
+        while (ob.pos < ob.size && !done) {
+            if (ib.pos == ib.size) {
+                size_t n = fread(in.data(), 1, in.size(), f);
+                bytes += n;
+                if (n == 0) {
+                    // last_ret != 0 means a frame was left unfinished
+                    if (ferror(f) || last_ret != 0) error = true;
+                    done = true;
+                    break;
+                }
+                ib.size = n;
+                ib.pos = 0;
+            }
+            size_t ret = ZSTD_decompressStream(ds, &ob, &ib);
+            if (ZSTD_isError(ret)) {
+                error = done = true;
+                break;
+            }
+            last_ret = ret;
+        }
+        return ob.pos;
+    }
+    bool failed() const override { return error; }
+    uint64_t raw_bytes() const override { return bytes; }
+
+private:
+    FILE* f;
+    ZSTD_DStream* ds;
+    vector<char> in;
+    ZSTD_inBuffer ib;
+    uint64_t bytes;
+    bool error;
+    bool done;
+    size_t last_ret;
+};
+#endif
+
+// Runs another reader on its own thread and hands decoded chunks over a
+// small bounded queue, so decompression overlaps with line splitting.
+class ReadAhead : public StreamReader {
+public:
+    explicit ReadAhead(unique_ptr<StreamReader> src)
+        : src(move(src)), offset(0), finished(false), stop(false), raw(0), error(false) {
+        worker = thread(&ReadAhead::produce, this);
+    }
+    ~ReadAhead() override {
+        {
+            lock_guard<mutex> lk(m);
+            stop = true;
+        }
+        cv.notify_all();
+        worker.join();
+    }
+
+    size_t read(char* out, size_t cap) override {
+        size_t done = 0;
+        while (done < cap) {
+            if (offset == current.size()) {
+                unique_lock<mutex> lk(m);
+                cv.wait(lk, [this] { return !chunks.empty() || finished; });
+                if (chunks.empty()) break;
+                current = move(chunks.front());
+                chunks.pop_front();
+                offset = 0;
+                lk.unlock();
+                cv.notify_all();
+            }
+            size_t n = min(cap - done, current.size() - offset);
+            memcpy(out + done, current.data() + offset, n);
+            done += n;
+            offset += n;
+        }
+        return done;
+    }
+    bool failed() const override { return error; }
+    uint64_t raw_bytes() const override { return raw; }
+
+private:
+    void produce() {
+        while (true) {
+            string chunk(IO_CHUNK, '\0');
+            size_t n = src->read(&chunk[0], chunk.size());
+            chunk.resize(n);
+            raw = src->raw_bytes();
+            error = src->failed();
+            unique_lock<mutex> lk(m);
+            if (n == 0 || stop) {
+                finished = true;
+                cv.notify_all();
+                return;
+            }
+            cv.wait(lk, [this] { return chunks.size() < READ_AHEAD_CHUNKS || stop; });
+            chunks.push_back(move(chunk));
+            cv.notify_all();
+        }
+    }
+
+    unique_ptr<StreamReader> src;
+    string current;
+    size_t offset;
+    deque<string> chunks;
+    bool finished;
+    bool stop;
+    atomic<uint64_t> raw;
+    atomic<bool> error;
+    mutex m;
+    condition_variable cv;
+    thread worker;
+};
+
+class PlainWriter : public StreamWriter {
+public:
+    explicit PlainWriter(FILE* f) : f(f), bytes(0) {}
+    ~PlainWriter() override {
+        if (f) fclose(f);
+    }
+
+    bool write(const char* data, size_t len) override {
+        size_t n = fwrite(data, 1, len, f);
+        bytes += n;
+        return n == len;
+    }
+    bool finish() override {
+        bool ok = fclose(f) == 0;
+        f = nullptr;
+        return ok;
+    }
+    uint64_t raw_bytes() const override { return bytes; }
+
+private:
+    FILE* f;
+    uint64_t bytes;
+};
+
+class GzipWriter : public StreamWriter {
+public:
+    explicit GzipWriter(FILE* f) : f(f), out(IO_CHUNK), bytes(0), ok(true) {
+        memset(&zs, 0, sizeof(zs));
+        // 15 + 16: write a gzip header instead of a zlib one
+        if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) ok = false;
+    }
+    ~GzipWriter() override {
+        deflateEnd(&zs);
+        if (f) fclose(f);
+    }
+
+    bool write(const char* data, size_t len) override {
+        zs.next_in = (Bytef*)data;
+        zs.avail_in = (uInt)len;
+        return pump(Z_NO_FLUSH);
+    }
+    bool finish() override {
+        zs.next_in = nullptr;
+        zs.avail_in = 0;
+        pump(Z_FINISH);
+        if (fclose(f) != 0) ok = false;
+        f = nullptr;
+        return ok;
+    }
+    uint64_t raw_bytes() const override { return bytes; }
+
+private:
+    bool pump(int flush) {
+        while (ok) {
+            zs.next_out = (Bytef*)out.data();
+            zs.avail_out = (uInt)out.size();
+            int rc = deflate(&zs, flush);
+            if (rc == Z_STREAM_ERROR) ok = false;
+            size_t n = out.size() - zs.avail_out;
+            if (n && fwrite(out.data(), 1, n, f) != n) ok = false;
+            bytes += n;
+            if (flush == Z_FINISH ? rc == Z_STREAM_END : zs.avail_out != 0) break;
+        }
+        return ok;
+    }
+
+    FILE* f;
+    z_stream zs;
+    vector<char> out;
+    uint64_t bytes;
+    bool ok;
+};
+
+#ifdef HAVE_ZSTD
+class ZstdWriter : public StreamWriter {
+public:
+    explicit ZstdWriter(FILE* f) : f(f), cctx(ZSTD_createCCtx()), out(IO_CHUNK), bytes(0), ok(cctx != nullptr) {
+        if (ok) {
+            ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, 3);
+            // Ignored by single-threaded libzstd builds.
+            unsigned workers = thread::hardware_concurrency();
+            if (workers > 1) ZSTD_CCtx_setParameter(cctx, ZSTD_c_nbWorkers, (int)workers);
+        }
+    }
+    ~ZstdWriter() override {
+        ZSTD_freeCCtx(cctx);
+        if (f) fclose(f);
+    }
+
+    bool write(const char* data, size_t len) override {
+        ZSTD_inBuffer ib = { data, len, 0 };
+        while (ok && ib.pos < ib.size) pump(ib, ZSTD_e_continue);
+        return ok;
+    }
+    bool finish() override {
+        ZSTD_inBuffer ib = { nullptr, 0, 0 };
+        while (ok && pump(ib, ZSTD_e_end) != 0) {
+        }
+        if (fclose(f) != 0) ok = false;
+        f = nullptr;
+        return ok;
+    }
+    uint64_t raw_bytes() const override { return bytes; }
+
+private:
+    size_t pump(ZSTD_inBuffer& ib, ZSTD_EndDirective mode) {
+        ZSTD_outBuffer ob = { out.data(), out.size(), 0 };
+        size_t ret = ZSTD_compressStream2(cctx, &ob, &ib, mode);
+        if (ZSTD_isError(ret)) {
+            ok = false;
+            return 0;
+        }
+        if (ob.pos && fwrite(out.data(), 1, ob.pos, f) != ob.pos) ok = false;
+        bytes += ob.pos;
+        return ret;
+    }
+
+    FILE* f;
+    ZSTD_CCtx* cctx;
+    vector<char> out;
+    uint64_t bytes;
+    bool ok;
+};
+#endif
+
+// Writes go to a temporary file next to the target, which finish() syncs
+// and renames over it. The old file stays whole until then, also for
+// anyone who has it mapped (the editor does for big files). sync_fd is a
+// second descriptor of the temporary file, as the inner writer closes its own.
+class ReplacingWriter : public StreamWriter {
+public:
+    ReplacingWriter(unique_ptr<StreamWriter> inner, int sync_fd, string tmp, string path)
+        : inner(move(inner)), sync_fd(sync_fd), tmp(move(tmp)), path(move(path)), done(false), ok(true) {}
+    ~ReplacingWriter() override {
+        close(sync_fd);
+        if (done) return;
+        inner.reset();
+        unlink(tmp.c_str());
+    }
+
+    bool write(const char* data, size_t len) override {
+        ok = inner->write(data, len) && ok;
+        return ok;
+    }
+    bool finish() override {
+        ok = inner->finish() && ok;
+        done = true;
+        // On disk before it takes the old file's name, or a crash could
+        // leave an empty file in its place
+        ok = ok && fsync(sync_fd) == 0;
+        if (ok && rename(tmp.c_str(), path.c_str()) != 0) ok = false;
+        if (!ok) unlink(tmp.c_str());
+        return ok;
+    }
+    uint64_t raw_bytes() const override { return inner->raw_bytes(); }
+
+private:
+    unique_ptr<StreamWriter> inner;
+    int sync_fd;
+    string tmp, path;
+    bool done;
+    bool ok; // a failed write keeps the old file
+};
+
+bool ends_with(const string& s, const char* suffix) {
+    size_t n = strlen(suffix);
+    return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+} // namespace
+
+const char* compression_name(Compression comp) {
+    switch (comp) {
+        case COMP_GZIP: return "gzip";
+        case COMP_ZSTD: return "zstd";
+        default: return "none";
+    }
+}
+
+Compression detect_compression(const string& path) {
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) return COMP_NONE;
+    unsigned char magic[4] = { 0, 0, 0, 0 };
+    size_t n = fread(magic, 1, sizeof(magic), f);
+    fclose(f);
+    if (n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) return COMP_GZIP;
+    if (n >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) return COMP_ZSTD;
+    return COMP_NONE;
+}
+
+Compression compression_from_name(const string& path) {
+    if (ends_with(path, ".gz")) return COMP_GZIP;
+    if (ends_with(path, ".zst")) return COMP_ZSTD;
+    return COMP_NONE;
+}
+
+unique_ptr<StreamReader> open_reader(const string& path, Compression comp, string& err) {
+#ifndef HAVE_ZSTD
+    if (comp == COMP_ZSTD) {
+        err = "zstd support not compiled in";
+        return nullptr;
+    }
+#endif
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) {
+        err = strerror(errno);
+        return nullptr;
+    }
+    switch (comp) {
+        case COMP_GZIP:
+            return unique_ptr<StreamReader>(new ReadAhead(unique_ptr<StreamReader>(new GzipReader(f))));
+#ifdef HAVE_ZSTD
+        case COMP_ZSTD:
+            return unique_ptr<StreamReader>(new ReadAhead(unique_ptr<StreamReader>(new ZstdReader(f))));
+#endif
+        default:
+            return unique_ptr<StreamReader>(new PlainReader(f));
+    }
+}
+
+// The compressor for comp on top of f
+unique_ptr<StreamWriter> make_writer(FILE* f, Compression comp) {
+    switch (comp) {
+        case COMP_GZIP: return unique_ptr<StreamWriter>(new GzipWriter(f));
+#ifdef HAVE_ZSTD
+        case COMP_ZSTD: return unique_ptr<StreamWriter>(new ZstdWriter(f));
+#endif
+        default: return unique_ptr<StreamWriter>(new PlainWriter(f));
+    }
+}
+
+unique_ptr<StreamWriter> open_writer(const string& path, Compression comp, bool replace, string& err) {
+#ifndef HAVE_ZSTD
+    if (comp == COMP_ZSTD) {
+        err = "zstd support not compiled in";
+        return nullptr;
+    }
+#endif
+    if (!replace) {
+        FILE* f = fopen(path.c_str(), "wb");
+        if (!f) {
+            err = strerror(errno);
+            return nullptr;
+        }
+        return make_writer(f, comp);
+    }
+    // Replace the file a symlink points to, not the link
+    string target = path;
+    char* real = realpath(path.c_str(), nullptr);
+    if (real) {
+        target = real;
+        free(real);
+    }
+    string tmp = target + ".XXXXXX";
+    int fd = mkostemp(&tmp[0], O_CLOEXEC);
+    if (fd < 0) {
+        err = string("cannot create a file next to it: ") + strerror(errno);
+        return nullptr;
+    }
+    // The new file gets the owner and mode of the one it replaces; new
+    // files get the usual 0666 & ~umask
+    struct stat st;
+    bool ok;
+    if (stat(target.c_str(), &st) == 0) {
+        ok = (fchown(fd, st.st_uid, st.st_gid) == 0 || (st.st_uid == geteuid() && st.st_gid == getegid())) &&
+             fchmod(fd, st.st_mode & 07777) == 0;
+    } else {
+        ok = fchmod(fd, 0666 & ~start_umask) == 0;
+    }
+    int sync_fd = ok ? dup(fd) : -1;
+    FILE* f = sync_fd >= 0 ? fdopen(fd, "wb") : nullptr;
+    if (!f) {
+        err = ok ? strerror(errno) : string("cannot keep its owner and mode: ") + strerror(errno);
+        if (sync_fd >= 0) close(sync_fd);
+        close(fd);
+        unlink(tmp.c_str());
+        return nullptr;
+    }
+    return unique_ptr<StreamWriter>(new ReplacingWriter(make_writer(f, comp), sync_fd, tmp, target));
+}
+
+string format_bytes(uint64_t bytes) {
+    const char* units[] = { "B", "KB", "MB", "GB", "TB" };
+    double v = (double)bytes;
+    int u = 0;
+    while (v >= 1024.0 && u < 4) {
+        v /= 1024.0;
+        u++;
+    }
+    char out[32];
+    if (u == 0) snprintf(out, sizeof(out), "%llu B", (unsigned long long)bytes);
+    else snprintf(out, sizeof(out), "%.1f %s", v, units[u]);
+    return out;
+}
+
+string format_rate(uint64_t bytes, double seconds) {
+    if (seconds <= 0.0) return "-";
+    return format_bytes((uint64_t)((double)bytes / seconds)) + "/s";
+}
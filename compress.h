@@ -0,0 +1,52 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <string>
+#include <memory>
+#include <cstdint>
+
+// Streaming (de)compression used by Editor::open_file / Editor::save_file.
+// gzip needs -lz; zstd is compiled in with -DHAVE_ZSTD -lzstd.
+
+enum Compression { COMP_NONE, COMP_GZIP, COMP_ZSTD };
+
+const char* compression_name(Compression comp);
+
+// Look at the magic bytes of an existing file (COMP_NONE if unreadable).
+Compression detect_compression(const std::string& path);
+
+// Pick a format from the file extension (.gz / .zst).
+Compression compression_from_name(const std::string& path);
+
+class StreamReader {
+public:
+    virtual ~StreamReader() {}
+    // Fill up to cap bytes of decompressed data; 0 means end of stream.
+    virtual size_t read(char* out, size_t cap) = 0;
+    virtual bool failed() const = 0;
+    // Bytes consumed from the file on disk so far.
+    virtual uint64_t raw_bytes() const = 0;
+};
+
+class StreamWriter {
+public:
+    virtual ~StreamWriter() {}
+    virtual bool write(const char* data, size_t len) = 0;
+    // Flush the compressor and close the file.
+    virtual bool finish() = 0;
+    // Bytes written to the file on disk so far.
+    virtual uint64_t raw_bytes() const = 0;
+};
+
+// Compressed input is decoded on a read-ahead thread so decompression
+// overlaps with whatever the caller does with the data.
+std::unique_ptr<StreamReader> open_reader(const std::string& path, Compression comp, std::string& err);
+// Writes path in place, or with replace to a temporary file that is synced
+// and renamed over path on finish() (for files someone may have mapped).
+std::unique_ptr<StreamWriter> open_writer(const std::string& path, Compression comp, bool replace, std::string& err);
+
+// "12.3 MB" / "450.0 MB/s" style helpers for status messages.
+std::string format_bytes(uint64_t bytes);
+std::string format_rate(uint64_t bytes, double seconds);
+
+#endif // COMPRESS_H
@@ -0,0 +1,109 @@
+#include "cursors.h"
+#include <algorithm>
+
+using namespace std;
+
+namespace {
+
+// Lines [first, last] and the cursors [begin, end) in them; shift is how
+// many lines the run gained (or lost) in the edit
+struct Run {
+    size_t first, last;
+    size_t begin, end;
+    ptrdiff_t shift;
+};
+
+} // namespace
+
+void edit_at_cursors(TextBuffer& buf, vector<Cursor>& cursors, size_t& main, CursorEdit op, string_view text) {
+    if (cursors.empty() || buf.empty()) return;
+    // Lines touched by each cursor (a join takes in the line above); runs
+    // that share a line are one run
+    vector<Run> runs;
+    for (size_t k = 0; k < cursors.size(); ++k) {
+        const Cursor& c = cursors[k];
+        size_t first = op == CURSOR_BACKSPACE && c.col == 0 && c.line > 0 ? c.line - 1 : c.line;
+        if (!runs.empty() && first <= runs.back().last) {
+            runs.back().last = c.line;
+            runs.back().end = k + 1;
+        } else {
+            runs.push_back(Run{ first, c.line, k, k + 1, 0 });
+        }
+    }
+    // Bottom up, so the runs still to do keep their line numbers
+    string joined;
+    vector<size_t> pos;
+    vector<string_view> out;
+    for (size_t r = runs.size(); r-- > 0;) {
+        Run& run = runs[r];
+        // The run as one string with '\n' between lines, cursors as offsets into it
+        joined.clear();
+        pos.clear();
+        size_t k = run.begin;
+        buf.for_each(run.first, run.last + 1, [&](size_t i, string_view s) {
+            for (; k < run.end && cursors[k].line == i; ++k) pos.push_back(joined.size() + min(cursors[k].col, s.size()));
+            joined.append(s.data(), s.size());
+            if (i < run.last) joined.push_back('\n');
+            return true;
+        });
+        // Left to right; delta is how far earlier edits moved the text
+        ptrdiff_t delta = 0;
+        for (size_t& p : pos) {
+            size_t at = p + delta;
+            if (op == CURSOR_INSERT) {
+                joined.insert(at, text.data(), text.size());
+                p = at + text.size();
+                delta += text.size();
+            } else if (op == CURSOR_BACKSPACE && at > 0) {
+                joined.erase(at - 1, 1);
+                p = at - 1;
+                delta--;
+            } else if (op == CURSOR_DELETE && at < joined.size() && joined[at] != '\n') {
+                joined.erase(at, 1);
+                p = at;
+                delta--;
+            } else {
+                p = at;
+            }
+        }
+        // Back to lines, placing the cursors on the way
+        out.clear();
+        k = 0;
+        for (size_t start = 0;;) {
+            size_t nl = joined.find('\n', start);
+            size_t end = nl == string::npos ? joined.size() : nl;
+            for (; k < pos.size() && pos[k] <= end; ++k) {
+                cursors[run.begin + k] = Cursor{ run.first + out.size(), pos[k] - start };
+            }
+            out.push_back(string_view(joined).substr(start, end - start));
+            if (nl == string::npos) break;
+            start = nl + 1;
+        }
+        // The first lines are replaced in place, so marks on them stay
+        size_t old_count = run.last - run.first + 1;
+        for (size_t i = 0; i < min(old_count, out.size()); ++i) buf.set_line(run.first + i, out[i]);
+        for (size_t i = old_count; i < out.size(); ++i) buf.insert(run.first + i, out[i]);
+        if (out.size() < old_count) buf.erase(run.first + out.size(), old_count - out.size());
+        run.shift = (ptrdiff_t)out.size() - (ptrdiff_t)old_count;
+    }
+    ptrdiff_t shift = 0;
+    for (const Run& run : runs) {
+        for (size_t k = run.begin; k < run.end; ++k) cursors[k].line += shift;
+        shift += run.shift;
+    }
+    Cursor m = cursors[main];
+    cursors.erase(unique(cursors.begin(), cursors.end()), cursors.end());
+    main = lower_bound(cursors.begin(), cursors.end(), m) - cursors.begin();
+}
+
+vector<Cursor> find_matches(const TextBuffer& buf, size_t from, size_t to, const string& pattern) {
+    vector<Cursor> out;
+    if (pattern.empty()) return out;
+    buf.for_each(from, to, [&](size_t i, string_view s) {
+        for (size_t p = s.find(pattern); p != string_view::npos; p = s.find(pattern, p + pattern.size())) {
+            out.push_back(Cursor{ i, p });
+        }
+        return true;
+    });
+    return out;
+}
@@ -0,0 +1,37 @@
+#ifndef CURSORS_H
+#define CURSORS_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstddef>
+#include "buffer.h"
+
+// Multiple cursors. A keystroke at every cursor is a single batched edit:
+// the cursors (kept sorted) are grouped into runs of lines the edit
+// touches, each run is rewritten once with every cursor in it applied
+// left to right, and the line shift of each run is added to the cursors
+// below it in one pass at the end.
+
+struct Cursor {
+    size_t line, col;
+    bool operator<(const Cursor& o) const { return line != o.line ? line < o.line : col < o.col; }
+    bool operator==(const Cursor& o) const { return line == o.line && col == o.col; }
+};
+
+enum CursorEdit {
+    CURSOR_INSERT,    // text goes in at the cursor ('\n' splits the line)
+    CURSOR_BACKSPACE, // the character before it; at column 0 joins with the line above
+    CURSOR_DELETE     // the character under it, never the line break (x)
+};
+
+// cursors must be sorted without duplicates and come back that way, moved
+// to where the edit leaves them; cursors that end up on the same spot are
+// merged. main is the index of the main cursor, before and after.
+void edit_at_cursors(TextBuffer& buf, std::vector<Cursor>& cursors, size_t& main, CursorEdit op,
+                     std::string_view text);
+
+// Every match of pattern in lines [from, to), in order (matches do not overlap).
+std::vector<Cursor> find_matches(const TextBuffer& buf, size_t from, size_t to, const std::string& pattern);
+
+#endif // CURSORS_H
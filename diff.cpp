@@ -0,0 +1,305 @@
+#include "diff.h"
+#include <algorithm>
+#include <climits>
+#include <cstring>
+
+using namespace std;
+
+namespace {
+
+// search steps tried before unmatched lines are filtered out
+const ptrdiff_t QUICK_STEPS = 1024;
+
+// Myers' O((N+M)D) search in linear space, after GNU diff's compareseq
+class Myers {
+public:
+    // With a give_up limit the search stops (setting gave_up) rather than
+    // take more steps than that anywhere.
+    Myers(const vector<uint64_t>& a, const vector<uint64_t>& b, const CancelToken& tok, ptrdiff_t give_up = 0)
+        : a_changed(a.size(), 0), b_changed(b.size(), 0), stopped(false), gave_up(false), a(a), b(b), tok(tok),
+          give_up(give_up) {
+        size_t diags = a.size() + b.size() + 3;
+        fdiag.resize(diags);
+        bdiag.resize(diags);
+        // both vectors are indexed by diagonal x - y, which starts at -b.size() - 1
+        fd = fdiag.data() + b.size() + 1;
+        bd = bdiag.data() + b.size() + 1;
+        // give up on a minimal diff past about sqrt(N) edits, like diff does
+        too_expensive = 1;
+        for (; diags != 0; diags >>= 2) too_expensive <<= 1;
+        too_expensive = max(too_expensive, (ptrdiff_t)4096);
+    }
+
+    void compare(ptrdiff_t xoff, ptrdiff_t xlim, ptrdiff_t yoff, ptrdiff_t ylim) {
+        while (xoff < xlim && yoff < ylim && a[xoff] == b[yoff]) {
+            ++xoff;
+            ++yoff;
+        }
+        while (xlim > xoff && ylim > yoff && a[xlim - 1] == b[ylim - 1]) {
+            --xlim;
+            --ylim;
+        }
+        if (xoff == xlim) {
+            fill(b_changed.begin() + yoff, b_changed.begin() + ylim, 1);
+        } else if (yoff == ylim) {
+            fill(a_changed.begin() + xoff, a_changed.begin() + xlim, 1);
+        } else {
+            ptrdiff_t xmid, ymid;
+            if (stopped || !middle(xoff, xlim, yoff, ylim, xmid, ymid)) return;
+            compare(xoff, xmid, yoff, ymid);
+            compare(xmid, xlim, ymid, ylim);
+        }
+    }
+
+    vector<char> a_changed, b_changed;
+    bool stopped, gave_up;
+
+private:
+    const vector<uint64_t>& a;
+    const vector<uint64_t>& b;
+    const CancelToken& tok;
+    ptrdiff_t give_up;
+    vector<ptrdiff_t> fdiag, bdiag;
+    ptrdiff_t* fd;
+    ptrdiff_t* bd;
+    ptrdiff_t too_expensive;
+
+    // Finds where a shortest path from (xoff, yoff) to (xlim, ylim) crosses
+    // its middle diagonal by searching from both ends at once. Past
+    // too_expensive steps it takes the point the searches got furthest to.
+    bool middle(ptrdiff_t xoff, ptrdiff_t xlim, ptrdiff_t yoff, ptrdiff_t ylim, ptrdiff_t& xmid, ptrdiff_t& ymid) {
+        const ptrdiff_t dmin = xoff - ylim, dmax = xlim - yoff;
+        const ptrdiff_t fmid = xoff - yoff, bmid = xlim - ylim;
+        ptrdiff_t fmin = fmid, fmax = fmid, bmin = bmid, bmax = bmid;
+        const bool odd = (fmid - bmid) & 1;
+        fd[fmid] = xoff;
+        bd[bmid] = xlim;
+        for (ptrdiff_t c = 1;; ++c) {
+            if ((c & 255) == 0 && tok.cancelled()) {
+                stopped = true;
+                return false;
+            }
+            if (give_up && c > give_up) {
+                stopped = gave_up = true;
+                return false;
+            }
+            if (fmin > dmin) fd[--fmin - 1] = -1;
+            else ++fmin;
+            if (fmax < dmax) fd[++fmax + 1] = -1;
+            else --fmax;
+            for (ptrdiff_t d = fmax; d >= fmin; d -= 2) {
+                ptrdiff_t lo = fd[d - 1], hi = fd[d + 1];
+                ptrdiff_t x = lo >= hi ? lo + 1 : hi;
+                ptrdiff_t y = x - d;
+                while (x < xlim && y < ylim && a[x] == b[y]) {
+                    ++x;
+                    ++y;
+                }
+                fd[d] = x;
+                if (odd && bmin <= d && d <= bmax && bd[d] <= x) {
+                    xmid = x;
+                    ymid = y;
+                    return true;
+                }
+            }
+            if (bmin > dmin) bd[--bmin - 1] = PTRDIFF_MAX;
+            else ++bmin;
+            if (bmax < dmax) bd[++bmax + 1] = PTRDIFF_MAX;
+            else --bmax;
+            for (ptrdiff_t d = bmax; d >= bmin; d -= 2) {
+                ptrdiff_t lo = bd[d - 1], hi = bd[d + 1];
+                ptrdiff_t x = lo < hi ? lo : hi - 1;
+                ptrdiff_t y = x - d;
+                while (x > xoff && y > yoff && a[x - 1] == b[y - 1]) {
+                    --x;
+                    --y;
+                }
+                bd[d] = x;
+                if (!odd && fmin <= d && d <= fmax && x <= fd[d]) {
+                    xmid = x;
+                    ymid = y;
+                    return true;
+                }
+            }
+            if (c < too_expensive) continue;
+            // Furthest point of each search (by x + y), clipped to the box
+            ptrdiff_t fxy = -1, fx = xoff;
+            for (ptrdiff_t d = fmax; d >= fmin; d -= 2) {
+                ptrdiff_t x = min(fd[d], xlim), y = x - d;
+                if (y > ylim) {
+                    x = ylim + d;
+                    y = ylim;
+                }
+                if (x + y > fxy) {
+                    fxy = x + y;
+                    fx = x;
+                }
+            }
+            ptrdiff_t bxy = PTRDIFF_MAX, bx = xlim;
+            for (ptrdiff_t d = bmax; d >= bmin; d -= 2) {
+                ptrdiff_t x = max(xoff, bd[d]), y = x - d;
+                if (y < yoff) {
+                    x = yoff + d;
+                    y = yoff;
+                }
+                if (x + y < bxy) {
+                    bxy = x + y;
+                    bx = x;
+                }
+            }
+            if ((xlim + ylim) - bxy < fxy - (xoff + yoff)) {
+                xmid = fx;
+                ymid = fxy - fx;
+            } else {
+                xmid = bx;
+                ymid = bxy - bx;
+            }
+            return true;
+        }
+    }
+};
+
+// Open-addressing set of line hashes (which are already well mixed)
+class HashSet {
+public:
+    HashSet(const vector<uint64_t>& v, size_t from, size_t to) : has_zero(false) {
+        size_t cap = 16;
+        while (cap < 2 * (to - from)) cap <<= 1;
+        slots.assign(cap, 0);
+        mask = cap - 1;
+        for (size_t i = from; i < to; ++i) {
+            uint64_t h = v[i];
+            if (h == 0) {
+                has_zero = true;
+                continue;
+            }
+            size_t k = h & mask;
+            while (slots[k] && slots[k] != h) k = (k + 1) & mask;
+            slots[k] = h;
+        }
+    }
+    bool contains(uint64_t h) const {
+        if (h == 0) return has_zero;
+        for (size_t k = h & mask; slots[k]; k = (k + 1) & mask) {
+            if (slots[k] == h) return true;
+        }
+        return false;
+    }
+
+private:
+    vector<uint64_t> slots;
+    size_t mask;
+    bool has_zero;
+};
+
+// The lines of x[from, to) that also occur in y[yfrom, yto); the others
+// are marked changed, as they cannot be part of any common subsequence
+void keep_matched(const vector<uint64_t>& x, size_t from, size_t to, const vector<uint64_t>& y, size_t yfrom, size_t yto,
+                  vector<uint64_t>& kept, vector<size_t>& where, vector<char>& changed) {
+    HashSet other(y, yfrom, yto);
+    for (size_t i = from; i < to; ++i) {
+        if (other.contains(x[i])) {
+            kept.push_back(x[i]);
+            where.push_back(i);
+        } else {
+            changed[i] = 1;
+        }
+    }
+}
+
+} // namespace
+
+uint64_t hash_line(string_view s) {
+    const uint64_t k = 0xff51afd7ed558ccdull;
+    const char* p = s.data();
+    size_t n = s.size();
+    uint64_t h = 0x9e3779b97f4a7c15ull ^ n;
+    for (; n >= 8; p += 8, n -= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        h = (h ^ w) * k;
+        h ^= h >> 32;
+    }
+    if (n) {
+        uint64_t w = 0;
+        memcpy(&w, p, n);
+        h = (h ^ w) * k;
+    }
+    h ^= h >> 29;
+    return h * k ^ (h >> 32);
+}
+
+DiffSidePtr hash_side(const TextBuffer& lines, const DiffSidePtr& prev) {
+    auto side = make_shared<DiffSide>();
+    side->lines = lines;
+    side->text.reserve(lines.size());
+    lines.for_each(0, lines.size(), [&](size_t, string_view s) {
+        side->text.push_back(s);
+        return true;
+    });
+    size_t n = side->text.size();
+    side->hashes.resize(n);
+    // Same pointer and length is the same text while both snapshots are alive
+    auto same = [](string_view x, string_view y) { return x.data() == y.data() && x.size() == y.size(); };
+    size_t head = 0, tail = 0;
+    if (prev) {
+        size_t m = prev->text.size();
+        while (head < n && head < m && same(side->text[head], prev->text[head])) {
+            side->hashes[head] = prev->hashes[head];
+            head++;
+        }
+        while (tail < n - head && tail < m - head && same(side->text[n - 1 - tail], prev->text[m - 1 - tail])) {
+            side->hashes[n - 1 - tail] = prev->hashes[m - 1 - tail];
+            tail++;
+        }
+    }
+    for (size_t i = head; i < n - tail; ++i) side->hashes[i] = hash_line(side->text[i]);
+    return side;
+}
+
+vector<DiffHunk> diff_lines(const vector<uint64_t>& a, const vector<uint64_t>& b, const CancelToken& tok) {
+    size_t n = a.size(), m = b.size(), head = 0, tail = 0;
+    while (head < n && head < m && a[head] == b[head]) head++;
+    while (tail < n - head && tail < m - head && a[n - 1 - tail] == b[m - 1 - tail]) tail++;
+    vector<DiffHunk> out;
+    vector<char> a_changed, b_changed;
+    // Few differences (the usual case) are found directly
+    Myers quick(a, b, tok, QUICK_STEPS);
+    quick.compare(head, n - tail, head, m - tail);
+    if (!quick.gave_up) {
+        if (quick.stopped) return out;
+        a_changed.swap(quick.a_changed);
+        b_changed.swap(quick.b_changed);
+    } else {
+        // Otherwise lines only one side has are left out of the search; on
+        // unrelated inputs that is most of them
+        a_changed.assign(n, 0);
+        b_changed.assign(m, 0);
+        vector<uint64_t> xa, xb;
+        vector<size_t> wa, wb;
+        keep_matched(a, head, n - tail, b, head, m - tail, xa, wa, a_changed);
+        keep_matched(b, head, m - tail, a, head, n - tail, xb, wb, b_changed);
+        Myers full(xa, xb, tok);
+        full.compare(0, xa.size(), 0, xb.size());
+        if (full.stopped) return out;
+        for (size_t i = 0; i < xa.size(); ++i) a_changed[wa[i]] |= full.a_changed[i];
+        for (size_t j = 0; j < xb.size(); ++j) b_changed[wb[j]] |= full.b_changed[j];
+    }
+    // Unchanged lines pair up in order; each run of changes between them is a hunk
+    size_t i = 0, j = 0;
+    while (i < n || j < m) {
+        if ((i < n && a_changed[i]) || (j < m && b_changed[j])) {
+            DiffHunk h = { i, 0, j, 0 };
+            while (i < n && a_changed[i]) i++;
+            while (j < m && b_changed[j]) j++;
+            h.a_count = i - h.a_start;
+            h.b_count = j - h.b_start;
+            out.push_back(h);
+        } else {
+            i++;
+            j++;
+        }
+    }
+    return out;
+}
+
@@ -0,0 +1,43 @@
+#ifndef DIFF_H
+#define DIFF_H
+
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+#include "buffer.h"
+#include "scheduler.h"
+
+// Line diff for :diff. Lines are compared by a 64-bit hash, so two lines
+// with equal hashes count as equal. The diff itself is Myers' linear-space
+// algorithm (forward and backward search meeting at a middle snake) on the
+// hashes, with the common head and tail stripped first and a cost cut-off
+// that settles for a non-minimal diff when the inputs have little in common.
+
+// Lines [a_start, a_start + a_count) of a are replaced by [b_start, b_start + b_count) of b.
+struct DiffHunk {
+    size_t a_start, a_count;
+    size_t b_start, b_count;
+};
+
+uint64_t hash_line(std::string_view s);
+
+// One side of a diff. The snapshot keeps the text behind `text` alive, so
+// the next run for the same buffer can reuse the hash of every line whose
+// text is still the same slice of the same chunk.
+struct DiffSide {
+    TextBuffer lines;
+    std::vector<std::string_view> text;
+    std::vector<uint64_t> hashes;
+};
+typedef std::shared_ptr<const DiffSide> DiffSidePtr;
+
+// prev may be null; only lines outside its common head and tail with
+// `lines` are hashed again.
+DiffSidePtr hash_side(const TextBuffer& lines, const DiffSidePtr& prev);
+
+// The hunks turning a into b, in order; empty once tok is cancelled.
+std::vector<DiffHunk> diff_lines(const std::vector<uint64_t>& a, const std::vector<uint64_t>& b, const CancelToken& tok);
+
+#endif // DIFF_H
@@ -1,37 +1,217 @@
 #include "editor.h"
+#include "session.h"
+#include "filter.h"
 #include <ncurses.h>
 #include <fstream>
 #include <algorithm>
+#include <unordered_map>
 #include <cstring>
 #include <chrono>
 #include <thread>
 #include <cctype>
+#include <cstdlib>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 using namespace std;
 
+namespace {
+
+// Buffers at least this big are searched on the job pool
+const uint64_t ASYNC_SEARCH_BYTES = 4 << 20;
+
+// Finds pattern after (start_line, start_col), wrapping around at the end.
+// Gives up once the token is cancelled.
+bool search_lines(const TextBuffer& lines, const string& pattern, size_t start_line, size_t start_col,
+                  const CancelToken& token, size_t& out_line, size_t& out_col) {
+    bool found = false;
+    auto scan = [&](size_t i, string_view line) {
+        if ((i & 1023) == 0 && token.cancelled()) return false;
+        // Start search from current column + 1 on the current line
+        size_t pos = (i == start_line) ? line.find(pattern, start_col) : line.find(pattern);
+        if (pos == string::npos) return true;
+        out_line = i;
+        out_col = pos;
+        found = true;
+        return false;
+    };
+    // Search from current position to end of file
+    lines.for_each(start_line, lines.size(), scan);
+    // Wrap-around search from BOF to starting line
+    if (!found && !token.cancelled()) lines.for_each(0, start_line, scan);
+    return found;
+}
+
+// Rough memory held by a buffer's lines
+uint64_t resident_bytes(const TextBuffer& b) {
+    return b.bytes() + b.size() * sizeof(string);
+}
+
+// uncompressed files at least this big are mapped instead of read
+const uint64_t MAP_MIN = 64ull << 20;
+// mapped files are split into about this much per line-counting job
+const uint64_t MAP_PART = 64ull << 20;
+
+// Reads all of `in` into out, lines clipped to max_len and at most
+// max_lines of them; returns the bytes read (after decompression)
+uint64_t read_lines(StreamReader& in, TextBuffer& out, size_t max_len, size_t max_lines) {
+    TextBuffer::Builder lines;
+    size_t count = 0;
+    vector<char> chunk(1 << 20);
+    string line;
+    uint64_t total = 0;
+    bool full = false;
+    size_t n;
+    // Split decompressed chunks into lines as they arrive
+    while (!full && (n = in.read(chunk.data(), chunk.size())) > 0) {
+        total += n;
+        const char* p = chunk.data();
+        const char* end = p + n;
+        while (p < end) {
+            const char* nl = (const char*)memchr(p, '\n', end - p);
+            size_t len = (nl ? nl : end) - p;
+            if (line.size() < max_len) line.append(p, min(len, max_len - line.size()));
+            if (!nl) break;
+            lines.add(line);
+            line.clear();
+            if (++count >= max_lines) {
+                full = true;
+                break;
+            }
+            p = nl + 1;
+        }
+    }
+    if (!full && !line.empty()) lines.add(line);
+    out = lines.finish();
+    return total;
+}
+
+// A file's lines as open_file would load them (mapped when big), for :diff
+bool load_lines(const string& path, TextBuffer& out, size_t max_len, size_t max_lines, string& err) {
+    Compression comp = detect_compression(path);
+    struct stat st;
+    if (comp == COMP_NONE && stat(path.c_str(), &st) == 0 && (uint64_t)st.st_size >= MAP_MIN) {
+        if (TextBuffer::ChunkPtr file = TextBuffer::map_file(path, err)) {
+            out = TextBuffer::from_file(file, 0, TextBuffer::mapped_size(file));
+            return true;
+        }
+    }
+    unique_ptr<StreamReader> in = open_reader(path, comp, err);
+    if (!in) return false;
+    read_lines(*in, out, max_len, max_lines);
+    return true;
+}
+
+// Resident set size of the whole process
+uint64_t process_rss() {
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (!f) return 0;
+    unsigned long long size = 0, rss = 0;
+    if (fscanf(f, "%llu %llu", &size, &rss) != 2) rss = 0;
+    fclose(f);
+    return rss * sysconf(_SC_PAGESIZE);
+}
+
+// ctags' kind letters, spelled out
+const char* tag_kind(char k) {
+    switch (k) {
+        case 'd': return "macro";
+        case 'f': return "function";
+        case 'c': return "class";
+        case 's': return "struct";
+        case 'u': return "union";
+        case 'g': return "enum";
+        case 'e': return "enumerator";
+        case 'n': return "namespace";
+        case 't': return "typedef";
+        default: return "tag";
+    }
+}
+
+} // namespace
+
 Editor::Editor()
-    : cy(0), cx(0), top_line(0), mode(MODE_NORMAL),
+    : file_comp(COMP_NONE), mapped(false), clean_version(0), cy(0), cx(0), top_line(0),
       status_msg("Welcome to mini-vi (press i to insert, :w to save, :q to quit)"),
-      undo_cx(0), undo_cy(0) {
+      mode(MODE_NORMAL), yank_kind(YANK_LINES), vis_y(0), vis_x(0), vis_eol(false), block_insert(false),
+      block_from(0), block_to(0), block_col(0), block_pad(false), block_undo_cx(0), block_undo_cy(0),
+      recording(-1), last_macro(-1), replay_depth(0), macro_stopped(false), key_count(0), undo_cx(0), undo_cy(0),
+      word_index(make_shared<WordIndex>()), index_running(false), comp_sel(0), comp_start(0), cur_buf(0), use_clock(0), mem_budget(0), live_version(0),
+      save_ok(false), save_comp(COMP_NONE), save_buf(0), save_version(0), compact_version(0), mem_cap(0), paging(false), qf_pos(SIZE_MAX), grep_running(false), tags_running(false), tag_pos(0), diff_on(false), diff_version(0), diff_running(false),
+      shared(nullptr), term(nullptr), key_fd(0), quitting(false), fps(60), drawn_top(0), drawn_version(0), full_redraw(true) {
     buf.clear();
     buf.push_back(std::string());
+    clean_version = buf.version();
+    buffers.push_back(current_state());
+    buffers[0].last_used = ++use_clock;
+    // Default budget: half of physical memory
+    long pages = sysconf(_SC_PHYS_PAGES), page = sysconf(_SC_PAGESIZE);
+    mem_budget = pages > 0 && page > 0 ? (uint64_t)pages * page / 2 : (1ull << 30);
+    mem_cap = mem_budget;
 }
 
 Editor::~Editor() {
+    finish_save();
+    // Before any member a job may still be using goes away
+    stop_jobs();
+    if (shared) shared->set_hot(this, {});
     end_ncurses();
 }
 
+void Editor::attach(SharedBuffers* s, Terminal* t, int keys, const string& dir, Scheduler& pool) {
+    shared = s;
+    term = t;
+    key_fd = keys;
+    cwd = dir;
+    jobs.share(pool);
+}
+
+// A path as typed. A server session runs in the server's directory, so
+// there it is taken from the client's and made full the way the client
+// makes the files it starts with (full_path), which is also the name
+// SharedBuffers knows them by.
+string Editor::resolve_path(const string& path) const {
+    if (cwd.empty() || path.empty()) return path;
+    string full = path[0] == '/' ? path : cwd + "/" + path;
+    char* real = realpath(full.c_str(), nullptr);
+    if (!real) return full;
+    full = real;
+    free(real);
+    return full;
+}
+
+// Where :grep and the tag index start, and :! runs
+string Editor::work_dir() const {
+    return cwd.empty() ? string(".") : cwd;
+}
+
+void Editor::resize(int rows, int cols) {
+    if (term) term->resize(rows, cols);
+    input.inject(KEY_RESIZE);
+}
+
+void Editor::feed(const string& keys) {
+    for (unsigned char c : keys) input.inject(c);
+}
+
 void Editor::init_ncurses() {
-    initscr();
+    ScreenLock lock(term);
+    // The server set up the screen its sessions share
+    if (!term) initscr();
     cbreak();
     noecho();
     keypad(stdscr, TRUE);
+    // let curses scroll the text rows with the terminal's scroll region
+    idlok(stdscr, TRUE);
     curs_set(1);
     start_color();
     use_default_colors();
 }
 
 void Editor::end_ncurses() {
+    // The server puts a client's terminal back when the session ends
+    if (term) return;
     if (isendwin() == FALSE) {
         curs_set(1);
         endwin();
@@ -39,79 +219,691 @@ void Editor::end_ncurses() {
 }
 
 void Editor::run(const string& fname) {
+    vector<string> files;
+    if (!fname.empty()) files.push_back(fname);
+    run(files);
+}
+
+void Editor::run(const vector<string>& files) {
     init_ncurses();
-    if (!fname.empty()) {
-        open_file(fname);
+    if (!files.empty()) {
+        filename = files[0];
+        load_current();
+        for (size_t i = 1; i < files.size(); ++i) add_buffer(files[i]);
+        if (files.size() > 1) set_status(status_msg + " [" + to_string(buffers.size()) + " buffers]");
+    }
+    // A client's resizes come through resize(), not SIGWINCH
+    input.start(key_fd, !term);
+
+    bool dirty = true;
+    auto last_frame = chrono::steady_clock::now() - chrono::seconds(1);
+    while (!quitting) {
+        auto now = chrono::steady_clock::now();
+        auto frame = chrono::microseconds(1000000 / fps);
+        if (dirty && now - last_frame >= frame) {
+            draw();
+            last_frame = now;
+            dirty = false;
+        }
+        // Sleep until a key arrives or the next frame is due; background
+        // work is checked at least every 100 ms
+        auto wait = dirty ? last_frame + frame - now : chrono::steady_clock::duration(chrono::milliseconds(100));
+        int ch;
+        bool got = input.wait_key(ch, wait);
+        if (poll_background()) dirty = true;
+        if (!got) {
+            compact_when_idle();
+            page_when_idle();
+            diff_when_idle();
+            index_when_idle();
+            if (fold_when_idle()) dirty = true;
+            if (follow_shared()) dirty = true;
+        }
+
+        // Apply everything typed since the last frame before drawing again,
+        // so held keys never queue up redundant frames
+        while (got && !quitting) {
+            if (recording >= 0 && ch != KEY_RESIZE) recorded.push_back(ch);
+            handle_key(ch);
+            dirty = true;
+            got = input.try_key(ch);
+        }
+        if (!quitting) publish_shared(false);
+        // The quit check is handled within command mode (:q)
     }
-    draw();
+}
 
+int Editor::read_key() {
     int ch;
+    if (replay_depth > 0) {
+        // A replay that runs out in the middle of a command ends it like Esc
+        if (pending_keys.empty()) return 27;
+        ch = pending_keys.front();
+        pending_keys.pop_front();
+        return ch;
+    }
     while (true) {
+        if (!input.wait_key(ch, chrono::milliseconds(100))) {
+            poll_background();
+            continue;
+        }
+        if (ch == KEY_EXIT) {
+            // Input is over: end what is being read like Esc, then hang up
+            input.inject(KEY_EXIT);
+            return 27;
+        }
+        if (ch != KEY_RESIZE) {
+            if (recording >= 0) recorded.push_back(ch);
+            return ch;
+        }
+        resize_terminal();
         draw();
-        // The getch() function is used to wait for user input
-        ch = getch(); 
-
-        // Handle different modes
-        if (mode == MODE_NORMAL) {
-            handle_normal(ch);
-        } else if (mode == MODE_INSERT) {
-            handle_insert(ch);
-        } else if (mode == MODE_COMMAND) {
-            handle_command();
-        } else if (mode == MODE_SEARCH) {
-            handle_search();
+    }
+}
+
+void Editor::handle_key(int ch) {
+    if (ch == KEY_RESIZE) {
+        resize_terminal();
+        return;
+    }
+    if (ch == KEY_EXIT) {
+        hangup();
+        return;
+    }
+    // Handle different modes
+    if (mode == MODE_NORMAL) {
+        handle_normal(ch);
+    } else if (mode == MODE_INSERT) {
+        handle_insert(ch);
+    } else if (in_visual()) {
+        handle_visual(ch);
+    }
+    // ':' and '/' read the rest of their line straight away
+    if (mode == MODE_COMMAND) {
+        handle_command();
+    } else if (mode == MODE_SEARCH) {
+        handle_search();
+    }
+    // What is typed goes where it can be seen
+    if (mode == MODE_INSERT && folds.any_closed()) {
+        folds.sync(buf);
+        if (folds.shown(cy) != cy) {
+            folds.reveal(cy);
+            full_redraw = true;
         }
-        // The quit check is handled within command mode (:q)
     }
+    // Jobs started for an older version of the buffer see themselves cancelled
+    live_version = buf.version();
+}
+
+void Editor::resize_terminal() {
+    // On a client's terminal, taking the lock applies the size it sent
+    ScreenLock lock(term);
+    struct winsize ws;
+    if (!term && ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 0 && ws.ws_col > 0) {
+        resizeterm(ws.ws_row, ws.ws_col);
+    }
+    full_redraw = true;
+}
+
+// :q, :q! and :wq. A server session only ends its own run() and leaves
+// the process to the others.
+void Editor::quit() {
+    end_ncurses();
+    stop_jobs();
+    if (!term) exit(0);
+    quitting = true;
+}
+
+// Background work for this editor is dropped: running jobs are cancelled
+// and waited for, queued ones never start. In a server that is only this
+// session's work; the workers go on for the others.
+void Editor::stop_jobs() {
+    live_version = 0;
+    for (const CancelPtr& t : { search_token, grep_token, tags_token, diff_token }) {
+        if (t) t->cancel();
+    }
+    jobs.shutdown();
+}
+
+// The terminal or the server's client went away: the edits are kept in
+// the sessions as :q does, but with nobody left to tell, a session that
+// cannot be written does not stop us
+void Editor::hangup() {
+    publish_shared(false);
+    finish_save();
+    if (!write_session()) fprintf(stderr, "main10: %s\n", status_msg.c_str());
+    quit();
 }
 
 // File operations
 void Editor::open_file(const string& fname) {
-    ifstream f(fname);
-    if (!f.is_open()) {
+    Compression comp = detect_compression(fname);
+    if (comp == COMP_NONE && open_mapped(fname)) return;
+    string err;
+    unique_ptr<StreamReader> in = open_reader(fname, comp, err);
+    if (!in) {
+        if (comp != COMP_NONE) {
+            // Never replace a compressed file we cannot read with an empty buffer
+            set_status("Error: cannot open " + fname + ": " + err);
+            return;
+        }
         // If file doesn't exist or cannot be opened for reading, start with an empty buffer
         set_status("File not found, starting new file: " + fname);
         filename = fname;
+        file_comp = compression_from_name(fname);
+        mapped = false;
         buf.clear();
         buf.push_back(string());
+        clean_version = buf.version();
         cy = cx = top_line = 0;
         return;
     }
-    buf.clear();
-    string line;
-    // Load file content into buffer
-    while (getline(f, line)) {
-        if (line.size() > MAX_LINE_LEN) line = line.substr(0, MAX_LINE_LEN);
-        buf.push_back(line);
-        if (buf.size() >= MAX_LINES) break;
+    auto t0 = chrono::steady_clock::now();
+    uint64_t total = read_lines(*in, buf, MAX_LINE_LEN, MAX_LINES);
+    if (buf.empty()) buf.push_back(string());
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    filename = fname;
+    file_comp = comp;
+    mapped = false;
+    clean_version = buf.version();
+    cy = cx = top_line = 0;
+    string msg = "Opened: " + fname + " (" + to_string(buf.size()) + " lines)";
+    if (comp != COMP_NONE) {
+        msg += string(" ") + compression_name(comp) + " " + format_rate(in->raw_bytes(), secs) + " in, " +
+               format_rate(total, secs) + " out";
     }
+    if (in->failed()) msg += " [read error, file truncated?]";
+    set_status(msg);
+}
+
+// Big uncompressed files are mapped instead of read: the buffer starts out
+// as span leaves over the file, built in parallel from line-aligned parts.
+// Nothing is copied until a line is edited, and lines are not clipped to
+// MAX_LINE_LEN or counted against MAX_LINES.
+bool Editor::open_mapped(const string& fname) {
+    struct stat st;
+    if (stat(fname.c_str(), &st) != 0 || !S_ISREG(st.st_mode) || (uint64_t)st.st_size < MAP_MIN) return false;
+    string err;
+    TextBuffer::ChunkPtr file = TextBuffer::map_file(fname, err);
+    if (!file) return false;
+    auto t0 = chrono::steady_clock::now();
+    uint64_t size = TextBuffer::mapped_size(file);
+    size_t parts = min<uint64_t>(size / MAP_PART + 1, 4 * jobs.stats().workers);
+    vector<uint64_t> cuts(parts + 1, size);
+    for (size_t k = 0; k < parts; ++k) cuts[k] = TextBuffer::line_start(file, size * k / parts);
+    vector<TextBuffer> pieces(parts);
+    vector<future<void>> done;
+    for (size_t k = 0; k < parts; ++k) {
+        auto p = make_shared<promise<void>>();
+        done.push_back(p->get_future());
+        jobs.submit([&, k, p](const CancelToken&) {
+            pieces[k] = TextBuffer::from_file(file, cuts[k], cuts[k + 1]);
+            p->set_value();
+        }, PRIO_VIEWPORT);
+    }
+    TextBuffer lines;
+    for (size_t k = 0; k < parts; ++k) {
+        done[k].wait();
+        lines.insert(lines.size(), pieces[k]);
+    }
+    buf = lines;
     if (buf.empty()) buf.push_back(string());
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
     filename = fname;
+    file_comp = COMP_NONE;
+    mapped = true;
+    clean_version = buf.version();
     cy = cx = top_line = 0;
-    set_status("Opened: " + fname + " (" + to_string(buf.size()) + " lines)");
+    set_status("Opened: " + fname + " (" + to_string(buf.size()) + " lines, mapped, " + format_rate(size, secs) + ")");
+    return true;
 }
 
 bool Editor::save_file(const string& fname) {
-    ofstream f(fname);
-    if (!f.is_open()) {
-        set_status("Error: cannot write to " + fname);
+    // One save at a time; a new one waits for the previous to finish
+    finish_save();
+    Compression comp = compression_from_name(fname);
+    if (comp == COMP_NONE && fname == filename) comp = file_comp;
+    // A file big enough to be mapped (see open_mapped), here or by a
+    // snapshot of it, must not change under the mapping: it is replaced
+    // by a new file instead of rewritten
+    struct stat st;
+    bool replace = stat(fname.c_str(), &st) == 0 && (uint64_t)st.st_size >= MAP_MIN;
+    string err;
+    unique_ptr<StreamWriter> out = open_writer(fname, comp, replace, err);
+    if (!out) {
+        set_status("Error: cannot write to " + fname + ": " + err);
+        return false;
+    }
+    // Other sessions of a server take what is saved, whatever they had
+    if (fname == filename) publish_shared(true);
+    // The writer thread serializes this snapshot while editing continues on buf
+    TextBuffer snapshot = buf;
+    save_name = fname;
+    save_comp = comp;
+    save_buf = cur_buf;
+    save_version = buf.version();
+    set_status("Saving " + fname + "...");
+    auto done = make_shared<promise<void>>();
+    save_job = done->get_future();
+    shared_ptr<StreamWriter> writer(move(out));
+    jobs.submit([this, snapshot, comp, fname, writer, done](const CancelToken&) {
+        auto t0 = chrono::steady_clock::now();
+        // Write all lines to the file, handing the writer 1 MB at a time
+        string chunk;
+        chunk.reserve(1 << 20);
+        uint64_t total = 0;
+        bool ok = true;
+        size_t n = snapshot.size();
+        snapshot.for_each(0, n, [&](size_t i, string_view line) {
+            chunk.append(line.data(), line.size());
+            if (i + 1 < n) chunk += '\n';
+            if (chunk.size() >= (1 << 20) || i + 1 == n) {
+                ok = writer->write(chunk.data(), chunk.size());
+                total += chunk.size();
+                chunk.clear();
+            }
+            return ok;
+        });
+        ok = writer->finish() && ok;
+        double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+        string msg = "Saved: " + fname + " (" + to_string(n) + " lines)";
+        if (comp != COMP_NONE) {
+            msg += string(" ") + compression_name(comp) + " " + format_rate(total, secs) + " in, " +
+                   format_rate(writer->raw_bytes(), secs) + " out";
+        }
+        save_ok = ok;
+        save_msg = ok ? msg : "Error: write failed for " + fname;
+        done->set_value();
+    });
+    return true;
+}
+
+// Runs on the main loop: collect results posted by background jobs.
+// True when something on screen may have changed.
+bool Editor::poll_background() {
+    bool changed = jobs.run_posted() > 0;
+    if (save_job.valid() && save_job.wait_for(chrono::seconds(0)) == future_status::ready) {
+        finish_save();
+        changed = true;
+    }
+    return changed;
+}
+
+void Editor::finish_save() {
+    if (!save_job.valid()) return;
+    save_job.get();
+    if (save_ok) {
+        // The user may have switched buffers while the save ran
+        if (save_buf == cur_buf) {
+            filename = save_name;
+            file_comp = save_comp;
+            clean_version = save_version;
+        } else if (save_buf < buffers.size()) {
+            buffers[save_buf].filename = save_name;
+            buffers[save_buf].file_comp = save_comp;
+            buffers[save_buf].clean_version = save_version;
+        }
+    }
+    set_status(save_msg);
+}
+
+// Sessions: reopen a file with its cursor, undo snapshot and yank buffer
+bool Editor::restore_session(const string& fname) {
+    auto t0 = chrono::steady_clock::now();
+    TextBuffer lines, undo_lines, yank;
+    SessionCursor cur;
+    string err;
+    if (!load_session(fname, lines, undo_lines, yank, cur, err)) {
+        if (!err.empty()) {
+            // Stale or unreadable sessions are dropped and the file is loaded normally
+            remove_session(fname);
+            open_file(fname);
+            set_status("Session ignored (" + err + "), opened " + fname);
+            return true;
+        }
         return false;
     }
-    // Write all lines to the file
-    for (size_t i = 0; i < buf.size(); ++i) {
-        f << buf[i];
-        if (i + 1 < buf.size()) f << '\n';
+    buf = lines;
+    if (buf.empty()) buf.push_back(string());
+    undo_buf.clear();
+    if (cur.has_undo) undo_buf = undo_lines;
+    // The yank buffer is shared by all buffers; a session only fills it at startup
+    if (yank_buffer.empty()) yank_buffer = yank;
+    filename = fname;
+    file_comp = detect_compression(fname);
+    mapped = cur.mapped;
+    cy = cur.cy;
+    cx = cur.cx;
+    top_line = cur.top_line;
+    undo_cy = cur.undo_cy;
+    undo_cx = cur.undo_cx;
+    clean_version = cur.modified ? 0 : buf.version();
+    ensure_cursor_in_bounds();
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+    char msbuf[32];
+    snprintf(msbuf, sizeof(msbuf), "%.1f ms", ms);
+    set_status("Restored session: " + fname + " (" + to_string(buf.size()) + " lines, " + msbuf + ")");
+    return true;
+}
+
+// Writes sessions for every loaded buffer. False (and the reason in the
+// status line) when a modified buffer's edits could not be kept; for an
+// unmodified one only the cursor is lost.
+bool Editor::write_session() {
+    bool ok = true;
+    BufferState active = current_state();
+    for (size_t i = 0; i < buffers.size(); ++i) {
+        if (i != cur_buf && !buffers[i].loaded) continue;
+        const BufferState& b = i == cur_buf ? active : buffers[i];
+        string err;
+        if (!write_session(b, err) && b.buf.version() != b.clean_version) {
+            set_status("Error: unsaved changes to " + b.filename + " not kept (" + err + "); :w them or :q! to discard");
+            ok = false;
+        }
     }
+    return ok;
+}
+
+bool Editor::write_session(const BufferState& b, string& err) {
+    if (b.filename.empty()) return true;
+    SessionCursor cur = { b.cy, b.cx, b.top_line, b.undo_cy, b.undo_cx, !b.undo_buf.empty(),
+                          b.buf.version() != b.clean_version, b.mapped };
+    return save_session(b.filename, b.buf, b.undo_buf, yank_buffer, cur, MAX_LINE_LEN, MAX_LINES, err);
+}
+
+// Buffer list
+bool Editor::modified() const {
+    return buf.version() != clean_version;
+}
+
+// A copy of the active buffer's state (the trees are shared, not copied)
+BufferState Editor::current_state() const {
+    BufferState b;
+    b.filename = filename;
+    b.file_comp = file_comp;
+    b.mapped = mapped;
+    b.buf = buf;
+    b.undo_buf = undo_buf;
+    b.cy = cy;
+    b.cx = cx;
+    b.top_line = top_line;
+    b.undo_cx = undo_cx;
+    b.undo_cy = undo_cy;
+    b.clean_version = clean_version;
+    b.shared_pos = shared_pos;
+    b.marks = marks;
+    b.indexed = indexed;
+    b.folds = folds;
+    b.loaded = true;
+    b.disk_size = 0;
+    b.last_used = use_clock;
+    return b;
+}
+
+// Load the active buffer's file, preferring its session
+void Editor::load_current() {
+    string fname = filename;
+    if (!adopt_shared() && !restore_session(fname)) open_file(fname);
+    // open_file leaves the buffer alone when it cannot read a compressed file
     filename = fname;
-    set_status("Saved: " + fname + " (" + to_string(buf.size()) + " lines)");
+    if (buf.empty()) {
+        buf.push_back(string());
+        clean_version = buf.version();
+    }
+    marks.attach(buf, undo_buf);
+    ensure_cursor_in_bounds();
+}
+
+// Adds fname to the list without reading it; returns its index
+size_t Editor::add_buffer(const string& fname) {
+    for (size_t i = 0; i < buffers.size(); ++i) {
+        if ((i == cur_buf ? filename : buffers[i].filename) == fname) return i;
+    }
+    BufferState b;
+    b.filename = fname;
+    b.file_comp = COMP_NONE;
+    b.mapped = false;
+    b.cy = b.cx = b.top_line = b.undo_cx = b.undo_cy = 0;
+    b.clean_version = 0;
+    b.loaded = false;
+    struct stat st;
+    b.disk_size = stat(fname.c_str(), &st) == 0 ? (uint64_t)st.st_size : 0;
+    b.last_used = 0;
+    buffers.push_back(b);
+    return buffers.size() - 1;
+}
+
+void Editor::switch_buffer(size_t i) {
+    if (i == cur_buf || i >= buffers.size()) return;
+    publish_shared(false);
+    if (diff_on) diff_off();
+    cursors.clear();
+    candidates.clear();
+    uint64_t last_used = buffers[cur_buf].last_used;
+    buffers[cur_buf] = current_state();
+    buffers[cur_buf].last_used = last_used;
+    BufferState b = move(buffers[i]);
+    buffers[i] = BufferState();
+    buffers[i].loaded = false;
+    cur_buf = i;
+    filename = b.filename;
+    file_comp = b.file_comp;
+    mapped = b.mapped;
+    buf = move(b.buf);
+    undo_buf = move(b.undo_buf);
+    cy = b.cy;
+    cx = b.cx;
+    top_line = b.top_line;
+    undo_cx = b.undo_cx;
+    undo_cy = b.undo_cy;
+    clean_version = b.clean_version;
+    shared_pos = b.shared_pos;
+    marks = b.marks;
+    indexed = move(b.indexed);
+    folds = move(b.folds);
+    buffers[i].disk_size = b.disk_size;
+    buffers[i].last_used = ++use_clock;
+    if (!b.loaded) {
+        load_current();
+    } else {
+        set_status("\"" + (filename.empty() ? string("[No Name]") : filename) + "\" " + to_string(buf.size()) +
+                   " lines" + (modified() ? " [+]" : ""));
+    }
+    full_redraw = true;
+    evict_buffers();
+}
+
+// Over the memory budget, unload the least recently used buffers that are
+// unmodified; their session keeps cursor and undo for when they come back
+void Editor::evict_buffers() {
+    uint64_t total = resident_bytes(buf) + resident_bytes(undo_buf);
+    for (size_t i = 0; i < buffers.size(); ++i) {
+        if (i != cur_buf && buffers[i].loaded) total += resident_bytes(buffers[i].buf) + resident_bytes(buffers[i].undo_buf);
+    }
+    // A buffer whose session cannot be written stays loaded
+    vector<bool> keep(buffers.size(), false);
+    while (total > mem_budget) {
+        size_t victim = SIZE_MAX;
+        for (size_t i = 0; i < buffers.size(); ++i) {
+            const BufferState& b = buffers[i];
+            if (i == cur_buf || keep[i] || !b.loaded || b.filename.empty() || b.buf.version() != b.clean_version) continue;
+            if (victim == SIZE_MAX || b.last_used < buffers[victim].last_used) victim = i;
+        }
+        if (victim == SIZE_MAX) break;
+        BufferState& b = buffers[victim];
+        string err;
+        if (!write_session(b, err)) {
+            keep[victim] = true;
+            continue;
+        }
+        total -= resident_bytes(b.buf) + resident_bytes(b.undo_buf);
+        b.marks.detach(b.buf);
+        b.buf = TextBuffer();
+        b.undo_buf = TextBuffer();
+        b.folds = Folds();
+        b.loaded = false;
+        struct stat st;
+        b.disk_size = stat(b.filename.c_str(), &st) == 0 ? (uint64_t)st.st_size : 0;
+    }
+}
+
+// Server sessions: open filename from the snapshot another session has
+// loaded instead of reading it
+bool Editor::adopt_shared() {
+    auto t0 = chrono::steady_clock::now();
+    shared_pos = SharedPos();
+    SharedBuffers::Entry e;
+    if (!shared || filename.empty() || !shared->get(filename, e)) return false;
+    buf = e.lines;
+    undo_buf.clear();
+    file_comp = e.comp;
+    mapped = e.mapped;
+    cy = cx = top_line = 0;
+    clean_version = e.clean ? buf.version() : 0;
+    shared_pos.serial = e.serial;
+    shared_pos.base = e.lines;
+    shared_pos.version = buf.version();
+    shared_pos.clean = e.clean;
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+    char msbuf[32];
+    snprintf(msbuf, sizeof(msbuf), "%.2f ms", ms);
+    set_status("Shared: " + filename + " (" + to_string(buf.size()) + " lines, " + msbuf + ")");
+    return true;
+}
+
+// Server sessions: hand the active buffer to the other sessions after an
+// edit or a save. force (:w) wins over what they published meanwhile.
+void Editor::publish_shared(bool force) {
+    if (!shared || filename.empty()) return;
+    bool clean = !modified();
+    if (!force && buf.version() == shared_pos.version && clean == shared_pos.clean) return;
+    for (int tries = 0; tries < 3; ++tries) {
+        // Anchors are this session's marks
+        TextBuffer lines;
+        lines.insert(0, buf);
+        uint64_t serial = shared->publish(filename, lines, file_comp, mapped, clean, shared_pos.serial, force);
+        if (serial != 0) {
+            shared_pos.serial = serial;
+            shared_pos.base = lines;
+            shared_pos.version = buf.version();
+            shared_pos.clean = clean;
+            shared_pos.diverged = false;
+            return;
+        }
+        // Another session got there first: take its change and try again.
+        // A clean buffer just follows it (follow_shared).
+        SharedBuffers::Entry e;
+        if (clean || !shared->get(filename, e) || !merge_shared(e)) break;
+        shared_pos.serial = e.serial;
+        shared_pos.base = e.lines;
+    }
+    shared_pos.version = buf.version();
+    shared_pos.clean = clean;
+    if (!clean) {
+        shared_pos.diverged = true;
+        set_status("\"" + filename + "\" was changed on the same lines in another session; :w to keep this version");
+    }
+}
+
+// Server sessions, when idle: take what another session published for the
+// active buffer, unless this one has edits of its own
+bool Editor::follow_shared() {
+    if (!shared || filename.empty() || shared_pos.diverged || buf.version() != shared_pos.version) return false;
+    SharedBuffers::Entry e;
+    if (!shared->get(filename, e) || e.serial == shared_pos.serial) return false;
+    if (!merge_shared(e)) {
+        // Not from the same snapshot (both read the file at once): take theirs
+        marks.remember(buf);
+        buf = e.lines;
+        undo_buf.clear();
+        marks.restore(buf, undo_buf);
+        cursors.clear();
+    }
+    file_comp = e.comp;
+    mapped = e.mapped;
+    clean_version = e.clean ? buf.version() : 0;
+    shared_pos.serial = e.serial;
+    shared_pos.base = e.lines;
+    shared_pos.version = buf.version();
+    shared_pos.clean = e.clean;
+    ensure_cursor_in_bounds();
+    full_redraw = true;
+    return true;
+}
+
+// Applies what another session changed between shared_pos.base and e to
+// buf, which keeps this session's own edits on other lines, its marks and
+// its cursors; false when both changed the same lines. The undo snapshot
+// gets their change too, so u only takes back this session's own edit.
+bool Editor::merge_shared(const SharedBuffers::Entry& e) {
+    const TextBuffer& base = shared_pos.base;
+    if (base.empty()) return false;
+    size_t th, tt;
+    base.common_ends(e.lines, th, tt);
+    size_t t_end = base.size() - tt;
+    size_t removed = t_end - th, added = e.lines.size() - tt - th;
+    // Their lines [th, t_end) of base, numbered as in t; false when t
+    // changed some of them as well
+    auto place = [&](const TextBuffer& t, size_t& at) {
+        size_t oh, ot;
+        base.common_ends(t, oh, ot);
+        size_t o_end = base.size() - ot;
+        if (o_end > th && t_end > oh) return false;
+        at = o_end <= th ? th + t.size() - base.size() : th;
+        return true;
+    };
+    auto splice = [&](TextBuffer& t, size_t at) {
+        if (removed > 0) t.erase(at, removed);
+        if (added > 0) t.insert(at, e.lines.slice(th, added));
+    };
+    size_t from, undo_from;
+    if (!place(buf, from)) return false;
+    splice(buf, from);
+    auto shift = [&](size_t& y, size_t at) {
+        if (y >= at + removed) y = y - removed + added;
+    };
+    shift(cy, from);
+    shift(top_line, from);
+    shift(vis_y, from);
+    for (Cursor& c : cursors) shift(c.line, from);
+    // An undo that would take back their lines as well is dropped
+    if (!undo_buf.empty() && place(undo_buf, undo_from)) {
+        splice(undo_buf, undo_from);
+        shift(undo_cy, undo_from);
+    } else {
+        undo_buf.clear();
+    }
+    ensure_cursor_in_bounds();
     return true;
 }
 
+// :ls - one entry per buffer: number, %a for the active one, + when modified
+void Editor::list_buffers() {
+    string out;
+    for (size_t i = 0; i < buffers.size(); ++i) {
+        bool active = i == cur_buf;
+        const string& name = active ? filename : buffers[i].filename;
+        out += to_string(i + 1) + (active ? " %a " : " ") + "\"" + (name.empty() ? "[No Name]" : name) + "\"";
+        if (active) {
+            if (modified()) out += " [+]";
+        } else if (!buffers[i].loaded) {
+            out += " (" + format_bytes(buffers[i].disk_size) + ", not loaded)";
+        } else if (buffers[i].buf.version() != buffers[i].clean_version) {
+            out += " [+]";
+        }
+        if (i + 1 < buffers.size()) out += " | ";
+    }
+    set_status(out);
+}
+
 // Drawing
 void Editor::draw() {
-    clear();
+    if (replay_depth > 0) return;
+    ScreenLock lock(term);
     draw_buffer();
     draw_status();
+    if (!candidates.empty()) draw_popup(LINES - 1, COLS);
     refresh();
 }
 
@@ -120,32 +912,57 @@ void Editor::draw_buffer() {
     getmaxyx(stdscr, rows, cols);
     // leave one row for status
     int avail = rows - 1;
+    folds.sync(buf);
     // Scroll view if cursor moves out of range
     center_view_on_cursor();
+    if (diff_on) {
+        // Filler rows shift everything, so the diff view is always drawn in full
+        draw_diff(avail, cols);
+        full_redraw = true;
+        return;
+    }
+    // The selection follows the cursor (and extra cursors follow edits), so
+    // any row may have changed
+    if (in_visual() || !cursors.empty()) full_redraw = true;
 
-    for (int i = 0; i < avail; ++i) {
-        size_t line_no = top_line + i;
-        move(i, 0);
-        clrtoeol(); // Clear to end of line for safety
-        if (line_no < buf.size()) {
-            // print line number with 4 width and space
-            char lnbuf[16];
-            snprintf(lnbuf, sizeof(lnbuf), "%4zu ", line_no + 1);
-            addstr(lnbuf);
-            
-            string disp = buf[line_no];
-            // clip buffer content to screen width minus line number space (5 chars)
-            int maxchars = cols - 5;
-            if ((int)disp.size() > maxchars) disp = disp.substr(0, maxchars);
-            addnstr(disp.c_str(), maxchars);
-        } else {
-            // Draw tildes (~) for empty lines beyond buffer end
-            addstr("~");
+    // When only the view moved, shift the rows still visible with the
+    // scroll region and paint just the ones that scrolled in
+    int first = 0, last = avail;
+    if (!full_redraw && drawn_version == buf.version()) {
+        long delta = (long)row_of(top_line) - (long)row_of(drawn_top);
+        if (delta == 0) {
+            last = 0;
+        } else if (labs(delta) < avail) {
+            scrollok(stdscr, TRUE);
+            setscrreg(0, avail - 1);
+            scrl((int)delta);
+            scrollok(stdscr, FALSE);
+            if (delta > 0) first = avail - (int)delta;
+            else last = (int)-delta;
         }
     }
+    if (folded()) {
+        // Rows skip the lines inside closed folds
+        size_t top_row = folds.row_of(top_line), total = folds.rows(buf.size());
+        for (int i = first; i < last; ++i) {
+            size_t line_no = top_row + i < total ? folds.line_at(top_row + i) : buf.size();
+            draw_row(i, cols, line_no, line_no < buf.size() ? buf[line_no] : string_view());
+        }
+    } else {
+        // One walk over the rows' lines rather than a lookup per row
+        size_t end = min(top_line + max(last, 0), buf.size());
+        buf.for_each(top_line + first, end, [&](size_t line_no, string_view text) {
+            draw_row((int)(line_no - top_line), cols, line_no, text);
+            return true;
+        });
+        for (int i = max(first, (int)(end - min(end, top_line))); i < last; ++i) draw_row(i, cols, top_line + i, string_view());
+    }
+    drawn_top = top_line;
+    drawn_version = buf.version();
+    full_redraw = false;
     
     // position cursor relative to screen
-    int screen_y = (int)(cy - top_line);
+    int screen_y = (int)(row_of(cy) - row_of(top_line));
     int screen_x = (int)(cx + 5); // accounting for "#### "
     if (screen_y >= 0 && screen_y < avail) {
         move(screen_y, screen_x);
@@ -155,6 +972,87 @@ void Editor::draw_buffer() {
     }
 }
 
+// text is line line_no (ignored past the end of the buffer)
+void Editor::draw_row(int row, int cols, size_t line_no, string_view text) {
+    move(row, 0);
+    clrtoeol(); // Clear to end of line for safety
+    if (line_no < buf.size()) {
+        // print line number with 4 width and space
+        char lnbuf[16];
+        snprintf(lnbuf, sizeof(lnbuf), "%4zu ", line_no + 1);
+        addstr(lnbuf);
+
+        string_view disp = text;
+        // clip buffer content to screen width minus line number space (5 chars)
+        size_t maxchars = cols > 5 ? cols - 5 : 0;
+        if (const Fold* f = folded() ? folds.closed_at(line_no) : nullptr) {
+            // A closed fold: how many lines and the first of them, dashed out to the edge
+            size_t lead = min(text.find_first_not_of(" \t"), text.size());
+            string label = "+-- " + to_string(f->end - f->start + 1) + " lines: " + string(text.substr(lead)) + " ";
+            label.resize(maxchars, '-');
+            attron(A_BOLD);
+            addnstr(label.data(), (int)label.size());
+            attroff(A_BOLD);
+            return;
+        }
+        if (disp.size() > maxchars) disp = disp.substr(0, maxchars);
+        size_t from = 0, to = 0;
+        bool sel = selected_cols(line_no, text.size(), from, to);
+        auto c0 = lower_bound(cursors.begin(), cursors.end(), Cursor{ line_no, 0 });
+        auto c1 = lower_bound(c0, cursors.end(), Cursor{ line_no + 1, 0 });
+        if (!sel && c0 == c1) {
+            addnstr(disp.data(), (int)disp.size());
+            return;
+        }
+        // The selection and extra cursors in reverse video; a selected line
+        // break or a cursor past the end shows as a space
+        auto lit = [&](size_t i) { return (sel && i >= from && i < to) || binary_search(c0, c1, Cursor{ line_no, i }); };
+        size_t width = max(disp.size(), sel ? to : 0);
+        if (c0 != c1) width = max(width, (c1 - 1)->col + 1);
+        width = min(width, maxchars);
+        for (size_t i = 0; i < width;) {
+            bool rev = lit(i);
+            size_t j = i + 1;
+            while (j < width && lit(j) == rev) j++;
+            if (rev) attron(A_REVERSE);
+            if (i < disp.size()) addnstr(disp.data() + i, (int)(min(j, disp.size()) - i));
+            for (size_t k = max(i, disp.size()); k < j; ++k) addch(' ');
+            if (rev) attroff(A_REVERSE);
+            i = j;
+        }
+    } else {
+        // Draw tildes (~) for empty lines beyond buffer end
+        addstr("~");
+    }
+}
+
+// The completion list under the word (above it near the bottom), the
+// choice in normal video. It covers text rows, so the next frame repaints
+// them all.
+void Editor::draw_popup(int avail, int cols) {
+    size_t n = candidates.size() - 1;
+    int height = (int)min<size_t>(n, 10);
+    int y = (int)(row_of(cy) - row_of(top_line));
+    int row = y + 1 + height <= avail ? y + 1 : y - height;
+    if (row < 0 || height == 0) return;
+    size_t width = 0;
+    for (size_t i = 1; i < candidates.size(); ++i) width = max(width, candidates[i].size());
+    width = min<size_t>(width + 2, cols > 5 ? cols - 5 : 0);
+    int x = (int)min(comp_start + 5, (size_t)cols - width);
+    // scrolled to keep the choice in view
+    size_t first = comp_sel > (size_t)height ? comp_sel - height : 0;
+    for (int r = 0; r < height; ++r) {
+        size_t i = first + r + 1;
+        string item = " " + candidates[i];
+        item.resize(width, ' ');
+        if (i != comp_sel) attron(A_REVERSE);
+        mvaddnstr(row + r, x, item.data(), (int)width);
+        if (i != comp_sel) attroff(A_REVERSE);
+    }
+    full_redraw = true;
+    move(y, (int)(cx + 5));
+}
+
 void Editor::draw_status() {
     int rows, cols;
     getmaxyx(stdscr, rows, cols);
@@ -166,9 +1064,16 @@ void Editor::draw_status() {
     if (mode == MODE_INSERT) mode_str = "-- INSERT --";
     else if (mode == MODE_NORMAL) mode_str = "-- NORMAL --";
     else if (mode == MODE_COMMAND) mode_str = "-- COMMAND --";
+    else if (mode == MODE_VISUAL) mode_str = "-- VISUAL --";
+    else if (mode == MODE_VISUAL_LINE) mode_str = "-- VISUAL LINE --";
+    else if (mode == MODE_VISUAL_BLOCK) mode_str = "-- VISUAL BLOCK --";
     else mode_str = "-- SEARCH --";
+    if (recording >= 0) mode_str += string(" recording @") + (char)('a' + recording);
     
     string filepart = filename.empty() ? "[No Name]" : filename;
+    if (modified()) filepart += " [+]";
+    if (!cursors.empty()) filepart += " [" + to_string(cursors.size() + 1) + " cursors]";
+    if (diff_on) filepart += " [diff: " + (diff_b ? to_string(hunks.size()) + " hunks" : string("...")) + "]";
     
     // Format position string
     char posbuf[64];
@@ -179,9 +1084,9 @@ void Editor::draw_status() {
     // Print status bar content
     addnstr(status.c_str(), min((int)status.size(), cols - 1));
     
-    // Print message at right, prioritizing status content
-    int msg_start_col = max(0, cols - (int)status_msg.size() - 1);
-    if (msg_start_col > (int)status.size()) {
+    // Print message at right, prioritizing status content (long messages are clipped)
+    int msg_start_col = max((int)status.size() + 1, cols - (int)status_msg.size() - 1);
+    if (msg_start_col < cols - 1) {
         move(rows - 1, msg_start_col);
         addnstr(status_msg.c_str(), cols - msg_start_col - 1);
     }
@@ -189,6 +1094,17 @@ void Editor::draw_status() {
 
 // Input handlers
 void Editor::handle_normal(int ch) {
+    // A count (100@a): 0 is a motion unless it continues one
+    if ((ch >= '1' && ch <= '9') || (ch == '0' && key_count > 0)) {
+        key_count = min<size_t>(key_count * 10 + (ch - '0'), MAX_LINES);
+        return;
+    }
+    size_t count = max<size_t>(key_count, 1);
+    key_count = 0;
+    if (!cursors.empty() && handle_multi_normal(ch)) {
+        ensure_cursor_in_bounds();
+        return;
+    }
     switch (ch) {
         case 'i': cmd_i(); break;
         case 'a': cmd_a(); break;
@@ -217,28 +1133,120 @@ void Editor::handle_normal(int ch) {
         
         // Multi-key commands
         case 'g': {
-            int c2 = getch();
+            int c2 = read_key();
             if (c2 == 'g') cmd_move_to_bof();
             else { set_status("Unknown command g" + string(1,(char)c2)); }
             break;
         }
         case 'd': {
-            int c2 = getch();
+            int c2 = read_key();
             if (c2 == 'd') cmd_dd();
             else { set_status("Unknown command d" + string(1,(char)c2)); }
             break;
         }
+        case 'z': fold_command(read_key()); break;
         case 'y': {
-            int c2 = getch();
+            int c2 = read_key();
             if (c2 == 'y') cmd_yy();
             else { set_status("Unknown command y" + string(1,(char)c2)); }
             break;
         }
+        case 'm': {
+            int c2 = read_key();
+            if (c2 >= 'a' && c2 <= 'z') {
+                marks.set(c2 - 'a', buf, undo_buf, cy, cx);
+                set_status("Mark " + string(1, (char)c2) + " set");
+            } else {
+                set_status("Marks are a-z");
+            }
+            break;
+        }
+        case '\'':
+        case '`': go_to_mark(read_key(), ch == '`'); break;
+        case 15: // Ctrl-O
+        case '\t': { // Ctrl-I
+            size_t line = cy, col = cx;
+            bool moved = ch == 15 ? marks.jump_older(buf, undo_buf, line, col) : marks.jump_newer(buf, line, col);
+            if (moved) {
+                cy = line;
+                cx = col;
+            } else {
+                set_status(ch == 15 ? "At the start of the jump list" : "At the end of the jump list");
+            }
+            break;
+        }
+        case 29: { // Ctrl-]
+            // The word under the cursor, or the next one on the line
+            string_view text = buf[cy];
+            size_t s = min(cx, text.size());
+            if (s < text.size() && is_word(text[s])) {
+                while (s > 0 && is_word(text[s - 1])) s--;
+            } else {
+                while (s < text.size() && !is_word(text[s])) s++;
+            }
+            size_t e = s;
+            while (e < text.size() && is_word(text[e])) e++;
+            if (e == s) set_status("No identifier under the cursor");
+            else find_tag(string(text.substr(s, e - s)));
+            break;
+        }
+        case 20: pop_tag(); break; // Ctrl-T
+        case ']':
+        case '[': {
+            int c2 = read_key();
+            if (c2 == 'c') jump_hunk(ch == ']');
+            else { set_status("Unknown command " + string(1,(char)ch) + string(1,(char)c2)); }
+            break;
+        }
 
         // Undo and Paste
         case 'u': cmd_u(); break;
         case 'p': cmd_p(); break;
 
+        // Macros: q{a-z} records (q{A-Z} adds to the register), q stops
+        case 'q': {
+            if (replay_depth > 0) break;
+            if (recording >= 0) {
+                recorded.pop_back(); // the q that stopped it
+                macros[recording].swap(recorded);
+                set_status("Recorded " + to_string(macros[recording].size()) + " keys into @" +
+                           string(1, (char)('a' + recording)));
+                recording = -1;
+                break;
+            }
+            int c2 = read_key();
+            // The register keeps its old keys until the recording is done
+            if (c2 >= 'A' && c2 <= 'Z') {
+                recording = c2 - 'A';
+                recorded = macros[recording];
+            } else if (c2 >= 'a' && c2 <= 'z') {
+                recording = c2 - 'a';
+                recorded.clear();
+            } else {
+                set_status("Macro registers are a-z");
+            }
+            break;
+        }
+        case '@': {
+            int c2 = read_key();
+            if (c2 == '@' && last_macro >= 0) play_macro(last_macro, count);
+            else if (c2 >= 'a' && c2 <= 'z') play_macro(c2 - 'a', count);
+            else set_status(c2 == '@' ? "No macro played yet" : "Macro registers are a-z");
+            break;
+        }
+
+        case 14: add_cursor_at_next(); break; // Ctrl-N
+
+        // Visual modes
+        case 'v':
+        case 'V':
+        case 22: // Ctrl-V
+            vis_y = cy;
+            vis_x = cx;
+            vis_eol = false;
+            mode = ch == 'v' ? MODE_VISUAL : ch == 'V' ? MODE_VISUAL_LINE : MODE_VISUAL_BLOCK;
+            break;
+
         // Modes
         case '/': mode = MODE_SEARCH; set_status("/ Search: "); break;
         case ':': mode = MODE_COMMAND; set_status(": Command: "); break;
@@ -256,11 +1264,38 @@ void Editor::handle_normal(int ch) {
 }
 
 void Editor::handle_insert(int ch) {
+    if (!candidates.empty()) {
+        size_t n = candidates.size();
+        if (ch == 14 || ch == 16) {
+            choose_completion((comp_sel + (ch == 14 ? 1 : n - 1)) % n);
+            return;
+        }
+        // Ctrl-E puts back what was typed; any other key keeps the choice
+        // (Ctrl-Y does nothing else)
+        if (ch == 5) choose_completion(0);
+        candidates.clear();
+        full_redraw = true;
+        if (ch == 5 || ch == 25) return;
+    }
+    if ((ch == 14 || ch == 16) && cursors.empty()) {
+        start_completion(ch == 14);
+        return;
+    }
     if (ch == 27) { // ESC
         mode = MODE_NORMAL;
         // Move cursor back one position after exiting insert mode (vi standard)
-        if (cx > 0) cx--; 
+        if (!cursors.empty()) move_cursors('h');
+        else if (cx > 0) cx--; 
         set_status("-- NORMAL --");
+        if (block_insert) finish_block_insert();
+        ensure_cursor_in_bounds();
+        return;
+    }
+    if (!cursors.empty()) {
+        // the same key at every cursor, as one edit
+        if (ch == KEY_BACKSPACE || ch == 127) edit_all(CURSOR_BACKSPACE, "");
+        else if (ch == '\n' || ch == KEY_ENTER) edit_all(CURSOR_INSERT, "\n");
+        else if (isprint(ch)) edit_all(CURSOR_INSERT, string(1, (char)ch));
         ensure_cursor_in_bounds();
         return;
     }
@@ -268,15 +1303,16 @@ void Editor::handle_insert(int ch) {
         // backspace behavior
         if (cx > 0) {
             snapshot_undo();
-            string &line = buf[cy];
+            string line(buf[cy]);
             line.erase(cx - 1, 1);
+            buf.set_line(cy, line);
             cx--;
         } else if (cy > 0) {
             // Join with previous line if at BOL
             snapshot_undo();
             size_t prevlen = buf[cy - 1].size();
-            buf[cy - 1] += buf[cy];
-            buf.erase(buf.begin() + cy);
+            buf.set_line(cy - 1, string(buf[cy - 1]) + string(buf[cy]));
+            buf.erase(cy);
             cy--;
             cx = prevlen;
         }
@@ -292,34 +1328,183 @@ void Editor::handle_insert(int ch) {
 
 void Editor::handle_command() {
     // Command input is blocking and happens inside prompt_command
-    string cmdline = prompt_command(":");
+    string cmdline = prompt_command(":", cmd_prefill);
+    cmd_prefill.clear();
+    size_t from = 0, to = buf.size();
+    bool ranged = false;
+    bool ok = parse_range(cmdline, from, to, ranged);
+    bool transform = cmdline == "uniq" || cmdline == "sort" || cmdline.rfind("sort ", 0) == 0 ||
+                     (cmdline.size() > 1 && cmdline[0] == '!');
+    bool normal = cmdline.rfind("normal ", 0) == 0 || cmdline.rfind("norm ", 0) == 0;
+    bool add_cursors_cmd = cmdline == "cursors" || cmdline.rfind("cursors ", 0) == 0;
     
     // Commands implementation
-    if (cmdline.empty()) {
+    if (!ok) {
+        // parse_range said what is wrong
+    } else if (transform) {
+        if (cmdline[0] == '!' && !ranged) set_status("Give :! a range of lines to filter (e.g. :%!sort)");
+        else transform_lines(cmdline, from, to);
+    } else if (add_cursors_cmd) {
+        string pattern = cmdline.size() > 8 ? cmdline.substr(8) : string();
+        if (!pattern.empty()) add_cursors(pattern, from, to);
+        else if (ranged) cursors_on_lines(from, to, cx);
+        else set_status("Give :cursors a pattern or a range of lines");
+    } else if (normal) {
+        // :normal without a range runs on the current line
+        if (!ranged) from = cy, to = cy + 1;
+        normal_lines(cmdline.substr(cmdline.find(' ') + 1), from, to);
+    } else if (ranged && cmdline.empty()) {
+        // :N goes to line N
+        push_jump();
+        cy = to - 1;
+        cx = 0;
+    } else if (ranged) {
+        set_status("No range allowed for :" + cmdline);
+    } else if (cmdline.empty()) {
         // Do nothing if command is empty
     } else if (cmdline == "q") {
-        end_ncurses();
-        exit(0);
+        publish_shared(false);
+        finish_save();
+        if (write_session()) quit();
+    } else if (cmdline == "q!") {
+        // Quit and forget the sessions, so unsaved changes are not restored
+        finish_save();
+        for (size_t i = 0; i < buffers.size(); ++i) {
+            const string& name = i == cur_buf ? filename : buffers[i].filename;
+            if (!name.empty()) remove_session(name);
+            if (!name.empty() && shared) shared->forget(name);
+        }
+        quit();
     } else if (cmdline == "w") {
         if (filename.empty()) {
-            string fn = prompt_input("Filename: ");
+            string fn = resolve_path(prompt_input("Filename: "));
             if (!fn.empty()) save_file(fn);
         } else {
             save_file(filename);
         }
+    } else if (cmdline.rfind("e ", 0) == 0) {
+        string fn = resolve_path(cmdline.substr(2));
+        if (filename.empty() && !modified() && buffers.size() == 1) {
+            // Replace the empty startup buffer instead of adding another one
+            filename = fn;
+            load_current();
+            full_redraw = true;
+        } else {
+            switch_buffer(add_buffer(fn));
+        }
+    } else if (cmdline == "bn" || cmdline == "bp") {
+        if (buffers.size() < 2) {
+            set_status("Only one buffer");
+        } else {
+            size_t n = buffers.size();
+            switch_buffer(cmdline == "bn" ? (cur_buf + 1) % n : (cur_buf + n - 1) % n);
+        }
+    } else if (cmdline.rfind("b ", 0) == 0) {
+        size_t n = (size_t)atol(cmdline.c_str() + 2);
+        if (n < 1 || n > buffers.size()) set_status("No buffer " + cmdline.substr(2));
+        else if (n - 1 == cur_buf) list_buffers();
+        else switch_buffer(n - 1);
+    } else if (cmdline == "ls") {
+        list_buffers();
+    } else if (cmdline.rfind("set bufmem=", 0) == 0) {
+        long mb = atol(cmdline.c_str() + 11);
+        if (mb < 1) {
+            set_status("bufmem is in MB and must be at least 1");
+        } else {
+            mem_budget = (uint64_t)mb << 20;
+            evict_buffers();
+            set_status("bufmem=" + to_string(mb) + "M");
+        }
+    } else if (cmdline.rfind("set memcap=", 0) == 0) {
+        long mb = atol(cmdline.c_str() + 11);
+        if (mb < 16) {
+            set_status("memcap is in MB and must be at least 16");
+        } else {
+            mem_cap = (uint64_t)mb << 20;
+            // check right away rather than after the next idle second
+            last_pageout = chrono::steady_clock::time_point();
+            set_status("memcap=" + to_string(mb) + "M");
+        }
+    } else if (cmdline.rfind("grep ", 0) == 0) {
+        start_grep_cmd(cmdline.substr(5));
+    } else if (cmdline == "cn" || cmdline == "cp" || cmdline == "cc" || cmdline == "cl") {
+        if (quickfix.empty()) {
+            set_status(grep_running ? "grep: no matches yet" : "No quickfix entries");
+        } else if (cmdline == "cn") {
+            if (qf_pos != SIZE_MAX && qf_pos + 1 >= quickfix.size()) set_status("No more items");
+            else jump_to_hit(qf_pos == SIZE_MAX ? 0 : qf_pos + 1);
+        } else if (cmdline == "cp") {
+            if (qf_pos == SIZE_MAX || qf_pos == 0) set_status("No previous item");
+            else jump_to_hit(qf_pos - 1);
+        } else if (cmdline == "cc") {
+            jump_to_hit(qf_pos == SIZE_MAX ? 0 : qf_pos);
+        } else {
+            // Where we are in the list, and whether it is still growing
+            size_t at = qf_pos == SIZE_MAX ? 0 : qf_pos + 1;
+            set_status("quickfix: " + to_string(at) + " of " + to_string(quickfix.size()) +
+                       (grep_running ? " (grep still running)" : ""));
+        }
+    } else if (cmdline.rfind("tag ", 0) == 0 || cmdline.rfind("ta ", 0) == 0) {
+        string name = cmdline.substr(cmdline.find(' ') + 1);
+        while (!name.empty() && name.back() == ' ') name.pop_back();
+        if (name.empty()) set_status("Usage: :tag name");
+        else find_tag(name);
+    } else if (cmdline == "tn" || cmdline == "tp") {
+        if (tag_matches.empty()) set_status("No tag matches");
+        else if (cmdline == "tn" && tag_pos + 1 >= tag_matches.size()) set_status("No more tag matches");
+        else if (cmdline == "tp" && tag_pos == 0) set_status("No previous tag match");
+        else jump_to_tag(cmdline == "tn" ? tag_pos + 1 : tag_pos - 1);
+    } else if (cmdline.rfind("set fps=", 0) == 0) {
+        int n = atoi(cmdline.c_str() + 8);
+        if (n < 1 || n > 1000) {
+            set_status("fps must be between 1 and 1000");
+        } else {
+            fps = n;
+            set_status("fps=" + to_string(fps));
+        }
+    } else if (cmdline == "set fps") {
+        set_status("fps=" + to_string(fps));
+    } else if (cmdline.rfind("set foldmethod=", 0) == 0 || cmdline.rfind("set fdm=", 0) == 0) {
+        string how = cmdline.substr(cmdline.find('=') + 1);
+        if (how == "indent" || how == "braces") {
+            folds.set_method(buf, how == "indent" ? FOLD_INDENT : FOLD_BRACES);
+            full_redraw = true;
+            set_status("foldmethod=" + how + ", " + to_string(folds.count()) + " folds");
+        } else {
+            set_status("foldmethod is indent or braces");
+        }
+    } else if (cmdline == "diff" || cmdline.rfind("diff ", 0) == 0) {
+        start_diff(cmdline.size() > 5 ? cmdline.substr(5) : string());
+    } else if (cmdline == "diffoff") {
+        if (diff_on) diff_off();
+        set_status("Diff off");
+    } else if (cmdline == "marks") {
+        set_status(marks.describe(buf));
+    } else if (cmdline == "mem") {
+        show_memory();
+    } else if (cmdline == "jobs") {
+        SchedulerStats st = jobs.stats();
+        char msg[200];
+        snprintf(msg, sizeof(msg),
+                 "jobs: %u workers, queued %zu/%zu/%zu, running %zu, done %llu, cancelled %llu, "
+                 "wait %.1f/%.1f ms, run %.1f/%.1f ms (avg/max)",
+                 st.workers, st.queued[PRIO_VIEWPORT], st.queued[PRIO_NORMAL], st.queued[PRIO_IDLE], st.running,
+                 (unsigned long long)st.completed, (unsigned long long)st.cancelled, st.wait_avg_ms, st.wait_max_ms,
+                 st.run_avg_ms, st.run_max_ms);
+        set_status(msg);
     } else if (cmdline.rfind("w ", 0) == 0) {
-        string fn = cmdline.substr(2);
+        string fn = resolve_path(cmdline.substr(2));
         save_file(fn);
     } else if (cmdline == "wq" || cmdline == "x") {
         if (filename.empty()) {
-            string fn = prompt_input("Filename: ");
+            string fn = resolve_path(prompt_input("Filename: "));
             if (!fn.empty()) save_file(fn);
-            end_ncurses();
-            exit(0);
+            finish_save();
+            if (write_session()) quit();
         } else {
             save_file(filename);
-            end_ncurses();
-            exit(0);
+            finish_save();
+            if (write_session()) quit();
         }
     } else {
         set_status("Unknown command: " + cmdline);
@@ -337,13 +1522,51 @@ void Editor::handle_search() {
         mode = MODE_NORMAL;
         return;
     }
+    last_search = pattern;
+    if (search_token) search_token->cancel();
+    search_token.reset();
+    // A replay needs the cursor on the match before its next key
+    if (buf.bytes() >= ASYNC_SEARCH_BYTES && replay_depth == 0) {
+        // Scan a snapshot on the pool; an edit before it finishes makes the result stale
+        CancelPtr token = version_token();
+        search_token = token;
+        TextBuffer snapshot = buf;
+        size_t from_line = cy, from_col = cx + 1;
+        set_status("Searching: " + pattern + " ...");
+        jobs.submit([this, snapshot, pattern, from_line, from_col, token](const CancelToken& tok) {
+            size_t line = 0, col = 0;
+            bool found = search_lines(snapshot, pattern, from_line, from_col, tok, line, col);
+            if (tok.cancelled()) return;
+            jobs.post([this, pattern, found, line, col, token]() {
+                if (token->cancelled() || search_token != token) return;
+                search_token.reset();
+                if (found) {
+                    push_jump();
+                    cy = line;
+                    cx = col;
+                    folds.sync(buf);
+                    folds.reveal(cy);
+                    full_redraw = true;
+                    set_status("Found: " + pattern);
+                } else {
+                    set_status("Pattern not found: " + pattern);
+                }
+            });
+        }, PRIO_VIEWPORT, token);
+        mode = MODE_NORMAL;
+        return;
+    }
     // Start search from next character
     ssize_t found_line = find_next(pattern, cy, cx + 1); 
     if (found_line >= 0) {
         // move cursor to found occurrence
+        push_jump();
         cy = (size_t)found_line;
         size_t pos = buf[cy].find(pattern);
         if (pos != string::npos) cx = pos;
+        folds.sync(buf);
+        folds.reveal(cy);
+        full_redraw = true;
         set_status("Found: " + pattern);
     } else {
         set_status("Pattern not found: " + pattern);
@@ -367,7 +1590,7 @@ void Editor::cmd_A() {
 void Editor::cmd_o() {
     snapshot_undo();
     // Insert new line below and move cursor to it
-    buf.insert(buf.begin() + cy + 1, string());
+    buf.insert(cy + 1, string());
     cy++;
     cx = 0;
     mode = MODE_INSERT;
@@ -376,7 +1599,7 @@ void Editor::cmd_o() {
 void Editor::cmd_O() {
     snapshot_undo();
     // Insert new line above and move cursor to it
-    buf.insert(buf.begin() + cy, string());
+    buf.insert(cy, string());
     cx = 0;
     mode = MODE_INSERT;
     set_status("-- INSERT --");
@@ -385,11 +1608,12 @@ void Editor::cmd_O() {
 void Editor::cmd_x() {
     if (is_buf_empty()) return;
     
-    string &line = buf[cy];
+    string line(buf[cy]);
     // Delete character under cursor if it exists
     if (cx < line.size()) {
         snapshot_undo();
         line.erase(cx, 1);
+        buf.set_line(cy, line);
         set_status("Deleted char");
     }
     ensure_cursor_in_bounds();
@@ -399,24 +1623,28 @@ void Editor::cmd_dd() {
     if (is_buf_empty()) return;
     
     snapshot_undo();
-    yank_buffer.clear();
-    yank_buffer.push_back(buf[cy]); // Save line to yank buffer
+    size_t n;
+    lines_at_cursor(cy, n);
+    yank_buffer = buf.slice(cy, n); // Save line to yank buffer
+    yank_kind = YANK_LINES;
     
-    buf.erase(buf.begin() + cy); // Delete the line
+    buf.erase(cy, n); // Delete the line
     
     if (buf.empty()) buf.push_back(string()); // Ensure buffer is never empty
     
     // Adjust cursor position
     if (cy >= buf.size()) cy = buf.size() - 1;
     cx = min(cx, buf[cy].size());
-    set_status("Deleted line");
+    set_status(n > 1 ? "Deleted " + to_string(n) + " lines" : string("Deleted line"));
 }
 
 void Editor::cmd_yy() {
     if (is_buf_empty()) return;
-    yank_buffer.clear();
-    yank_buffer.push_back(buf[cy]);
-    set_status("Yanked line");
+    size_t first, n;
+    lines_at_cursor(first, n);
+    yank_buffer = buf.slice(first, n);
+    yank_kind = YANK_LINES;
+    set_status(n > 1 ? "Yanked " + to_string(n) + " lines" : string("Yanked line"));
 }
 
 void Editor::cmd_p() {
@@ -425,10 +1653,20 @@ void Editor::cmd_p() {
         return;
     }
     snapshot_undo();
+    if (yank_kind == YANK_CHARS) {
+        paste_chars();
+        set_status("Pasted");
+        return;
+    }
+    if (yank_kind == YANK_BLOCK) {
+        paste_block();
+        set_status("Pasted block");
+        return;
+    }
     
     // Paste yanked lines as new lines after the current line (cy)
     // Inserts at cy + 1
-    buf.insert(buf.begin() + cy + 1, yank_buffer.begin(), yank_buffer.end());
+    buf.insert(cy + 1, yank_buffer);
     
     // Move cursor to the first pasted line
     cy = cy + 1;
@@ -441,10 +1679,13 @@ void Editor::cmd_u() {
         set_status("Nothing to undo");
         return;
     }
+    marks.remember(buf);
     buf = undo_buf;
     cx = undo_cx;
     cy = undo_cy;
+    cursors.clear();
     undo_buf.clear();
+    marks.restore(buf, undo_buf);
     set_status("Undo successful");
 }
 
@@ -466,15 +1707,20 @@ void Editor::cmd_move_right() {
     }
 }
 void Editor::cmd_move_up() {
-    if (cy > 0) {
-        cy--;
+    if (folds.any_closed()) folds.sync(buf);
+    // a closed fold is one step
+    size_t row = row_of(cy);
+    if (row > 0) {
+        cy = line_at(row - 1);
         // Maintain column position, but clip if line is shorter
         cx = min(cx, buf[cy].size());
     }
 }
 void Editor::cmd_move_down() {
-    if (cy + 1 < buf.size()) {
-        cy++;
+    if (folds.any_closed()) folds.sync(buf);
+    size_t next = line_at(row_of(cy) + 1);
+    if (next < buf.size()) {
+        cy = next;
         // Maintain column position, but clip if line is shorter
         cx = min(cx, buf[cy].size());
     }
@@ -489,11 +1735,13 @@ void Editor::cmd_move_to_eol() {
 }
 
 void Editor::cmd_move_to_bof() {
+    push_jump();
     cy = 0; // Move to the first line
     cx = 0; // Move to beginning of line
 }
 
 void Editor::cmd_move_to_eof() {
+    push_jump();
     if (buf.size() > 0) {
         cy = buf.size() - 1; // Move to the last line
         cx = 0; // Move to beginning of line (vi standard for 'G')
@@ -504,7 +1752,9 @@ void Editor::cmd_move_to_eof() {
 // Editing primitives
 void Editor::insert_char(char c) {
     if (buf[cy].size() < MAX_LINE_LEN) {
-        buf[cy].insert(buf[cy].begin() + cx, c);
+        string line(buf[cy]);
+        line.insert(line.begin() + cx, c);
+        buf.set_line(cy, line);
         cx++;
     } else {
         set_status("Line length limit reached (MAX_LINE_LEN)");
@@ -514,24 +1764,26 @@ void Editor::insert_char(char c) {
 void Editor::delete_char() {
     // delete_char is not directly used by current commands, but kept for completeness
     if (cx < buf[cy].size()) {
-        buf[cy].erase(cx, 1);
+        string line(buf[cy]);
+        line.erase(cx, 1);
+        buf.set_line(cy, line);
     } else if (cy + 1 < buf.size()) {
         join_with_next_line();
     }
 }
 
 void Editor::split_line_at_cursor() {
-    string rest = buf[cy].substr(cx);
-    buf[cy].erase(cx);
-    buf.insert(buf.begin() + cy + 1, rest);
+    string line(buf[cy]);
+    buf.set_line(cy, line.substr(0, cx));
+    buf.insert(cy + 1, line.substr(cx));
     cy++;
     cx = 0;
 }
 
 void Editor::join_with_next_line() {
     if (cy + 1 < buf.size()) {
-        buf[cy] += buf[cy + 1];
-        buf.erase(buf.begin() + cy + 1);
+        buf.set_line(cy, string(buf[cy]) + string(buf[cy + 1]));
+        buf.erase(cy + 1);
     }
 }
 
@@ -544,17 +1796,101 @@ void Editor::ensure_cursor_in_bounds() {
     // Ensure column is in bounds (can be up to size() which is one position past the last char)
     if (cx > buf[cy].size()) cx = buf[cy].size(); 
     
-    if (buf.size() > MAX_LINES) {
-        buf.resize(MAX_LINES);
+    // Mapped files are not held in memory and may have any number of lines
+    if (buf.size() > MAX_LINES && !mapped) {
+        buf.erase(MAX_LINES, buf.size() - MAX_LINES);
         set_status("Truncated buffer to MAX_LINES");
     }
 }
 
+// Edited lines leave their old text behind in the chunks; once that dead
+// text outweighs the live text, a copy of the buffer is compacted on the
+// pool and swapped in if no edit happened meanwhile
+void Editor::compact_when_idle() {
+    auto now = chrono::steady_clock::now();
+    if (buf.version() == compact_version || now - last_compact < chrono::seconds(5)) return;
+    last_compact = now;
+    compact_version = buf.version();
+    TextBuffer snapshot = buf;
+    jobs.submit([this, snapshot](const CancelToken& tok) {
+        TextBuffer::MemoryStats m = snapshot.memory();
+        if (m.chunks < 2 * m.copied + (1 << 20) || tok.cancelled()) return;
+        TextBuffer packed = snapshot.compacted();
+        jobs.post([this, packed]() {
+            // compacted() keeps the version, so this only matches an unchanged buffer
+            if (buf.version() != packed.version()) return;
+            // Anchors set since the snapshot are put back by restore
+            marks.remember(buf);
+            buf = packed;
+            marks.restore(buf, undo_buf);
+        });
+    }, PRIO_IDLE, version_token());
+}
+
+// Pages of the mapped files and scratch chunks behind a few screens around
+// each loaded buffer's cursor (and its undo snapshot) stay; the rest are
+// dropped on the pool once the process is over mem_cap. In a server the
+// pages the other sessions are around stay as well.
+void Editor::page_when_idle() {
+    auto now = chrono::steady_clock::now();
+    if (paging || now - last_pageout < chrono::seconds(1)) return;
+    last_pageout = now;
+    if (!shared && process_rss() <= mem_cap) return;
+    vector<pair<const char*, const char*>> hot;
+    size_t rows;
+    {
+        ScreenLock lock(term);
+        rows = max(LINES, 1);
+    }
+    auto keep = [&](const TextBuffer& b, size_t line) {
+        b.hot_ranges(line > 2 * rows ? line - 2 * rows : 0, line + 3 * rows, hot);
+    };
+    keep(buf, top_line);
+    keep(undo_buf, undo_cy);
+    for (size_t i = 0; i < buffers.size(); ++i) {
+        if (i == cur_buf || !buffers[i].loaded) continue;
+        keep(buffers[i].buf, buffers[i].top_line);
+        keep(buffers[i].undo_buf, buffers[i].undo_cy);
+    }
+    if (shared) {
+        // Kept up to date whether or not this session is the one to page
+        shared->set_hot(this, hot);
+        if (process_rss() <= mem_cap) return;
+        hot = shared->all_hot();
+    }
+    paging = true;
+    // Ahead of queued work: scans over big buffers are what fill memory
+    jobs.submit([this, hot](const CancelToken&) {
+        TextBuffer::page_out(hot);
+        jobs.post([this]() { paging = false; });
+    }, PRIO_VIEWPORT);
+}
+
+void Editor::show_memory() {
+    TextBuffer::MemoryStats m = buf.memory();
+    double per_line = m.lines ? ((double)m.chunks + m.nodes - m.copied) / m.lines : 0;
+    char msg[240];
+    snprintf(msg, sizeof(msg), "%zu lines, %s text, %s in chunks, %s in nodes, %.1f bytes/line overhead",
+             m.lines, format_bytes(m.text).c_str(), format_bytes(m.chunks).c_str(), format_bytes(m.nodes).c_str(),
+             per_line);
+    string out = msg;
+    if (m.mapped) out += ", " + format_bytes(m.mapped) + " mapped";
+    out += "; resident " + format_bytes(process_rss()) + " of " + format_bytes(mem_cap);
+    set_status(out);
+}
+
+CancelPtr Editor::version_token() {
+    live_version = buf.version();
+    return make_shared<CancelToken>(&live_version, buf.version());
+}
+
 void Editor::set_status(const string& msg) {
     status_msg = msg;
 }
 
 void Editor::snapshot_undo() {
+    // a replay took its snapshot when it started
+    if (replay_depth > 0) return;
     undo_buf = buf;
     undo_cx = cx;
     undo_cy = cy;
@@ -568,75 +1904,1279 @@ bool Editor::is_buf_empty() {
 void Editor::center_view_on_cursor() {
     int rows, cols;
     getmaxyx(stdscr, rows, cols);
-    int avail = rows - 1; // Available lines for buffer display
+    size_t avail = rows - 1; // Available lines for buffer display
+    // Worked out in screen rows, which closed folds make fewer than lines
+    size_t cur = row_of(cy), top = row_of(top_line), total = folded() ? folds.rows(buf.size()) : buf.size();
     
     // Scroll up if cursor is above the visible window
-    if (cy < top_line) {
-        top_line = cy;
+    if (cur < top) {
+        top = cur;
     } 
     // Scroll down if cursor is below the visible window
-    else if (cy >= top_line + (size_t)avail) {
-        top_line = cy - avail + 1;
+    else if (cur >= top + avail) {
+        top = cur - avail + 1;
     }
     // Optimization: keep cursor somewhat centered vertically
-    // If the top_line is not 0, try to move the view up to center the cursor
-    if (cy > (size_t)(avail / 2) && cy < buf.size() - (size_t)(avail / 2)) {
-        top_line = cy - avail / 2;
-    } else if (cy <= (size_t)(avail / 2)) {
-        top_line = 0;
-    } else if (cy >= buf.size() - (size_t)(avail / 2) && buf.size() > (size_t)avail) {
-        top_line = buf.size() - avail;
+    // If the top row is not 0, try to move the view up to center the cursor
+    if (cur > avail / 2 && cur < total - avail / 2) {
+        top = cur - avail / 2;
+    } else if (cur <= avail / 2) {
+        top = 0;
+    } else if (cur >= total - avail / 2 && total > avail) {
+        top = total - avail;
     }
+    top_line = line_at(top);
 }
 
 ssize_t Editor::find_next(const std::string& pattern, size_t start_line, size_t start_col) {
     if (pattern.empty()) return -1;
-    
-    // Search from current position to end of file
-    for (size_t i = start_line; i < buf.size(); ++i) {
-        size_t pos = 0;
-        if (i == start_line) {
-            // Start search from current column + 1 on the current line
-            pos = buf[i].find(pattern, start_col); 
+    static const CancelToken never;
+    size_t line, col;
+    if (!search_lines(buf, pattern, start_line, start_col, never, line, col)) return -1;
+    // Update cx to the start of the match
+    cx = col;
+    return (ssize_t)line;
+}
+
+// Strips a leading line range off cmd: %, or one or two addresses (N, .
+// or $, each optionally followed by +N / -N) separated by a comma. from
+// and to come back as a half-open range of line indexes; false (status
+// set) if the range is not valid.
+bool Editor::parse_range(string& cmd, size_t& from, size_t& to, bool& given) {
+    given = false;
+    size_t i = 0;
+    if (!cmd.empty() && cmd[0] == '%') {
+        given = true;
+        from = 0;
+        to = buf.size();
+        cmd.erase(0, 1);
+        return true;
+    }
+    // one address; returns false if there is none at i
+    auto address = [&](long& line) {
+        size_t start = i;
+        if (i < cmd.size() && cmd[i] == '.') {
+            line = (long)cy + 1;
+            i++;
+        } else if (i < cmd.size() && cmd[i] == '$') {
+            line = (long)buf.size();
+            i++;
+        } else if (i < cmd.size() && isdigit((unsigned char)cmd[i])) {
+            line = atol(cmd.c_str() + i);
+            while (i < cmd.size() && isdigit((unsigned char)cmd[i])) i++;
         } else {
-            pos = buf[i].find(pattern);
+            line = (long)cy + 1;
         }
-        if (pos != string::npos) {
-            // Update cx to the start of the match
-            cx = pos; 
-            return (ssize_t)i;
+        while (i < cmd.size() && (cmd[i] == '+' || cmd[i] == '-')) {
+            int sign = cmd[i] == '+' ? 1 : -1;
+            long n = 1;
+            if (++i < cmd.size() && isdigit((unsigned char)cmd[i])) {
+                n = atol(cmd.c_str() + i);
+                while (i < cmd.size() && isdigit((unsigned char)cmd[i])) i++;
+            }
+            line += sign * n;
         }
+        return i > start;
+    };
+    long a, b;
+    if (!address(a)) return true;
+    b = a;
+    if (i < cmd.size() && cmd[i] == ',' && (++i, !address(b))) {
+        set_status("Missing address after ,");
+        return false;
     }
-    
-    // Wrap-around search from BOF to starting line
-    for (size_t i = 0; i < start_line; ++i) {
-        size_t pos = buf[i].find(pattern);
-        if (pos != string::npos) {
-            // Update cx to the start of the match
-            cx = pos;
-            return (ssize_t)i;
+    if (a > b) swap(a, b);
+    if (a < 1 || b > (long)buf.size()) {
+        set_status("Invalid range");
+        return false;
+    }
+    given = true;
+    from = (size_t)a - 1;
+    to = (size_t)b;
+    cmd.erase(0, i);
+    return true;
+}
+
+// :sort [n][u][r], :uniq and :!cmd over lines [from, to), as one undo step
+void Editor::transform_lines(const string& cmd, size_t from, size_t to) {
+    auto t0 = chrono::steady_clock::now();
+    TextBuffer lines;
+    string what;
+    if (cmd[0] == '!') {
+        string shell = cmd.substr(1);
+        int status = 0;
+        string err;
+        set_status("Running " + shell + "...");
+        draw();
+        if (!filter_lines(buf, from, to, shell, cwd, lines, status, err)) {
+            set_status("Error: cannot run " + shell + ": " + err);
+            return;
+        }
+        what = "Filtered " + to_string(to - from) + " lines through " + shell + " (" + to_string(lines.size()) +
+               " back" + (status ? ", exit " + to_string(status) : string()) + ")";
+    } else if (cmd == "uniq") {
+        lines = uniq_lines(buf, from, to);
+        what = "Removed " + to_string(to - from - lines.size()) + " duplicate lines";
+    } else {
+        SortOptions opt = { false, false, false };
+        for (size_t i = 4; i < cmd.size(); ++i) {
+            char f = cmd[i];
+            if (f == 'n') opt.numeric = true;
+            else if (f == 'u') opt.unique = true;
+            else if (f == 'r') opt.reverse = true;
+            else if (f != ' ') {
+                set_status("Unknown :sort flag " + string(1, f) + " (n, u or r)");
+                return;
+            }
         }
+        lines = sort_lines(jobs, buf, from, to, opt);
+        what = "Sorted " + to_string(to - from) + " lines";
+        if (lines.size() != to - from) what += ", " + to_string(to - from - lines.size()) + " duplicates removed";
     }
-    return -1;
+    snapshot_undo();
+    replace_lines(from, to, lines);
+    cy = min(from, buf.size() - 1);
+    cx = 0;
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+    char took[32];
+    snprintf(took, sizeof(took), " in %.0f ms", ms);
+    set_status(what + took);
 }
 
-string Editor::prompt_command(const string& prompt) {
-    int rows, cols;
-    getmaxyx(stdscr, rows, cols);
-    echo(); // Enable echoing characters to screen
-    curs_set(1); // Ensure cursor is visible
-    move(rows - 1, 0); // Move to status line
-    clrtoeol(); // Clear status line
-    addstr(prompt.c_str());
-    
-    char input[1024];
-    // Read user input
-    getnstr(input, sizeof(input) - 1); 
-    
-    noecho(); // Disable echoing
-    curs_set(1); // Ensure cursor is visible
-    
-    return string(input);
+// Swaps in new lines for [from, to) as one edit (the caller takes the undo
+// snapshot); marks on those lines stay on the same line numbers
+void Editor::replace_lines(size_t from, size_t to, const TextBuffer& lines) {
+    marks.remember(buf);
+    buf.erase(from, to - from);
+    buf.insert(from, lines);
+    if (buf.empty()) buf.push_back(string());
+    marks.restore(buf, undo_buf);
+}
+
+// Runs lines [from, to) through fn(line_no, text, out) in one walk, straight
+// into fresh chunks, and swaps the result in with replace_lines
+void Editor::rewrite_lines(size_t from, size_t to, const function<void(size_t, string_view, string&)>& fn) {
+    TextBuffer::Builder b;
+    string out;
+    buf.for_each(from, to, [&](size_t i, string_view text) {
+        out.clear();
+        fn(i, text, out);
+        b.add(out);
+        return true;
+    });
+    replace_lines(from, to, b.finish());
+}
+
+bool Editor::in_visual() const {
+    return mode == MODE_VISUAL || mode == MODE_VISUAL_LINE || mode == MODE_VISUAL_BLOCK;
+}
+
+// The selection as lines y1..y2 and half-open columns [x1, x2): in v the
+// text from (y1, x1) up to (y2, x2), in Ctrl-V those columns of every
+// line, in V whole lines
+void Editor::selection(size_t& y1, size_t& x1, size_t& y2, size_t& x2) const {
+    y1 = min(vis_y, cy);
+    y2 = max(vis_y, cy);
+    if (mode == MODE_VISUAL_LINE) {
+        x1 = 0;
+        x2 = SIZE_MAX;
+    } else if (mode == MODE_VISUAL_BLOCK) {
+        x1 = min(vis_x, cx);
+        x2 = vis_eol ? SIZE_MAX : max(vis_x, cx) + 1;
+    } else {
+        bool forward = vis_y < cy || (vis_y == cy && vis_x <= cx);
+        x1 = forward ? vis_x : cx;
+        x2 = (forward ? cx : vis_x) + 1;
+        // Ending past the last character takes the line break along
+        if (x2 > buf[y2].size() && y2 + 1 < buf.size()) {
+            y2++;
+            x2 = 0;
+        } else {
+            x2 = min(x2, buf[y2].size());
+        }
+    }
+}
+
+// Columns [from, to) of a line of length len that are selected; to is
+// len + 1 when its line break is
+bool Editor::selected_cols(size_t line, size_t len, size_t& from, size_t& to) const {
+    if (!in_visual()) return false;
+    size_t y1, x1, y2, x2;
+    selection(y1, x1, y2, x2);
+    if (line < y1 || line > y2) return false;
+    if (mode == MODE_VISUAL_BLOCK) {
+        from = x1;
+        to = min(x2, len);
+    } else {
+        from = line == y1 ? x1 : 0;
+        to = line == y2 && x2 != SIZE_MAX ? x2 : len + 1;
+    }
+    return from < to;
+}
+
+// v, V and Ctrl-V: moves stretch the selection from where it started,
+// operators act on all of it as one edit
+void Editor::handle_visual(int ch) {
+    size_t lo = min(vis_y, cy), hi = max(vis_y, cy);
+    switch (ch) {
+        case 27: mode = MODE_NORMAL; break;
+        // The key of the current mode leaves it, another one switches
+        case 'v': mode = mode == MODE_VISUAL ? MODE_NORMAL : MODE_VISUAL; break;
+        case 'V': mode = mode == MODE_VISUAL_LINE ? MODE_NORMAL : MODE_VISUAL_LINE; break;
+        case 22: mode = mode == MODE_VISUAL_BLOCK ? MODE_NORMAL : MODE_VISUAL_BLOCK; break; // Ctrl-V
+        case 'o':
+            swap(vis_y, cy);
+            swap(vis_x, cx);
+            break;
+
+        case 'h':
+        case KEY_LEFT: cmd_move_left(); vis_eol = false; break;
+        case 'j':
+        case KEY_DOWN: cmd_move_down(); break;
+        case 'k':
+        case KEY_UP: cmd_move_up(); break;
+        case 'l':
+        case KEY_RIGHT: cmd_move_right(); vis_eol = false; break;
+        case '0':
+        case '^': cmd_move_to_bol(); vis_eol = false; break;
+        // In a block, $ takes every line to its own end
+        case '$': cmd_move_to_eol(); vis_eol = true; break;
+        case 'G': cmd_move_to_eof(); break;
+        case 'g': {
+            int c2 = read_key();
+            if (c2 == 'g') cmd_move_to_bof();
+            break;
+        }
+
+        case 'y': visual_yank(); break;
+        case 'd':
+        case 'x': visual_delete(false); break;
+        case 'c': visual_delete(true); break;
+        case '>':
+        case '<': visual_shift(ch == '>'); break;
+        // Insert on every line: at the block's left edge / after its right
+        // edge, or at the start / end of each line outside a block
+        case 'I':
+        case 'A': {
+            size_t col = ch == 'I' ? 0 : SIZE_MAX;
+            if (mode == MODE_VISUAL_BLOCK) {
+                size_t y1, x1, y2, x2;
+                selection(y1, x1, y2, x2);
+                col = ch == 'I' ? x1 : x2;
+            }
+            snapshot_undo();
+            start_block_insert(lo, hi + 1, col, ch == 'A');
+            break;
+        }
+        case ':':
+            cmd_prefill = to_string(lo + 1) + "," + to_string(hi + 1);
+            mode = MODE_COMMAND;
+            break;
+        case 14: { // Ctrl-N: a cursor on every selected line, at the block's left edge
+            size_t y1, x1, y2, x2;
+            selection(y1, x1, y2, x2);
+            size_t col = mode == MODE_VISUAL_BLOCK ? x1 : cx;
+            mode = MODE_NORMAL;
+            cursors_on_lines(lo, hi + 1, col);
+            break;
+        }
+        default: break;
+    }
+    if (!in_visual()) full_redraw = true;
+    ensure_cursor_in_bounds();
+}
+
+void Editor::visual_yank() {
+    size_t y1, x1, y2, x2;
+    selection(y1, x1, y2, x2);
+    size_t n = y2 - y1 + 1;
+    if (mode == MODE_VISUAL_LINE) {
+        yank_buffer = buf.slice(y1, n);
+        yank_kind = YANK_LINES;
+        set_status(to_string(n) + " lines yanked");
+    } else if (mode == MODE_VISUAL_BLOCK) {
+        TextBuffer::Builder b;
+        buf.for_each(y1, y2 + 1, [&](size_t, string_view text) {
+            b.add(x1 < text.size() ? text.substr(x1, x2 - x1) : string_view());
+            return true;
+        });
+        yank_buffer = b.finish();
+        yank_kind = YANK_BLOCK;
+        set_status("block of " + to_string(n) + " lines yanked");
+    } else {
+        // The lines in between are shared, not copied
+        yank_buffer = buf.slice(y1, n);
+        if (n == 1) {
+            yank_buffer.set_line(0, buf[y1].substr(x1, x2 - x1));
+        } else {
+            yank_buffer.set_line(0, buf[y1].substr(x1));
+            yank_buffer.set_line(n - 1, buf[y2].substr(0, x2));
+        }
+        yank_kind = YANK_CHARS;
+        set_status(n > 1 ? to_string(n) + " lines yanked" : "Yanked");
+    }
+    mode = MODE_NORMAL;
+    cy = y1;
+    if (yank_kind != YANK_LINES) cx = x1;
+}
+
+// d and c; the deleted text goes to the yank buffer as with y
+void Editor::visual_delete(bool change) {
+    size_t y1, x1, y2, x2;
+    selection(y1, x1, y2, x2);
+    bool block = mode == MODE_VISUAL_BLOCK;
+    visual_yank();
+    snapshot_undo();
+    size_t n = y2 - y1 + 1;
+    if (yank_kind == YANK_LINES) {
+        if (change) {
+            if (n > 1) buf.erase(y1 + 1, n - 1);
+            buf.set_line(y1, string());
+        } else {
+            buf.erase(y1, n);
+            if (buf.empty()) buf.push_back(string());
+        }
+        cy = min(y1, buf.size() - 1);
+        cx = 0;
+        set_status(to_string(n) + " fewer lines");
+    } else if (block) {
+        rewrite_lines(y1, y2 + 1, [&](size_t, string_view text, string& out) {
+            out.assign(text.substr(0, x1));
+            if (x2 < text.size()) out.append(text.substr(x2));
+        });
+        set_status("Deleted block of " + to_string(n) + " lines");
+    } else {
+        string joined = string(buf[y1].substr(0, x1)) + string(buf[y2].substr(x2));
+        if (n > 1) buf.erase(y1 + 1, n - 1);
+        buf.set_line(y1, joined);
+        set_status(n > 1 ? to_string(n - 1) + " fewer lines" : "Deleted");
+    }
+    if (!change) return;
+    if (block) {
+        start_block_insert(y1, y2 + 1, x1, false);
+        return;
+    }
+    mode = MODE_INSERT;
+    set_status("-- INSERT --");
+}
+
+// > and <: every selected line in or out by SHIFT_WIDTH spaces (or one tab)
+void Editor::visual_shift(bool right) {
+    size_t lo = min(vis_y, cy), hi = max(vis_y, cy);
+    snapshot_undo();
+    string indent(SHIFT_WIDTH, ' ');
+    rewrite_lines(lo, hi + 1, [&](size_t, string_view text, string& out) {
+        if (right) {
+            // Empty lines stay empty
+            if (!text.empty()) out = indent;
+            out.append(text.data(), text.size());
+            return;
+        }
+        size_t n = 0;
+        if (!text.empty() && text[0] == '\t') n = 1;
+        else while (n < SHIFT_WIDTH && n < text.size() && text[n] == ' ') n++;
+        out.assign(text.substr(n));
+    });
+    mode = MODE_NORMAL;
+    cy = lo;
+    cx = 0;
+    set_status(to_string(hi - lo + 1) + " lines " + (right ? ">" : "<") + "ed");
+}
+
+// Typing goes into the first line at col (SIZE_MAX: its end) as usual;
+// finish_block_insert copies it to the others. The caller has taken the
+// undo snapshot, which the keystrokes in between do not replace.
+void Editor::start_block_insert(size_t from, size_t to, size_t col, bool pad) {
+    block_insert = true;
+    block_from = from;
+    block_to = to;
+    block_col = col;
+    block_pad = pad;
+    block_undo = undo_buf;
+    block_undo_cx = undo_cx;
+    block_undo_cy = undo_cy;
+    string first(buf[from]);
+    if (col != SIZE_MAX && first.size() < col) {
+        first.resize(col, ' ');
+        buf.set_line(from, first);
+    }
+    block_line = first;
+    cy = from;
+    cx = min(col, first.size());
+    mode = MODE_INSERT;
+    set_status("-- INSERT --");
+}
+
+// Esc after a block insert: one pass over the other lines puts the same
+// text in, and the whole insert undoes as one step
+void Editor::finish_block_insert() {
+    block_insert = false;
+    undo_buf = block_undo;
+    undo_cx = block_undo_cx;
+    undo_cy = block_undo_cy;
+    size_t at = min(block_col, block_line.size());
+    string_view now = buf[block_from];
+    const string& was = block_line;
+    // Only text typed in place on the first line is repeated (no line
+    // breaks, no backspacing past where it started)
+    if (cy != block_from || block_to - block_from < 2 || now.size() <= was.size() ||
+        now.compare(0, at, was, 0, at) != 0 || now.substr(now.size() - (was.size() - at)) != string_view(was).substr(at)) {
+        return;
+    }
+    auto t0 = chrono::steady_clock::now();
+    string added(now.substr(at, now.size() - was.size()));
+    rewrite_lines(block_from + 1, block_to, [&](size_t, string_view text, string& out) {
+        size_t col = block_col == SIZE_MAX ? text.size() : block_col;
+        out.assign(text.data(), text.size());
+        if (text.size() < col) {
+            if (!block_pad) return;
+            out.resize(col, ' ');
+        }
+        out.insert(col, added);
+    });
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+    char took[32];
+    snprintf(took, sizeof(took), " in %.0f ms", ms);
+    set_status("Inserted on " + to_string(block_to - block_from) + " lines" + took);
+}
+
+// p after v: the text goes in after the cursor, splitting the line when it
+// holds line breaks
+void Editor::paste_chars() {
+    string line(buf[cy]);
+    size_t at = line.empty() ? 0 : min(cx + 1, line.size());
+    size_t n = yank_buffer.size();
+    if (n == 1) {
+        string_view text = yank_buffer[0];
+        line.insert(at, text.data(), text.size());
+        buf.set_line(cy, line);
+        cx = at + (text.empty() ? 0 : text.size() - 1);
+        return;
+    }
+    TextBuffer rest = yank_buffer.slice(1, n - 1);
+    rest.set_line(n - 2, string(rest[n - 2]) + line.substr(at));
+    buf.set_line(cy, line.substr(0, at) + string(yank_buffer[0]));
+    buf.insert(cy + 1, rest);
+    cx = at;
+}
+
+// p after Ctrl-V: row k of the block goes in after the cursor column on
+// line cy + k (lines are added at the end if needed), padded out so the
+// text right of it stays lined up
+void Editor::paste_block() {
+    size_t n = yank_buffer.size();
+    size_t at = buf[cy].empty() ? 0 : cx + 1;
+    vector<string_view> rows;
+    size_t width = 0;
+    yank_buffer.for_each(0, n, [&](size_t, string_view s) {
+        rows.push_back(s);
+        width = max(width, s.size());
+        return true;
+    });
+    while (buf.size() < cy + n) buf.push_back(string());
+    rewrite_lines(cy, cy + n, [&](size_t i, string_view text, string& out) {
+        string_view row = rows[i - cy];
+        out.assign(text.substr(0, at));
+        out.resize(at, ' ');
+        out.append(row.data(), row.size());
+        if (at < text.size()) {
+            out.append(width - row.size(), ' ');
+            out.append(text.substr(at));
+        }
+    });
+    cx = at;
+}
+
+// Keys that act at every cursor while there are several (false for the
+// rest, which act on the main cursor; those that edit drop the others)
+bool Editor::handle_multi_normal(int ch) {
+    switch (ch) {
+        case 27:
+            cursors.clear();
+            set_status("One cursor");
+            return true;
+        case 'h': case KEY_LEFT:
+        case 'l': case KEY_RIGHT:
+        case 'j': case KEY_DOWN:
+        case 'k': case KEY_UP:
+        case '0': case '^': case '$':
+            move_cursors(ch);
+            return true;
+        case 'i':
+        case 'a':
+        case 'A':
+            if (ch != 'i') move_cursors(ch);
+            mode = MODE_INSERT;
+            set_status("-- INSERT --");
+            return true;
+        case 'x':
+            edit_all(CURSOR_DELETE, "");
+            return true;
+        case 14: // Ctrl-N
+        case ':':
+        case '/':
+        case 15: // Ctrl-O
+        case '\t': // Ctrl-I
+        case '\'':
+        case '`':
+        case 'm':
+            return false;
+        default:
+            cursors.clear();
+            return false;
+    }
+}
+
+// One keystroke at the main and every extra cursor as one batched edit
+// (see edit_at_cursors) and one undo step
+void Editor::edit_all(CursorEdit op, const string& text) {
+    snapshot_undo();
+    // Edits elsewhere may have left cursors past the end of their lines
+    vector<Cursor> all;
+    all.reserve(cursors.size() + 1);
+    for (Cursor c : cursors) {
+        c.line = min(c.line, buf.size() - 1);
+        c.col = min(c.col, buf[c.line].size());
+        all.push_back(c);
+    }
+    Cursor me = { cy, cx };
+    all.push_back(me);
+    sort(all.begin(), all.end());
+    all.erase(unique(all.begin(), all.end()), all.end());
+    size_t main = lower_bound(all.begin(), all.end(), me) - all.begin();
+    edit_at_cursors(buf, all, main, op, text);
+    cy = all[main].line;
+    cx = all[main].col;
+    all.erase(all.begin() + main);
+    cursors.swap(all);
+}
+
+// h l j k 0 ^ $ at every cursor, each within its own line; a and A move
+// each cursor where the insert starts
+void Editor::move_cursors(int ch) {
+    auto move = [&](size_t& line, size_t& col) {
+        line = min(line, buf.size() - 1);
+        size_t len = buf[line].size();
+        switch (ch) {
+            case 'h': case KEY_LEFT: if (col > 0) col--; break;
+            case 'l': case KEY_RIGHT: if (col < len) col++; break;
+            case 'a': col = min(col + 1, len); break;
+            case '0': case '^': col = 0; break;
+            case '$': case 'A': col = len; break;
+            case 'j': case KEY_DOWN:
+                if (line + 1 < buf.size()) line++;
+                break;
+            case 'k': case KEY_UP:
+                if (line > 0) line--;
+                break;
+        }
+        col = min(col, buf[line].size());
+    };
+    move(cy, cx);
+    for (Cursor& c : cursors) move(c.line, c.col);
+    // Cursors that run into each other become one
+    Cursor me = { cy, cx };
+    sort(cursors.begin(), cursors.end());
+    cursors.erase(unique(cursors.begin(), cursors.end()), cursors.end());
+    auto it = lower_bound(cursors.begin(), cursors.end(), me);
+    if (it != cursors.end() && *it == me) cursors.erase(it);
+}
+
+// Ctrl-N: the main cursor moves to the next match of the last search and
+// leaves another cursor where it was
+void Editor::add_cursor_at_next() {
+    if (last_search.empty()) {
+        set_status("Search for something first (/pattern)");
+        return;
+    }
+    CancelToken never;
+    size_t line, col;
+    if (!search_lines(buf, last_search, cy, cx + 1, never, line, col)) {
+        set_status("Pattern not found: " + last_search);
+        return;
+    }
+    Cursor me = { cy, cx }, next = { line, col };
+    if (next == me || binary_search(cursors.begin(), cursors.end(), next)) {
+        set_status("Every match of " + last_search + " has a cursor");
+        return;
+    }
+    cursors.insert(lower_bound(cursors.begin(), cursors.end(), me), me);
+    cy = line;
+    cx = col;
+    set_status(to_string(cursors.size() + 1) + " cursors");
+}
+
+// :[range]cursors pattern: a cursor on every match in the range (the main
+// cursor on the first)
+void Editor::add_cursors(const string& pattern, size_t from, size_t to) {
+    vector<Cursor> all = find_matches(buf, from, to, pattern);
+    if (all.empty()) {
+        set_status("Pattern not found: " + pattern);
+        return;
+    }
+    cy = all[0].line;
+    cx = all[0].col;
+    all.erase(all.begin());
+    cursors.swap(all);
+    set_status(to_string(cursors.size() + 1) + " cursors");
+}
+
+// A cursor on each of lines [from, to) at col (or the end of shorter lines)
+void Editor::cursors_on_lines(size_t from, size_t to, size_t col) {
+    cursors.clear();
+    buf.for_each(from, to, [&](size_t i, string_view s) {
+        cursors.push_back(Cursor{ i, min(col, s.size()) });
+        return true;
+    });
+    if (cursors.empty()) return;
+    cy = cursors[0].line;
+    cx = cursors[0].col;
+    cursors.erase(cursors.begin());
+    set_status(to_string(cursors.size() + 1) + " cursors");
+}
+
+// Ctrl-N / Ctrl-P in insert mode: words that start with the one left of
+// the cursor. Words within COMP_NEAR lines come first, nearest first; then
+// the rest of the word index, most frequent first.
+void Editor::start_completion(bool forward) {
+    string line(buf[cy]);
+    size_t start = min(cx, line.size());
+    while (start > 0 && is_word(line[start - 1])) start--;
+    string prefix = line.substr(start, cx - start);
+    vector<pair<size_t, string>> near;
+    unordered_map<string, size_t> seen;
+    size_t from = cy > COMP_NEAR ? cy - COMP_NEAR : 0;
+    buf.for_each(from, min(buf.size(), cy + COMP_NEAR + 1), [&](size_t i, string_view s) {
+        size_t dist = i > cy ? i - cy : cy - i;
+        for_each_word(s, [&](string_view w) {
+            if (w.size() <= prefix.size() || w.compare(0, prefix.size(), prefix) != 0) return;
+            // the word being completed does not count
+            if (i == cy && w.data() == s.data() + start) return;
+            auto it = seen.emplace(string(w), near.size());
+            if (it.second) near.push_back({ dist, string(w) });
+            else near[it.first->second].first = min(near[it.first->second].first, dist);
+        });
+        return true;
+    });
+    // stable: on the same line, the order they appear in
+    stable_sort(near.begin(), near.end(), [](const pair<size_t, string>& a, const pair<size_t, string>& b) { return a.first < b.first; });
+    candidates.assign(1, prefix);
+    for (auto& n : near) {
+        if (candidates.size() > COMP_MAX) break;
+        candidates.push_back(move(n.second));
+    }
+    for (string_view w : word_index->top(prefix, COMP_MAX)) {
+        if (candidates.size() > COMP_MAX) break;
+        if (!seen.count(string(w))) candidates.push_back(string(w));
+    }
+    if (candidates.size() == 1) {
+        candidates.clear();
+        set_status("No completions for \"" + prefix + "\"");
+        return;
+    }
+    snapshot_undo();
+    comp_start = start;
+    comp_sel = 0;
+    choose_completion(forward ? 1 : candidates.size() - 1);
+}
+
+// Puts candidate i in place of the one in the text (0 is the word as typed)
+void Editor::choose_completion(size_t i) {
+    string line(buf[cy]);
+    line.replace(comp_start, cx - comp_start, candidates[i]);
+    buf.set_line(cy, line);
+    cx = comp_start + candidates[i].size();
+    comp_sel = i;
+    size_t n = candidates.size() - 1;
+    if (i == 0) set_status("Back at original");
+    else set_status("match " + to_string(i) + " of " + to_string(n));
+}
+
+// @: replays a register count times. The first (outermost) replay takes
+// the undo snapshot and nothing is drawn until it is over.
+void Editor::play_macro(int reg, size_t count) {
+    vector<int> keys = macros[reg];
+    if (keys.empty()) {
+        set_status("Register " + string(1, (char)('a' + reg)) + " is empty");
+        return;
+    }
+    last_macro = reg;
+    if (replay_depth >= MACRO_DEPTH) {
+        // a macro that (indirectly) plays itself
+        macro_stopped = true;
+        set_status("Macros nested too deep, stopped");
+        return;
+    }
+    bool outer = replay_depth == 0;
+    auto t0 = chrono::steady_clock::now();
+    if (outer) snapshot_undo();
+    replay_depth++;
+    for (size_t i = 0; i < count && !macro_stopped; ++i) run_keys(keys);
+    replay_depth--;
+    if (!outer) return;
+    bool stopped = macro_stopped;
+    macro_stopped = false;
+    full_redraw = true;
+    if (stopped) return;
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+    char took[32];
+    snprintf(took, sizeof(took), " in %.0f ms", ms);
+    set_status("Played @" + string(1, (char)('a' + reg)) + (count > 1 ? " " + to_string(count) + " times" : "") + took);
+}
+
+// Feeds keys to handle_key as if typed. Keys still queued by an outer
+// replay wait until these are done.
+void Editor::run_keys(const vector<int>& keys) {
+    deque<int> queued(keys.begin(), keys.end());
+    pending_keys.swap(queued);
+    while (!pending_keys.empty() && !macro_stopped) {
+        int ch = pending_keys.front();
+        pending_keys.pop_front();
+        handle_key(ch);
+    }
+    pending_keys.swap(queued);
+}
+
+// :{range}normal keys: the keys run with the cursor at the start of each
+// line of the range in turn, all as one undo step
+void Editor::normal_lines(const string& keys, size_t from, size_t to) {
+    vector<int> k;
+    for (char c : keys) k.push_back((unsigned char)c);
+    bool outer = replay_depth == 0;
+    auto t0 = chrono::steady_clock::now();
+    if (outer) snapshot_undo();
+    replay_depth++;
+    size_t line = from;
+    for (size_t i = from; i < to && line < buf.size() && !macro_stopped; ++i) {
+        size_t before = buf.size();
+        mode = MODE_NORMAL;
+        cy = line;
+        cx = 0;
+        run_keys(k);
+        // An unfinished insert or selection ends as if Esc was typed
+        if (mode != MODE_NORMAL) handle_key(27);
+        // Lines added or deleted move the rest of the range along
+        line = (size_t)max<ptrdiff_t>(0, (ptrdiff_t)line + 1 + (ptrdiff_t)buf.size() - (ptrdiff_t)before);
+    }
+    replay_depth--;
+    mode = MODE_NORMAL;
+    if (!outer) return;
+    bool stopped = macro_stopped;
+    macro_stopped = false;
+    full_redraw = true;
+    if (stopped) return;
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+    char took[32];
+    snprintf(took, sizeof(took), " in %.0f ms", ms);
+    set_status("Ran :normal on " + to_string(to - from) + " lines" + took);
+}
+
+// z commands. Folding starts with the first one: by braces for C-like
+// and JSON files, by indentation for everything else.
+void Editor::fold_command(int c) {
+    if (c != 'c' && c != 'o' && c != 'a' && c != 'M' && c != 'R') {
+        set_status("Unknown command z" + string(1, (char)c));
+        return;
+    }
+    if (!folds.on()) {
+        static const char* braces[] = { ".c", ".h", ".cc", ".cpp", ".hpp", ".cxx", ".java", ".js", ".ts", ".go", ".rs", ".cs", ".json" };
+        FoldMethod how = FOLD_INDENT;
+        for (const char* ext : braces) {
+            size_t n = strlen(ext);
+            if (filename.size() > n && filename.compare(filename.size() - n, n, ext) == 0) how = FOLD_BRACES;
+        }
+        folds.set_method(buf, how);
+    }
+    folds.sync(buf);
+    if (folds.stale()) folds.rebuild();
+    bool found = true;
+    if (c == 'c') found = folds.close(cy);
+    else if (c == 'o') found = folds.open(cy);
+    else if (c == 'a') found = folds.toggle(cy);
+    else if (c == 'M') folds.close_all();
+    else folds.open_all();
+    if (!found) set_status("No fold here");
+    // The cursor goes to the line that stands for the fold it is in
+    cy = folds.shown(cy);
+    full_redraw = true;
+}
+
+// Typing shifts the folds right away; they are worked out again from the
+// line shapes once it pauses. True when the view may have changed.
+bool Editor::fold_when_idle() {
+    folds.sync(buf);
+    if (!folds.stale()) return false;
+    folds.rebuild();
+    full_redraw = true;
+    return true;
+}
+
+// The cursor's line, or all of the closed fold it is in (dd, yy)
+void Editor::lines_at_cursor(size_t& first, size_t& n) {
+    if (folds.any_closed()) folds.sync(buf);
+    first = folded() ? folds.shown(cy) : cy;
+    const Fold* f = folded() ? folds.closed_at(first) : nullptr;
+    n = f ? f->end - first + 1 : 1;
+}
+
+// Closed folds count outside the diff view, which has rows of its own
+bool Editor::folded() const {
+    return !diff_on && folds.any_closed();
+}
+
+size_t Editor::row_of(size_t line) const {
+    return folded() ? folds.row_of(line) : line;
+}
+
+size_t Editor::line_at(size_t row) const {
+    return folded() ? folds.line_at(row) : row;
+}
+
+// Where a jump (G, gg, a search, :N, a mark...) leaves from
+void Editor::push_jump() {
+    marks.push_jump(buf, undo_buf, cy, cx);
+}
+
+// 'x goes to the line of mark x, `x to its exact spot; '' and `` go back
+// to where the last jump started
+void Editor::go_to_mark(int c, bool exact) {
+    int slot = c == '\'' || c == '`' ? MarkSet::CONTEXT : c - 'a';
+    size_t line, col;
+    if (slot < 0 || slot > MarkSet::CONTEXT || !marks.get(slot, buf, line, col)) {
+        set_status("Mark not set: " + string(1, (char)c));
+        return;
+    }
+    push_jump();
+    cy = line;
+    if (exact) {
+        cx = col;
+    } else {
+        string_view text = buf[cy];
+        size_t first = text.find_first_not_of(" \t");
+        cx = first == string_view::npos ? 0 : first;
+    }
+}
+
+// :grep pattern [dir] - the last word is taken as the directory when it names one
+void Editor::start_grep_cmd(const string& args) {
+    string pattern = args, root = work_dir();
+    size_t sp = args.rfind(' ');
+    if (sp != string::npos && sp > 0) {
+        string last = resolve_path(args.substr(sp + 1));
+        struct stat st;
+        if (!last.empty() && stat(last.c_str(), &st) == 0) {
+            pattern = args.substr(0, sp);
+            root = last;
+        }
+    }
+    if (pattern.empty()) {
+        set_status("Usage: :grep pattern [dir]");
+        return;
+    }
+    // A new search replaces the list and stops the previous one
+    if (grep_token) grep_token->cancel();
+    grep_token = make_shared<CancelToken>();
+    quickfix.clear();
+    qf_pos = SIZE_MAX;
+    grep_running = true;
+    set_status("grep: searching " + root + " for " + pattern + "...");
+    start_grep(jobs, pattern, root, grep_token,
+        [this](vector<GrepHit>& hits) {
+            for (GrepHit& h : hits) quickfix.push_back(move(h));
+            set_status("grep: " + to_string(quickfix.size()) + " matches so far (:cn to jump)");
+        },
+        [this](const GrepStats& st) {
+            grep_running = false;
+            char msg[160];
+            snprintf(msg, sizeof(msg), "grep: %zu matches in %llu files (%s, %llu binary skipped) in %.0f ms",
+                     quickfix.size(), (unsigned long long)st.files, format_bytes(st.bytes).c_str(),
+                     (unsigned long long)st.binary, st.secs * 1000);
+            set_status(msg);
+        });
+}
+
+// :diff compares with the file on disk, :diff N with buffer N
+void Editor::start_diff(const string& arg) {
+    string path;
+    TextBuffer other;
+    if (arg.empty()) {
+        if (filename.empty()) {
+            set_status("No file name to diff against");
+            return;
+        }
+        path = filename;
+        diff_name = filename + " (on disk)";
+    } else {
+        size_t n = (size_t)atol(arg.c_str());
+        if (n < 1 || n > buffers.size() || n - 1 == cur_buf) {
+            set_status("No other buffer " + arg);
+            return;
+        }
+        const BufferState& b = buffers[n - 1];
+        diff_name = b.filename.empty() ? "[No Name]" : b.filename;
+        if (b.loaded) other = b.buf;
+        else path = b.filename;
+    }
+    if (diff_on) diff_off();
+    diff_on = true;
+    set_status("Diffing against " + diff_name + "...");
+    run_diff(path, other);
+}
+
+// Hashes and diffs a snapshot of buf on the pool. The first run also loads
+// (path) or takes (other) the other side; later runs reuse its hashes and
+// those of every line of buf that did not change since the last run.
+void Editor::run_diff(const string& path, const TextBuffer& other) {
+    if (diff_token) diff_token->cancel();
+    CancelPtr token = make_shared<CancelToken>();
+    diff_token = token;
+    diff_running = true;
+    TextBuffer snapshot = buf;
+    DiffSidePtr prev = diff_a, side_b = diff_b;
+    size_t max_len = MAX_LINE_LEN, max_lines = MAX_LINES;
+    jobs.submit([this, snapshot, prev, side_b, path, other, token, max_len, max_lines](const CancelToken& tok) {
+        auto t0 = chrono::steady_clock::now();
+        DiffSidePtr b = side_b;
+        if (!b) {
+            TextBuffer lines = other;
+            string err;
+            if (!path.empty() && !load_lines(path, lines, max_len, max_lines, err)) {
+                jobs.post([this, token, path, err]() {
+                    if (token != diff_token) return;
+                    diff_off();
+                    set_status("Error: cannot diff against " + path + ": " + err);
+                });
+                return;
+            }
+            b = hash_side(lines, nullptr);
+        }
+        DiffSidePtr a = hash_side(snapshot, prev);
+        vector<DiffHunk> h = diff_lines(a->hashes, b->hashes, tok);
+        if (tok.cancelled()) return;
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+        jobs.post([this, token, a, b, h, ms]() {
+            if (token != diff_token) return;
+            bool first = !diff_b;
+            diff_running = false;
+            diff_a = a;
+            diff_b = b;
+            diff_other = b->lines;
+            hunks = h;
+            diff_version = a->lines.version();
+            hunk_rows.clear();
+            size_t extra = 0;
+            for (const DiffHunk& d : hunks) {
+                hunk_rows.push_back(d.a_start + extra);
+                extra += max(d.a_count, d.b_count) - d.a_count;
+            }
+            if (first) {
+                char msg[64];
+                snprintf(msg, sizeof(msg), " (%.0f ms)", ms);
+                set_status(to_string(hunks.size()) + " hunks against " + diff_name + msg);
+            }
+        });
+    }, PRIO_NORMAL, token);
+}
+
+// Edits are re-diffed once typing pauses
+void Editor::diff_when_idle() {
+    if (diff_on && !diff_running && diff_b && diff_version != buf.version()) run_diff(string(), TextBuffer());
+}
+
+void Editor::diff_off() {
+    if (diff_token) diff_token->cancel();
+    diff_token.reset();
+    diff_on = diff_running = false;
+    diff_other = TextBuffer();
+    diff_a.reset();
+    diff_b.reset();
+    hunks.clear();
+    hunk_rows.clear();
+    full_redraw = true;
+}
+
+// Brings word_index up to date with one buffer at a time once typing
+// pauses: the active one first, then the other loaded ones. Evicted buffers
+// are updated to empty, which takes their words out.
+void Editor::index_when_idle() {
+    if (index_running) return;
+    size_t which = SIZE_MAX;
+    TextBuffer before, after;
+    if (indexed.empty() || indexed.version() != buf.version()) {
+        which = cur_buf;
+        before = indexed;
+        after = buf;
+    }
+    for (size_t i = 0; i < buffers.size() && which == SIZE_MAX; ++i) {
+        const BufferState& b = buffers[i];
+        if (i == cur_buf) continue;
+        bool stale = b.loaded ? b.indexed.empty() || b.indexed.version() != b.buf.version() : !b.indexed.empty();
+        if (!stale) continue;
+        which = i;
+        before = b.indexed;
+        if (b.loaded) after = b.buf;
+    }
+    if (which == SIZE_MAX) return;
+    index_running = true;
+    WordIndexPtr base = word_index;
+    jobs.submit([this, which, base, before, after](const CancelToken& tok) {
+        WordIndexPtr next = base->updated(before, after, tok);
+        jobs.post([this, which, next, after]() {
+            index_running = false;
+            if (!next) return;
+            word_index = next;
+            // buffers do not move in the list, so which is still this buffer
+            if (which == cur_buf) indexed = after;
+            else buffers[which].indexed = after;
+        });
+    }, PRIO_IDLE);
+}
+
+// ]c and [c: to the start of the next / previous hunk
+void Editor::jump_hunk(bool forward) {
+    if (!diff_on) {
+        set_status("Not diffing (use :diff)");
+        return;
+    }
+    if (hunks.empty()) {
+        set_status(diff_b ? "No differences" : "Diff still running");
+        return;
+    }
+    size_t i;
+    if (forward) {
+        for (i = 0; i < hunks.size() && hunks[i].a_start <= cy; ++i) {}
+        if (i == hunks.size()) {
+            set_status("No next hunk");
+            return;
+        }
+    } else {
+        for (i = hunks.size(); i > 0 && hunks[i - 1].a_start >= cy; --i) {}
+        if (i == 0) {
+            set_status("No previous hunk");
+            return;
+        }
+        i--;
+    }
+    push_jump();
+    cy = min(hunks[i].a_start, buf.size() - 1);
+    cx = 0;
+    set_status("hunk " + to_string(i + 1) + " of " + to_string(hunks.size()));
+}
+
+// Screen row of line `line` of buf in the diff view, counting the filler
+// rows that pad out hunks where the other side has more lines
+size_t Editor::diff_row_of(size_t line) const {
+    size_t i = upper_bound(hunks.begin(), hunks.end(), line,
+                           [](size_t l, const DiffHunk& h) { return l < h.a_start; }) - hunks.begin();
+    if (i == 0) return line;
+    const DiffHunk& h = hunks[i - 1];
+    if (line < h.a_start + h.a_count) return hunk_rows[i - 1] + (line - h.a_start);
+    return hunk_rows[i - 1] + max(h.a_count, h.b_count) + (line - h.a_start - h.a_count);
+}
+
+// What a diff view row shows: a line of each side (SIZE_MAX for a filler)
+void Editor::diff_row_at(size_t row, size_t& a, size_t& b, bool& changed) const {
+    size_t i = upper_bound(hunk_rows.begin(), hunk_rows.end(), row) - hunk_rows.begin();
+    changed = false;
+    if (i == 0) {
+        a = b = row;
+    } else {
+        const DiffHunk& h = hunks[i - 1];
+        size_t off = row - hunk_rows[i - 1], rows = max(h.a_count, h.b_count);
+        if (off < rows) {
+            changed = true;
+            a = off < h.a_count ? h.a_start + off : SIZE_MAX;
+            b = off < h.b_count ? h.b_start + off : SIZE_MAX;
+        } else {
+            a = h.a_start + h.a_count + (off - rows);
+            b = h.b_start + h.b_count + (off - rows);
+        }
+    }
+    // Hunks lag behind edits until the next run
+    if (a != SIZE_MAX && a >= buf.size()) a = SIZE_MAX;
+    if (b != SIZE_MAX && b >= diff_other.size()) b = SIZE_MAX;
+}
+
+void Editor::draw_diff(int avail, int cols) {
+    int half = (cols - 1) / 2;
+    size_t cur = diff_row_of(cy);
+    size_t top = cur > (size_t)avail / 2 ? cur - avail / 2 : 0;
+    for (int r = 0; r < avail; ++r) {
+        size_t a, b;
+        bool changed;
+        diff_row_at(top + r, a, b, changed);
+        bool past_end = a == SIZE_MAX && b == SIZE_MAX && !changed;
+        move(r, 0);
+        clrtoeol();
+        draw_diff_pane(r, 0, half, buf, a, changed, past_end);
+        mvaddch(r, half, '|');
+        draw_diff_pane(r, half + 1, cols - half - 1, diff_other, b, changed, past_end);
+    }
+    move((int)(cur - top), min((int)cx + 5, max(half - 1, 0)));
+}
+
+void Editor::draw_diff_pane(int row, int col, int width, const TextBuffer& lines, size_t line, bool changed,
+                            bool past_end) {
+    if (width <= 0) return;
+    move(row, col);
+    if (line == SIZE_MAX) {
+        if (past_end) {
+            addstr("~");
+        } else {
+            // The other side has lines here
+            attron(A_DIM);
+            hline('-', width);
+            attroff(A_DIM);
+        }
+        return;
+    }
+    char lnbuf[24];
+    snprintf(lnbuf, sizeof(lnbuf), "%4zu ", line + 1);
+    addnstr(lnbuf, width);
+    int room = width - 5;
+    if (room <= 0) return;
+    string_view text = lines[line];
+    if ((int)text.size() > room) text = text.substr(0, room);
+    if (changed) attron(A_REVERSE);
+    // an empty changed line still gets a mark
+    if (text.empty() && changed) addch(' ');
+    else addnstr(text.data(), (int)text.size());
+    if (changed) attroff(A_REVERSE);
+}
+
+void Editor::jump_to_hit(size_t i) {
+    GrepHit h = quickfix[i];
+    qf_pos = i;
+    push_jump();
+    if (h.path != filename) switch_buffer(add_buffer(h.path));
+    if (filename != h.path) return;
+    cy = min(h.line - 1, buf.size() - 1);
+    cx = h.col;
+    ensure_cursor_in_bounds();
+    set_status("(" + to_string(i + 1) + " of " + to_string(quickfix.size()) + ") " + h.path + ":" +
+               to_string(h.line) + ": " + h.text);
+}
+
+// Ctrl-] and :tag name. The index on disk answers at once and is brought
+// up to date in the background for the next lookup; a name it does not
+// have (or a first lookup with no index yet) waits for that update.
+void Editor::find_tag(const string& name) {
+    if (!tag_index) tag_index = TagIndex::open(work_dir());
+    bool found = go_to_tag(name);
+    refresh_tags();
+    if (found) return;
+    tag_wanted = name;
+    set_status(tag_index ? "tag: " + name + " not in the index, updating it..." : "tag: indexing sources under " + work_dir() + " ...");
+}
+
+bool Editor::go_to_tag(const string& name) {
+    vector<TagHit> hits;
+    if (tag_index) hits = tag_index->find(name);
+    if (hits.empty()) return false;
+    // Types first, so a class comes before its constructors
+    stable_partition(hits.begin(), hits.end(), [](const TagHit& h) { return strchr("csugnt", h.kind) != nullptr; });
+    tag_stack.push_back(TagJump{ filename, cy, cx });
+    tag_name = name;
+    tag_matches = move(hits);
+    jump_to_tag(0);
+    return true;
+}
+
+void Editor::refresh_tags() {
+    if (tags_running) return;
+    tags_running = true;
+    tags_token = make_shared<CancelToken>();
+    start_tag_index(jobs, work_dir(), tag_index, tags_token, [this](TagIndexPtr idx, const TagStats& st) {
+        tags_running = false;
+        if (idx) tag_index = idx;
+        if (tag_wanted.empty()) return;
+        string name;
+        name.swap(tag_wanted);
+        // Typing went on meanwhile: no jump from under it
+        if (mode != MODE_NORMAL) return;
+        if (!idx) {
+            set_status("tag: cannot write the index to " + tags_path(work_dir()));
+        } else if (!go_to_tag(name)) {
+            char msg[160];
+            snprintf(msg, sizeof(msg), "tag not found: %s (%llu symbols in %llu files, %llu read in %.0f ms)", name.c_str(),
+                     (unsigned long long)st.tags, (unsigned long long)st.files, (unsigned long long)st.parsed,
+                     st.secs * 1000);
+            set_status(msg);
+        }
+    });
+}
+
+void Editor::jump_to_tag(size_t i) {
+    TagHit h = tag_matches[i];
+    tag_pos = i;
+    push_jump();
+    if (h.path != filename) switch_buffer(add_buffer(h.path));
+    if (filename != h.path) return;
+    cy = min(h.line - 1, buf.size() - 1);
+    // On the name when it is still on that line
+    string_view text = buf[cy];
+    size_t at = text.find(tag_name);
+    while (at != string_view::npos && ((at > 0 && is_word(text[at - 1])) ||
+                                       (at + tag_name.size() < text.size() && is_word(text[at + tag_name.size()])))) {
+        at = text.find(tag_name, at + 1);
+    }
+    cx = at == string_view::npos ? 0 : at;
+    ensure_cursor_in_bounds();
+    set_status("tag " + to_string(i + 1) + " of " + to_string(tag_matches.size()) + ": " + tag_kind(h.kind) + " " + tag_name +
+               " at " + h.path + ":" + to_string(h.line));
+}
+
+// Ctrl-T: back to where the last tag jump left from
+void Editor::pop_tag() {
+    if (tag_stack.empty()) {
+        set_status("At the bottom of the tag stack");
+        return;
+    }
+    TagJump j = tag_stack.back();
+    tag_stack.pop_back();
+    if (j.file != filename) switch_buffer(add_buffer(j.file));
+    if (filename != j.file) return;
+    cy = min(j.line, buf.size() - 1);
+    cx = j.col;
+    ensure_cursor_in_bounds();
+}
+
+string Editor::prompt_command(const string& prompt, const string& initial) {
+    string line = initial;
+    {
+        ScreenLock lock(term);
+        curs_set(1); // Ensure cursor is visible
+    }
+    while (true) {
+        // A replayed command line is not shown
+        if (replay_depth == 0) {
+            ScreenLock lock(term);
+            int rows, cols;
+            getmaxyx(stdscr, rows, cols);
+            move(rows - 1, 0); // Move to status line
+            clrtoeol(); // Clear status line
+            // Keep the end of a long line in view
+            string shown = prompt + line;
+            if ((int)shown.size() > cols - 1) shown = shown.substr(shown.size() - (cols - 1));
+            addstr(shown.c_str());
+            refresh();
+        }
+
+        int ch = read_key();
+        if (ch == '\n' || ch == KEY_ENTER) break;
+        if (ch == 27) {
+            // ESC cancels the prompt
+            line.clear();
+            break;
+        }
+        if (ch == KEY_BACKSPACE) {
+            if (line.empty()) break;
+            line.pop_back();
+        } else if (ch >= 32 && ch < 256 && line.size() < 1023) {
+            line += (char)ch;
+        }
+    }
+    return line;
 }
 
 string Editor::prompt_input(const string& prompt) {
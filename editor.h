@@ -3,9 +3,49 @@
 
 #include <string>
 #include <vector>
+#include <deque>
 #include <iostream> // Needed for size_t
+#include <atomic>
+#include <future>
+#include <functional>
+#include "compress.h"
+#include "buffer.h"
+#include "scheduler.h"
+#include "input.h"
+#include "grep.h"
+#include "diff.h"
+#include "marks.h"
+#include "cursors.h"
+#include "complete.h"
+#include "fold.h"
+#include "tags.h"
+#include "server.h"
 
-enum Mode { MODE_NORMAL, MODE_INSERT, MODE_COMMAND, MODE_SEARCH };
+enum Mode { MODE_NORMAL, MODE_INSERT, MODE_COMMAND, MODE_SEARCH, MODE_VISUAL, MODE_VISUAL_LINE, MODE_VISUAL_BLOCK };
+
+// What the yank buffer holds: whole lines, a run of text that may span
+// lines (v), or a rectangle (Ctrl-V)
+enum YankKind { YANK_LINES, YANK_CHARS, YANK_BLOCK };
+
+// One entry of the buffer list. The active buffer lives in Editor's own
+// fields (buf, filename, cy, ...) and is swapped in and out on a switch,
+// which only moves tree roots around.
+struct BufferState {
+    std::string filename;
+    Compression file_comp;
+    bool mapped;
+    TextBuffer buf;
+    TextBuffer undo_buf;
+    size_t cy, cx, top_line, undo_cx, undo_cy;
+    uint64_t clean_version; // buf.version() when it last matched the file, 0 if never
+    SharedPos shared_pos;
+    MarkSet marks;
+    TextBuffer indexed;     // the snapshot word_index counts for this buffer
+    Folds folds;
+    bool loaded;            // false until first shown, and again after eviction
+    uint64_t disk_size;     // from stat when the buffer was added
+    uint64_t last_used;
+};
 
 class Editor {
 public:
@@ -14,11 +54,30 @@ public:
 
     // main entry
     void run(const std::string& filename = "");
+    // Files after the first are added to the buffer list without loading them
+    void run(const std::vector<std::string>& files);
+
+    // Server sessions: draw on a client's terminal and read its keys from
+    // key_fd instead of the process's own, sharing buffers with the other
+    // sessions. Paths typed in the session are taken from the client's
+    // directory cwd, and background work runs on pool's workers. Call
+    // before run(), which then returns on :q instead of exiting.
+    void attach(SharedBuffers* shared, Terminal* term, int key_fd, const std::string& cwd, Scheduler& pool);
+    // From other threads while run() is going: the client's window changed
+    // size, or keys to handle as if typed
+    void resize(int rows, int cols);
+    void feed(const std::string& keys);
 
 private:
-    // buffer
-    std::vector<std::string> buf;
+    // buffer (copies are O(1) immutable snapshots)
+    TextBuffer buf;
     std::string filename;
+    // compression of the file on disk, reused when saving it back
+    Compression file_comp;
+    // opened by mapping the file (see open_mapped)
+    bool mapped;
+    // buf.version() when buf last matched the file
+    uint64_t clean_version;
     // cursor (row, col)
     size_t cy;
     size_t cx;
@@ -32,31 +91,200 @@ private:
     // modes
     Mode mode;
 
-    // yank/cut buffer (lines)
-    std::vector<std::string> yank_buffer;
+    // yank/cut buffer (lines), shared by all buffers; shares nodes with the buffer it came from
+    TextBuffer yank_buffer;
+    YankKind yank_kind;
+
+    // visual modes select from (vis_y, vis_x) to the cursor; vis_eol is $ in a block
+    size_t vis_y, vis_x;
+    bool vis_eol;
+    // I, A and c on a block: what is typed on its first line goes to the
+    // other lines on Esc. block_line is that first line before the insert.
+    bool block_insert;
+    size_t block_from, block_to, block_col;
+    bool block_pad; // A pads short lines out to the column, I skips them
+    std::string block_line;
+    TextBuffer block_undo;
+    size_t block_undo_cx, block_undo_cy;
+    // typed ahead into the next command line (':' from a visual mode)
+    std::string cmd_prefill;
+
+    // macros: keys recorded into registers a-z by q and replayed by @
+    std::vector<int> macros[26];
+    int recording;  // register being recorded, -1 when not
+    std::vector<int> recorded; // stored into the register when recording stops
+    int last_macro; // for @@, -1 until the first replay
+    // keys still to replay; while replay_depth > 0 nothing is drawn and
+    // the replay as a whole is a single undo step
+    std::deque<int> pending_keys;
+    int replay_depth;
+    bool macro_stopped;
+    // count typed before a normal command (used by @)
+    size_t key_count;
 
     // single-level undo snapshot
-    std::vector<std::string> undo_buf;
+    TextBuffer undo_buf;
     size_t undo_cx, undo_cy;
 
+    // marks and jump list, anchored to lines of buf
+    MarkSet marks;
+
+    // folds of buf, worked out the first time a z command is used
+    Folds folds;
+
+    // extra cursors, sorted; (cy, cx) is the main one
+    std::vector<Cursor> cursors;
+    // last / pattern (Ctrl-N adds a cursor at its next match)
+    std::string last_search;
+
+    // insert-mode completion. word_index counts the words of every loaded
+    // buffer as of its `indexed` snapshot and catches up on the pool when idle.
+    WordIndexPtr word_index;
+    TextBuffer indexed;
+    bool index_running;
+    // the open popup: candidates[0] is the word as typed, comp_sel the one
+    // in the text, which starts at column comp_start
+    std::vector<std::string> candidates;
+    size_t comp_sel;
+    size_t comp_start;
+
+    // buffer list; buffers[cur_buf] is a placeholder while that buffer is active
+    std::vector<BufferState> buffers;
+    size_t cur_buf;
+    uint64_t use_clock;
+    // unmodified inactive buffers are unloaded (LRU first) above this many bytes
+    uint64_t mem_budget;
+
+    // background jobs; live_version is buf.version() as of the last handled key
+    Scheduler jobs;
+    std::atomic<uint64_t> live_version;
+
+    // background save of a buffer snapshot
+    std::future<void> save_job;
+    bool save_ok;
+    std::string save_msg;
+    std::string save_name;
+    Compression save_comp;
+    size_t save_buf;
+    uint64_t save_version;
+
+    // idle compaction of the line chunks (see TextBuffer::compacted)
+    std::chrono::steady_clock::time_point last_compact;
+    uint64_t compact_version;
+
+    // above mem_cap bytes resident, cold pages of mapped files and scratch
+    // chunks are given back to the kernel (see TextBuffer::page_out)
+    uint64_t mem_cap;
+    std::chrono::steady_clock::time_point last_pageout;
+    bool paging;
+
+    // search running on the pool (large buffers only)
+    CancelPtr search_token;
+
+    // quickfix list filled by :grep while the search runs
+    std::vector<GrepHit> quickfix;
+    size_t qf_pos;
+    bool grep_running;
+    CancelPtr grep_token;
+
+    // Ctrl-] and :tag: the symbol index of the working directory, brought
+    // up to date in the background on every lookup; the matches of the
+    // last lookup (:tn / :tp); where each tag jump left from (Ctrl-T)
+    TagIndexPtr tag_index;
+    bool tags_running;
+    CancelPtr tags_token;
+    std::string tag_wanted; // looked up again once the running update is done
+    std::string tag_name;
+    std::vector<TagHit> tag_matches;
+    size_t tag_pos;
+    struct TagJump {
+        std::string file;
+        size_t line, col;
+    };
+    std::vector<TagJump> tag_stack;
+
+    // :diff shows buf side by side with diff_other (the file on disk or
+    // another buffer); hunks are redone in the background after edits
+    bool diff_on;
+    std::string diff_name;
+    TextBuffer diff_other;
+    DiffSidePtr diff_a, diff_b;
+    std::vector<DiffHunk> hunks;
+    std::vector<size_t> hunk_rows; // screen row (counting filler rows) where each hunk starts
+    uint64_t diff_version;         // buf.version() the hunks are for
+    bool diff_running;
+    CancelPtr diff_token;
+
+    // server sessions (see server.h): the client's terminal, and the
+    // buffers the sessions share with where buf stands against them
+    SharedBuffers* shared;
+    Terminal* term; // null on the process's own terminal
+    int key_fd;
+    std::string cwd; // the client's directory; empty on the process's own terminal
+    SharedPos shared_pos;
+    bool quitting;
+
+    // keys arrive from the input thread; frames are drawn at most fps times a second
+    InputQueue input;
+    int fps;
+    // what the text rows on screen show, so a frame only repaints what changed
+    size_t drawn_top;
+    uint64_t drawn_version;
+    bool full_redraw;
+
     // helper limits
     const size_t MAX_LINE_LEN = 1024;
-    const size_t MAX_LINES = 10000;
+    const size_t MAX_LINES = 100000000;
+    const size_t SHIFT_WIDTH = 4;
+    const int MACRO_DEPTH = 100;
+    const size_t COMP_MAX = 50;
+    const size_t COMP_NEAR = 100; // lines either side of the cursor ranked first
 
     // core
     void init_ncurses();
     void end_ncurses();
     void open_file(const std::string& fname);
+    bool open_mapped(const std::string& fname);
     bool save_file(const std::string& fname);
+    bool restore_session(const std::string& fname);
+    std::string resolve_path(const std::string& path) const;
+    std::string work_dir() const;
+    bool write_session();
+    bool write_session(const BufferState& b, std::string& err);
+    bool poll_background();
+    void finish_save();
+    CancelPtr version_token();
+    void compact_when_idle();
+    void page_when_idle();
+    void start_diff(const std::string& arg);
+    void run_diff(const std::string& path, const TextBuffer& other);
+    void diff_when_idle();
+    void diff_off();
+    void index_when_idle();
+    void jump_hunk(bool forward);
+    size_t diff_row_of(size_t line) const;
+    void diff_row_at(size_t row, size_t& a, size_t& b, bool& changed) const;
+    void draw_diff(int avail, int cols);
+    void draw_diff_pane(int row, int col, int width, const TextBuffer& lines, size_t line, bool changed, bool past_end);
+    void show_memory();
     void draw();
     void draw_status();
     void draw_buffer();
+    void draw_row(int row, int cols, size_t line_no, std::string_view text);
+    void draw_popup(int avail, int cols);
+    void resize_terminal();
+    void quit();
+    void hangup();
+    void stop_jobs();
 
     // input handlers
+    int read_key();
+    void handle_key(int ch);
     void handle_normal(int ch);
     void handle_insert(int ch);
     void handle_command();
     void handle_search();
+    void handle_visual(int ch);
 
     // commands
     void cmd_i(); // insert before cursor
@@ -94,8 +322,81 @@ private:
     void center_view_on_cursor();
     ssize_t find_next(const std::string& pattern, size_t start_line, size_t start_col);
 
+    // buffer list
+    bool modified() const;
+    BufferState current_state() const;
+    void load_current();
+    size_t add_buffer(const std::string& fname);
+    void switch_buffer(size_t i);
+    void evict_buffers();
+    void list_buffers();
+
+    // buffers shared between server sessions
+    bool adopt_shared();
+    void publish_shared(bool force);
+    bool follow_shared();
+    bool merge_shared(const SharedBuffers::Entry& e);
+
+    // :grep and the quickfix list
+    void start_grep_cmd(const std::string& args);
+    void jump_to_hit(size_t i);
+
+    // tags
+    void find_tag(const std::string& name);
+    bool go_to_tag(const std::string& name);
+    void refresh_tags();
+    void jump_to_tag(size_t i);
+    void pop_tag();
+
+    // marks and jumps
+    void push_jump();
+    void go_to_mark(int c, bool exact);
+
+    // visual modes and the bulk edits behind them
+    bool in_visual() const;
+    void selection(size_t& y1, size_t& x1, size_t& y2, size_t& x2) const;
+    bool selected_cols(size_t line, size_t len, size_t& from, size_t& to) const;
+    void visual_yank();
+    void visual_delete(bool change);
+    void visual_shift(bool right);
+    void start_block_insert(size_t from, size_t to, size_t col, bool pad);
+    void finish_block_insert();
+    void paste_chars();
+    void paste_block();
+    void rewrite_lines(size_t from, size_t to, const std::function<void(size_t, std::string_view, std::string&)>& fn);
+    void replace_lines(size_t from, size_t to, const TextBuffer& lines);
+
+    // multiple cursors
+    bool handle_multi_normal(int ch);
+    void edit_all(CursorEdit op, const std::string& text);
+    void move_cursors(int ch);
+    void add_cursor_at_next();
+    void add_cursors(const std::string& pattern, size_t from, size_t to);
+    void cursors_on_lines(size_t from, size_t to, size_t col);
+
+    // insert-mode completion
+    void start_completion(bool forward);
+    void choose_completion(size_t i);
+
+    // folding
+    void fold_command(int c);
+    bool fold_when_idle();
+    bool folded() const;
+    void lines_at_cursor(size_t& first, size_t& n);
+    size_t row_of(size_t line) const;
+    size_t line_at(size_t row) const;
+
+    // macros and :normal
+    void play_macro(int reg, size_t count);
+    void run_keys(const std::vector<int>& keys);
+    void normal_lines(const std::string& keys, size_t from, size_t to);
+
+    // line ranges, :sort, :uniq and :!
+    bool parse_range(std::string& cmd, size_t& from, size_t& to, bool& given);
+    void transform_lines(const std::string& cmd, size_t from, size_t to);
+
     // command-line helpers
-    std::string prompt_command(const std::string& prompt);
+    std::string prompt_command(const std::string& prompt, const std::string& initial = "");
     std::string prompt_input(const std::string& prompt);
 };
 
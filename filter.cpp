@@ -0,0 +1,251 @@
+#include "filter.h"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+
+extern char** environ;
+
+namespace {
+
+// fewest lines worth a sort job of their own
+const size_t SORT_PART = 64 * 1024;
+// bytes written to / read from the filter command at a time
+const size_t PIPE_BLOCK = 64 * 1024;
+
+// Runs fn(0) .. fn(n - 1) on the pool and waits for all of them
+void run_parallel(Scheduler& jobs, size_t n, const function<void(size_t)>& fn) {
+    vector<future<void>> done;
+    for (size_t k = 0; k < n; ++k) {
+        auto p = make_shared<promise<void>>();
+        done.push_back(p->get_future());
+        jobs.submit([&fn, k, p](const CancelToken&) {
+            fn(k);
+            p->set_value();
+        }, PRIO_VIEWPORT);
+    }
+    for (future<void>& f : done) f.wait();
+}
+
+// Stable: each part is stable_sort'ed on its own, then neighbouring runs
+// are merged pairwise (ties taken from the left run) until one is left
+template <class T, class Less>
+void parallel_sort(Scheduler& jobs, vector<T>& v, Less less) {
+    size_t parts = max<size_t>(1, min<size_t>(v.size() / SORT_PART + 1, 4 * jobs.stats().workers));
+    vector<size_t> cuts(parts + 1);
+    for (size_t k = 0; k <= parts; ++k) cuts[k] = v.size() * k / parts;
+    run_parallel(jobs, parts, [&](size_t k) { stable_sort(v.begin() + cuts[k], v.begin() + cuts[k + 1], less); });
+    vector<T> tmp(v.size());
+    while (cuts.size() > 2) {
+        size_t runs = cuts.size() - 1;
+        run_parallel(jobs, (runs + 1) / 2, [&](size_t k) {
+            size_t lo = cuts[2 * k], mid = cuts[min(2 * k + 1, runs)], hi = cuts[min(2 * k + 2, runs)];
+            merge(v.begin() + lo, v.begin() + mid, v.begin() + mid, v.begin() + hi, tmp.begin() + lo, less);
+        });
+        vector<size_t> next;
+        for (size_t k = 0; k < runs; k += 2) next.push_back(cuts[k]);
+        next.push_back(cuts[runs]);
+        cuts.swap(next);
+        v.swap(tmp);
+    }
+}
+
+// A line with the first decimal number in it (one leading '-' included),
+// saturated to the int64 range
+struct NumLine {
+    bool has;
+    int64_t num;
+    string_view text;
+};
+
+NumLine number_of(string_view s) {
+    NumLine n = { false, 0, s };
+    size_t i = 0;
+    while (i < s.size() && (s[i] < '0' || s[i] > '9')) i++;
+    if (i == s.size()) return n;
+    bool neg = i > 0 && s[i - 1] == '-';
+    uint64_t v = 0;
+    for (; i < s.size() && s[i] >= '0' && s[i] <= '9'; ++i) {
+        v = v > (UINT64_MAX - 9) / 10 ? UINT64_MAX : v * 10 + (s[i] - '0');
+    }
+    n.has = true;
+    if (neg) n.num = v > (uint64_t)INT64_MAX ? INT64_MIN : -(int64_t)v;
+    else n.num = v > (uint64_t)INT64_MAX ? INT64_MAX : (int64_t)v;
+    return n;
+}
+
+// A line with its first 8 bytes as a big-endian number, which settles
+// most comparisons without touching the text itself
+struct LexLine {
+    uint64_t prefix;
+    string_view text;
+};
+
+LexLine prefix_of(string_view s) {
+    uint64_t p = 0;
+    for (size_t i = 0; i < 8; ++i) p = p << 8 | (i < s.size() ? (unsigned char)s[i] : 0);
+    return LexLine{ p, s };
+}
+
+string_view view_of(const LexLine& l) { return l.text; }
+string_view view_of(const NumLine& n) { return n.text; }
+
+template <class T, class Less>
+vector<string_view> sorted_views(Scheduler& jobs, vector<T>& v, const SortOptions& opt, Less less) {
+    // Reversed by swapping the operands, so equal lines keep their order
+    auto cmp = [&](const T& a, const T& b) { return opt.reverse ? less(b, a) : less(a, b); };
+    parallel_sort(jobs, v, cmp);
+    vector<string_view> out;
+    out.reserve(v.size());
+    for (size_t i = 0; i < v.size(); ++i) {
+        if (opt.unique && i > 0 && !cmp(v[i - 1], v[i])) continue;
+        out.push_back(view_of(v[i]));
+    }
+    return out;
+}
+
+bool write_all(int fd, const char* p, size_t n) {
+    while (n > 0) {
+        ssize_t k = write(fd, p, n);
+        if (k < 0 && errno == EINTR) continue;
+        if (k <= 0) return false;
+        p += k;
+        n -= k;
+    }
+    return true;
+}
+
+} // namespace
+
+TextBuffer sort_lines(Scheduler& jobs, const TextBuffer& lines, size_t from, size_t to, const SortOptions& opt) {
+    vector<string_view> out;
+    if (opt.numeric) {
+        vector<NumLine> v;
+        v.reserve(to - from);
+        lines.for_each(from, to, [&](size_t, string_view s) {
+            v.push_back(number_of(s));
+            return true;
+        });
+        out = sorted_views(jobs, v, opt, [](const NumLine& a, const NumLine& b) {
+            return a.has != b.has ? b.has : a.num < b.num;
+        });
+    } else {
+        vector<LexLine> v;
+        v.reserve(to - from);
+        lines.for_each(from, to, [&](size_t, string_view s) {
+            v.push_back(prefix_of(s));
+            return true;
+        });
+        out = sorted_views(jobs, v, opt, [](const LexLine& a, const LexLine& b) {
+            return a.prefix != b.prefix ? a.prefix < b.prefix : a.text < b.text;
+        });
+    }
+    return lines.share_lines(out);
+}
+
+TextBuffer uniq_lines(const TextBuffer& lines, size_t from, size_t to) {
+    vector<string_view> out;
+    lines.for_each(from, to, [&](size_t, string_view s) {
+        if (out.empty() || out.back() != s) out.push_back(s);
+        return true;
+    });
+    return lines.share_lines(out);
+}
+
+bool filter_lines(const TextBuffer& lines, size_t from, size_t to, const string& cmd, const string& dir,
+                  TextBuffer& out, int& status, string& err) {
+    int in[2], res[2];
+    if (pipe2(in, O_CLOEXEC) != 0) {
+        err = strerror(errno);
+        return false;
+    }
+    if (pipe2(res, O_CLOEXEC) != 0) {
+        err = strerror(errno);
+        close(in[0]);
+        close(in[1]);
+        return false;
+    }
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_adddup2(&fa, in[0], 0);
+    posix_spawn_file_actions_adddup2(&fa, res[1], 1);
+    posix_spawn_file_actions_adddup2(&fa, res[1], 2);
+    if (!dir.empty()) posix_spawn_file_actions_addchdir_np(&fa, dir.c_str());
+    const char* argv[] = { "/bin/sh", "-c", cmd.c_str(), nullptr };
+    pid_t pid;
+    int rc = posix_spawn(&pid, "/bin/sh", &fa, nullptr, (char* const*)argv, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    close(in[0]);
+    close(res[1]);
+    if (rc != 0) {
+        err = strerror(rc);
+        close(in[1]);
+        close(res[0]);
+        return false;
+    }
+    // Feed the command from a thread of its own while its output is read
+    // here, so neither side waits for the other to finish
+    int wfd = in[1];
+    thread writer([&lines, from, to, wfd]() {
+        // A command that stops reading early makes write fail with EPIPE;
+        // the signal stays pending on this thread and dies with it
+        sigset_t pipe_sig;
+        sigemptyset(&pipe_sig);
+        sigaddset(&pipe_sig, SIGPIPE);
+        pthread_sigmask(SIG_BLOCK, &pipe_sig, nullptr);
+        string block;
+        bool ok = true;
+        lines.for_each(from, to, [&](size_t, string_view s) {
+            block.append(s.data(), s.size());
+            block.push_back('\n');
+            if (block.size() >= PIPE_BLOCK) {
+                ok = write_all(wfd, block.data(), block.size());
+                block.clear();
+            }
+            return ok;
+        });
+        if (ok && !block.empty()) write_all(wfd, block.data(), block.size());
+        close(wfd);
+    });
+    TextBuffer::Builder b;
+    vector<char> chunk(PIPE_BLOCK);
+    string partial;
+    for (;;) {
+        ssize_t k = read(res[0], chunk.data(), chunk.size());
+        if (k < 0 && errno == EINTR) continue;
+        if (k <= 0) break;
+        const char* p = chunk.data();
+        const char* end = p + k;
+        while (const char* nl = (const char*)memchr(p, '\n', end - p)) {
+            if (partial.empty()) {
+                b.add(string_view(p, nl - p));
+            } else {
+                partial.append(p, nl - p);
+                b.add(partial);
+                partial.clear();
+            }
+            p = nl + 1;
+        }
+        partial.append(p, end - p);
+    }
+    if (!partial.empty()) b.add(partial);
+    close(res[0]);
+    writer.join();
+    int st = 0;
+    while (waitpid(pid, &st, 0) < 0 && errno == EINTR) {}
+    status = WIFEXITED(st) ? WEXITSTATUS(st) : WIFSIGNALED(st) ? 128 + WTERMSIG(st) : 0;
+    out = b.finish();
+    return true;
+}
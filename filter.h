@@ -0,0 +1,35 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <string>
+#include <cstddef>
+#include "buffer.h"
+#include "scheduler.h"
+
+// Whole-range line transformations behind :sort, :uniq and :!. Each one
+// returns the new lines for [from, to) of `lines`; the editor swaps them
+// in as a single edit.
+
+struct SortOptions {
+    bool numeric; // by the first decimal number in the line
+    bool unique;  // keep only the first of lines that compare equal
+    bool reverse;
+};
+
+// Stable sort split over the job pool and merged back together. Without
+// `numeric` lines compare as bytes; with it, lines without a number go
+// first in their old order. The result shares the text of `lines`.
+TextBuffer sort_lines(Scheduler& jobs, const TextBuffer& lines, size_t from, size_t to, const SortOptions& opt);
+
+// Drops every line that equals the one before it, like uniq(1).
+TextBuffer uniq_lines(const TextBuffer& lines, size_t from, size_t to);
+
+// Streams the lines through `/bin/sh -c cmd` over pipes, writing and
+// reading at the same time; what it prints (stderr included) becomes
+// `out`. The command runs in dir (ours when empty). False with err set
+// when the command cannot be started, otherwise status is its exit status
+// (or 128 + signal).
+bool filter_lines(const TextBuffer& lines, size_t from, size_t to, const std::string& cmd, const std::string& dir,
+                  TextBuffer& out, int& status, std::string& err);
+
+#endif // FILTER_H
@@ -0,0 +1,291 @@
+#include "fold.h"
+#include <algorithm>
+
+using namespace std;
+
+LineShape shape_of(string_view s, bool in_comment) {
+    LineShape sh = { -1, 0, 0, in_comment };
+    size_t i = 0;
+    int32_t col = 0;
+    for (; i < s.size() && (s[i] == ' ' || s[i] == '\t'); ++i) col = s[i] == '\t' ? (col / 8 + 1) * 8 : col + 1;
+    if (i == s.size()) return sh;
+    sh.indent = col;
+    // Braces in strings, character literals and comments do not count
+    int depth = 0, low = 0;
+    char quote = 0;
+    bool comment = in_comment;
+    for (; i < s.size(); ++i) {
+        char c = s[i];
+        if (comment) {
+            if (c == '*' && i + 1 < s.size() && s[i + 1] == '/') {
+                comment = false;
+                i++;
+            }
+        } else if (quote) {
+            if (c == '\\') i++;
+            else if (c == quote) quote = 0;
+        } else if (c == '"' || c == '\'') {
+            quote = c;
+        } else if (c == '/' && i + 1 < s.size() && s[i + 1] == '*') {
+            comment = true;
+            i++;
+        } else if (c == '/' && i + 1 < s.size() && s[i + 1] == '/') {
+            break;
+        } else if (c == '{' || c == '[') {
+            depth++;
+        } else if (c == '}' || c == ']') {
+            low = min(low, --depth);
+        }
+    }
+    sh.comment = comment;
+    sh.net = (int16_t)max(-32768, min(depth, 32767));
+    sh.low = (int16_t)max(-32768, low);
+    return sh;
+}
+
+Folds::Folds() : enabled(false), how(FOLD_INDENT), dirty(false) {}
+
+void Folds::set_method(const TextBuffer& buf, FoldMethod m) {
+    how = m;
+    if (!enabled) {
+        enabled = true;
+        lines = buf;
+        shapes.clear();
+        shapes.reserve(buf.size());
+        bool comment = false;
+        buf.for_each(0, buf.size(), [&](size_t, string_view s) {
+            shapes.push_back(shape_of(s, comment));
+            comment = shapes.back().comment;
+            return true;
+        });
+    } else {
+        sync(buf);
+    }
+    rebuild();
+}
+
+void Folds::sync(const TextBuffer& buf) {
+    if (!enabled || buf.version() == lines.version()) return;
+    size_t head, tail;
+    lines.common_ends(buf, head, tail);
+    size_t old_end = lines.size() - tail, new_end = buf.size() - tail;
+    vector<LineShape> fresh;
+    fresh.reserve(new_end - head);
+    bool comment = head > 0 && shapes[head - 1].comment;
+    buf.for_each(head, new_end, [&](size_t, string_view s) {
+        fresh.push_back(shape_of(s, comment));
+        comment = fresh.back().comment;
+        return true;
+    });
+    // A comment opened or closed by the edit changes how the unchanged
+    // lines after it read, until both agree again on where comments are
+    bool was = old_end > 0 && shapes[old_end - 1].comment;
+    while (comment != was && new_end < buf.size()) {
+        was = shapes[old_end].comment;
+        fresh.push_back(shape_of(buf[new_end], comment));
+        comment = fresh.back().comment;
+        old_end++;
+        new_end++;
+    }
+    lines = buf;
+    // Typing that leaves indentation and braces alone changes no fold
+    if (old_end - head == fresh.size() && equal(fresh.begin(), fresh.end(), shapes.begin() + head)) return;
+    shapes.erase(shapes.begin() + head, shapes.begin() + old_end);
+    shapes.insert(shapes.begin() + head, fresh.begin(), fresh.end());
+    shift(head, old_end, new_end);
+    dirty = true;
+}
+
+// Lines [head, old_end) became [head, new_end): folds below move, folds
+// around the change stretch or shrink with it, and folds that started on
+// lines that are gone go too
+void Folds::shift(size_t head, size_t old_end, size_t new_end) {
+    size_t kept = 0;
+    for (Fold f : folds) {
+        if (f.start >= old_end) {
+            f.start = f.start - old_end + new_end;
+        } else if (f.start >= new_end) {
+            continue;
+        }
+        if (f.end >= old_end) f.end = f.end - old_end + new_end;
+        else if (f.end >= head) f.end = new_end > head ? min(f.end, new_end - 1) : head - 1;
+        if (f.end > f.start) folds[kept++] = f;
+    }
+    folds.resize(kept);
+    link();
+    index();
+}
+
+void Folds::rebuild() {
+    vector<Fold> old;
+    old.swap(folds);
+    folds.reserve(old.size());
+    dirty = false;
+    // A fold gets its slot when it opens, so they come out in order of
+    // start with the enclosing ones first; ones that end where they start
+    // are dropped at the end
+    struct Open {
+        size_t slot;
+        int64_t level;
+    };
+    vector<Open> stack;
+    auto open = [&](size_t line, int64_t level) {
+        stack.push_back(Open{ folds.size(), level });
+        folds.push_back(Fold{ line, line, SIZE_MAX, false });
+    };
+    auto close = [&](size_t end) {
+        folds[stack.back().slot].end = end;
+        stack.pop_back();
+    };
+    if (how == FOLD_INDENT) {
+        // A line folds the more indented lines after it, up to the last
+        // of them before one that is indented no more than it
+        size_t last = 0;
+        for (size_t i = 0; i < shapes.size(); ++i) {
+            int32_t indent = shapes[i].indent;
+            if (indent < 0) continue;
+            while (!stack.empty() && stack.back().level >= indent) close(last);
+            open(i, indent);
+            last = i;
+        }
+        while (!stack.empty()) close(last);
+    } else {
+        // A line that opens braces folds down to the line that closes
+        // them; on "} else {" the fold before ends the line above
+        int64_t depth = 0;
+        for (size_t i = 0; i < shapes.size(); ++i) {
+            int64_t low = depth + shapes[i].low, after = depth + shapes[i].net;
+            bool reopens = after > low;
+            while (!stack.empty() && stack.back().level > low) close(reopens ? i - 1 : i);
+            if (reopens) open(i, after);
+            depth = after;
+        }
+        while (!stack.empty()) close(shapes.size() - 1);
+    }
+    folds.erase(remove_if(folds.begin(), folds.end(), [](const Fold& f) { return f.end <= f.start; }), folds.end());
+    link();
+    // Closed folds stay closed when they still start on the same line
+    size_t j = 0;
+    for (Fold& f : folds) {
+        while (j < old.size() && old[j].start < f.start) j++;
+        for (size_t k = j; k < old.size() && old[k].start == f.start; ++k) f.closed = f.closed || old[k].closed;
+    }
+    index();
+}
+
+// Parents, with every fold cut to fit inside its parent
+void Folds::link() {
+    vector<size_t> stack;
+    for (size_t k = 0; k < folds.size(); ++k) {
+        Fold& f = folds[k];
+        while (!stack.empty() && folds[stack.back()].end < f.start) stack.pop_back();
+        f.parent = stack.empty() ? SIZE_MAX : stack.back();
+        if (!stack.empty()) f.end = min(f.end, folds[stack.back()].end);
+        stack.push_back(k);
+    }
+}
+
+// Runs of hidden lines: one per closed fold not inside another closed one
+void Folds::index() {
+    hidden.clear();
+    size_t total = 0;
+    for (size_t k = 0; k < folds.size(); ++k) {
+        const Fold& f = folds[k];
+        if (!f.closed || f.end <= f.start || (!hidden.empty() && f.start <= hidden.back().last)) continue;
+        hidden.push_back(Hidden{ f.start + 1, f.end, total, k });
+        total += f.end - f.start;
+    }
+}
+
+size_t Folds::innermost(size_t line) const {
+    auto it = upper_bound(folds.begin(), folds.end(), line, [](size_t l, const Fold& f) { return l < f.start; });
+    if (it == folds.begin()) return SIZE_MAX;
+    size_t k = it - folds.begin() - 1;
+    while (k != SIZE_MAX && folds[k].end < line) k = folds[k].parent;
+    return k;
+}
+
+size_t Folds::outermost_closed(size_t line) const {
+    size_t found = SIZE_MAX;
+    for (size_t k = innermost(line); k != SIZE_MAX; k = folds[k].parent) {
+        if (folds[k].closed) found = k;
+    }
+    return found;
+}
+
+bool Folds::close(size_t line) {
+    // On a closed fold, zc closes the one around it
+    size_t k = outermost_closed(line);
+    k = k != SIZE_MAX ? folds[k].parent : innermost(line);
+    if (k == SIZE_MAX) return false;
+    folds[k].closed = true;
+    index();
+    return true;
+}
+
+bool Folds::open(size_t line) {
+    size_t k = outermost_closed(line);
+    if (k == SIZE_MAX) return false;
+    folds[k].closed = false;
+    index();
+    return true;
+}
+
+bool Folds::toggle(size_t line) {
+    return outermost_closed(line) != SIZE_MAX ? open(line) : close(line);
+}
+
+void Folds::open_all() {
+    for (Fold& f : folds) f.closed = false;
+    index();
+}
+
+void Folds::close_all() {
+    for (Fold& f : folds) f.closed = true;
+    index();
+}
+
+void Folds::reveal(size_t line) {
+    if (hidden.empty()) return;
+    bool changed = false;
+    for (size_t k = innermost(line); k != SIZE_MAX; k = folds[k].parent) {
+        changed = changed || folds[k].closed;
+        folds[k].closed = false;
+    }
+    if (changed) index();
+}
+
+size_t Folds::shown(size_t line) const {
+    auto it = upper_bound(hidden.begin(), hidden.end(), line, [](size_t l, const Hidden& h) { return l < h.first; });
+    if (it != hidden.begin() && line <= (it - 1)->last) return (it - 1)->first - 1;
+    return line;
+}
+
+size_t Folds::row_of(size_t line) const {
+    line = shown(line);
+    auto it = upper_bound(hidden.begin(), hidden.end(), line, [](size_t l, const Hidden& h) { return l < h.first; });
+    if (it == hidden.begin()) return line;
+    --it;
+    return line - it->before - (it->last - it->first + 1);
+}
+
+size_t Folds::line_at(size_t row) const {
+    // first - before is the row just below each run's fold line, which
+    // only grows along the runs
+    auto it = partition_point(hidden.begin(), hidden.end(), [&](const Hidden& h) { return h.first - h.before <= row; });
+    if (it == hidden.begin()) return row;
+    --it;
+    return row + it->before + (it->last - it->first + 1);
+}
+
+size_t Folds::rows(size_t n) const {
+    if (hidden.empty()) return n;
+    const Hidden& h = hidden.back();
+    return n - h.before - (h.last - h.first + 1);
+}
+
+const Fold* Folds::closed_at(size_t line) const {
+    auto it = lower_bound(hidden.begin(), hidden.end(), line + 1, [](const Hidden& h, size_t l) { return h.first < l; });
+    if (it == hidden.end() || it->first != line + 1) return nullptr;
+    return &folds[it->fold];
+}
@@ -0,0 +1,102 @@
+#ifndef FOLD_H
+#define FOLD_H
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include "buffer.h"
+
+// Folding. A fold is a range of lines whose first line stays on screen
+// while it is closed and stands for the rest. Folds come from indentation
+// (a line and the more indented lines after it) or from braces (a line
+// that opens { or [ down to the line that closes it).
+//
+// What decides folds is kept per line (a LineShape), so after an edit only
+// the lines that changed are looked at again: the fold list is shifted
+// right away and rebuilt from the shapes once typing pauses. Closed folds
+// are indexed as sorted runs of hidden lines with a running count, which
+// maps buffer lines to screen rows and back in O(log n).
+
+enum FoldMethod { FOLD_INDENT, FOLD_BRACES };
+
+struct LineShape {
+    int32_t indent; // columns of leading white space, -1 for a blank line
+    // brace depth at the end of the line and the lowest on it, both
+    // relative to its start
+    int16_t net, low;
+    bool comment; // ends inside a /* */ comment
+    bool operator==(const LineShape& o) const {
+        return indent == o.indent && net == o.net && low == o.low && comment == o.comment;
+    }
+    bool operator!=(const LineShape& o) const { return !(*this == o); }
+};
+
+// in_comment: the line starts inside a /* */ comment (the line before ended in one)
+LineShape shape_of(std::string_view line, bool in_comment = false);
+
+struct Fold {
+    size_t start, end; // lines; start + 1 to end are hidden when closed
+    size_t parent;     // enclosing fold, SIZE_MAX at the top
+    bool closed;
+};
+
+class Folds {
+public:
+    Folds();
+
+    // Nothing is computed until the first fold command turns folding on
+    bool on() const { return enabled; }
+    FoldMethod method() const { return how; }
+    void set_method(const TextBuffer& buf, FoldMethod m);
+
+    // Brings the shapes up to date with buf; folds are shifted over the
+    // lines that changed and rebuilt later (see rebuild)
+    void sync(const TextBuffer& buf);
+    bool stale() const { return dirty; }
+    // Folds from the shapes again; closed ones that still start on the
+    // same line stay closed
+    void rebuild();
+
+    // zc, zo, za, zR, zM; false when there is no fold at line to act on
+    bool close(size_t line);
+    bool open(size_t line);
+    bool toggle(size_t line);
+    void open_all();
+    void close_all();
+    // Opens the closed folds line is hidden in, so it can be seen
+    void reveal(size_t line);
+
+    size_t count() const { return folds.size(); }
+    bool any_closed() const { return !hidden.empty(); }
+    // The line shown for line: the start of the closed fold it is hidden in, or itself
+    size_t shown(size_t line) const;
+    // Screen rows from the top of the buffer and back (line_at gives the shown line)
+    size_t row_of(size_t line) const;
+    size_t line_at(size_t row) const;
+    // Rows the whole buffer of `lines` lines takes
+    size_t rows(size_t lines) const;
+    // The closed fold shown at line, or nullptr
+    const Fold* closed_at(size_t line) const;
+
+private:
+    bool enabled;
+    FoldMethod how;
+    bool dirty;
+    TextBuffer lines;             // the snapshot the shapes are for
+    std::vector<LineShape> shapes;
+    std::vector<Fold> folds;      // by start, enclosing folds before the ones inside them
+    // runs of lines hidden by closed folds, sorted; before = lines hidden
+    // by earlier runs, fold = the closed fold that hides them
+    struct Hidden {
+        size_t first, last, before, fold;
+    };
+    std::vector<Hidden> hidden;
+
+    void shift(size_t head, size_t old_end, size_t new_end);
+    void link();
+    void index();
+    size_t innermost(size_t line) const;
+    size_t outermost_closed(size_t line) const;
+};
+
+#endif // FOLD_H
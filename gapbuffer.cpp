@@ -0,0 +1,114 @@
+#include "gapbuffer.h"
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+using namespace std;
+
+void gb_init(GapBuffer* gb, size_t capacity) {
+    if (capacity < 64) capacity = 64;
+    gb->data = (char*)malloc(capacity);
+    gb->capacity = gb->data ? capacity : 0;
+    gb->gap_start = 0;
+    gb->gap_end = gb->capacity;
+    gb->lines = 1;
+}
+
+void gb_free(GapBuffer* gb) {
+    free(gb->data);
+    gb->data = NULL;
+    gb->capacity = gb->gap_start = gb->gap_end = 0;
+    gb->lines = 1;
+}
+
+void gb_clear(GapBuffer* gb) {
+    gb->gap_start = 0;
+    gb->gap_end = gb->capacity;
+    gb->lines = 1;
+}
+
+size_t gb_size(const GapBuffer* gb) {
+    return gb->capacity - (gb->gap_end - gb->gap_start);
+}
+
+char gb_at(const GapBuffer* gb, size_t pos) {
+    if (pos < gb->gap_start) return gb->data[pos];
+    return gb->data[pos + (gb->gap_end - gb->gap_start)];
+}
+
+size_t gb_cursor(const GapBuffer* gb) {
+    return gb->gap_start;
+}
+
+void gb_move_to(GapBuffer* gb, size_t pos) {
+    pos = min(pos, gb_size(gb));
+    if (pos < gb->gap_start) {
+        size_t n = gb->gap_start - pos;
+        memmove(gb->data + gb->gap_end - n, gb->data + pos, n);
+        gb->gap_start -= n;
+        gb->gap_end -= n;
+    } else if (pos > gb->gap_start) {
+        size_t n = pos - gb->gap_start;
+        memmove(gb->data + gb->gap_start, gb->data + gb->gap_end, n);
+        gb->gap_start += n;
+        gb->gap_end += n;
+    }
+}
+
+static bool gb_grow(GapBuffer* gb) {
+    size_t new_capacity = gb->capacity ? gb->capacity * 2 : 64;
+    char* data = (char*)realloc(gb->data, new_capacity);
+    if (!data) return false;
+    size_t tail = gb->capacity - gb->gap_end;
+    memmove(data + new_capacity - tail, data + gb->gap_end, tail);
+    gb->data = data;
+    gb->gap_end = new_capacity - tail;
+    gb->capacity = new_capacity;
+    return true;
+}
+
+bool gb_insert(GapBuffer* gb, char c) {
+    if (gb->gap_start == gb->gap_end && !gb_grow(gb)) return false;
+    gb->data[gb->gap_start++] = c;
+    if (c == '\n') gb->lines++;
+    return true;
+}
+
+bool gb_delete_before(GapBuffer* gb) {
+    if (gb->gap_start == 0) return false;
+    gb->gap_start--;
+    if (gb->data[gb->gap_start] == '\n') gb->lines--;
+    return true;
+}
+
+bool gb_delete_after(GapBuffer* gb) {
+    if (gb->gap_end == gb->capacity) return false;
+    if (gb->data[gb->gap_end] == '\n') gb->lines--;
+    gb->gap_end++;
+    return true;
+}
+
+size_t gb_line_start(const GapBuffer* gb, size_t pos) {
+    while (pos > 0 && gb_at(gb, pos - 1) != '\n') pos--;
+    return pos;
+}
+
+size_t gb_line_end(const GapBuffer* gb, size_t pos) {
+    size_t size = gb_size(gb);
+    while (pos < size && gb_at(gb, pos) != '\n') pos++;
+    return pos;
+}
+
+size_t gb_copy(const GapBuffer* gb, size_t pos, char* out, size_t len) {
+    size_t size = gb_size(gb);
+    if (pos >= size) return 0;
+    len = min(len, size - pos);
+    size_t done = 0;
+    if (pos < gb->gap_start) {
+        done = min(len, gb->gap_start - pos);
+        memcpy(out, gb->data + pos, done);
+    }
+    if (done < len) {
+        memcpy(out + done, gb->data + gb->gap_end + (pos + done - gb->gap_start), len - done);
+    }
+    return len;
+}
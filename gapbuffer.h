@@ -0,0 +1,26 @@
+#ifndef GAPBUFFER_H
+#define GAPBUFFER_H
+#include <cstddef>
+// Text is one byte sequence with '\n' between lines. The gap sits at the
+// cursor, so inserting or deleting next to the cursor never moves the rest.
+struct GapBuffer {
+    char* data;
+    size_t capacity;
+    size_t gap_start;
+    size_t gap_end;
+    size_t lines;
+};
+void gb_init(GapBuffer* gb, size_t capacity);
+void gb_free(GapBuffer* gb);
+void gb_clear(GapBuffer* gb);
+size_t gb_size(const GapBuffer* gb);
+char gb_at(const GapBuffer* gb, size_t pos);
+size_t gb_cursor(const GapBuffer* gb);
+void gb_move_to(GapBuffer* gb, size_t pos);
+bool gb_insert(GapBuffer* gb, char c);
+bool gb_delete_before(GapBuffer* gb);
+bool gb_delete_after(GapBuffer* gb);
+size_t gb_line_start(const GapBuffer* gb, size_t pos);
+size_t gb_line_end(const GapBuffer* gb, size_t pos);
+size_t gb_copy(const GapBuffer* gb, size_t pos, char* out, size_t len);
+#endif
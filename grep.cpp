@@ -0,0 +1,326 @@
+#include "grep.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+// One .gitignore line
+struct IgnoreRule {
+    string pattern;
+    string base; // directory holding the .gitignore, relative to the root ("" or "dir/")
+    bool negate, dir_only, anchored;
+};
+
+// The rules in effect for a directory: its parent's plus its own .gitignore
+struct IgnoreRules {
+    shared_ptr<const IgnoreRules> parent;
+    vector<IgnoreRule> rules;
+};
+
+namespace {
+
+// files handed to one search job
+const size_t BATCH_FILES = 32;
+// bytes looked at to decide a file is binary
+const size_t BINARY_PROBE = 8192;
+// matched lines are clipped to this many bytes in the quickfix list
+const size_t MAX_HIT_TEXT = 256;
+
+bool glob_match(const string& pattern, const string& path, bool anchored) {
+    int flags = anchored ? FNM_PATHNAME : 0;
+    // fnmatch has no "**"; "**/x" also matches x at any depth, "x/**" anything below x
+    if (pattern.rfind("**/", 0) == 0) {
+        string rest = pattern.substr(3);
+        if (fnmatch(rest.c_str(), path.c_str(), flags) == 0) return true;
+        for (size_t p = path.find('/'); p != string::npos; p = path.find('/', p + 1)) {
+            if (fnmatch(rest.c_str(), path.c_str() + p + 1, flags) == 0) return true;
+        }
+        return false;
+    }
+    if (pattern.size() > 3 && pattern.compare(pattern.size() - 3, 3, "/**") == 0) {
+        string head = pattern.substr(0, pattern.size() - 3);
+        return path.size() > head.size() && path[head.size()] == '/' &&
+               fnmatch(head.c_str(), path.substr(0, head.size()).c_str(), flags) == 0;
+    }
+    return fnmatch(pattern.c_str(), path.c_str(), flags) == 0;
+}
+
+// Decides a rule for one path; returns -1 (no opinion), 0 (keep) or 1 (ignore)
+int apply_rules(const IgnoreRules* r, const string& rel, const string& name, bool is_dir) {
+    int verdict = r->parent ? apply_rules(r->parent.get(), rel, name, is_dir) : -1;
+    for (const IgnoreRule& rule : r->rules) {
+        if (rule.dir_only && !is_dir) continue;
+        if (rel.compare(0, rule.base.size(), rule.base) != 0) continue;
+        bool hit = rule.anchored ? glob_match(rule.pattern, rel.substr(rule.base.size()), true)
+                                 : glob_match(rule.pattern, name, false);
+        if (hit) verdict = rule.negate ? 0 : 1;
+    }
+    return verdict;
+}
+
+// State shared by all the jobs of one walk_tree
+struct Walk {
+    Scheduler* jobs;
+    CancelPtr token;
+    TreeWalk cb;
+    atomic<size_t> outstanding; // jobs not finished yet
+};
+typedef shared_ptr<Walk> WalkPtr;
+
+// State shared by all the batches of one :grep
+struct GrepRun {
+    Scheduler* jobs;
+    string pattern;
+    CancelPtr token;
+    function<void(vector<GrepHit>&)> on_hits;
+    function<void(const GrepStats&)> on_done;
+    chrono::steady_clock::time_point started;
+    atomic<uint64_t> files, binary, bytes, hits;
+};
+typedef shared_ptr<GrepRun> RunPtr;
+
+void search_buffer(const GrepRun& run, const string& path, const char* data, size_t n, vector<GrepHit>& out) {
+    const char* end = data + n;
+    const char* p = data;
+    const char* counted = data;
+    size_t line = 1;
+    while (p < end) {
+        const char* hit = find_literal(p, end - p, run.pattern);
+        if (!hit) break;
+        line += count(counted, hit, '\n');
+        counted = hit;
+        const char* start = hit;
+        while (start > data && start[-1] != '\n') start--;
+        const char* stop = (const char*)memchr(hit, '\n', end - hit);
+        if (!stop) stop = end;
+        GrepHit h;
+        h.path = path;
+        h.line = line;
+        h.col = hit - start;
+        h.text.assign(start, min((size_t)(stop - start), MAX_HIT_TEXT));
+        out.push_back(move(h));
+        // One hit per line, like grep
+        if (stop == end) break;
+        p = stop + 1;
+    }
+}
+
+void search_file(GrepRun& run, const WalkFile& f, vector<GrepHit>& out) {
+    FileView v;
+    if (!v.load(f.path, f.size)) return;
+    if (memchr(v.data(), 0, min(v.size(), BINARY_PROBE))) {
+        run.binary++;
+    } else {
+        run.files++;
+        run.bytes += v.size();
+        search_buffer(run, f.path, v.data(), v.size(), out);
+    }
+}
+
+void search_batch(const RunPtr& run, vector<WalkFile>& batch, const CancelToken& tok) {
+    vector<GrepHit> hits;
+    for (const WalkFile& f : batch) {
+        if (tok.cancelled()) break;
+        search_file(*run, f, hits);
+    }
+    if (hits.empty() || tok.cancelled()) return;
+    run->hits += hits.size();
+    auto shared = make_shared<vector<GrepHit>>(move(hits));
+    RunPtr keep = run;
+    run->jobs->post([keep, shared]() {
+        if (!keep->token->cancelled()) keep->on_hits(*shared);
+    });
+}
+
+void finish_grep(const RunPtr& run) {
+    GrepStats st;
+    st.files = run->files;
+    st.binary = run->binary;
+    st.bytes = run->bytes;
+    st.hits = run->hits;
+    st.secs = chrono::duration<double>(chrono::steady_clock::now() - run->started).count();
+    RunPtr keep = run;
+    run->jobs->post([keep, st]() {
+        if (!keep->token->cancelled()) keep->on_done(st);
+    });
+}
+
+void finish_job(const WalkPtr& w) {
+    if (--w->outstanding != 0) return;
+    if (w->token->cancelled()) return;
+    if (w->cb.on_done) w->cb.on_done();
+}
+
+void submit_batch(const WalkPtr& w, vector<WalkFile> batch) {
+    w->outstanding++;
+    auto files = make_shared<vector<WalkFile>>(move(batch));
+    w->jobs->submit([w, files](const CancelToken& tok) {
+        if (!tok.cancelled()) w->cb.on_batch(*files, tok);
+        finish_job(w);
+    }, PRIO_NORMAL, w->token);
+}
+
+void submit_dir(const WalkPtr& w, string dir, string rel, IgnorePtr rules) {
+    w->outstanding++;
+    w->jobs->submit([w, dir, rel, rules](const CancelToken& tok) {
+        if (!tok.cancelled()) {
+            IgnorePtr here = load_gitignore(rules, dir, rel);
+            DIR* d = opendir(dir.c_str());
+            vector<WalkFile> batch;
+            while (d && !tok.cancelled()) {
+                struct dirent* e = readdir(d);
+                if (!e) break;
+                string name = e->d_name;
+                if (name == "." || name == "..") continue;
+                string path = dir == "." ? name : dir + "/" + name;
+                struct stat st;
+                // Symlinks are not followed
+                if (lstat(path.c_str(), &st) != 0) continue;
+                bool is_dir = S_ISDIR(st.st_mode);
+                if (!is_dir && (!S_ISREG(st.st_mode) || st.st_size == 0)) continue;
+                string rel_path = rel + name;
+                if (ignored(here, rel_path, name, is_dir)) continue;
+                if (is_dir) {
+                    if (!w->cb.want_dir || w->cb.want_dir(rel_path, name)) submit_dir(w, path, rel_path + "/", here);
+                    continue;
+                }
+                WalkFile f{ path, (uint64_t)st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec };
+                if (w->cb.want_file && !w->cb.want_file(name, f)) continue;
+                batch.push_back(move(f));
+                if (batch.size() == BATCH_FILES) {
+                    submit_batch(w, move(batch));
+                    batch.clear();
+                }
+            }
+            if (d) closedir(d);
+            if (!batch.empty()) submit_batch(w, move(batch));
+        }
+        finish_job(w);
+    }, PRIO_NORMAL, w->token);
+}
+
+} // namespace
+
+bool ignored(const IgnorePtr& rules, const string& rel, const string& name, bool is_dir) {
+    if (is_dir && name == ".git") return true;
+    return rules && apply_rules(rules.get(), rel, name, is_dir) == 1;
+}
+
+IgnorePtr load_gitignore(const IgnorePtr& parent, const string& dir, const string& rel_dir) {
+    ifstream f(dir + "/.gitignore");
+    if (!f.is_open()) return parent;
+    auto r = make_shared<IgnoreRules>();
+    r->parent = parent;
+    string line;
+    while (getline(f, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        while (!line.empty() && line.back() == ' ') line.pop_back();
+        if (line.empty() || line[0] == '#') continue;
+        IgnoreRule rule;
+        rule.base = rel_dir;
+        rule.negate = line[0] == '!';
+        if (rule.negate) line.erase(0, 1);
+        rule.dir_only = !line.empty() && line.back() == '/';
+        if (rule.dir_only) line.pop_back();
+        // A slash anywhere but the end ties the pattern to this directory
+        rule.anchored = line.find('/') != string::npos;
+        if (!line.empty() && line[0] == '/') line.erase(0, 1);
+        if (line.empty()) continue;
+        rule.pattern = line;
+        r->rules.push_back(rule);
+    }
+    return r;
+}
+
+const char* find_literal(const char* hay, size_t n, const string& needle) {
+    size_t m = needle.size();
+    if (m == 0 || m > n) return nullptr;
+    if (m == 1) return (const char*)memchr(hay, needle[0], n);
+    size_t i = 0;
+#ifdef __SSE2__
+    // Compare 16 candidate positions at once on the first and last byte of
+    // the needle; only positions where both agree are checked in full
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[m - 1]);
+    for (; i + m - 1 + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(hay + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(hay + i + m - 1));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask) {
+            unsigned bit = __builtin_ctz(mask);
+            if (memcmp(hay + i + bit + 1, needle.data() + 1, m - 2) == 0) return hay + i + bit;
+            mask &= mask - 1;
+        }
+    }
+#endif
+    return (const char*)memmem(hay + i, n - i, needle.data(), m);
+}
+
+void walk_tree(Scheduler& jobs, const string& root, CancelPtr token, TreeWalk walk) {
+    string dir = root;
+    while (dir.size() > 1 && dir.back() == '/') dir.pop_back();
+    auto w = make_shared<Walk>();
+    w->jobs = &jobs;
+    w->token = token ? token : make_shared<CancelToken>();
+    w->cb = move(walk);
+    w->outstanding = 1;
+    struct stat st;
+    if (stat(dir.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+        WalkFile f{ dir, (uint64_t)st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec };
+        string name = dir.substr(dir.rfind('/') + 1);
+        if (st.st_size > 0 && (!w->cb.want_file || w->cb.want_file(name, f))) {
+            submit_batch(w, vector<WalkFile>(1, f));
+        }
+    } else {
+        submit_dir(w, dir, "", IgnorePtr());
+    }
+    // Drop the reference held for the walk setup
+    finish_job(w);
+}
+
+// Read rather than mapped: a file truncated under a mapping faults the
+// whole process on the next page touched, a short read() just ends early
+bool FileView::load(const string& path, uint64_t size) {
+    thread_local vector<char> scratch;
+    data_ = nullptr;
+    size_ = 0;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    size_t n = fstat(fd, &st) == 0 ? (size_t)st.st_size : size;
+    scratch.resize(n);
+    size_t got = 0;
+    ssize_t k;
+    while (got < n && (k = read(fd, scratch.data() + got, n - got)) > 0) got += k;
+    close(fd);
+    data_ = scratch.data();
+    size_ = got;
+    return true;
+}
+
+void start_grep(Scheduler& jobs, const string& pattern, const string& root, CancelPtr token,
+                function<void(vector<GrepHit>&)> on_hits, function<void(const GrepStats&)> on_done) {
+    auto run = make_shared<GrepRun>();
+    run->jobs = &jobs;
+    run->pattern = pattern;
+    run->token = token ? token : make_shared<CancelToken>();
+    run->on_hits = move(on_hits);
+    run->on_done = move(on_done);
+    run->started = chrono::steady_clock::now();
+    run->files = run->binary = run->bytes = run->hits = 0;
+    TreeWalk walk;
+    walk.on_batch = [run](vector<WalkFile>& batch, const CancelToken& tok) { search_batch(run, batch, tok); };
+    walk.on_done = [run]() { finish_grep(run); };
+    walk_tree(jobs, root, run->token, move(walk));
+}
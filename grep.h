@@ -0,0 +1,94 @@
+#ifndef GREP_H
+#define GREP_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <cstddef>
+#include <cstdint>
+#include "scheduler.h"
+
+// :grep — literal search over a directory tree on the job pool. Every
+// directory and every batch of files is its own job, so the walk and the
+// search overlap and spread over all workers. Files with a NUL byte near
+// the start are treated as binary and skipped; .gitignore files are
+// honoured on the way down (the .git directory itself is always skipped).
+
+struct GrepHit {
+    std::string path;
+    size_t line; // 1-based
+    size_t col;  // 0-based byte offset of the match
+    std::string text;
+};
+
+struct GrepStats {
+    uint64_t files, binary, bytes, hits;
+    double secs;
+};
+
+// .gitignore rules in effect for a directory, for walks of a tree
+struct IgnoreRules;
+typedef std::shared_ptr<const IgnoreRules> IgnorePtr;
+
+// parent plus the .gitignore in dir (rel_dir is dir relative to the root
+// of the walk: "" or "sub/dir/"); parent itself when there is none
+IgnorePtr load_gitignore(const IgnorePtr& parent, const std::string& dir, const std::string& rel_dir);
+// Whether rel (ending in name) is ignored; .git directories always are
+bool ignored(const IgnorePtr& rules, const std::string& rel, const std::string& name, bool is_dir);
+
+// A regular file found by walk_tree
+struct WalkFile {
+    std::string path; // as walked from the root
+    uint64_t size;
+    int64_t mtime_sec, mtime_nsec;
+};
+
+// What walk_tree does with the tree. The filters run on the walking job,
+// after the .gitignore rules; null keeps everything. Kept files go to
+// on_batch a batch at a time, each batch a job of its own, and on_done
+// runs on the job that finishes last unless the token is cancelled.
+struct TreeWalk {
+    std::function<bool(const std::string& rel, const std::string& name)> want_dir;
+    std::function<bool(const std::string& name, const WalkFile& f)> want_file;
+    std::function<void(std::vector<WalkFile>& batch, const CancelToken& tok)> on_batch;
+    std::function<void()> on_done;
+};
+
+// Walks root (or just root, when it is a file) on the job pool: every
+// directory is a job, symlinks are not followed and only regular,
+// non-empty files are seen.
+void walk_tree(Scheduler& jobs, const std::string& root, CancelPtr token, TreeWalk walk);
+
+// A file's contents for a search or a scan, read into a buffer per
+// thread, so only one view per thread at a time.
+class FileView {
+public:
+    FileView() : data_(nullptr), size_(0) {}
+    // size is the one the walk saw, used when fstat fails; false when the
+    // file cannot be opened
+    bool load(const std::string& path, uint64_t size);
+
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    const char* data_;
+    size_t size_;
+
+    FileView(const FileView&) = delete;
+    FileView& operator=(const FileView&) = delete;
+};
+
+// First occurrence of needle in hay[0..n), or nullptr. Uses an SSE2
+// first/last-byte prefilter when the compiler targets it.
+const char* find_literal(const char* hay, size_t n, const std::string& needle);
+
+// Start searching root for pattern. on_hits gets the matches of each file
+// batch and on_done the totals; both run on the main loop through
+// Scheduler::post, and neither runs once token is cancelled.
+void start_grep(Scheduler& jobs, const std::string& pattern, const std::string& root, CancelPtr token,
+                std::function<void(std::vector<GrepHit>&)> on_hits,
+                std::function<void(const GrepStats&)> on_done);
+
+#endif // GREP_H
@@ -0,0 +1,191 @@
+#include "input.h"
+#include <ncurses.h>
+#include <csignal>
+#include <cerrno>
+#include <string>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+
+// How long a lone ESC waits for the rest of an escape sequence
+const int ESC_WAIT_MS = 25;
+
+// write end of the self-pipe of the running queue, for the signal handler
+volatile sig_atomic_t winch_fd = -1;
+
+void on_winch(int) {
+    int saved = errno;
+    if (winch_fd >= 0) {
+        char c = 'r';
+        (void)!write(winch_fd, &c, 1);
+    }
+    errno = saved;
+}
+
+int csi_key(char final, int param) {
+    switch (final) {
+        case 'A': return KEY_UP;
+        case 'B': return KEY_DOWN;
+        case 'C': return KEY_RIGHT;
+        case 'D': return KEY_LEFT;
+        case 'H': return KEY_HOME;
+        case 'F': return KEY_END;
+        case '~':
+            switch (param) {
+                case 1: case 7: return KEY_HOME;
+                case 2: return KEY_IC;
+                case 3: return KEY_DC;
+                case 4: case 8: return KEY_END;
+                case 5: return KEY_PPAGE;
+                case 6: return KEY_NPAGE;
+            }
+    }
+    return ERR;
+}
+
+} // namespace
+
+InputQueue::InputQueue() : fd(-1) {
+    wake[0] = wake[1] = -1;
+}
+
+InputQueue::~InputQueue() {
+    if (!reader.joinable()) return;
+    if (winch_fd == wake[1]) winch_fd = -1;
+    char c = 'q';
+    (void)!write(wake[1], &c, 1);
+    reader.join();
+    close(wake[0]);
+    close(wake[1]);
+}
+
+void InputQueue::start(int in_fd, bool winch) {
+    fd = in_fd;
+    if (pipe(wake) != 0) return;
+    fcntl(wake[1], F_SETFL, O_NONBLOCK);
+    if (winch) {
+        winch_fd = wake[1];
+        // Replaces the curses handler; resizes are applied by the UI thread on KEY_RESIZE
+        struct sigaction sa = {};
+        sa.sa_handler = on_winch;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = SA_RESTART;
+        sigaction(SIGWINCH, &sa, nullptr);
+    }
+    reader = thread(&InputQueue::reader_main, this);
+}
+
+bool InputQueue::wait_key(int& key, chrono::steady_clock::duration wait) {
+    unique_lock<mutex> lk(m);
+    if (!cv.wait_for(lk, wait, [this] { return !keys.empty(); })) return false;
+    key = keys.front();
+    keys.pop_front();
+    return true;
+}
+
+bool InputQueue::try_key(int& key) {
+    lock_guard<mutex> lk(m);
+    if (keys.empty()) return false;
+    key = keys.front();
+    keys.pop_front();
+    return true;
+}
+
+void InputQueue::push(int key) {
+    {
+        lock_guard<mutex> lk(m);
+        keys.push_back(key);
+    }
+    cv.notify_one();
+}
+
+size_t InputQueue::decode(const unsigned char* p, size_t n, bool flush) {
+    size_t i = 0;
+    while (i < n) {
+        unsigned char c = p[i];
+        if (c != 27) {
+            if (c == 127 || c == 8) push(KEY_BACKSPACE);
+            else if (c == '\r') push('\n');
+            else push(c);
+            i++;
+            continue;
+        }
+        // ESC: a key of its own unless an escape sequence follows
+        if (i + 1 >= n) {
+            if (!flush) break;
+            push(27);
+            i++;
+            continue;
+        }
+        unsigned char intro = p[i + 1];
+        if (intro != '[' && intro != 'O') {
+            push(27);
+            i++;
+            continue;
+        }
+        // CSI: ESC [ params final; SS3: ESC O final
+        size_t j = i + 2;
+        int param = 0;
+        if (intro == '[') {
+            while (j < n && p[j] >= 0x20 && p[j] <= 0x3f) {
+                if (p[j] >= '0' && p[j] <= '9') param = param * 10 + (p[j] - '0');
+                else if (p[j] == ';') param = 0; // keep the last parameter only
+                j++;
+            }
+        }
+        if (j >= n) {
+            if (!flush) break;
+            push(27);
+            i++;
+            continue;
+        }
+        int key = csi_key((char)p[j], intro == '[' ? (param ? param : 1) : 0);
+        // Unknown sequences are dropped rather than typed in
+        if (key != ERR) push(key);
+        i = j + 1;
+    }
+    return i;
+}
+
+void InputQueue::reader_main() {
+    string pending;
+    unsigned char chunk[4096];
+    while (true) {
+        struct pollfd fds[2] = { { fd, POLLIN, 0 }, { wake[0], POLLIN, 0 } };
+        int r = poll(fds, 2, pending.empty() ? -1 : ESC_WAIT_MS);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        if (r == 0) {
+            // Nothing followed the ESC in time
+            decode((const unsigned char*)pending.data(), pending.size(), true);
+            pending.clear();
+            continue;
+        }
+        if (fds[1].revents & POLLIN) {
+            char c[64];
+            ssize_t k = read(wake[0], c, sizeof(c));
+            for (ssize_t i = 0; i < k; ++i) {
+                if (c[i] == 'q') return;
+                push(KEY_RESIZE);
+            }
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP)) {
+            ssize_t k = read(fd, chunk, sizeof(chunk));
+            if (k <= 0) {
+                if (k < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+                decode((const unsigned char*)pending.data(), pending.size(), true);
+                push(KEY_EXIT);
+                return;
+            }
+            pending.append((const char*)chunk, k);
+            size_t used = decode((const unsigned char*)pending.data(), pending.size(), false);
+            pending.erase(0, used);
+        }
+    }
+}
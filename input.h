@@ -0,0 +1,48 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+// Keyboard input read on its own thread. Raw bytes from the terminal are
+// decoded into the same key codes getch() returns (KEY_UP, KEY_BACKSPACE,
+// ...) and queued, so the UI thread can drain everything typed since the
+// last frame without blocking in curses. A terminal resize shows up as
+// KEY_RESIZE, and the end of input (the terminal hung up) as KEY_EXIT.
+
+class InputQueue {
+public:
+    InputQueue();
+    ~InputQueue();
+
+    // Start reading fd; call after initscr() so the terminal is already in
+    // cbreak mode. With winch, resizes of the process's terminal (SIGWINCH,
+    // one handler for the process) are queued too.
+    void start(int fd = 0, bool winch = true);
+
+    // Wait up to `wait` for the next key; false on timeout.
+    bool wait_key(int& key, std::chrono::steady_clock::duration wait);
+    bool try_key(int& key);
+    // Queue a key as if it had been typed; safe from any thread.
+    void inject(int key) { push(key); }
+
+private:
+    int fd;
+    int wake[2]; // self-pipe: SIGWINCH and shutdown
+    std::thread reader;
+    std::mutex m;
+    std::condition_variable cv;
+    std::deque<int> keys;
+
+    void reader_main();
+    void push(int key);
+    // Decode as many keys as possible from the front of buf; an escape
+    // sequence cut off at the end is left for the next read unless `flush`.
+    size_t decode(const unsigned char* p, size_t n, bool flush);
+};
+
+#endif // INPUT_H
@@ -1,11 +1,17 @@
 #include "editor.h"
+#include "server.h"
 #include <iostream>
 
 int main(int argc, char** argv) 
 {
+    std::string mode = argc > 1 ? argv[1] : "";
+    std::vector<std::string> rest(argv + std::min(argc, 2), argv + argc);
+    if (mode == "--server") return run_server(socket_path());
+    if (mode == "--client") return run_client(socket_path(), rest);
+    if (mode == "--remote") return run_remote(socket_path(), rest);
     Editor ed;
     if (argc > 1) {
-        ed.run(argv[1]);
+        ed.run(std::vector<std::string>(argv + 1, argv + argc));
     } else {
         ed.run();
     }
@@ -32,7 +38,39 @@ NORMAL dd Editing Delete the current line (Cut).
 
 NORMAL yy Editing Yank (Copy) the current line.
 
-NORMAL p Editing Paste the yanked line(s) below the current line.
+NORMAL p Editing Paste the yanked line(s) below the current line (text and blocks from a visual mode go in after the cursor).
+
+NORMAL v / V / Ctrl-V Visual Select characters / whole lines / a block; h j k l 0 $ gg G stretch the selection, o goes to its other end, Esc leaves.
+
+VISUAL d or x / y / c Visual Delete / yank / change the selection as one edit (one undo step).
+
+VISUAL > / < Visual Shift the selected lines right / left by 4 spaces.
+
+VISUAL I / A Visual Type once, on every selected line: at the block's left / right edge (after $, each line's end), or at line start / end outside a block.
+
+VISUAL : Visual Start a command on the selected lines (e.g. :12,40sort).
+
+NORMAL m{a-z} Marks Set a mark on the cursor position; it follows its line through edits and goes away when the line is deleted.
+
+NORMAL '{a-z} / `{a-z} Marks Jump to the mark's line / exact position ('' and `` go back to where the last jump started).
+
+NORMAL Ctrl-O / Ctrl-I Marks Go to the older / newer position in the jump list (G, gg, searches, :N, marks, ]c and :cn are jumps).
+
+NORMAL zc / zo / za Folding Close / open / toggle the fold at the cursor (by braces in C-like and JSON files, by indent otherwise); j and k step over a closed fold.
+
+NORMAL zM / zR Folding Close / open every fold.
+
+NORMAL Ctrl-N Cursors Add a cursor: the main one moves to the next match of the last / search (in a visual mode: one cursor per selected line).
+
+CURSORS h l j k 0 $ / i a A / x / Esc Cursors With several cursors, move all of them / insert at all of them (typing, Backspace and Enter) / delete under all / back to one.
+
+NORMAL q{a-z} ... q Macros Record keys into a register until the next q (q{A-Z} adds to it).
+
+NORMAL [N]@{a-z} / @@ Macros Replay a register N times (@@ the last one played); nothing is redrawn until it ends and u undoes all of it.
+
+NORMAL ]c / [c Diff Jump to the next / previous changed hunk while diffing.
+
+NORMAL Ctrl-] / Ctrl-T Tags Jump to the definition of the identifier under the cursor (C/C++ sources under the working directory, indexed in the background) / back to where the last tag jump started.
 
 NORMAL u Utility Single-level Undo (revert last change).
 
@@ -46,12 +84,73 @@ INSERT Enter (\n) Editing Insert a new line.
 
 INSERT Backspace Editing Delete preceding character / Join lines.
 
+INSERT Ctrl-N / Ctrl-P Completion Complete the word before the cursor from the words of all loaded buffers (nearby lines first, then the most frequent); again to cycle.
+
+INSERT Ctrl-E / Ctrl-Y Completion Put back what was typed / keep the choice and close the list (typing on also keeps it).
+
 COMMAND :w [filename] File Ops Save the file (Use filename for 'Save As').
 
-COMMAND :q File Ops Quit the editor.
+COMMAND :q File Ops Quit the editor (cursor, unsaved edits, undo and yank of every buffer are kept in a session; refuses when unsaved edits cannot be kept).
+
+COMMAND :q! File Ops Quit and discard the session.
 
 COMMAND :wq or :x File Ops Save and Quit.
 
+COMMAND :e file Buffers Edit file in a new buffer (or switch to it if it is already open).
+
+COMMAND :bn / :bp / :b N Buffers Switch to the next / previous / Nth buffer.
+
+COMMAND :ls Buffers List buffers ([+] modified, files given on the command line load when first shown).
+
+COMMAND :set bufmem=MB Buffers Unload unmodified hidden buffers above this much text (default: half of RAM).
+
+COMMAND :set memcap=MB Buffers Above this resident size, hand cold pages of big files and old edits back to disk (default: half of RAM).
+
+COMMAND :grep pat [dir] Search Search files under dir (default .) for a literal string in the background.
+
+COMMAND :cn / :cp Search Jump to the next / previous :grep match (:cc current, :cl position in the list).
+
+COMMAND :tag name Tags Jump to the definition of name (also :ta); :tn / :tp go to the next / previous one when there are several.
+
+COMMAND :diff [N] Diff Show the buffer side by side with the file on disk (or buffer N); kept up to date as you edit.
+
+COMMAND :diffoff Diff Leave the diff view.
+
+COMMAND :[range]sort [n][u][r] Lines Sort the lines (whole buffer by default): n by the first number, u dropping duplicates, r reversed.
+
+COMMAND :[range]uniq Lines Drop lines equal to the line before them.
+
+COMMAND :{range}!cmd Lines Pipe the lines through a shell command and replace them with its output (e.g. :%!fmt).
+
+COMMAND :[range]cursors [pat] Cursors A cursor on every match of pat (whole buffer by default), or without pat on every line of the range.
+
+COMMAND :[range]normal keys Macros Run normal-mode keys on every line of the range (e.g. :%normal @a), as one undo step.
+
+COMMAND :N Movement Go to line N (ranges are N, ., $, N,M, % with +N/-N offsets).
+
+COMMAND :marks Marks Show where the marks are and how many jumps are remembered.
+
+COMMAND :set fps=N Utility Cap screen updates at N frames a second (default 60).
+
+COMMAND :set foldmethod=indent|braces Folding Fold by indentation or by { } and [ ] (also :set fdm=).
+
+SHELL main10 --server Server Hold buffers for clients on a Unix socket ($MAIN10_SOCKET, default main10.sock in $XDG_RUNTIME_DIR or /tmp/main10-<uid>/); only the same user may attach.
+
+SHELL main10 --client [file...] Server Edit in this terminal on the server; a file another client has open opens at once from its buffer, and edits show up in both.
+
+SHELL main10 --remote file... Server Open files in the client typed in last.
+
+COMMAND :mem Utility Show how much memory the buffer's lines take (text, chunks, tree) per line.
+
+COMMAND :jobs Utility Show background job queue depth (viewport/normal/idle) and latencies.
+
 SEARCH / <pattern> Search Search for the specified pattern (wraps around).
 
-/*
\ No newline at end of file
+FILES .gz / .zst Compression Detected by magic bytes; decompressed while loading and recompressed on save.
+
+//g++ -Wall -Wextra -std=c++17 main10.cpp editor.cpp compress.cpp session.cpp cache.cpp buffer.cpp scheduler.cpp input.cpp grep.cpp diff.cpp filter.cpp marks.cpp cursors.cpp complete.cpp fold.cpp server.cpp tags.cpp -o main10 -lncurses -lz -pthread
+//(add -DHAVE_ZSTD -lzstd for .zst support)
+//./main10 [file...]
+//./main10 --server, then ./main10 --client [file...] in any terminal and ./main10 --remote file... to open files in the last one used
+
+*/
@@ -30,9 +30,10 @@ int main() {
     }
 
     end_ncurses();
+    gb_free(&textBuffer);
     cout << "Editor Exited. Goodbye!" << endl;
     return 0;
 }
 
-//g++ -Wall -Wextra -std=c++17 main5.cpp menu.cpp -o main5 -lncurses
+//g++ -Wall -Wextra -std=c++17 main5.cpp menu.cpp pager.cpp gapbuffer.cpp -o main5 -lncurses
 //./main5
\ No newline at end of file
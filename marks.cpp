@@ -0,0 +1,183 @@
+#include "marks.h"
+#include <algorithm>
+
+using namespace std;
+
+MarkSet::MarkSet() : jump_pos(0) {
+    for (Mark& m : marks) m = Mark{ false, 0, 0, 0 };
+}
+
+template <class F>
+void MarkSet::each(F fn) {
+    for (Mark& m : marks) {
+        if (m.set) fn(m);
+    }
+    for (Mark& m : jumps) {
+        if (m.set) fn(m);
+    }
+}
+
+bool MarkSet::resolve(const Mark& m, const TextBuffer& buf, size_t& line) const {
+    if (!m.set || buf.empty()) return false;
+    line = m.anchor ? buf.find_anchor(m.anchor) : min(m.line, buf.size() - 1);
+    return line != SIZE_MAX;
+}
+
+bool MarkSet::referenced(uint32_t id) const {
+    for (const Mark& m : marks) {
+        if (m.set && m.anchor == id) return true;
+    }
+    for (const Mark& m : jumps) {
+        if (m.anchor == id) return true;
+    }
+    return false;
+}
+
+// Takes id off its line once no mark uses it
+void MarkSet::release(TextBuffer& buf, uint32_t id) {
+    if (id == 0 || referenced(id)) return;
+    size_t line = buf.find_anchor(id);
+    if (line != SIZE_MAX) buf.set_anchor(line, 0);
+}
+
+// The line's anchor, or a new one; 0 when all ids are taken
+uint32_t MarkSet::anchor_for(TextBuffer& buf, const TextBuffer& undo, size_t line) {
+    if (uint32_t id = buf.anchor_of(line)) return id;
+    for (int pass = 0; pass < 2; ++pass) {
+        for (uint32_t id = 1; id <= TextBuffer::ANCHOR_MAX; ++id) {
+            if (referenced(id) || undo.find_anchor(id) != SIZE_MAX) continue;
+            size_t at = buf.find_anchor(id);
+            if (at == SIZE_MAX) {
+                buf.set_anchor(line, id);
+                return id;
+            }
+            // Left behind by an undo; reclaimed when nothing else is free
+            if (pass == 1) {
+                buf.set_anchor(at, 0);
+                buf.set_anchor(line, id);
+                return id;
+            }
+        }
+    }
+    return 0;
+}
+
+void MarkSet::place(Mark& m, TextBuffer& buf, const TextBuffer& undo, size_t line) {
+    uint32_t old = m.anchor;
+    m.set = true;
+    m.line = line;
+    m.anchor = anchor_for(buf, undo, line);
+    if (old != m.anchor) release(buf, old);
+}
+
+bool MarkSet::set(int slot, TextBuffer& buf, const TextBuffer& undo, size_t line, size_t col) {
+    if (slot < 0 || slot > CONTEXT || line >= buf.size()) return false;
+    marks[slot].col = col;
+    // Without a free anchor the mark still works, by line number
+    place(marks[slot], buf, undo, line);
+    return true;
+}
+
+bool MarkSet::get(int slot, const TextBuffer& buf, size_t& line, size_t& col) const {
+    if (slot < 0 || slot > CONTEXT || !resolve(marks[slot], buf, line)) return false;
+    col = marks[slot].col;
+    return true;
+}
+
+void MarkSet::push_jump(TextBuffer& buf, const TextBuffer& undo, size_t line, size_t col) {
+    if (line >= buf.size()) return;
+    set(CONTEXT, buf, undo, line, col);
+    // One entry per line: an older one on the same line moves to the end
+    vector<uint32_t> dropped;
+    for (size_t i = 0; i < jumps.size();) {
+        size_t at;
+        if (!resolve(jumps[i], buf, at) || at == line || (jumps.size() >= JUMPS_MAX && i == 0)) {
+            dropped.push_back(jumps[i].anchor);
+            jumps.erase(jumps.begin() + i);
+        } else {
+            ++i;
+        }
+    }
+    Mark m = { true, 0, line, col };
+    place(m, buf, undo, line);
+    jumps.push_back(m);
+    jump_pos = jumps.size();
+    for (uint32_t id : dropped) release(buf, id);
+}
+
+bool MarkSet::jump_older(TextBuffer& buf, const TextBuffer& undo, size_t& line, size_t& col) {
+    if (jump_pos >= jumps.size()) {
+        // Leaving the newest position: remember it so Ctrl-I comes back here
+        push_jump(buf, undo, line, col);
+        jump_pos = jumps.size() - 1;
+    }
+    for (size_t i = jump_pos; i > 0; --i) {
+        size_t at;
+        if (resolve(jumps[i - 1], buf, at)) {
+            jump_pos = i - 1;
+            line = at;
+            col = jumps[i - 1].col;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool MarkSet::jump_newer(const TextBuffer& buf, size_t& line, size_t& col) {
+    for (size_t i = jump_pos + 1; i < jumps.size(); ++i) {
+        size_t at;
+        if (resolve(jumps[i], buf, at)) {
+            jump_pos = i;
+            line = at;
+            col = jumps[i].col;
+            return true;
+        }
+    }
+    return false;
+}
+
+void MarkSet::remember(const TextBuffer& buf) {
+    each([&](Mark& m) {
+        size_t at;
+        if (!m.anchor) return;
+        if (resolve(m, buf, at)) {
+            m.line = at;
+        } else {
+            // its line was deleted, so it is not coming back
+            m.set = false;
+            m.anchor = 0;
+        }
+    });
+}
+
+void MarkSet::restore(TextBuffer& buf, const TextBuffer& undo) {
+    each([&](Mark& m) {
+        if (m.anchor && buf.find_anchor(m.anchor) != SIZE_MAX) return;
+        place(m, buf, undo, min(m.line, buf.size() - 1));
+    });
+}
+
+void MarkSet::detach(const TextBuffer& buf) {
+    remember(buf);
+    each([](Mark& m) { m.anchor = 0; });
+}
+
+void MarkSet::attach(TextBuffer& buf, const TextBuffer& undo) {
+    if (buf.empty()) return;
+    each([&](Mark& m) {
+        if (!m.anchor) place(m, buf, undo, min(m.line, buf.size() - 1));
+    });
+}
+
+string MarkSet::describe(const TextBuffer& buf) const {
+    string out;
+    for (int i = 0; i <= CONTEXT; ++i) {
+        size_t line, col;
+        if (!get(i, buf, line, col)) continue;
+        if (!out.empty()) out += "  ";
+        out += (i == CONTEXT ? string("'") : string(1, (char)('a' + i))) + " " + to_string(line + 1) + ":" +
+               to_string(col + 1);
+    }
+    if (out.empty()) out = "no marks set";
+    return "marks: " + out + " | " + to_string(jumps.size()) + " jumps";
+}
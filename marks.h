@@ -0,0 +1,67 @@
+#ifndef MARKS_H
+#define MARKS_H
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include "buffer.h"
+
+// Marks (ma, 'a, `a) and the jump list (Ctrl-O / Ctrl-I) of one buffer.
+// A position is an anchor on its line (see TextBuffer), so edits never
+// walk the marks to shift them and looking one up is a walk down the tree.
+// Marks on the same line share that line's anchor. A mark whose line is
+// deleted is gone, as in vi.
+//
+// Calls that may add or drop anchors take the buffer and its undo
+// snapshot: an id still present in the snapshot is not handed out again,
+// so undoing never brings back a line carrying someone else's anchor.
+class MarkSet {
+public:
+    static const int LETTERS = 26;
+    static const int CONTEXT = 26; // '' and ``: where the last jump started
+    static const size_t JUMPS_MAX = 30;
+
+    MarkSet();
+
+    // slot is 0-25 for a-z, or CONTEXT
+    bool set(int slot, TextBuffer& buf, const TextBuffer& undo, size_t line, size_t col);
+    bool get(int slot, const TextBuffer& buf, size_t& line, size_t& col) const;
+
+    // (line, col) is where a jump starts; also sets CONTEXT
+    void push_jump(TextBuffer& buf, const TextBuffer& undo, size_t line, size_t col);
+    // Ctrl-O and Ctrl-I; line and col go in as the cursor and come out as the target
+    bool jump_older(TextBuffer& buf, const TextBuffer& undo, size_t& line, size_t& col);
+    bool jump_newer(const TextBuffer& buf, size_t& line, size_t& col);
+
+    // Around replacing the whole buffer (undo, :sort, compaction): marks
+    // whose line did not come along are put back by line number.
+    void remember(const TextBuffer& buf);
+    void restore(TextBuffer& buf, const TextBuffer& undo);
+    // Around unloading a buffer: keep only line numbers, anchor them again on load
+    void detach(const TextBuffer& buf);
+    void attach(TextBuffer& buf, const TextBuffer& undo);
+
+    // for :marks
+    std::string describe(const TextBuffer& buf) const;
+
+private:
+    struct Mark {
+        bool set;
+        uint32_t anchor; // 0 while detached
+        size_t line;     // last known line
+        size_t col;
+    };
+    Mark marks[LETTERS + 1];
+    std::vector<Mark> jumps;
+    size_t jump_pos; // jumps.size() unless moving through the list
+
+    bool resolve(const Mark& m, const TextBuffer& buf, size_t& line) const;
+    void place(Mark& m, TextBuffer& buf, const TextBuffer& undo, size_t line);
+    uint32_t anchor_for(TextBuffer& buf, const TextBuffer& undo, size_t line);
+    bool referenced(uint32_t id) const;
+    void release(TextBuffer& buf, uint32_t id);
+    template <class F> void each(F fn);
+};
+
+#endif // MARKS_H
@@ -1,24 +1,18 @@
 #include "menu.h"
+#include "pager.h"
 #include <iostream>
 #include <fstream>
 #include <cstring>
 #include <algorithm>
 #include <ncurses.h>
 using namespace std;
-char textBuffer[MAX_LINES][MAX_LINE_LENGTH + 1] = {{'\0'}}; 
+GapBuffer textBuffer = {NULL, 0, 0, 0, 1}; 
 size_t bufferSizeLimit = 0; 
 size_t cursor_x = 0;        
 size_t cursor_y = 0;        
-size_t current_lines = 1;
+size_t top_line = 0;
 size_t get_total_size() {
-    size_t total = 0;
-    for (size_t i = 0; i < current_lines; ++i) {
-        total += strlen(textBuffer[i]);
-    }
-    if (current_lines > 0) {
-        total += current_lines - 1;
-    }
-    return total;
+    return gb_size(&textBuffer);
 }
 void init_ncurses() {
     initscr();              
@@ -41,115 +35,109 @@ void display_menu() {
     refresh();
 }
 void draw_editor_screen() {
-    clear();
+    int rows, cols;
+    getmaxyx(stdscr, rows, cols);
+    size_t text_rows = rows > 3 ? rows - 2 : 1;
+    if (cursor_y < top_line) top_line = cursor_y;
+    if (cursor_y >= top_line + text_rows) top_line = cursor_y - text_rows + 1;
+    erase();
     printw("--- Editor Mode (Limit: %zu) ---\n", bufferSizeLimit);
     printw("-----------------------------------\n");
-    int current_line_num = 2; 
-    for (size_t i = 0; i < current_lines; ++i) {
-        move(current_line_num, 0);
-        printw("%s", textBuffer[i]);
-        current_line_num++;
+    size_t pos = gb_line_start(&textBuffer, gb_cursor(&textBuffer));
+    for (size_t i = top_line; i < cursor_y; ++i) {
+        pos = gb_line_start(&textBuffer, pos - 1);
+    }
+    for (size_t row = 0; row < text_rows && top_line + row < textBuffer.lines; ++row) {
+        move(row + 2, 0);
+        size_t end = gb_line_end(&textBuffer, pos);
+        for (size_t i = pos; i < end && i - pos < (size_t)cols; ++i) {
+            addch(gb_at(&textBuffer, i));
+        }
+        pos = end + 1;
     }
-    move(cursor_y + 2, cursor_x); 
+    move(cursor_y - top_line + 2, min(cursor_x, (size_t)cols - 1)); 
     curs_set(1); 
     refresh();
 }
 void run_editor() 
 {
     int ch;
-    textBuffer[0][0] = '\0';
+    if (!textBuffer.data) gb_init(&textBuffer, 4096);
+    gb_clear(&textBuffer);
     cursor_y = 0;
     cursor_x = 0;
-    current_lines = 1;
+    top_line = 0;
     draw_editor_screen();
     while ((ch = getch()) != 27) { 
-        char* currentLine = textBuffer[cursor_y];
-        size_t lineLength = strlen(currentLine);
+        size_t pos = gb_cursor(&textBuffer);
         size_t totalSize = get_total_size();
-        if (ch >= 32 && ch <= 126 && totalSize < bufferSizeLimit && lineLength < MAX_LINE_LENGTH) 
+        if (ch >= 32 && ch <= 126 && totalSize < bufferSizeLimit) 
         {
-            memmove(currentLine + cursor_x + 1, currentLine + cursor_x, lineLength - cursor_x + 1);
-            currentLine[cursor_x] = (char)ch;
-            cursor_x++;
+            if (gb_insert(&textBuffer, (char)ch)) cursor_x++;
         }
-        else if ((ch == '\n' || ch == KEY_ENTER) && current_lines < MAX_LINES)
+        else if (ch == '\n' || ch == KEY_ENTER)
         {
             if (totalSize + 1 > bufferSizeLimit)
                 flash();
-            else 
+            else if (gb_insert(&textBuffer, '\n'))
             {
-                if (current_lines < MAX_LINES) 
-                {
-                    memmove(&textBuffer[cursor_y + 2], &textBuffer[cursor_y + 1], 
-                            (current_lines - 1 - cursor_y) * (MAX_LINE_LENGTH + 1));
-                    char restOfLine[MAX_LINE_LENGTH + 1];
-                    strcpy(restOfLine, currentLine + cursor_x);
-                    currentLine[cursor_x] = '\0';
-                    strcpy(textBuffer[cursor_y + 1], restOfLine);
-                    current_lines++;
-                    cursor_y++;
-                    cursor_x = 0;
-                }
+                cursor_y++;
+                cursor_x = 0;
             }
         }
         else if (ch == KEY_UP) {
             if (cursor_y > 0) {
+                size_t lineStart = pos - cursor_x;
+                size_t prevStart = gb_line_start(&textBuffer, lineStart - 1);
+                gb_move_to(&textBuffer, prevStart + min(cursor_x, lineStart - 1 - prevStart));
                 cursor_y--;
-                cursor_x = min(cursor_x, strlen(textBuffer[cursor_y]));
+                cursor_x = gb_cursor(&textBuffer) - prevStart;
             }
         }
         else if (ch == KEY_DOWN) {
-            if (cursor_y < current_lines - 1) {
+            if (cursor_y < textBuffer.lines - 1) {
+                size_t nextStart = gb_line_end(&textBuffer, pos) + 1;
+                size_t nextEnd = gb_line_end(&textBuffer, nextStart);
+                gb_move_to(&textBuffer, nextStart + min(cursor_x, nextEnd - nextStart));
                 cursor_y++;
-                cursor_x = min(cursor_x, strlen(textBuffer[cursor_y]));
+                cursor_x = gb_cursor(&textBuffer) - nextStart;
             }
         }
         else if (ch == KEY_LEFT) {
-            if (cursor_x > 0) {
-                cursor_x--;
-            } else if (cursor_y > 0) {
-                cursor_y--;
-                cursor_x = strlen(textBuffer[cursor_y]);
+            if (pos > 0) {
+                gb_move_to(&textBuffer, pos - 1);
+                if (cursor_x > 0) {
+                    cursor_x--;
+                } else {
+                    cursor_y--;
+                    cursor_x = pos - 1 - gb_line_start(&textBuffer, pos - 1);
+                }
             }
         }
         else if (ch == KEY_RIGHT) {
-            if (cursor_x < lineLength) {
-                cursor_x++;
-            } else if (cursor_y < current_lines - 1) {
-                cursor_y++;
-                cursor_x = 0;
+            if (pos < totalSize) {
+                bool atNewline = gb_at(&textBuffer, pos) == '\n';
+                gb_move_to(&textBuffer, pos + 1);
+                if (atNewline) {
+                    cursor_y++;
+                    cursor_x = 0;
+                } else {
+                    cursor_x++;
+                }
             }
         }
         else if (ch == KEY_BACKSPACE || ch == 127) { 
             if (cursor_x > 0) {
-                memmove(currentLine + cursor_x - 1, currentLine + cursor_x, lineLength - cursor_x + 1);
+                gb_delete_before(&textBuffer);
                 cursor_x--;
             } else if (cursor_y > 0) {
-                char* previousLine = textBuffer[cursor_y - 1];
-                size_t prevLen = strlen(previousLine);
-                if (prevLen + lineLength <= MAX_LINE_LENGTH) {
-                    strcat(previousLine, currentLine);
-                    cursor_x = prevLen;
-                    memmove(&textBuffer[cursor_y], &textBuffer[cursor_y + 1], 
-                            (current_lines - cursor_y) * (MAX_LINE_LENGTH + 1));
-                    current_lines--;
-                    cursor_y--;
-                }
+                gb_delete_before(&textBuffer);
+                cursor_y--;
+                cursor_x = pos - 1 - gb_line_start(&textBuffer, pos - 1);
             }
         }
         else if (ch == KEY_DC) { 
-            if (cursor_x < lineLength) {
-                memmove(currentLine + cursor_x, currentLine + cursor_x + 1, lineLength - cursor_x);
-            } else if (cursor_y < current_lines - 1) {
-                char* nextLine = textBuffer[cursor_y + 1];
-                size_t nextLen = strlen(nextLine);
-                if (lineLength + nextLen <= MAX_LINE_LENGTH) {
-                    strcat(currentLine, nextLine);
-                    memmove(&textBuffer[cursor_y + 1], &textBuffer[cursor_y + 2], 
-                            (current_lines - cursor_y - 1) * (MAX_LINE_LENGTH + 1));
-                    current_lines--;
-                }
-            }
+            gb_delete_after(&textBuffer);
         }
         draw_editor_screen(); 
     }
@@ -191,11 +179,11 @@ void run_editor()
         getch();
 
     } else { 
-        textBuffer[0][0] = '\0';
-        current_lines = 1;
+        gb_clear(&textBuffer);
         bufferSizeLimit = 0;
         cursor_x = 0;
         cursor_y = 0;
+        top_line = 0;
         clear();
         printw("Buffer discarded. Press any key to return to menu...");
         refresh();
@@ -229,17 +217,23 @@ void handle_new_task() {
     }
 }
 
+static size_t read_text_buffer(void* ctx, size_t offset, char* out, size_t len) {
+    return gb_copy((const GapBuffer*)ctx, offset, out, len);
+}
+
 void handle_display_task() {
     clear();
     printw("--- DISPLAY TASK ---\n");
 
     if (get_total_size() > 0) {
-        printw("Buffer content:\n");
-        printw("-----------------------------------\n");
-        for (size_t i = 0; i < current_lines; ++i) {
-            printw("%s\n", textBuffer[i]);
-        }
-        printw("-----------------------------------\n");
+        PagerSource src;
+        src.title = "[buffer]";
+        src.size = get_total_size();
+        src.read = read_text_buffer;
+        src.ctx = &textBuffer;
+        run_pager(src);
+        clear();
+        printw("--- DISPLAY TASK ---\n");
     } else {
         printw("Buffer is empty.\n");
     }
@@ -257,19 +251,10 @@ void handle_display_task() {
         getstr(filename_buffer);
         noecho(); 
 
-        ifstream file(filename_buffer);
-        if (file.is_open()) {
-            string line;
-            printw("\nContent of %s:\n", filename_buffer);
-            printw("-----------------------------------\n");
-            while (getline(file, line)) {
-                printw("%s\n", line.c_str());
-            }
-            printw("-----------------------------------\n");
-            file.close();
-        } else {
-            printw("\nError: Could not open file %s.\n", filename_buffer);
+        if (page_file(filename_buffer)) {
+            return;
         }
+        printw("\nError: Could not open file %s.\n", filename_buffer);
     }
     
     printw("Press any key to return to menu...");
@@ -287,18 +272,14 @@ bool save_buffer_to_file(const char* filename, bool appendMode) {
     }
     ofstream file(filename, mode); 
     if (file.is_open()) {
-        for (size_t i = 0; i < current_lines; ++i) {
-            file << textBuffer[i];
-            if (i < current_lines - 1) {
-                file << '\n';
-            }
-        }
+        file.write(textBuffer.data, textBuffer.gap_start);
+        file.write(textBuffer.data + textBuffer.gap_end, textBuffer.capacity - textBuffer.gap_end);
         file.close();
-        textBuffer[0][0] = '\0';
-        current_lines = 1;
+        gb_clear(&textBuffer);
         bufferSizeLimit = 0;
         cursor_x = 0;
         cursor_y = 0;
+        top_line = 0;
 
         return true;
     }
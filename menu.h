@@ -1,13 +1,12 @@
 #ifndef MENU_H
 #define MENU_H
 #include <cstddef>
-#define MAX_LINE_LENGTH 100
-#define MAX_LINES 50
-extern char textBuffer[MAX_LINES][MAX_LINE_LENGTH + 1]; 
+#include "gapbuffer.h"
+extern GapBuffer textBuffer; 
 extern size_t bufferSizeLimit; 
 extern size_t cursor_x;
 extern size_t cursor_y;
-extern size_t current_lines;
+extern size_t top_line;
 void init_ncurses();
 void end_ncurses();
 void display_menu();
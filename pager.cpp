@@ -0,0 +1,289 @@
+#include "pager.h"
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <ncurses.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+using namespace std;
+
+// Everything is read through one fixed chunk, so memory use does not depend on the file size.
+#define PAGER_CHUNK 65536
+// Lines longer than this are shown as several display lines.
+#define PAGER_MAX_LINE 4096
+
+static char chunk[PAGER_CHUNK];
+static char linebuf[PAGER_MAX_LINE + 1];
+
+struct FileSource {
+    const char* map;
+    int fd;
+};
+
+static size_t read_mapped(void* ctx, size_t offset, char* out, size_t len) {
+    FileSource* fs = (FileSource*)ctx;
+    memcpy(out, fs->map + offset, len);
+    return len;
+}
+
+static size_t read_fd(void* ctx, size_t offset, char* out, size_t len) {
+    FileSource* fs = (FileSource*)ctx;
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fs->fd, out + done, len - done, (off_t)(offset + done));
+        if (n <= 0) break;
+        done += (size_t)n;
+    }
+    return done;
+}
+
+static size_t next_line_start(const PagerSource& src, size_t pos) {
+    size_t limit = min(src.size, pos + PAGER_MAX_LINE);
+    if (pos >= limit) return src.size;
+    size_t n = src.read(src.ctx, pos, chunk, limit - pos);
+    const char* nl = (const char*)memchr(chunk, '\n', n);
+    if (nl) return pos + (nl - chunk) + 1;
+    return n == 0 ? src.size : pos + n;
+}
+
+// Start of the display line that contains byte pos.
+static size_t find_line_start(const PagerSource& src, size_t pos) {
+    if (pos == 0) return 0;
+    size_t lo = pos > PAGER_MAX_LINE - 1 ? pos - (PAGER_MAX_LINE - 1) : 0;
+    size_t n = src.read(src.ctx, lo, chunk, pos - lo);
+    const char* nl = (const char*)memrchr(chunk, '\n', n);
+    if (nl) return lo + (nl - chunk) + 1;
+    return lo;
+}
+
+static size_t prev_line_start(const PagerSource& src, size_t top) {
+    if (top == 0) return 0;
+    return find_line_start(src, top - 1);
+}
+
+static size_t search_forward(const PagerSource& src, const string& pat, size_t from, size_t to) {
+    size_t plen = pat.size();
+    if (plen == 0 || plen > PAGER_CHUNK / 2) return string::npos;
+    size_t pos = from;
+    size_t chunks = 0;
+    while (pos < to && to - pos >= plen) {
+        size_t n = min(to - pos, (size_t)PAGER_CHUNK);
+        n = src.read(src.ctx, pos, chunk, n);
+        if (n < plen) break;
+        const char* hit = (const char*)memmem(chunk, n, pat.data(), plen);
+        if (hit) return pos + (hit - chunk);
+        if (pos + n >= to) break;
+        pos += n - (plen - 1);
+        // Let a long search over a huge file be interrupted with any key.
+        if (++chunks % 1024 == 0) {
+            nodelay(stdscr, TRUE);
+            int ch = getch();
+            nodelay(stdscr, FALSE);
+            if (ch != ERR) return string::npos;
+        }
+    }
+    return string::npos;
+}
+
+static size_t draw_page(const PagerSource& src, size_t top, size_t match, size_t match_len,
+                        const string& msg) {
+    int rows, cols;
+    getmaxyx(stdscr, rows, cols);
+    int page_rows = rows - 1;
+    erase();
+    size_t pos = top;
+    for (int r = 0; r < page_rows; ++r) {
+        if (pos >= src.size) {
+            mvaddch(r, 0, '~');
+            continue;
+        }
+        size_t next = next_line_start(src, pos);
+        size_t show = min(next - pos, (size_t)max(cols, 0));
+        show = src.read(src.ctx, pos, linebuf, show);
+        for (size_t i = 0; i < show; ++i) {
+            unsigned char c = (unsigned char)linebuf[i];
+            if (c == '\n' || c == '\r' || c == '\t') linebuf[i] = ' ';
+            else if (c < 32 || c > 126) linebuf[i] = '.';
+        }
+        mvaddnstr(r, 0, linebuf, (int)show);
+        if (match != string::npos && match >= pos && match < pos + show) {
+            size_t hl = min(match_len, pos + show - match);
+            mvchgat(r, (int)(match - pos), (int)hl, A_REVERSE, 0, NULL);
+        }
+        pos = next;
+    }
+
+    char status[256];
+    unsigned pct = src.size ? (unsigned)((double)pos * 100.0 / (double)src.size) : 100;
+    snprintf(status, sizeof(status), " %s  byte %zu/%zu (%u%%)  %s", src.title, top, src.size, pct,
+             msg.empty() ? "j/k line  f/b page  g/G ends  o offset  / search  n next  q quit" : msg.c_str());
+    attron(A_REVERSE);
+    mvaddnstr(rows - 1, 0, status, cols - 1);
+    attroff(A_REVERSE);
+    refresh();
+    return pos;
+}
+
+static string pager_prompt(const char* prompt) {
+    int rows, cols;
+    getmaxyx(stdscr, rows, cols);
+    (void)cols;
+    move(rows - 1, 0);
+    clrtoeol();
+    printw("%s", prompt);
+    echo();
+    curs_set(1);
+    char input[256];
+    getnstr(input, sizeof(input) - 1);
+    noecho();
+    curs_set(0);
+    return string(input);
+}
+
+static bool parse_offset(const string& text, size_t size, size_t& out) {
+    if (text.empty()) return false;
+    char* end = NULL;
+    unsigned long long v = strtoull(text.c_str(), &end, 0);
+    if (end == text.c_str()) return false;
+    if (*end == '%') {
+        out = (size_t)((double)size * (double)min(v, 100ULL) / 100.0);
+        return true;
+    }
+    if (*end == 'k' || *end == 'K') v <<= 10;
+    else if (*end == 'm' || *end == 'M') v <<= 20;
+    else if (*end == 'g' || *end == 'G') v <<= 30;
+    else if (*end != '\0') return false;
+    out = (size_t)v;
+    return true;
+}
+
+void run_pager(const PagerSource& src) {
+    size_t top = 0;
+    size_t match = string::npos;
+    string pattern;
+    string msg;
+    curs_set(0);
+    while (true) {
+        int rows, cols;
+        getmaxyx(stdscr, rows, cols);
+        (void)cols;
+        int page_rows = max(rows - 1, 1);
+        size_t bottom = draw_page(src, top, match, pattern.size(), msg);
+        msg.clear();
+        int ch = getch();
+
+        bool do_search = false;
+        switch (ch) {
+            case 'q':
+            case 'Q':
+            case 27:
+                return;
+            case 'j':
+            case '\n':
+            case KEY_DOWN:
+            case KEY_ENTER:
+                if (bottom < src.size) top = next_line_start(src, top);
+                break;
+            case 'k':
+            case KEY_UP:
+                top = prev_line_start(src, top);
+                break;
+            case ' ':
+            case 'f':
+            case KEY_NPAGE:
+                if (bottom < src.size) top = bottom;
+                break;
+            case 'b':
+            case KEY_PPAGE:
+                for (int i = 0; i < page_rows && top > 0; ++i) top = prev_line_start(src, top);
+                break;
+            case 'g':
+            case KEY_HOME:
+                top = 0;
+                break;
+            case 'G':
+            case KEY_END:
+                top = src.size;
+                for (int i = 0; i < page_rows && top > 0; ++i) top = prev_line_start(src, top);
+                break;
+            case 'o':
+            case ':': {
+                size_t off;
+                string text = pager_prompt("Jump to offset (bytes, K/M/G, or N%): ");
+                if (parse_offset(text, src.size, off)) {
+                    top = src.size ? find_line_start(src, min(off, src.size - 1)) : 0;
+                } else if (!text.empty()) {
+                    msg = "Invalid offset: " + text;
+                }
+                break;
+            }
+            case '/': {
+                string text = pager_prompt("/");
+                if (!text.empty()) {
+                    pattern = text;
+                    match = string::npos;
+                    do_search = true;
+                }
+                break;
+            }
+            case 'n':
+                if (pattern.empty()) msg = "No previous search";
+                else do_search = true;
+                break;
+            default:
+                break;
+        }
+
+        if (do_search) {
+            size_t from = (match != string::npos && match >= top && match < bottom) ? match + 1 : top;
+            move(rows - 1, 0);
+            clrtoeol();
+            printw("Searching for %s... (any key to stop)", pattern.c_str());
+            refresh();
+            size_t hit = search_forward(src, pattern, from, src.size);
+            if (hit == string::npos && from > 0) {
+                hit = search_forward(src, pattern, 0, min(src.size, from + pattern.size() - 1));
+                if (hit != string::npos) msg = "Search wrapped to top";
+            }
+            if (hit != string::npos) {
+                match = hit;
+                top = find_line_start(src, hit);
+            } else {
+                match = string::npos;
+                msg = "Pattern not found: " + pattern;
+            }
+        }
+    }
+}
+
+bool page_file(const char* filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return false;
+    }
+    FileSource fs;
+    fs.fd = fd;
+    fs.map = NULL;
+    PagerSource src;
+    src.title = filename;
+    src.size = (size_t)st.st_size;
+    src.read = read_fd;
+    src.ctx = &fs;
+    if (src.size > 0) {
+        void* m = mmap(NULL, src.size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m != MAP_FAILED) {
+            fs.map = (const char*)m;
+            src.read = read_mapped;
+        }
+    }
+    run_pager(src);
+    if (fs.map) munmap((void*)fs.map, src.size);
+    close(fd);
+    return true;
+}
@@ -0,0 +1,13 @@
+#ifndef PAGER_H
+#define PAGER_H
+#include <cstddef>
+typedef size_t (*pager_read_fn)(void* ctx, size_t offset, char* out, size_t len);
+struct PagerSource {
+    const char* title;
+    size_t size;
+    pager_read_fn read;
+    void* ctx;
+};
+void run_pager(const PagerSource& src);
+bool page_file(const char* filename);
+#endif
@@ -0,0 +1,246 @@
+#include "scheduler.h"
+#include <algorithm>
+
+using namespace std;
+
+namespace {
+
+// index of the worker running on this thread in current_pool
+thread_local const void* current_pool = nullptr;
+thread_local size_t current_worker = SIZE_MAX;
+
+uint64_t elapsed_ns(chrono::steady_clock::time_point from, chrono::steady_clock::time_point to) {
+    return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(to - from).count();
+}
+
+void store_max(atomic<uint64_t>& slot, uint64_t v) {
+    uint64_t cur = slot.load(memory_order_relaxed);
+    while (v > cur && !slot.compare_exchange_weak(cur, v, memory_order_relaxed)) {
+    }
+}
+
+} // namespace
+
+// The threads, shared by every Scheduler on them
+struct Scheduler::Pool {
+    vector<unique_ptr<Worker>> workers;
+    vector<thread> threads;
+    atomic<size_t> next_worker;
+    atomic<size_t> pending;
+    mutex sleep_m;
+    condition_variable sleep_cv;
+    bool stopping;
+
+    explicit Pool(unsigned n) : next_worker(0), pending(0), stopping(false) {
+        for (unsigned i = 0; i < n; ++i) workers.emplace_back(new Worker());
+        for (unsigned i = 0; i < n; ++i) threads.emplace_back(&Pool::worker_main, this, i);
+    }
+
+    // Every Scheduler on it has shut down by now, so nothing is queued
+    ~Pool() {
+        {
+            lock_guard<mutex> lk(sleep_m);
+            stopping = true;
+        }
+        sleep_cv.notify_all();
+        for (thread& t : threads) t.join();
+    }
+
+    void push(Task t, JobPriority prio) {
+        // Jobs spawned by a job stay on that worker; others are spread round-robin
+        size_t w = current_pool == this ? current_worker : next_worker++ % workers.size();
+        {
+            lock_guard<mutex> lk(workers[w]->m);
+            workers[w]->q[prio].push_back(move(t));
+        }
+        pending++;
+        {
+            lock_guard<mutex> lk(sleep_m);
+        }
+        sleep_cv.notify_one();
+    }
+
+    // The job is counted as running for its owner before the lock it was
+    // taken under goes, so Scheduler::shutdown() cannot miss it
+    bool take(size_t self, Task& out) {
+        size_t n = workers.size();
+        for (size_t p = 0; p < PRIO_COUNT; ++p) {
+            for (size_t k = 0; k < n; ++k) {
+                Worker& w = *workers[(self + k) % n];
+                lock_guard<mutex> lk(w.m);
+                if (w.q[p].empty()) continue;
+                if (k == 0) {
+                    out = move(w.q[p].back());
+                    w.q[p].pop_back();
+                } else {
+                    out = move(w.q[p].front());
+                    w.q[p].pop_front();
+                }
+                out.owner->queued[p]--;
+                out.owner->running++;
+                pending--;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void worker_main(size_t self) {
+        current_pool = this;
+        current_worker = self;
+        while (true) {
+            Task t;
+            if (take(self, t)) {
+                run(t);
+                continue;
+            }
+            unique_lock<mutex> lk(sleep_m);
+            if (stopping) return;
+            sleep_cv.wait(lk, [this] { return pending.load() > 0 || stopping; });
+        }
+    }
+};
+
+Scheduler::Scheduler(unsigned n)
+    : want_workers(n), started(nullptr), closed(false), posted(nullptr), running(0), completed(0), cancelled(0),
+      wait_ns(0), wait_max_ns(0), run_ns(0), run_max_ns(0) {
+    if (want_workers == 0) {
+        // leave a core for the UI thread
+        unsigned hw = thread::hardware_concurrency();
+        want_workers = hw > 1 ? hw - 1 : 1;
+    }
+    for (size_t p = 0; p < PRIO_COUNT; ++p) queued[p] = 0;
+}
+
+Scheduler::~Scheduler() {
+    shutdown();
+    // Results nobody collected are dropped
+    Posted* p = posted.exchange(nullptr);
+    while (p) {
+        Posted* next = p->next;
+        delete p;
+        p = next;
+    }
+}
+
+Scheduler::Pool& Scheduler::workers() {
+    Pool* p = started.load(memory_order_acquire);
+    if (p) return *p;
+    lock_guard<mutex> lk(pool_m);
+    if (!pool) pool = make_shared<Pool>(want_workers);
+    started.store(pool.get(), memory_order_release);
+    return *pool;
+}
+
+void Scheduler::share(Scheduler& other) {
+    other.workers();
+    lock_guard<mutex> lk(pool_m);
+    pool = other.pool;
+    started.store(pool.get(), memory_order_release);
+}
+
+void Scheduler::wait_idle() {
+    unique_lock<mutex> lk(idle_m);
+    idle_cv.wait(lk, [this] { return running.load() == 0; });
+}
+
+void Scheduler::shutdown() {
+    closed = true;
+    Pool* p = started.load(memory_order_acquire);
+    if (!p) return;
+    // Our running jobs may still submit; once they are done nothing of
+    // ours is added, and what is left queued goes
+    wait_idle();
+    for (unique_ptr<Worker>& w : p->workers) {
+        lock_guard<mutex> lk(w->m);
+        for (size_t prio = 0; prio < PRIO_COUNT; ++prio) {
+            deque<Task>& q = w->q[prio];
+            auto mine = stable_partition(q.begin(), q.end(), [this](const Task& t) { return t.owner != this; });
+            size_t n = q.end() - mine;
+            q.erase(mine, q.end());
+            queued[prio] -= n;
+            p->pending -= n;
+            cancelled += n;
+        }
+    }
+    // A worker may have taken one of them meanwhile (and skips it)
+    wait_idle();
+}
+
+void Scheduler::submit(JobFn fn, JobPriority prio, CancelPtr token) {
+    if (closed) return;
+    Task t;
+    t.fn = move(fn);
+    t.token = move(token);
+    t.queued_at = chrono::steady_clock::now();
+    t.owner = this;
+    queued[prio]++;
+    workers().push(move(t), prio);
+}
+
+void Scheduler::run(Task& t) {
+    Scheduler& s = *t.owner;
+    auto start = chrono::steady_clock::now();
+    uint64_t waited = elapsed_ns(t.queued_at, start);
+    s.wait_ns += waited;
+    store_max(s.wait_max_ns, waited);
+    static const CancelToken never;
+    const CancelToken& token = t.token ? *t.token : never;
+    if (s.closed || token.cancelled()) {
+        s.cancelled++;
+    } else {
+        t.fn(token);
+        uint64_t ran = elapsed_ns(start, chrono::steady_clock::now());
+        s.run_ns += ran;
+        store_max(s.run_max_ns, ran);
+        if (token.cancelled()) s.cancelled++;
+        else s.completed++;
+    }
+    // The job goes before its owner may (shutdown() waits for running)
+    t = Task();
+    lock_guard<mutex> lk(s.idle_m);
+    if (--s.running == 0) s.idle_cv.notify_all();
+}
+
+void Scheduler::post(function<void()> fn) {
+    Posted* node = new Posted{ move(fn), posted.load(memory_order_relaxed) };
+    while (!posted.compare_exchange_weak(node->next, node, memory_order_release, memory_order_relaxed)) {
+    }
+}
+
+size_t Scheduler::run_posted() {
+    Posted* list = posted.exchange(nullptr, memory_order_acquire);
+    // The stack holds newest first; reverse it to run in posting order
+    Posted* ordered = nullptr;
+    while (list) {
+        Posted* next = list->next;
+        list->next = ordered;
+        ordered = list;
+        list = next;
+    }
+    size_t n = 0;
+    while (ordered) {
+        Posted* next = ordered->next;
+        ordered->fn();
+        delete ordered;
+        ordered = next;
+        n++;
+    }
+    return n;
+}
+
+SchedulerStats Scheduler::stats() const {
+    SchedulerStats s;
+    Pool* pl = started.load(memory_order_acquire);
+    s.workers = pl ? (unsigned)pl->workers.size() : want_workers;
+    for (size_t p = 0; p < PRIO_COUNT; ++p) s.queued[p] = queued[p].load();
+    s.running = running.load();
+    s.completed = completed.load();
+    s.cancelled = cancelled.load();
+    uint64_t jobs = s.completed + s.cancelled;
+    s.wait_avg_ms = jobs ? wait_ns.load() / 1e6 / (double)jobs : 0.0;
+    s.wait_max_ms = wait_max_ns.load() / 1e6;
+    s.run_avg_ms = jobs ? run_ns.load() / 1e6 / (double)jobs : 0.0;
+    s.run_max_ms = run_max_ns.load() / 1e6;
+    return s;
+}
@@ -0,0 +1,122 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+
+// Shared thread pool for background editor work (saving, searching,
+// indexing...). Every worker owns one deque per priority; it pops its own
+// work LIFO and steals from the other workers FIFO when it runs dry.
+// Viewport jobs are always taken before normal and idle ones.
+//
+// The workers are started with the first job. A Scheduler can instead run
+// on the workers of another one (share()), as the sessions of a server do:
+// its jobs, posts, shutdown() and stats stay its own.
+
+enum JobPriority { PRIO_VIEWPORT, PRIO_NORMAL, PRIO_IDLE, PRIO_COUNT };
+
+// Cooperative cancellation. A token can be cancelled explicitly, or tied to
+// a version counter (e.g. the buffer version) so it goes stale by itself
+// as soon as that counter moves on.
+class CancelToken {
+public:
+    CancelToken() : flag(false), watched(nullptr), version(0) {}
+    CancelToken(const std::atomic<uint64_t>* watched, uint64_t version)
+        : flag(false), watched(watched), version(version) {}
+
+    void cancel() { flag.store(true, std::memory_order_relaxed); }
+    bool cancelled() const {
+        return flag.load(std::memory_order_relaxed) ||
+               (watched && watched->load(std::memory_order_relaxed) != version);
+    }
+
+private:
+    std::atomic<bool> flag;
+    const std::atomic<uint64_t>* watched;
+    uint64_t version;
+};
+typedef std::shared_ptr<CancelToken> CancelPtr;
+
+struct SchedulerStats {
+    unsigned workers;
+    size_t queued[PRIO_COUNT];
+    size_t running;
+    uint64_t completed;
+    uint64_t cancelled;
+    double wait_avg_ms, wait_max_ms; // time spent queued
+    double run_avg_ms, run_max_ms;   // time spent running
+};
+
+class Scheduler {
+public:
+    typedef std::function<void(const CancelToken&)> JobFn;
+
+    explicit Scheduler(unsigned workers = 0);
+    ~Scheduler();
+
+    // Run on other's workers instead of starting our own. Call before the
+    // first submit.
+    void share(Scheduler& other);
+
+    // Waits for our running jobs and drops our queued ones; none of ours
+    // runs after it returns, and later submits are dropped. Jobs of other
+    // schedulers on the same workers go on. The destructor does it too.
+    void shutdown();
+
+    // Jobs whose token is already cancelled when they are dequeued are skipped.
+    void submit(JobFn fn, JobPriority prio = PRIO_NORMAL, CancelPtr token = CancelPtr());
+
+    // Hand fn to the main loop. Lock-free; callable from any thread.
+    void post(std::function<void()> fn);
+    // Main loop side: run everything posted so far, oldest first.
+    size_t run_posted();
+
+    SchedulerStats stats() const;
+
+private:
+    struct Task {
+        JobFn fn;
+        CancelPtr token;
+        std::chrono::steady_clock::time_point queued_at;
+        Scheduler* owner;
+    };
+    struct Worker {
+        std::mutex m;
+        std::deque<Task> q[PRIO_COUNT];
+    };
+    struct Pool;
+    struct Posted {
+        std::function<void()> fn;
+        Posted* next;
+    };
+
+    unsigned want_workers;
+    std::mutex pool_m;
+    std::shared_ptr<Pool> pool;
+    std::atomic<Pool*> started; // pool once it is there
+
+    std::atomic<bool> closed;
+    std::mutex idle_m;
+    std::condition_variable idle_cv; // running dropped to 0
+
+    std::atomic<Posted*> posted;
+
+    std::atomic<size_t> queued[PRIO_COUNT];
+    std::atomic<size_t> running; // taken off a queue and not finished
+    std::atomic<uint64_t> completed, cancelled;
+    std::atomic<uint64_t> wait_ns, wait_max_ns, run_ns, run_max_ns;
+
+    Pool& workers();
+    void wait_idle();
+    static void run(Task& t);
+};
+
+#endif // SCHEDULER_H
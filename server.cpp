@@ -0,0 +1,616 @@
+#include "server.h"
+#include "editor.h"
+#include <ncurses.h>
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+
+// Client to server: a type byte, a 32-bit length and the payload. Fields
+// of a payload are separated by NULs. The server answers a session with
+// plain terminal output and an open with an error message, if any.
+const char MSG_HELLO = 'h';  // rows, cols, cwd, files...
+const char MSG_KEYS = 'k';   // raw bytes typed
+const char MSG_RESIZE = 'r'; // rows, cols
+const char MSG_OPEN = 'o';   // files... (--remote)
+const uint32_t MSG_MAX = 1 << 20;
+
+bool write_all(int fd, const char* p, size_t n) {
+    while (n > 0) {
+        ssize_t k = write(fd, p, n);
+        if (k < 0 && errno == EINTR) continue;
+        if (k <= 0) return false;
+        p += k;
+        n -= k;
+    }
+    return true;
+}
+
+bool read_all(int fd, char* p, size_t n) {
+    while (n > 0) {
+        ssize_t k = read(fd, p, n);
+        if (k < 0 && errno == EINTR) continue;
+        if (k <= 0) return false;
+        p += k;
+        n -= k;
+    }
+    return true;
+}
+
+bool send_msg(int fd, char type, const string& payload) {
+    string m(1, type);
+    uint32_t len = (uint32_t)payload.size();
+    m.append((const char*)&len, sizeof(len));
+    m += payload;
+    return write_all(fd, m.data(), m.size());
+}
+
+bool recv_msg(int fd, char& type, string& payload) {
+    char head[1 + sizeof(uint32_t)];
+    if (!read_all(fd, head, sizeof(head))) return false;
+    type = head[0];
+    uint32_t len;
+    memcpy(&len, head + 1, sizeof(len));
+    if (len > MSG_MAX) return false;
+    payload.resize(len);
+    return read_all(fd, &payload[0], len);
+}
+
+string join_fields(const vector<string>& fields) {
+    string out;
+    for (size_t i = 0; i < fields.size(); ++i) {
+        if (i > 0) out += '\0';
+        out += fields[i];
+    }
+    return out;
+}
+
+vector<string> split_fields(const string& s) {
+    vector<string> out;
+    size_t start = 0;
+    while (start <= s.size()) {
+        size_t end = s.find('\0', start);
+        if (end == string::npos) end = s.size();
+        out.push_back(s.substr(start, end - start));
+        start = end + 1;
+    }
+    return out;
+}
+
+// Sessions run in the server's directory, so clients send full paths;
+// they are also what SharedBuffers knows a file by
+string full_path(const string& f) {
+    char* real = realpath(f.c_str(), nullptr);
+    if (real) {
+        string out = real;
+        free(real);
+        return out;
+    }
+    if (!f.empty() && f[0] == '/') return f;
+    char cwd[4096];
+    if (!getcwd(cwd, sizeof(cwd))) return f;
+    return string(cwd) + "/" + f;
+}
+
+// Whether the other end of a Unix socket runs as our user. Both sides ask:
+// nobody else may attach to our buffers or pose as our server.
+bool same_user(int fd) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == getuid();
+}
+
+// Without $XDG_RUNTIME_DIR the socket goes in a directory of our own in /tmp
+string fallback_dir() {
+    return "/tmp/main10-" + to_string(getuid());
+}
+
+int connect_to(const string& path) {
+    struct sockaddr_un addr = {};
+    if (path.size() >= sizeof(addr.sun_path)) return -1;
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.c_str(), path.size());
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || !same_user(fd)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Server side
+
+SharedBuffers shared_buffers;
+
+// The SCREEN all terminals share writes to screen_out, a memory file that
+// is handed to the current terminal whenever a ScreenLock ends
+recursive_mutex screen_m;
+thread_local int screen_depth = 0;
+SCREEN* screen = nullptr;
+FILE* screen_out = nullptr;
+int screen_fd = -1;
+Terminal* current = nullptr;
+
+bool open_screen() {
+    screen_fd = memfd_create("main10-screen", MFD_CLOEXEC);
+    if (screen_fd < 0) return false;
+    screen_out = fdopen(screen_fd, "w+");
+    // Keys come from the clients; curses gets nothing to read
+    FILE* in = fopen("/dev/null", "r");
+    if (!screen_out || !in) return false;
+    const char* type = getenv("TERM");
+    screen = newterm(type && *type ? type : "xterm", screen_out, in);
+    if (!screen) screen = newterm("xterm", screen_out, in);
+    if (!screen) return false;
+    set_term(screen);
+    typeahead(-1);
+    return true;
+}
+
+// Writes terminfo capability cap straight to fd, outside curses' buffer
+void put_cap(int fd, const char* cap) {
+    char* s = tigetstr(cap);
+    if (s && s != (char*)-1) write_all(fd, s, strlen(s));
+}
+
+// Live sessions; --remote goes to the one with the latest input
+struct Session {
+    Editor* ed;
+    uint64_t last_input;
+};
+mutex sessions_m;
+vector<Session*> sessions;
+uint64_t input_clock = 0;
+
+// Copies what curses writes for a session to its client. Curses writes
+// with the screen lock held, so a client that stops reading must not block
+// it (and with it every other session): the output waits here instead.
+// Closes the connection once the session's screen is gone.
+void pump_output(int from, int sock) {
+    string pending;
+    char chunk[65536];
+    bool open = true;
+    while (open || !pending.empty()) {
+        struct pollfd fds[2] = { { open ? from : -1, POLLIN, 0 }, { pending.empty() ? -1 : sock, POLLOUT, 0 } };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP)) {
+            ssize_t k = read(from, chunk, sizeof(chunk));
+            if (k > 0) pending.append(chunk, k);
+            else if (k == 0 || errno != EINTR) open = false;
+        }
+        if (fds[1].revents & (POLLERR | POLLHUP)) break;
+        if (fds[1].revents & POLLOUT) {
+            ssize_t k = send(sock, pending.data(), pending.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (k > 0) pending.erase(0, k);
+            else if (k < 0 && errno != EAGAIN && errno != EINTR) break;
+        }
+    }
+    close(from);
+    shutdown(sock, SHUT_RDWR);
+}
+
+void run_session(int sock, const vector<string>& hello, Scheduler& jobs) {
+    int rows = max(atoi(hello[0].c_str()), 2), cols = max(atoi(hello[1].c_str()), 10);
+    // A client whose directory has no name left works in ours
+    string cwd = !hello[2].empty() && hello[2][0] == '/' ? hello[2] : string();
+    vector<string> files(hello.begin() + 3, hello.end());
+    int keys[2], out[2];
+    if (pipe2(keys, O_CLOEXEC) != 0) return;
+    if (pipe2(out, O_CLOEXEC) != 0) {
+        close(keys[0]);
+        close(keys[1]);
+        return;
+    }
+    {
+        Terminal term(out[1], rows, cols);
+        Editor ed;
+        Session self = { &ed, 0 };
+        ed.attach(&shared_buffers, &term, keys[0], cwd, jobs);
+        {
+            lock_guard<mutex> lk(sessions_m);
+            self.last_input = ++input_clock;
+            sessions.push_back(&self);
+        }
+        thread pump(pump_output, out[0], sock);
+        thread reader([&] {
+            char type;
+            string payload;
+            while (recv_msg(sock, type, payload)) {
+                if (type == MSG_KEYS) {
+                    write_all(keys[1], payload.data(), payload.size());
+                    lock_guard<mutex> lk(sessions_m);
+                    self.last_input = ++input_clock;
+                } else if (type == MSG_RESIZE) {
+                    vector<string> size = split_fields(payload);
+                    if (size.size() == 2) ed.resize(max(atoi(size[0].c_str()), 2), max(atoi(size[1].c_str()), 10));
+                }
+            }
+            // The client went away: the editor sees its input end and
+            // hangs up, keeping unsaved edits in the sessions as :q does
+            close(keys[1]);
+        });
+        ed.run(files);
+        {
+            lock_guard<mutex> lk(sessions_m);
+            sessions.erase(find(sessions.begin(), sessions.end(), &self));
+        }
+        // Once the terminal is put back the pump sends the last of it and
+        // hangs up, which ends the reader. The editor still drains the key
+        // pipe until then.
+        term.close();
+        pump.join();
+        reader.join();
+    }
+    close(keys[0]);
+}
+
+// --remote: :e every file in the session typed in last
+string open_remote(const vector<string>& files) {
+    lock_guard<mutex> lk(sessions_m);
+    if (sessions.empty()) return "no session to open files in";
+    Session* last = *max_element(sessions.begin(), sessions.end(),
+                                 [](const Session* a, const Session* b) { return a->last_input < b->last_input; });
+    for (const string& f : files) {
+        if (f.empty() || f.find('\n') != string::npos) continue;
+        last->ed->feed("\x1b\x1b:e " + f + "\n");
+    }
+    return "";
+}
+
+void serve(int sock, Scheduler* jobs) {
+    char type;
+    string payload;
+    if (same_user(sock) && recv_msg(sock, type, payload)) {
+        vector<string> fields = split_fields(payload);
+        if (type == MSG_HELLO && fields.size() >= 3) {
+            run_session(sock, fields, *jobs);
+        } else if (type == MSG_OPEN) {
+            string err = open_remote(fields);
+            write_all(sock, err.data(), err.size());
+        }
+    }
+    close(sock);
+}
+
+// Client side
+
+int winch_pipe[2] = { -1, -1 };
+
+void on_winch(int) {
+    int saved = errno;
+    char c = 'w';
+    (void)!write(winch_pipe[1], &c, 1);
+    errno = saved;
+}
+
+string window_size() {
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) != 0 || ws.ws_row == 0 || ws.ws_col == 0) return join_fields({ "24", "80" });
+    return join_fields({ to_string(ws.ws_row), to_string(ws.ws_col) });
+}
+
+} // namespace
+
+string socket_path() {
+    const char* env = getenv("MAIN10_SOCKET");
+    if (env && *env) return env;
+    const char* run = getenv("XDG_RUNTIME_DIR");
+    return (run && *run ? string(run) : fallback_dir()) + "/main10.sock";
+}
+
+bool SharedBuffers::get(const string& path, Entry& out) const {
+    lock_guard<mutex> lk(m);
+    auto it = entries.find(path);
+    if (it == entries.end()) return false;
+    out = it->second;
+    return true;
+}
+
+uint64_t SharedBuffers::publish(const string& path, const TextBuffer& lines, Compression comp, bool mapped, bool clean,
+                                uint64_t base, bool force) {
+    // The old snapshot is dropped outside the lock
+    Entry old;
+    lock_guard<mutex> lk(m);
+    auto it = entries.find(path);
+    if (it != entries.end() && it->second.serial != base && !force) return 0;
+    Entry& e = entries[path];
+    old = e;
+    e.lines = lines;
+    e.comp = comp;
+    e.mapped = mapped;
+    e.clean = clean;
+    e.serial = ++last_serial;
+    return e.serial;
+}
+
+void SharedBuffers::set_hot(const void* session, HotRanges ranges) {
+    lock_guard<mutex> lk(m);
+    if (ranges.empty()) hot.erase(session);
+    else hot[session] = move(ranges);
+}
+
+SharedBuffers::HotRanges SharedBuffers::all_hot() const {
+    lock_guard<mutex> lk(m);
+    HotRanges out;
+    for (const auto& h : hot) out.insert(out.end(), h.second.begin(), h.second.end());
+    return out;
+}
+
+void SharedBuffers::forget(const string& path) {
+    Entry old;
+    lock_guard<mutex> lk(m);
+    auto it = entries.find(path);
+    if (it == entries.end()) return;
+    old = it->second;
+    entries.erase(it);
+}
+
+Terminal::Terminal(int out_fd, int rows, int cols)
+    : out(out_fd), want_rows(rows), want_cols(cols), drawn(nullptr), shown(nullptr), drawn_y(0), drawn_x(0),
+      shown_y(0), shown_x(0), started(false) {}
+
+Terminal::~Terminal() {
+    close();
+}
+
+void Terminal::resize(int rows, int cols) {
+    want_rows = rows;
+    want_cols = cols;
+}
+
+void Terminal::close() {
+    ScreenLock lock(nullptr);
+    if (current == this) current = nullptr;
+    if (drawn) delwin(drawn);
+    if (shown) delwin(shown);
+    drawn = shown = nullptr;
+    if (out < 0) return;
+    if (started) {
+        put_cap(out, "sgr0");
+        put_cap(out, "cnorm");
+        char* cup = tigetstr("cup");
+        if (cup && cup != (char*)-1) {
+            char* s = tparm(cup, want_rows - 1, 0);
+            if (s) write_all(out, s, strlen(s));
+        }
+        put_cap(out, "rmcup");
+    }
+    ::close(out);
+    out = -1;
+}
+
+// The screen becomes this terminal's: the contents of the one before go to
+// its copies and this one's come back from them. The physical cursor is
+// set again, since curses moves it relative to where it thinks it is.
+void Terminal::swap_in() {
+    int rows = want_rows, cols = want_cols;
+    if (current == this && rows == LINES && cols == COLS) return;
+    if (current && current != this) current->swap_out();
+    if (rows != LINES || cols != COLS) resize_term(rows, cols);
+    auto copy = [](WINDOW* from, WINDOW* to) {
+        int r = min(getmaxy(from), getmaxy(to)), c = min(getmaxx(from), getmaxx(to));
+        copywin(from, to, 0, 0, 0, 0, r - 1, c - 1, FALSE);
+    };
+    if (!started) {
+        // A new client: to the alternate screen, cleared on the first refresh
+        put_cap(out, "smcup");
+        werase(stdscr);
+        clearok(curscr, TRUE);
+        started = true;
+    } else if (current != this) {
+        copy(drawn, stdscr);
+        wmove(stdscr, drawn_y, drawn_x);
+        copy(shown, curscr);
+        copy(shown, newscr);
+        // Resized while another terminal was current: what it shows may
+        // have been rewrapped
+        clearok(curscr, getmaxy(shown) != rows || getmaxx(shown) != cols);
+        mvcur(-1, -1, shown_y, shown_x);
+    } else {
+        clearok(curscr, TRUE);
+    }
+    current = this;
+}
+
+void Terminal::swap_out() {
+    for (WINDOW** w : { &drawn, &shown }) {
+        if (*w && getmaxy(*w) == LINES && getmaxx(*w) == COLS) continue;
+        if (*w) delwin(*w);
+        *w = newpad(LINES, COLS);
+    }
+    copywin(stdscr, drawn, 0, 0, 0, 0, LINES - 1, COLS - 1, FALSE);
+    getyx(stdscr, drawn_y, drawn_x);
+    copywin(curscr, shown, 0, 0, 0, 0, LINES - 1, COLS - 1, FALSE);
+    getyx(curscr, shown_y, shown_x);
+}
+
+// Sends this terminal what curses wrote while it was current
+void Terminal::flush() {
+    // Output of mvcur and putp waits in curses' buffer until an update
+    doupdate();
+    fflush(screen_out);
+    off_t n = lseek(screen_fd, 0, SEEK_END);
+    if (n > 0) {
+        string bytes(n, '\0');
+        if (pread(screen_fd, &bytes[0], n, 0) == n && out >= 0) write_all(out, bytes.data(), n);
+    }
+    if (ftruncate(screen_fd, 0) != 0) return;
+    fseek(screen_out, 0, SEEK_SET);
+}
+
+ScreenLock::ScreenLock(Terminal* term) : t(term) {
+    screen_m.lock();
+    if (screen_depth++ == 0 && t) t->swap_in();
+}
+
+ScreenLock::~ScreenLock() {
+    if (--screen_depth == 0 && t) t->flush();
+    screen_m.unlock();
+}
+
+int run_server(const string& path) {
+    signal(SIGPIPE, SIG_IGN);
+    if (!open_screen()) {
+        fprintf(stderr, "main10: cannot set up a screen for TERM=%s\n", getenv("TERM") ? getenv("TERM") : "");
+        return 1;
+    }
+    struct sockaddr_un addr = {};
+    if (path.size() >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "main10: socket path too long: %s\n", path.c_str());
+        return 1;
+    }
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.c_str(), path.size());
+    string dir = path.substr(0, path.rfind('/'));
+    if (dir == fallback_dir()) {
+        // Anyone can make it first in /tmp: it has to be ours and closed to others
+        mkdir(dir.c_str(), 0700);
+        struct stat st;
+        if (lstat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077)) {
+            fprintf(stderr, "main10: %s is not a directory only we can use\n", dir.c_str());
+            return 1;
+        }
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("main10: socket");
+        return 1;
+    }
+    // The socket is created 0600, never open to others even for a moment
+    mode_t old_mask = umask(077);
+    bool bound = bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+    if (!bound && errno == EADDRINUSE) {
+        // Left over from a server that is gone, unless one still answers
+        int other = connect_to(path);
+        if (other >= 0) {
+            close(other);
+            fprintf(stderr, "main10: a server is already running on %s\n", path.c_str());
+            close(fd);
+            return 1;
+        }
+        unlink(path.c_str());
+        bound = bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+    }
+    umask(old_mask);
+    if (!bound || listen(fd, 16) != 0) {
+        perror(("main10: " + path).c_str());
+        close(fd);
+        return 1;
+    }
+    fprintf(stderr, "main10: serving on %s (main10 --client [file...] to attach)\n", path.c_str());
+    // One set of workers for all sessions
+    Scheduler jobs;
+    while (true) {
+        int c = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (c < 0) {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE) continue;
+            perror("main10: accept");
+            break;
+        }
+        thread(serve, c, &jobs).detach();
+    }
+    close(fd);
+    unlink(path.c_str());
+    return 1;
+}
+
+int run_client(const string& path, const vector<string>& files) {
+    int fd = connect_to(path);
+    if (fd < 0) {
+        fprintf(stderr, "main10: no server on %s (start one with main10 --server)\n", path.c_str());
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    vector<string> hello = split_fields(window_size());
+    // Paths typed in the session are the client's too
+    hello.push_back(full_path("."));
+    for (const string& f : files) hello.push_back(full_path(f));
+    if (!send_msg(fd, MSG_HELLO, join_fields(hello))) {
+        perror("main10: send");
+        close(fd);
+        return 1;
+    }
+
+    // Raw mode: every key goes to the server as typed
+    struct termios saved;
+    bool tty = tcgetattr(STDIN_FILENO, &saved) == 0;
+    if (tty) {
+        struct termios raw = saved;
+        cfmakeraw(&raw);
+        tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+    }
+    if (pipe2(winch_pipe, O_CLOEXEC | O_NONBLOCK) == 0) {
+        struct sigaction sa = {};
+        sa.sa_handler = on_winch;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = SA_RESTART;
+        sigaction(SIGWINCH, &sa, nullptr);
+    }
+
+    char chunk[65536];
+    bool input = true;
+    while (true) {
+        struct pollfd fds[3] = { { input ? STDIN_FILENO : -1, POLLIN, 0 }, { fd, POLLIN, 0 }, { winch_pipe[0], POLLIN, 0 } };
+        if (poll(fds, 3, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t k = read(fd, chunk, sizeof(chunk));
+            if (k < 0 && errno == EINTR) continue;
+            if (k <= 0 || !write_all(STDOUT_FILENO, chunk, k)) break;
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP)) {
+            ssize_t k = read(STDIN_FILENO, chunk, sizeof(chunk));
+            if (k > 0) send_msg(fd, MSG_KEYS, string(chunk, k));
+            else if (k == 0 || errno != EINTR) input = false;
+        }
+        if (fds[2].revents & POLLIN) {
+            while (read(winch_pipe[0], chunk, sizeof(chunk)) > 0) {
+            }
+            send_msg(fd, MSG_RESIZE, window_size());
+        }
+    }
+    if (tty) tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+    close(fd);
+    return 0;
+}
+
+int run_remote(const string& path, const vector<string>& files) {
+    int fd = connect_to(path);
+    if (fd < 0) {
+        fprintf(stderr, "main10: no server on %s\n", path.c_str());
+        return 1;
+    }
+    vector<string> full;
+    for (const string& f : files) full.push_back(full_path(f));
+    string reply;
+    if (send_msg(fd, MSG_OPEN, join_fields(full))) {
+        char chunk[512];
+        ssize_t k;
+        while ((k = read(fd, chunk, sizeof(chunk))) > 0) reply.append(chunk, k);
+    }
+    close(fd);
+    if (!reply.empty()) fprintf(stderr, "main10: %s\n", reply.c_str());
+    return reply.empty() ? 0 : 1;
+}
@@ -0,0 +1,127 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include "compress.h"
+#include "buffer.h"
+
+// Client/server mode. `main10 --server` holds the editors; every
+// `main10 --client [file...]` is a terminal attached over a Unix socket
+// with a session of its own on the server. The client only passes bytes:
+// keys one way and what curses writes for the session's screen the other,
+// which is already just the cells that changed since the last frame.
+// `main10 --remote file...` opens files in the session typed in last.
+//
+// Sessions share their buffers through SharedBuffers: opening a file
+// another session has loaded takes its latest snapshot (tree nodes, chunks
+// and mapped pages are shared, nothing is read), and edits are published
+// after every batch of keys and picked up by the other sessions when idle.
+
+struct _win_st; // curses' WINDOW
+
+// A client's terminal. The server draws on one curses SCREEN for all of
+// them: this ncurses keeps a single list of windows, so screens of their
+// own could not be resized or freed without breaking the others. Instead
+// each terminal keeps copies of what it shows (curscr) and of what was
+// drawn for it (stdscr), swapped in while its session holds a ScreenLock,
+// and gets what curses wrote in the meantime. Curses then compares against
+// this terminal's own screen, so only the cells that changed go out.
+class Terminal {
+public:
+    Terminal(int out_fd, int rows, int cols);
+    ~Terminal();
+    // The client's window changed size; applied on the next ScreenLock
+    void resize(int rows, int cols);
+    // Puts the client's terminal back as endwin() would and closes out_fd
+    // (also done by the destructor)
+    void close();
+
+private:
+    friend class ScreenLock;
+    int out;
+    std::atomic<int> want_rows, want_cols;
+    struct _win_st* drawn; // stdscr while another terminal is current
+    struct _win_st* shown; // curscr likewise
+    int drawn_y, drawn_x, shown_y, shown_x;
+    bool started;
+
+    void swap_in();
+    void swap_out();
+    void flush();
+};
+
+// Held around curses calls. Serializes them between sessions and makes
+// t's terminal the one curses draws on; t is null on the process's own
+// terminal. May be nested.
+class ScreenLock {
+public:
+    explicit ScreenLock(Terminal* t);
+    ~ScreenLock();
+    ScreenLock(const ScreenLock&) = delete;
+    ScreenLock& operator=(const ScreenLock&) = delete;
+
+private:
+    Terminal* t;
+};
+
+// Where the server listens: $MAIN10_SOCKET, or main10.sock in
+// $XDG_RUNTIME_DIR or else in /tmp/main10-<uid>/ (made 0700 by the server).
+// Only processes of the same user are served or trusted as the server.
+std::string socket_path();
+
+int run_server(const std::string& path);
+int run_client(const std::string& path, const std::vector<std::string>& files);
+int run_remote(const std::string& path, const std::vector<std::string>& files);
+
+// Where a buffer of a session stands against SharedBuffers: the serial it
+// was last published or taken at and that snapshot (base), its version()
+// and whether it matched the file at the last try, and whether that try
+// lost to another session that changed the same lines
+struct SharedPos {
+    uint64_t serial = 0;
+    TextBuffer base;
+    uint64_t version = 0;
+    bool clean = false;
+    bool diverged = false;
+};
+
+class SharedBuffers {
+public:
+    struct Entry {
+        TextBuffer lines; // without anchors; marks belong to each session
+        Compression comp;
+        bool mapped;
+        bool clean;
+        uint64_t serial;
+    };
+
+    // Latest snapshot of path; false when no session has published it
+    bool get(const std::string& path, Entry& out) const;
+    // Makes lines the latest snapshot of path if it is still at serial
+    // `base` (0 when the caller never had it), if nobody has it, or if
+    // force. Returns the new serial, 0 when another session got there first.
+    uint64_t publish(const std::string& path, const TextBuffer& lines, Compression comp, bool mapped, bool clean,
+                     uint64_t base, bool force);
+    // The next session to open path reads it again (:q!)
+    void forget(const std::string& path);
+
+    // TextBuffer::page_out() is process-wide, so the pages every session
+    // is looking at have to be kept: each one files its hot ranges under
+    // its own key (empty when it ends) and paging keeps all of them
+    typedef std::vector<std::pair<const char*, const char*>> HotRanges;
+    void set_hot(const void* session, HotRanges hot);
+    HotRanges all_hot() const;
+
+private:
+    mutable std::mutex m;
+    std::map<std::string, Entry> entries;
+    uint64_t last_serial = 0;
+    std::map<const void*, HotRanges> hot;
+};
+
+#endif // SERVER_H
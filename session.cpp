@@ -0,0 +1,422 @@
+#include "session.h"
+#include "compress.h"
+#include "cache.h"
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <cerrno>
+#include <algorithm>
+#include <deque>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+namespace {
+
+const char SESSION_MAGIC[8] = { 'M', 'V', 'S', 'E', 'S', 'S', '\0', '\0' };
+const uint32_t SESSION_VERSION = 3;
+// bytes hashed at each end of the source file to detect changes
+const size_t HASH_SAMPLE = 64 * 1024;
+// how far ahead in the source a changed line may re-synchronise (deleted lines)
+const size_t MATCH_WINDOW = 256;
+
+enum PieceKind : uint32_t { PIECE_COPY = 0, PIECE_LITERAL = 1 };
+
+struct LineEntry {
+    uint64_t off;
+    uint32_t len;
+    uint32_t pad;
+};
+
+// COPY: the whole source lines in bytes [start, start + count) of the source.
+// LITERAL: count lines starting at literal entry `start`.
+struct Piece {
+    uint32_t kind;
+    uint32_t pad;
+    uint64_t start;
+    uint64_t count;
+};
+
+struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t has_undo;
+    uint32_t modified;
+    uint32_t mapped; // the buffer was mapped: copied lines are not clipped
+    uint64_t src_size;
+    int64_t src_mtime_sec;
+    int64_t src_mtime_nsec;
+    uint64_t src_hash;
+    uint64_t line_limit; // copied lines are clipped to this when not mapped
+    uint64_t cy, cx, top_line, undo_cy, undo_cx;
+    Section literals; // LineEntry[] into the text section
+    Section text;     // raw bytes, count is the size
+    Section pieces;   // Piece[] for the buffer
+    Section undo;     // Piece[] for the undo snapshot
+    Section yank;     // literal entries [off, off + count)
+};
+
+struct Mapping {
+    const char* data;
+    size_t size;
+    Mapping() : data(nullptr), size(0) {}
+    ~Mapping() {
+        if (data) munmap((void*)data, size);
+    }
+    bool map(const string& path, struct stat* st) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat tmp;
+        if (!st) st = &tmp;
+        bool ok = fstat(fd, st) == 0 && S_ISREG(st->st_mode);
+        if (ok && st->st_size > 0) {
+            void* m = mmap(nullptr, (size_t)st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (m == MAP_FAILED) ok = false;
+            else {
+                data = (const char*)m;
+                size = (size_t)st->st_size;
+            }
+        }
+        close(fd);
+        return ok;
+    }
+};
+
+uint64_t sample_hash(const Mapping& m) {
+    size_t head = min(m.size, HASH_SAMPLE);
+    uint64_t h = fnv1a(m.data, head);
+    if (m.size > head) {
+        size_t tail = min(m.size - head, HASH_SAMPLE);
+        h = fnv1a(m.data + m.size - tail, tail, h);
+    }
+    uint64_t size = m.size;
+    return fnv1a((const char*)&size, sizeof(size), h);
+}
+
+// One source line, [off, off + len), and where the line after it starts
+struct SourceLine {
+    uint64_t off;
+    uint64_t len;
+    uint64_t next;
+};
+
+// The source's lines front to back, read a window ahead of where the
+// encoder is, so no index of the whole file is ever built. Same line rules
+// as Editor::open_file: '\n' separated, and only max_lines of them.
+struct SourceLines {
+    const Mapping& src;
+    size_t max_lines;
+    uint64_t pos;
+    size_t read;
+    deque<SourceLine> ahead;
+
+    SourceLines(const Mapping& src, size_t max_lines) : src(src), max_lines(max_lines), pos(0), read(0) {}
+
+    // Go on from the line at offset pos
+    void seek(uint64_t to) {
+        ahead.clear();
+        pos = to;
+    }
+
+    // At least n lines ahead unless the source runs out
+    void fill(size_t n) {
+        while (ahead.size() < n && pos < src.size && read < max_lines) {
+            const char* nl = (const char*)memchr(src.data + pos, '\n', src.size - pos);
+            uint64_t end = nl ? (uint64_t)(nl - src.data) : src.size;
+            ahead.push_back(SourceLine{ pos, end - pos, nl ? end + 1 : end });
+            pos = ahead.back().next;
+            read++;
+        }
+    }
+};
+
+struct Encoder {
+    const Mapping& src;
+    size_t max_line_len, max_lines;
+    // The editor's own mapping of the source, when the buffer is mapped:
+    // its lines that still point into it are copies by where they point
+    const char* own;
+    vector<string_view> literals;
+
+    Encoder(const Mapping& src, size_t max_line_len, size_t max_lines, const char* own)
+        : src(src), max_line_len(max_line_len), max_lines(max_lines), own(own) {}
+
+    bool in_own(const char* p, uint64_t len) const {
+        return own && p >= own && p <= own + src.size && len <= (uint64_t)(own + src.size - p);
+    }
+
+    bool same(const SourceLine& e, string_view s) const {
+        return min<uint64_t>(e.len, max_line_len) == s.size() && memcmp(src.data + e.off, s.data(), s.size()) == 0;
+    }
+
+    // Runs of unchanged source lines become COPY pieces, everything else is
+    // stored literally. Span leaves over our own mapping are copied without
+    // reading a byte of them, so an untouched mapped file costs nothing.
+    vector<Piece> encode(const TextBuffer& lines) {
+        vector<Piece> pieces;
+        SourceLines source(src, max_lines);
+        auto copy = [&](uint64_t off, uint64_t next) {
+            if (!pieces.empty() && pieces.back().kind == PIECE_COPY && pieces.back().start + pieces.back().count == off) {
+                pieces.back().count = next - pieces.back().start;
+            } else {
+                pieces.push_back(Piece{ PIECE_COPY, 0, off, next - off });
+            }
+        };
+        auto encode_line = [&](size_t, string_view line) {
+            if (in_own(line.data(), line.size())) {
+                uint64_t off = line.data() - own, end = off + line.size();
+                if ((off == 0 || own[off - 1] == '\n') && (end == src.size || own[end] == '\n')) {
+                    uint64_t next = end == src.size ? end : end + 1;
+                    copy(off, next);
+                    source.seek(next);
+                    return true;
+                }
+            }
+            source.fill(MATCH_WINDOW + 1);
+            size_t d = 0;
+            while (d < source.ahead.size() && !same(source.ahead[d], line)) d++;
+            if (d < source.ahead.size()) {
+                const SourceLine& e = source.ahead[d];
+                copy(e.off, e.next);
+                source.ahead.erase(source.ahead.begin(), source.ahead.begin() + d + 1);
+            } else {
+                if (!pieces.empty() && pieces.back().kind == PIECE_LITERAL &&
+                    pieces.back().start + pieces.back().count == literals.size()) {
+                    pieces.back().count++;
+                } else {
+                    pieces.push_back(Piece{ PIECE_LITERAL, 0, literals.size(), 1 });
+                }
+                literals.push_back(line);
+            }
+            return true;
+        };
+        lines.for_each_span(encode_line, [&](const char* text, uint64_t len, size_t count) {
+            if (in_own(text, len)) {
+                uint64_t off = text - own;
+                copy(off, off + len);
+                source.seek(off + len);
+                return true;
+            }
+            // Another mapping: line by line
+            const char* end = text + len;
+            for (size_t i = 0; i < count; ++i) {
+                const char* nl = (const char*)memchr(text, '\n', end - text);
+                const char* stop = nl ? nl : end;
+                encode_line(0, string_view(text, stop - text));
+                text = stop + 1;
+            }
+            return true;
+        });
+        return pieces;
+    }
+};
+
+// Lines of the pieces into out. Copied lines are span leaves over `file`
+// when the session was mapped, else read from src and clipped as
+// open_file does.
+bool expand(const Piece* pieces, size_t count, const Header& h, const Mapping& sess, const Mapping& src,
+            const TextBuffer::ChunkPtr& file, TextBuffer& out) {
+    const LineEntry* lits = (const LineEntry*)(sess.data + h.literals.off);
+    const char* text = sess.data + h.text.off;
+    TextBuffer::Builder b;
+    out.clear();
+    for (size_t i = 0; i < count; ++i) {
+        const Piece& p = pieces[i];
+        if (p.kind == PIECE_COPY) {
+            uint64_t end = p.start + p.count;
+            if (p.start >= src.size || p.count == 0 || p.count > src.size - p.start ||
+                (p.start > 0 && src.data[p.start - 1] != '\n') || (end < src.size && src.data[end - 1] != '\n')) {
+                return false;
+            }
+            if (file) {
+                out.insert(out.size(), b.finish());
+                out.insert(out.size(), TextBuffer::from_file(file, p.start, end));
+                continue;
+            }
+            for (uint64_t pos = p.start; pos < end;) {
+                const char* nl = (const char*)memchr(src.data + pos, '\n', end - pos);
+                uint64_t stop = nl ? (uint64_t)(nl - src.data) : end;
+                b.add(string_view(src.data + pos, min(stop - pos, h.line_limit)));
+                pos = stop + 1;
+            }
+            continue;
+        }
+        if (p.start > h.literals.count || p.count > h.literals.count - p.start) return false;
+        for (uint64_t k = p.start; k < p.start + p.count; ++k) {
+            const LineEntry& e = lits[k];
+            if (e.off > h.text.count || e.len > h.text.count - e.off) return false;
+            b.add(string_view(text + e.off, e.len));
+        }
+    }
+    out.insert(out.size(), b.finish());
+    return true;
+}
+
+} // namespace
+
+string session_path(const string& source) {
+    return cache_file("sessions", source, ".session");
+}
+
+bool save_session(const string& source, const TextBuffer& lines, const TextBuffer& undo_lines,
+                  const TextBuffer& yank, const SessionCursor& cur, size_t max_line_len, size_t max_lines,
+                  string& err) {
+    struct stat st;
+    Mapping src;
+    if (!src.map(source, &st)) {
+        err = "cannot read " + source;
+        return false;
+    }
+    // Mapped buffers hold the source's lines as they are, however many.
+    // Compressed sources cannot be addressed by offset, so their lines are
+    // all stored literally.
+    TextBuffer::ChunkPtr own;
+    if (cur.mapped) {
+        max_line_len = max_lines = SIZE_MAX;
+        own = TextBuffer::find_mapping(source);
+    }
+    if (detect_compression(source) != COMP_NONE) max_lines = 0;
+
+    Encoder enc(src, max_line_len, max_lines, own ? TextBuffer::mapped_data(own) : nullptr);
+    vector<Piece> pieces = enc.encode(lines);
+    vector<Piece> undo = cur.has_undo ? enc.encode(undo_lines) : vector<Piece>();
+    size_t yank_start = enc.literals.size();
+    yank.for_each(0, yank.size(), [&](size_t, string_view line) {
+        enc.literals.push_back(line);
+        return true;
+    });
+
+    Header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SESSION_MAGIC, sizeof(h.magic));
+    h.version = SESSION_VERSION;
+    h.has_undo = cur.has_undo ? 1 : 0;
+    h.modified = cur.modified ? 1 : 0;
+    h.mapped = cur.mapped ? 1 : 0;
+    h.line_limit = max_line_len;
+    h.src_size = (uint64_t)st.st_size;
+    h.src_mtime_sec = st.st_mtim.tv_sec;
+    h.src_mtime_nsec = st.st_mtim.tv_nsec;
+    h.src_hash = sample_hash(src);
+    h.cy = cur.cy;
+    h.cx = cur.cx;
+    h.top_line = cur.top_line;
+    h.undo_cy = cur.undo_cy;
+    h.undo_cx = cur.undo_cx;
+
+    vector<LineEntry> lit_entries;
+    lit_entries.reserve(enc.literals.size());
+    uint64_t text_size = 0;
+    for (string_view s : enc.literals) {
+        lit_entries.push_back(LineEntry{ text_size, (uint32_t)s.size(), 0 });
+        text_size += s.size();
+    }
+
+    size_t off = align8(sizeof(Header));
+    h.literals = Section{ off, lit_entries.size() };
+    off = align8(off + lit_entries.size() * sizeof(LineEntry));
+    h.text = Section{ off, text_size };
+    off = align8(off + text_size);
+    h.pieces = Section{ off, pieces.size() };
+    off = align8(off + pieces.size() * sizeof(Piece));
+    h.undo = Section{ off, undo.size() };
+    h.yank = Section{ yank_start, yank.size() };
+
+    string path = session_path(source);
+    make_dirs(path.substr(0, path.rfind('/')));
+    string tmp = path + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "wb");
+    if (!f) {
+        err = strerror(errno);
+        return false;
+    }
+    const char zeros[8] = { 0 };
+    size_t written = 0;
+    auto put = [&](const void* data, size_t n) {
+        if (n) fwrite(data, 1, n, f);
+        written += n;
+    };
+    auto pad = [&]() { put(zeros, align8(written) - written); };
+    put(&h, sizeof(h));
+    pad();
+    put(lit_entries.data(), lit_entries.size() * sizeof(LineEntry));
+    pad();
+    for (string_view s : enc.literals) put(s.data(), s.size());
+    pad();
+    put(pieces.data(), pieces.size() * sizeof(Piece));
+    pad();
+    put(undo.data(), undo.size() * sizeof(Piece));
+    bool ok = !ferror(f);
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        err = "cannot write " + path;
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool load_session(const string& source, TextBuffer& lines, TextBuffer& undo_lines,
+                  TextBuffer& yank, SessionCursor& cur, string& err) {
+    err.clear();
+    Mapping sess;
+    if (!sess.map(session_path(source), nullptr)) return false; // no session, not an error
+    Header h;
+    if (sess.size < sizeof(h)) {
+        err = "session file is corrupt";
+        return false;
+    }
+    memcpy(&h, sess.data, sizeof(h));
+    if (memcmp(h.magic, SESSION_MAGIC, sizeof(h.magic)) != 0 || h.version != SESSION_VERSION) {
+        err = "session file has an unknown format";
+        return false;
+    }
+    struct stat st;
+    Mapping src;
+    if (!src.map(source, &st) || (uint64_t)st.st_size != h.src_size || st.st_mtim.tv_sec != h.src_mtime_sec ||
+        st.st_mtim.tv_nsec != h.src_mtime_nsec || sample_hash(src) != h.src_hash) {
+        err = "file changed since the session was saved";
+        return false;
+    }
+    if (!section_ok(h.literals, sizeof(LineEntry), sess.size) ||
+        !section_ok(h.text, 1, sess.size) || !section_ok(h.pieces, sizeof(Piece), sess.size) ||
+        !section_ok(h.undo, sizeof(Piece), sess.size) || h.yank.off > h.literals.count ||
+        h.yank.count > h.literals.count - h.yank.off) {
+        err = "session file is corrupt";
+        return false;
+    }
+    // A mapped buffer comes back mapped, its unchanged lines left in the file
+    TextBuffer::ChunkPtr file;
+    if (h.mapped && src.size > 0) {
+        file = TextBuffer::map_file(source, err);
+        if (!file) return false;
+        if (TextBuffer::mapped_size(file) != src.size) {
+            err = "file changed since the session was saved";
+            return false;
+        }
+    }
+    Piece yank_piece = { PIECE_LITERAL, 0, h.yank.off, h.yank.count };
+    if (!expand((const Piece*)(sess.data + h.pieces.off), h.pieces.count, h, sess, src, file, lines) ||
+        !expand((const Piece*)(sess.data + h.undo.off), h.undo.count, h, sess, src, file, undo_lines) ||
+        !expand(&yank_piece, 1, h, sess, src, nullptr, yank)) {
+        err = "session file is corrupt";
+        return false;
+    }
+    cur.cy = h.cy;
+    cur.cx = h.cx;
+    cur.top_line = h.top_line;
+    cur.undo_cy = h.undo_cy;
+    cur.undo_cx = h.undo_cx;
+    cur.has_undo = h.has_undo != 0;
+    cur.modified = h.modified != 0;
+    cur.mapped = h.mapped != 0;
+    return true;
+}
+
+void remove_session(const string& source) {
+    unlink(session_path(source).c_str());
+}
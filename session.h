@@ -0,0 +1,36 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include "buffer.h"
+
+// Binary session snapshots: everything needed to reopen a file exactly
+// where it was left without parsing it again. The buffer is stored as
+// runs of lines copied from the source file (by byte offset, so a file
+// of any size needs no index) plus the lines that differ.
+
+struct SessionCursor {
+    size_t cy, cx, top_line;
+    size_t undo_cy, undo_cx;
+    bool has_undo;
+    bool modified; // buffer differs from the file
+    bool mapped;   // buffer is over the mapped file (lines not clipped, no line limit)
+};
+
+// Where the session for a source file lives ($XDG_CACHE_HOME/mini-vi/sessions/).
+std::string session_path(const std::string& source);
+
+bool save_session(const std::string& source, const TextBuffer& lines,
+                  const TextBuffer& undo_lines, const TextBuffer& yank,
+                  const SessionCursor& cur, size_t max_line_len, size_t max_lines, std::string& err);
+
+// Fails (with err set) when there is no session or the source file changed since it was written.
+bool load_session(const std::string& source, TextBuffer& lines,
+                  TextBuffer& undo_lines, TextBuffer& yank,
+                  SessionCursor& cur, std::string& err);
+
+void remove_session(const std::string& source);
+
+#endif // SESSION_H
@@ -0,0 +1,822 @@
+#include "tags.h"
+#include "grep.h"
+#include "cache.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+
+const char TAGS_MAGIC[8] = { 'M', 'V', 'T', 'A', 'G', 'S', '\0', '\0' };
+const uint32_t TAGS_VERSION = 1;
+// bigger files are generated, not written, and are left out
+const uint64_t MAX_SOURCE = 16ull << 20;
+// tokens kept of one declaration; the name is near the start
+const size_t MAX_STMT = 256;
+
+struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t pad;
+    Section files; // FileRec[], sorted by path
+    Section tags;  // TagRec[], grouped by file, in line order
+    Section order; // uint32_t[] into tags, sorted by name
+    Section text;  // paths and names, count is the size
+};
+
+struct FileRec {
+    int64_t mtime_sec, mtime_nsec;
+    uint64_t size;
+    uint32_t path_off, path_len;
+    uint32_t first_tag, tag_count;
+};
+
+struct TagRec {
+    uint32_t name_off, name_len;
+    uint32_t line;
+    uint32_t file;
+    char kind;
+    char pad[3];
+};
+
+bool is_source(const string& name) {
+    static const char* const exts[] = { ".c", ".cc", ".cpp", ".cxx", ".c++", ".h", ".hh", ".hpp", ".hxx", ".h++",
+                                        ".inl", ".ipp", ".tcc" };
+    size_t dot = name.rfind('.');
+    if (dot == string::npos) return false;
+    for (const char* e : exts) {
+        if (name.compare(dot, string::npos, e) == 0) return true;
+    }
+    return false;
+}
+
+bool ident_start(unsigned char c) {
+    return c == '_' || c == '$' || c >= 0x80 || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z');
+}
+
+bool ident_char(unsigned char c) {
+    return ident_start(c) || (c >= '0' && c <= '9');
+}
+
+struct Tok {
+    const char* p;
+    uint32_t len;
+    uint32_t line;
+    // 'i' identifier, '"' string or character literal, '0' number, 'Q' for
+    // "::", 'A' for "->", otherwise the punctuation character itself
+    char type;
+
+    string_view text() const { return string_view(p, len); }
+    bool is(string_view w) const { return type == 'i' && text() == w; }
+};
+
+// Words that are followed by parentheses without being a function's name
+bool not_a_name(const Tok& t) {
+    static const char* const words[] = { "if", "for", "while", "switch", "return", "sizeof", "catch", "decltype",
+                                         "alignof", "alignas", "static_assert", "noexcept", "throw", "typeid",
+                                         "operator", "new", "delete", "defined", "__attribute__", "__declspec" };
+    for (const char* w : words) {
+        if (t.is(w)) return true;
+    }
+    return false;
+}
+
+bool is_attribute(const Tok& t) {
+    return t.is("alignas") || t.is("__attribute__") || t.is("__declspec");
+}
+
+// One pass over a source file. Comments, literals and preprocessor lines
+// are skipped by the tokenizer (only #define names are kept, and of
+// #if 0 / #else branches only the first one that counts is read). The
+// tokens of a declaration at namespace or class level are collected up to
+// its ';' or '{' and looked at there; the bodies of functions and
+// initializers are only counted through.
+class Scanner {
+public:
+    Scanner(const char* text, size_t n, const function<void(string_view, size_t, char)>& emit)
+        : p(text), end(text + n), line(1), bol(true), skip(0), enum_item(false), enum_depth(0), emit(emit) {
+        scopes.push_back(Scope{ SCOPE_OPEN, false });
+    }
+
+    void run() {
+        Tok t;
+        while (next(t)) {
+            if (skip) {
+                if (t.type == '{') skip++;
+                else if (t.type == '}' && --skip == 0) stmt.clear();
+                continue;
+            }
+            if (scopes.back().kind == SCOPE_ENUM) {
+                enum_token(t);
+                continue;
+            }
+            switch (t.type) {
+                case ';':
+                    end_statement();
+                    stmt.clear();
+                    break;
+                case '{':
+                    open_brace();
+                    stmt.clear();
+                    break;
+                case '}': close_brace(); break;
+                default:
+                    if (stmt.size() < MAX_STMT) stmt.push_back(t);
+            }
+        }
+    }
+
+private:
+    enum ScopeKind { SCOPE_OPEN, SCOPE_CLASS, SCOPE_ENUM };
+    struct Scope {
+        ScopeKind kind;
+        bool typedef_names; // typedef struct { ... } name;
+    };
+
+    const char* p;
+    const char* end;
+    size_t line;
+    bool bol; // nothing but blanks since the last newline
+    vector<Scope> scopes;
+    vector<Tok> stmt;
+    size_t skip; // depth inside a body that is not looked into
+    bool enum_item;
+    int enum_depth;
+    const function<void(string_view, size_t, char)>& emit;
+
+    void tag(const Tok& t, char kind) { emit(t.text(), t.line, kind); }
+
+    void count_lines(const char* from, const char* to) { line += count(from, to, '\n'); }
+
+    void skip_comment() {
+        const char* stop = end - p >= 4 ? (const char*)memmem(p + 2, end - p - 2, "*/", 2) : nullptr;
+        stop = stop ? stop + 2 : end;
+        count_lines(p, stop);
+        p = stop;
+    }
+
+    void skip_quoted(char q) {
+        p++;
+        while (p < end) {
+            char c = *p;
+            if (c == '\\') {
+                if (p + 1 < end && p[1] == '\n') line++;
+                p = min(p + 2, end);
+            } else if (c == q) {
+                p++;
+                return;
+            } else if (c == '\n') {
+                return; // unterminated
+            } else {
+                p++;
+            }
+        }
+    }
+
+    // R"delim( ... )delim" with p on the opening quote
+    void skip_raw() {
+        const char* open = (const char*)memchr(p, '(', min<size_t>(end - p, 18));
+        if (!open) {
+            skip_quoted('"');
+            return;
+        }
+        string close = ")" + string(p + 1, open) + "\"";
+        const char* stop = (const char*)memmem(open, end - open, close.data(), close.size());
+        stop = stop ? stop + close.size() : end;
+        count_lines(p, stop);
+        p = stop;
+    }
+
+    // Rest of a preprocessor line, with its continuations
+    void skip_to_eol() {
+        while (p < end && *p != '\n') {
+            if (*p == '\\' && p + 1 < end && (p[1] == '\n' || (p[1] == '\r' && p + 2 < end && p[2] == '\n'))) {
+                p += p[1] == '\n' ? 2 : 3;
+                line++;
+            } else if (*p == '/' && p + 1 < end && p[1] == '*') {
+                skip_comment();
+            } else if (*p == '/' && p + 1 < end && p[1] == '/') {
+                const char* nl = (const char*)memchr(p, '\n', end - p);
+                p = nl ? nl : end;
+            } else if (*p == '"' || *p == '\'') {
+                skip_quoted(*p);
+            } else {
+                p++;
+            }
+        }
+    }
+
+    string_view directive_word() {
+        while (p < end && (*p == ' ' || *p == '\t')) p++;
+        const char* start = p;
+        while (p < end && ident_char(*p)) p++;
+        return string_view(start, p - start);
+    }
+
+    // Skips to the #endif closing the current #if; at_else also stops at an
+    // #else or #elif of it, whose branch is then read
+    void skip_branch(bool at_else) {
+        int depth = 0;
+        while (p < end) {
+            while (p < end && (*p == ' ' || *p == '\t')) p++;
+            if (p < end && *p == '#') {
+                p++;
+                string_view w = directive_word();
+                if (w == "if" || w == "ifdef" || w == "ifndef") {
+                    depth++;
+                } else if (w == "endif") {
+                    if (depth-- == 0) break;
+                } else if (depth == 0 && at_else && (w == "else" || w == "elif")) {
+                    break;
+                }
+                skip_to_eol();
+            }
+            const char* nl = (const char*)memchr(p, '\n', end - p);
+            if (!nl) {
+                p = end;
+                return;
+            }
+            line++;
+            p = nl + 1;
+        }
+        skip_to_eol();
+    }
+
+    void directive() {
+        string_view w = directive_word();
+        if (w == "define") {
+            while (p < end && (*p == ' ' || *p == '\t')) p++;
+            const char* start = p;
+            while (p < end && ident_char(*p)) p++;
+            if (p > start && ident_start(*start)) emit(string_view(start, p - start), line, 'd');
+            skip_to_eol();
+        } else if (w == "if") {
+            while (p < end && (*p == ' ' || *p == '\t')) p++;
+            bool never = p < end && *p == '0' && (p + 1 == end || !ident_char(p[1]));
+            skip_to_eol();
+            if (never) skip_branch(true);
+        } else if (w == "else" || w == "elif") {
+            skip_branch(false);
+        } else {
+            skip_to_eol();
+        }
+    }
+
+    bool next(Tok& t) {
+        while (p < end) {
+            unsigned char c = *p;
+            if (c == '\n') {
+                line++;
+                bol = true;
+                p++;
+                continue;
+            }
+            if (c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v') {
+                p++;
+                continue;
+            }
+            if (c == '/' && p + 1 < end && p[1] == '/') {
+                const char* nl = (const char*)memchr(p, '\n', end - p);
+                p = nl ? nl : end;
+                continue;
+            }
+            if (c == '/' && p + 1 < end && p[1] == '*') {
+                skip_comment();
+                continue;
+            }
+            if (c == '#' && bol) {
+                p++;
+                directive();
+                continue;
+            }
+            bol = false;
+            t.p = p;
+            t.line = (uint32_t)line;
+            if (ident_start(c)) {
+                while (p < end && ident_char(*p)) p++;
+                t.type = 'i';
+                if (p < end && *p == '"' && p[-1] == 'R' && p - t.p <= 3) {
+                    skip_raw();
+                    t.type = '"';
+                }
+            } else if ((c >= '0' && c <= '9') || (c == '.' && p + 1 < end && p[1] >= '0' && p[1] <= '9')) {
+                // Digit separators and exponent signs included
+                p++;
+                while (p < end && (ident_char(*p) || *p == '.' || *p == '\'' ||
+                                   ((*p == '+' || *p == '-') && ((p[-1] | 0x20) == 'e' || (p[-1] | 0x20) == 'p')))) {
+                    p++;
+                }
+                t.type = '0';
+            } else if (c == '"' || c == '\'') {
+                skip_quoted(c);
+                t.type = '"';
+            } else if (c == ':' && p + 1 < end && p[1] == ':') {
+                p += 2;
+                t.type = 'Q';
+            } else if (c == '-' && p + 1 < end && p[1] == '>') {
+                p += 2;
+                t.type = 'A';
+            } else {
+                p++;
+                t.type = c;
+            }
+            t.len = (uint32_t)(p - t.p);
+            return true;
+        }
+        return false;
+    }
+
+    // Index just past the bracket closing the one at stmt[j]
+    size_t skip_group(size_t j) const {
+        char open = stmt[j].type;
+        char close = open == '(' ? ')' : open == '[' ? ']' : '>';
+        int depth = 0;
+        for (; j < stmt.size(); ++j) {
+            if (stmt[j].type == open) depth++;
+            else if (stmt[j].type == close && --depth == 0) return j + 1;
+        }
+        return j;
+    }
+
+    // Past access labels, template headers, typedef and inline
+    size_t lead(bool& is_typedef) const {
+        size_t i = 0, n = stmt.size();
+        is_typedef = false;
+        while (i < n) {
+            const Tok& t = stmt[i];
+            if ((t.is("public") || t.is("private") || t.is("protected")) && i + 1 < n && stmt[i + 1].type == ':') {
+                i += 2;
+            } else if (t.is("template") && i + 1 < n && stmt[i + 1].type == '<') {
+                i = skip_group(i + 1);
+            } else if (t.is("typedef")) {
+                is_typedef = true;
+                i++;
+            } else if (t.is("inline") || t.is("export")) {
+                i++;
+            } else {
+                break;
+            }
+        }
+        return i;
+    }
+
+    void open_brace() {
+        bool is_typedef;
+        size_t i = lead(is_typedef), n = stmt.size();
+        if (i == n) {
+            skip = 1;
+            return;
+        }
+        const Tok& first = stmt[i];
+        if (first.is("namespace")) {
+            for (size_t j = i + 1; j < n; ++j) {
+                if (stmt[j].type == 'i') tag(stmt[j], 'n');
+            }
+            scopes.push_back(Scope{ SCOPE_OPEN, false });
+            return;
+        }
+        if (first.is("extern") && i + 1 < n && stmt[i + 1].type == '"') {
+            scopes.push_back(Scope{ SCOPE_OPEN, false });
+            return;
+        }
+        char kind = first.is("class") ? 'c' : first.is("struct") ? 's' : first.is("union") ? 'u' : first.is("enum") ? 'g' : 0;
+        if (kind) {
+            size_t j = i + 1;
+            if (kind == 'g' && j < n && (stmt[j].is("class") || stmt[j].is("struct"))) j++;
+            // The name is the last word before the bases (class EXPORT Foo
+            // final : Base), leaving out template arguments and attributes
+            const Tok* name = nullptr;
+            bool function = false, init = false, attr = false;
+            for (; j < n; ++j) {
+                const Tok& t = stmt[j];
+                if (t.type == ':') break;
+                if (t.type == '=') {
+                    init = true;
+                    break;
+                }
+                if (t.type == '<' || t.type == '[' || (t.type == '(' && attr)) {
+                    j = skip_group(j) - 1;
+                } else if (t.type == '(') {
+                    // struct S f() { returns one
+                    function = true;
+                    break;
+                } else if (t.type == 'i' && !t.is("final") && !is_attribute(t)) {
+                    name = &t;
+                }
+                attr = is_attribute(t);
+            }
+            if (init) {
+                skip = 1;
+                return;
+            }
+            if (!function) {
+                if (name) tag(*name, kind);
+                scopes.push_back(Scope{ kind == 'g' ? SCOPE_ENUM : SCOPE_CLASS, is_typedef });
+                enum_item = true;
+                enum_depth = 0;
+                return;
+            }
+        }
+        // A function: the word before the first parentheses, unless an
+        // '=' comes first (a lambda or an initializer)
+        for (size_t j = i; j < n; ++j) {
+            const Tok& t = stmt[j];
+            if (t.type == '=') break;
+            if (t.type == '[' || t.type == '<') {
+                j = skip_group(j) - 1;
+                continue;
+            }
+            if (t.type != '(') continue;
+            if (j == i || stmt[j - 1].type != 'i') break;
+            const Tok& name = stmt[j - 1];
+            if (is_attribute(name)) {
+                j = skip_group(j) - 1;
+                continue;
+            }
+            if (not_a_name(name)) break;
+            if (j >= i + 2 && stmt[j - 2].type == '~' && stmt[j - 2].p + 1 == name.p) {
+                emit(string_view(name.p - 1, name.len + 1), name.line, 'f');
+            } else {
+                tag(name, 'f');
+            }
+            break;
+        }
+        skip = 1;
+    }
+
+    void close_brace() {
+        if (scopes.size() == 1) return; // unbalanced
+        bool names = scopes.back().typedef_names;
+        scopes.pop_back();
+        stmt.clear();
+        // The names after } are typedefs
+        static const char word[] = "typedef";
+        if (names) stmt.push_back(Tok{ word, 7, (uint32_t)line, 'i' });
+    }
+
+    void end_statement() {
+        bool is_typedef;
+        size_t i = lead(is_typedef), n = stmt.size();
+        if (is_typedef) {
+            // Every name before a ',', '[' or the end; (*name)(...) for
+            // function pointers. Template arguments do not count.
+            for (size_t j = i; j < n; ++j) {
+                const Tok& t = stmt[j];
+                if (t.type == '<' || t.type == '[') {
+                    j = skip_group(j) - 1;
+                } else if (t.type == '(') {
+                    if (j + 2 < n && (stmt[j + 1].type == '*' || stmt[j + 1].type == '&' || stmt[j + 1].type == '^') &&
+                        stmt[j + 2].type == 'i') {
+                        tag(stmt[j + 2], 't');
+                    }
+                    j = skip_group(j) - 1;
+                } else if (t.type == 'i' && (j + 1 == n || stmt[j + 1].type == ',' || stmt[j + 1].type == '[')) {
+                    tag(t, 't');
+                }
+            }
+        } else if (i + 2 < n && stmt[i].is("using") && stmt[i + 1].type == 'i' && stmt[i + 2].type == '=') {
+            tag(stmt[i + 1], 't');
+        }
+    }
+
+    // Enumerators are the first word of each item
+    void enum_token(const Tok& t) {
+        if (t.type == '}' && enum_depth == 0) {
+            close_brace();
+            return;
+        }
+        if (t.type == '(' || t.type == '[' || t.type == '{') enum_depth++;
+        else if (t.type == ')' || t.type == ']' || t.type == '}') enum_depth--;
+        if (enum_depth != 0) return;
+        if (t.type == ',') {
+            enum_item = true;
+            return;
+        }
+        if (t.type == 'i' && enum_item) tag(t, 'e');
+        enum_item = false;
+    }
+};
+
+// A source file being indexed: its tags, with name_off into names
+struct FileTags {
+    string path;
+    int64_t mtime_sec, mtime_nsec;
+    uint64_t size;
+    string names;
+    vector<TagRec> tags;
+
+    explicit FileTags(const WalkFile& f)
+        : path(f.path), mtime_sec(f.mtime_sec), mtime_nsec(f.mtime_nsec), size(f.size) {}
+};
+
+const Header* header_of(const char* data) {
+    return (const Header*)data;
+}
+
+} // namespace
+
+// State shared by all the jobs of one index update
+struct TagRun {
+    Scheduler* jobs;
+    string root;
+    TagIndexPtr old;
+    unordered_map<string_view, size_t> old_files; // path -> FileRec in old
+    CancelPtr token;
+    function<void(TagIndexPtr, const TagStats&)> on_done;
+    chrono::steady_clock::time_point started;
+    atomic<uint64_t> parsed;
+    mutex m;
+    vector<FileTags> files;
+
+    void add(FileTags&& f) {
+        lock_guard<mutex> lock(m);
+        files.push_back(move(f));
+    }
+
+    void index_old() {
+        if (!old) return;
+        const Header* h = header_of(old->data);
+        const FileRec* recs = (const FileRec*)(old->data + h->files.off);
+        const char* text = old->data + h->text.off;
+        old_files.reserve(h->files.count);
+        for (uint64_t k = 0; k < h->files.count; ++k) {
+            old_files[string_view(text + recs[k].path_off, recs[k].path_len)] = k;
+        }
+    }
+
+    // The tags of path from the old index when its size and mtime are the same
+    bool reuse(FileTags& f) const {
+        auto it = old_files.find(f.path);
+        if (it == old_files.end()) return false;
+        const char* data = old->data;
+        const Header* h = header_of(data);
+        const FileRec& r = ((const FileRec*)(data + h->files.off))[it->second];
+        if (r.size != f.size || r.mtime_sec != f.mtime_sec || r.mtime_nsec != f.mtime_nsec) return false;
+        const TagRec* tags = (const TagRec*)(data + h->tags.off) + r.first_tag;
+        const char* text = data + h->text.off;
+        for (uint32_t k = 0; k < r.tag_count; ++k) {
+            TagRec t = tags[k];
+            size_t off = f.names.size();
+            f.names.append(text + t.name_off, t.name_len);
+            t.name_off = (uint32_t)off;
+            f.tags.push_back(t);
+        }
+        return true;
+    }
+
+    TagIndexPtr write(TagStats& st);
+};
+typedef shared_ptr<TagRun> RunPtr;
+
+TagIndex::~TagIndex() {
+    if (data) munmap((void*)data, len);
+}
+
+TagIndexPtr TagIndex::open(const string& root) {
+    int fd = ::open(tags_path(root).c_str(), O_RDONLY);
+    if (fd < 0) return nullptr;
+    struct stat st;
+    void* m = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(Header)) {
+        m = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (m == MAP_FAILED) return nullptr;
+    shared_ptr<TagIndex> idx(new TagIndex());
+    idx->data = (const char*)m;
+    idx->len = (size_t)st.st_size;
+    const Header* h = header_of(idx->data);
+    if (memcmp(h->magic, TAGS_MAGIC, sizeof(TAGS_MAGIC)) != 0 || h->version != TAGS_VERSION ||
+        !section_ok(h->files, sizeof(FileRec), idx->len) || !section_ok(h->tags, sizeof(TagRec), idx->len) ||
+        !section_ok(h->order, sizeof(uint32_t), idx->len) || !section_ok(h->text, 1, idx->len) ||
+        h->order.count != h->tags.count) {
+        return nullptr;
+    }
+    // Only offsets the lookups follow blindly are checked
+    const FileRec* files = (const FileRec*)(idx->data + h->files.off);
+    const TagRec* tags = (const TagRec*)(idx->data + h->tags.off);
+    const uint32_t* order = (const uint32_t*)(idx->data + h->order.off);
+    for (uint64_t k = 0; k < h->files.count; ++k) {
+        const FileRec& f = files[k];
+        if ((uint64_t)f.path_off + f.path_len > h->text.count || (uint64_t)f.first_tag + f.tag_count > h->tags.count) {
+            return nullptr;
+        }
+    }
+    for (uint64_t k = 0; k < h->tags.count; ++k) {
+        const TagRec& t = tags[k];
+        if ((uint64_t)t.name_off + t.name_len > h->text.count || t.file >= h->files.count || order[k] >= h->tags.count) {
+            return nullptr;
+        }
+    }
+    return idx;
+}
+
+size_t TagIndex::files() const {
+    return header_of(data)->files.count;
+}
+
+size_t TagIndex::size() const {
+    return header_of(data)->tags.count;
+}
+
+vector<TagHit> TagIndex::find(string_view name) const {
+    const Header* h = header_of(data);
+    const FileRec* files = (const FileRec*)(data + h->files.off);
+    const TagRec* tags = (const TagRec*)(data + h->tags.off);
+    const uint32_t* order = (const uint32_t*)(data + h->order.off);
+    const char* text = data + h->text.off;
+    auto name_of = [&](uint32_t k) { return string_view(text + tags[k].name_off, tags[k].name_len); };
+    const uint32_t* lo = lower_bound(order, order + h->order.count, name, [&](uint32_t k, string_view s) { return name_of(k) < s; });
+    vector<TagHit> out;
+    for (const uint32_t* it = lo; it != order + h->order.count && name_of(*it) == name; ++it) {
+        const TagRec& t = tags[*it];
+        const FileRec& f = files[t.file];
+        out.push_back(TagHit{ string(text + f.path_off, f.path_len), t.line, t.kind });
+    }
+    return out;
+}
+
+string tags_path(const string& root) {
+    return cache_file("tags", root, ".tags");
+}
+
+// Lays the files out sorted by path with a name table over all their
+// tags, and swaps the result in for the old file
+TagIndexPtr TagRun::write(TagStats& st) {
+    sort(files.begin(), files.end(), [](const FileTags& a, const FileTags& b) { return a.path < b.path; });
+    st.files = files.size();
+    st.tags = 0;
+    size_t text_size = 0;
+    for (const FileTags& f : files) {
+        st.tags += f.tags.size();
+        text_size += f.path.size() + f.names.size();
+    }
+    if (text_size > UINT32_MAX || st.tags > UINT32_MAX) return nullptr;
+    vector<FileRec> recs;
+    vector<TagRec> tags;
+    string text;
+    recs.reserve(files.size());
+    tags.reserve(st.tags);
+    text.reserve(text_size);
+    for (const FileTags& f : files) {
+        FileRec r = { f.mtime_sec, f.mtime_nsec, f.size, (uint32_t)text.size(), (uint32_t)f.path.size(),
+                      (uint32_t)tags.size(), (uint32_t)f.tags.size() };
+        text += f.path;
+        uint32_t base = (uint32_t)text.size();
+        text += f.names;
+        for (TagRec t : f.tags) {
+            t.name_off += base;
+            t.file = (uint32_t)recs.size();
+            tags.push_back(t);
+        }
+        recs.push_back(r);
+    }
+    // Tags are already in path and line order, which ties keep
+    vector<uint32_t> order(tags.size());
+    for (size_t k = 0; k < order.size(); ++k) order[k] = (uint32_t)k;
+    auto name_of = [&](uint32_t k) { return string_view(text.data() + tags[k].name_off, tags[k].name_len); };
+    stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return name_of(a) < name_of(b); });
+
+    Header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, TAGS_MAGIC, sizeof(TAGS_MAGIC));
+    h.version = TAGS_VERSION;
+    size_t off = align8(sizeof(Header));
+    h.files = Section{ off, recs.size() };
+    off = align8(off + recs.size() * sizeof(FileRec));
+    h.tags = Section{ off, tags.size() };
+    off = align8(off + tags.size() * sizeof(TagRec));
+    h.order = Section{ off, order.size() };
+    off = align8(off + order.size() * sizeof(uint32_t));
+    h.text = Section{ off, text.size() };
+
+    // Written next to the old index and renamed over it, so sessions that
+    // have the old one mapped keep reading it
+    string path = tags_path(root);
+    make_dirs(path.substr(0, path.rfind('/')));
+    string tmp = path + ".XXXXXX";
+    int fd = mkstemp(&tmp[0]);
+    if (fd < 0) return nullptr;
+    FILE* f = fdopen(fd, "wb");
+    if (!f) {
+        close(fd);
+        unlink(tmp.c_str());
+        return nullptr;
+    }
+    const char zeros[8] = { 0 };
+    size_t written = 0;
+    auto put = [&](const void* data, size_t n) {
+        if (n) fwrite(data, 1, n, f);
+        written += n;
+    };
+    auto pad = [&]() { put(zeros, align8(written) - written); };
+    put(&h, sizeof(h));
+    pad();
+    put(recs.data(), recs.size() * sizeof(FileRec));
+    pad();
+    put(tags.data(), tags.size() * sizeof(TagRec));
+    pad();
+    put(order.data(), order.size() * sizeof(uint32_t));
+    pad();
+    put(text.data(), text.size());
+    bool ok = !ferror(f);
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        unlink(tmp.c_str());
+        return nullptr;
+    }
+    return TagIndex::open(root);
+}
+
+namespace {
+
+void lex_file(TagRun& run, FileTags& f) {
+    FileView v;
+    if (!v.load(f.path, f.size)) return;
+    scan_definitions(v.data(), v.size(), [&](string_view name, size_t line, char kind) {
+        TagRec t;
+        memset(&t, 0, sizeof(t));
+        t.name_off = (uint32_t)f.names.size();
+        t.name_len = (uint32_t)min<size_t>(name.size(), 255);
+        t.line = (uint32_t)line;
+        t.kind = kind;
+        f.names.append(name.data(), t.name_len);
+        f.tags.push_back(t);
+    });
+    run.parsed++;
+}
+
+// Files that are not sources or are too big are left out, and those the
+// old index has as they are now are taken from it without lexing
+bool want_file(TagRun& run, const string& name, const WalkFile& w) {
+    if (!is_source(name) || w.size > MAX_SOURCE) return false;
+    FileTags f(w);
+    if (!run.reuse(f)) return true;
+    run.add(move(f));
+    return false;
+}
+
+void lex_batch(TagRun& run, vector<WalkFile>& batch, const CancelToken& tok) {
+    for (const WalkFile& w : batch) {
+        if (tok.cancelled()) break;
+        FileTags f(w);
+        lex_file(run, f);
+        run.add(move(f));
+    }
+}
+
+void finish_index(const RunPtr& run) {
+    TagStats st;
+    st.parsed = run->parsed;
+    TagIndexPtr idx;
+    if (run->old && st.parsed == 0 && run->files.size() == run->old->files()) {
+        // Nothing changed: every file came from the old index
+        idx = run->old;
+        st.files = idx->files();
+        st.tags = idx->size();
+    } else {
+        idx = run->write(st);
+    }
+    st.secs = chrono::duration<double>(chrono::steady_clock::now() - run->started).count();
+    RunPtr keep = run;
+    run->jobs->post([keep, idx, st]() {
+        if (!keep->token->cancelled()) keep->on_done(idx, st);
+    });
+}
+
+} // namespace
+
+void scan_definitions(const char* text, size_t n, const function<void(string_view, size_t, char)>& fn) {
+    Scanner(text, n, fn).run();
+}
+
+void start_tag_index(Scheduler& jobs, const string& root, TagIndexPtr old, CancelPtr token,
+                     function<void(TagIndexPtr, const TagStats&)> on_done) {
+    string dir = root;
+    while (dir.size() > 1 && dir.back() == '/') dir.pop_back();
+    auto run = make_shared<TagRun>();
+    run->jobs = &jobs;
+    run->root = dir;
+    run->old = old;
+    run->index_old();
+    run->token = token ? token : make_shared<CancelToken>();
+    run->on_done = move(on_done);
+    run->started = chrono::steady_clock::now();
+    run->parsed = 0;
+    TreeWalk walk;
+    walk.want_file = [run](const string& name, const WalkFile& f) { return want_file(*run, name, f); };
+    walk.on_batch = [run](vector<WalkFile>& batch, const CancelToken& tok) { lex_batch(*run, batch, tok); };
+    walk.on_done = [run]() { finish_index(run); };
+    walk_tree(jobs, dir, run->token, move(walk));
+}
@@ -0,0 +1,73 @@
+#ifndef TAGS_H
+#define TAGS_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <cstddef>
+#include <cstdint>
+#include "scheduler.h"
+
+// Symbol index behind Ctrl-] and :tag, like a ctags file built in. The
+// tree is walked on the job pool the way :grep does it (.gitignore is
+// honoured) and every C/C++ source is run through a small lexer that
+// picks out definitions: macros, namespaces, classes, structs, unions,
+// enums and their values, typedefs and functions with a body. The index
+// is written to $XDG_CACHE_HOME/mini-vi/tags/ and used mapped, names in a
+// sorted table, so a lookup is a binary search on the mapped pages. A
+// refresh only lexes the files whose size or mtime changed since.
+
+struct TagHit {
+    std::string path; // as walked from the root, like :grep's
+    size_t line;      // 1-based
+    char kind;        // d f c s u g e n t, as in ctags
+};
+
+struct TagStats {
+    uint64_t files;  // source files in the index
+    uint64_t parsed; // of which lexed this time (the rest were unchanged)
+    uint64_t tags;
+    double secs;
+};
+
+class TagIndex;
+typedef std::shared_ptr<const TagIndex> TagIndexPtr;
+
+class TagIndex {
+public:
+    ~TagIndex();
+    // The index for root as last written; null when there is none or it
+    // cannot be used
+    static TagIndexPtr open(const std::string& root);
+
+    size_t files() const;
+    size_t size() const;
+    // Every definition of name, in path and line order
+    std::vector<TagHit> find(std::string_view name) const;
+
+private:
+    friend struct TagRun;
+    const char* data;
+    size_t len;
+
+    TagIndex() : data(nullptr), len(0) {}
+};
+
+// Where the index for root lives
+std::string tags_path(const std::string& root);
+
+// Brings the index for root up to date from old (null to lex everything)
+// and writes it out. on_done gets the new index, null if it could not be
+// written, and runs on the main loop through Scheduler::post unless token
+// is cancelled first.
+void start_tag_index(Scheduler& jobs, const std::string& root, TagIndexPtr old, CancelPtr token,
+                     std::function<void(TagIndexPtr, const TagStats&)> on_done);
+
+// Calls fn(name, line, kind) for every definition in the C/C++ source
+// text[0..n); line is 1-based.
+void scan_definitions(const char* text, size_t n,
+                      const std::function<void(std::string_view, size_t, char)>& fn);
+
+#endif // TAGS_H